@@ -1,6 +1,10 @@
 #include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <concepts>
 #include <cstddef>
+#include <cstdlib>
 #include <memory>
 #include <sstream>
 #include <string_view>
@@ -23,13 +27,170 @@
 #include <analyzer/script.cpp>
 #include <analyzer/db.cpp>
 #include <analyzer/index.cpp>
+#include <analyzer/batch.cpp>
+#include <analyzer/index_file.cpp>
+#include <analyzer/workspace.cpp>
+
+// Output collected in a buffer of a fixed size, and written out whenever it
+// fills up, rather than a piece at a time through std::cout: writing out a
+// large index is then bound by the writes, not by the streams
+struct Output
+{
+  static constexpr size_t SIZE = 1 << 20;
+  std::string buffer;
+
+  Output() { buffer.reserve( SIZE + 1024 ); }
+  ~Output() { Flush(); }
+
+  void Flush()
+  {
+    std::cout.write( buffer.data(), buffer.size() );
+    buffer.clear();
+  }
+
+  Output& operator<<( std::string_view text )
+  {
+    buffer.append( text );
+    if ( buffer.size() >= SIZE )
+    {
+      Flush();
+    }
+    return *this;
+  }
+
+  Output& operator<<( char c )
+  {
+    buffer.push_back( c );
+    return *this;
+  }
+
+  Output& operator<<( std::integral auto n )
+  {
+    char digits[ 24 ];
+    auto end = std::to_chars( digits, digits + sizeof( digits ), n ).ptr;
+    return *this << std::string_view( digits, end - digits );
+  }
+
+  // As Parser::operator<<( std::ostream&, const SourceLocation& ), but only
+  // looking the file up when it changes
+  Output& operator<<( const Parser::SourceLocation& location )
+  {
+    if ( !file || file->id != location.file )
+    {
+      file = Parser::FindSourceFile( location.file );
+    }
+    if ( !file )
+    {
+      return *this << "<unknown>:" << location.offset;
+    }
+    return *this << file->fileName << ':'
+                 << Parser::OffsetToLineByte( *file, location.offset );
+  }
+
+  Output& operator<<( const Parser::LinePos& p )
+  {
+    return *this << p.line + 1 << ':' << p.column + 1;
+  }
+
+private:
+  Parser::SourceFilePtr file;
+};
+
+void PrintIndex( Index::Index& index )
+{
+  Output out;
+
+  // In name order (and for the same name, in id order)
+  auto sortedByName = []( const auto& record ) {
+    std::vector< std::pair< std::string_view, Index::ID > > entries;
+    for ( auto& row : record.table )
+    {
+      if ( record.IsLive( row ) )
+      {
+        entries.emplace_back( row.name.Text(), row.id );
+      }
+    }
+    std::stable_sort( entries.begin(),
+                      entries.end(),
+                      []( const auto& a, const auto& b ) {
+                        return a.first < b.first;
+                      } );
+    return entries;
+  };
+
+  for ( auto& kv : sortedByName( index.namespaces ) )
+  {
+    out << "Namespace: "
+        << Index::GetPrintName( index, index.namespaces.Get( kv.second ) )
+        << '\n';
+  }
+
+  for ( auto& kv : sortedByName( index.procs ) )
+  {
+    out << "Proc: "
+        << Index::GetPrintName( index, index.procs.Get( kv.second ) ) << '\n';
+
+    auto range = index.procs.refsByID.equal_range( kv.second );
+    for ( auto it = range.first; it != range.second; ++it )
+    {
+      auto& r = index.procs.references[ it->second ];
+      out << "  " << r.type << " Ref: "
+          << Index::GetPrintName( index, index.procs.Get( r.id ) ) << " at "
+          << r.location << '\n';
+    }
+  }
+}
+
+// The same output as PrintIndex( index ) for the index that `m` was saved
+// from, straight from the mapped file
+void PrintIndex( const IndexFile::Mapped& m )
+{
+  Output out;
+
+  for ( auto id : m.Rows< uint32_t >( IndexFile::NAMESPACES_BY_NAME ) )
+  {
+    auto& ns = m.GetNamespace( id );
+    out << "Namespace: " << m.PrintName( ns.name, ns.parent ) << '\n';
+  }
+
+  for ( auto id : m.Rows< uint32_t >( IndexFile::PROCS_BY_NAME ) )
+  {
+    auto& proc = m.GetProc( id );
+    out << "Proc: " << m.PrintName( proc.name, proc.parent_namespace )
+        << '\n';
+
+    for ( auto& r : m.References( proc ) )
+    {
+      auto& target = m.GetProc( r.id );
+      out << "  " << static_cast< Index::ReferenceType >( r.type ) << " Ref: "
+          << m.PrintName( target.name, target.parent_namespace ) << " at ";
+      if ( r.file == IndexFile::NONE )
+      {
+        out << "<unknown>:" << r.offset;
+      }
+      else
+      {
+        out << m.Text( m.Files()[ r.file ].name ) << ':'
+            << Parser::LinePos{ r.line, r.column };
+      }
+      out << '\n';
+    }
+  }
+}
 
 int main( int argc, char** argv )
 {
   Tcl_FindExecutable( argv[ 0 ] );
   Tcl_Interp* interp = Tcl_CreateInterp();
 
-  Parser::SourceFile mainFile;
+  Parser::SourceFilePtr mainFile;
+  std::optional< size_t > jobs;
+  std::vector< std::string > batchFiles;
+  bool batch = false;
+  std::optional< std::string > indexFile;
+  Batch::Seconds discover{};
+  auto tokenizer = Parser::Tokenizer::TCL;
+  int benchRuns = 0;
 
   auto shift = [ & ]() { ++argv, --argc; };
   shift();
@@ -41,6 +202,8 @@ int main( int argc, char** argv )
       shift();
       Parser::Test::Run();
       Index::Test::Run();
+      IndexFile::Test::Run();
+      Workspace::Test::Run();
       return 0;
     }
     else if ( arg == "--file" )
@@ -56,6 +219,40 @@ int main( int argc, char** argv )
         mainFile = Parser::make_source_file( "stdin", { begin, end } );
       }
       else
+      {
+        mainFile = Parser::read_source_file( std::string( arg ) );
+        if ( !mainFile )
+        {
+          std::cerr << "Unable to read file: " << arg << '\n';
+          return 1;
+        }
+      }
+
+      shift();
+    }
+    else if ( arg == "--dir" )
+    {
+      // Index every .tcl file under this directory
+      shift();
+      auto start = std::chrono::steady_clock::now();
+      auto found = Batch::FindTclFiles( argv[ 0 ] );
+      discover += std::chrono::steady_clock::now() - start;
+      batchFiles.insert( batchFiles.end(), found.begin(), found.end() );
+      batch = true;
+      shift();
+    }
+    else if ( arg == "--files-from" )
+    {
+      // Index every file listed (one per line) in this file, or - for stdin
+      shift();
+      arg = argv[ 0 ];
+      auto start = std::chrono::steady_clock::now();
+      std::vector< std::string > listed;
+      if ( arg == "-" )
+      {
+        listed = Batch::ReadFileList( std::cin );
+      }
+      else
       {
         std::ifstream f{ std::string( arg ) };
         if ( !f )
@@ -63,15 +260,63 @@ int main( int argc, char** argv )
           std::cerr << "Unable to read file: " << arg << '\n';
           return 1;
         }
-        f >> std::noskipws;  // fucking hell
-        std::istream_iterator< char > begin( f );
-        std::istream_iterator< char > end;
-        mainFile = Parser::make_source_file( std::string( arg ),
-                                             { begin, end } );
+        listed = Batch::ReadFileList( f );
       }
-
+      discover += std::chrono::steady_clock::now() - start;
+      batchFiles.insert( batchFiles.end(), listed.begin(), listed.end() );
+      batch = true;
+      shift();
+    }
+    else if ( arg == "--index-file" )
+    {
+      // With --dir/--files-from, use the index saved here if none of the
+      // files have changed; otherwise index those which have (and any new
+      // ones) again, and save it here
+      shift();
+      indexFile = argv[ 0 ];
       shift();
     }
+    else if ( arg == "--jobs" )
+    {
+      // Parse the top-level commands (or with --dir/--files-from, the files)
+      // on this many threads
+      shift();
+      jobs = std::max( 1, atoi( argv[ 0 ] ) );
+      shift();
+    }
+    else if ( arg == "--tokenizer" )
+    {
+      // tcl or native
+      shift();
+      arg = argv[ 0 ];
+      if ( arg == "native" )
+      {
+        tokenizer = Parser::Tokenizer::NATIVE;
+      }
+      else if ( arg != "tcl" )
+      {
+        std::cerr << "Unrecognised tokenizer: " << arg << "\n";
+        return 1;
+      }
+      shift();
+    }
+    else if ( arg == "--bench" )
+    {
+      // Time parsing the script this many times with each tokenizer, instead
+      // of indexing it
+      shift();
+      benchRuns = std::max( 1, atoi( argv[ 0 ] ) );
+      shift();
+    }
+    else if ( arg == "--bench-db" )
+    {
+      // Time inserting and getting this many rows of each index table, and
+      // each kind of key at a few workspace sizes
+      shift();
+      Index::Bench::Run( std::max( 1, atoi( argv[ 0 ] ) ) );
+      Index::Bench::RunKeys();
+      return 0;
+    }
     else if ( arg == "--string" )
     {
       shift();
@@ -85,17 +330,112 @@ int main( int argc, char** argv )
     }
   }
 
-  if ( mainFile.fileName.empty() )
+  if ( batch )
+  {
+    Batch::Options options{ .tokenizer = tokenizer };
+    if ( jobs )
+    {
+      options.workers = *jobs;
+    }
+
+    std::unique_ptr< IndexFile::Mapped > mapped;
+    if ( indexFile )
+    {
+      auto start = std::chrono::steady_clock::now();
+      mapped = IndexFile::Map( *indexFile );
+      if ( mapped && IndexFile::IsIndexOf( *mapped, batchFiles ) )
+      {
+        Batch::Seconds load = std::chrono::steady_clock::now() - start;
+        PrintIndex( *mapped );
+        std::cerr << "Files: " << batchFiles.size() << ", unchanged since "
+                  << *indexFile << " was saved\n"
+                  << "  Discover: " << discover.count() * 1000 << " ms\n"
+                  << "  Validate: " << load.count() * 1000 << " ms\n";
+
+        Tcl_DeleteInterp( interp );
+        return 0;
+      }
+    }
+
+    // Only the files which have changed since the index was saved need
+    // indexing again
+    Index::Index index = Index::make_index();
+    auto changed = batchFiles;
+    if ( mapped )
+    {
+      auto start = std::chrono::steady_clock::now();
+      index = IndexFile::Load( *mapped );
+      changed = IndexFile::RemoveStale( index, *mapped, batchFiles );
+      Batch::Seconds load = std::chrono::steady_clock::now() - start;
+      std::cerr << "Files: " << batchFiles.size() << ", " << changed.size()
+                << " new or changed since " << *indexFile
+                << " was saved\n"
+                << "  Load: " << load.count() * 1000 << " ms\n";
+    }
+
+    auto timings = Batch::IndexFiles( index, changed, options );
+    timings.discover = discover;
+    timings.total += discover;
+
+    // (Rows are saved by position, so none removed can be left)
+    Index::MaybeCompact( index, 0.0 );
+
+    PrintIndex( index );
+    std::cerr << timings;
+
+    if ( indexFile && !IndexFile::Save( index, *indexFile, mapped.get() ) )
+    {
+      std::cerr << "Unable to save the index to " << *indexFile << '\n';
+    }
+
+    Tcl_DeleteInterp( interp );
+    return timings.failed ? 1 : 0;
+  }
+
+  if ( !mainFile )
   {
     std::cerr << "No script supplied\n";
     return 1;
   }
 
+  if ( benchRuns > 0 )
+  {
+    for ( auto kind : { Parser::Tokenizer::TCL, Parser::Tokenizer::NATIVE } )
+    {
+      auto start = std::chrono::steady_clock::now();
+      for ( int run = 0; run < benchRuns; ++run )
+      {
+        Parser::ParseContext context{
+          .file = mainFile,
+          .cur_ns = "",
+          .tokenizer = kind,
+        };
+        Parser::ParseScript( interp, context, context.file->contents );
+      }
+      std::chrono::duration< double > elapsed =
+        std::chrono::steady_clock::now() - start;
+
+      const double bytes =
+        static_cast< double >( mainFile->contents.size() ) * benchRuns;
+      std::cout << ( kind == Parser::Tokenizer::TCL ? "tcl" : "native" )
+                << ": " << elapsed.count() * 1000 / benchRuns << " ms/parse, "
+                << bytes / elapsed.count() / ( 1024 * 1024 ) << " MiB/s\n";
+    }
+
+    Tcl_DeleteInterp( interp );
+    return 0;
+  }
+
   Parser::ParseContext context{
     .file = std::move( mainFile ),
-    .cur_ns = ""
+    .cur_ns = "",
+    .tokenizer = tokenizer,
   };
-  auto script = Parser::ParseScript( interp, context, context.file.contents );
+  auto* script =
+    Parser::ParseScriptParallel( interp,
+                                 context,
+                                 context.file->contents,
+                                 { .workers = jobs.value_or( 1 ) } );
 
   // Smenatics to add the tree:
   //
@@ -141,31 +481,11 @@ int main( int argc, char** argv )
   //       once to find references
   Index::Index index = Index::make_index();
   Index::ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
-  Index::Build( index, scanContext, script );
+  Index::BeginBulkLoad( index );
+  Index::Build( index, scanContext, *script );
+  Index::EndBulkLoad( index );
 
-  for ( auto& kv : index.namespaces.byName )
-  {
-    std::cout << "Namespace: "
-              << Index::GetPrintName( index, index.namespaces.Get( kv.second ) )
-              << '\n';
-  }
-
-  for ( auto& kv : index.procs.byName )
-  {
-    std::cout << "Proc: "
-              << Index::GetPrintName( index, index.procs.Get( kv.second ) )
-              << '\n';
-
-    auto range = index.procs.refsByID.equal_range( kv.second );
-    for ( auto it = range.first; it != range.second; ++it )
-    {
-      auto& r = index.procs.references[ it->second ];
-      std::cout << "  " << r->type << " Ref: "
-                << Index::GetPrintName( index, index.procs.Get( r->id ) )
-                << " at " << r->location
-                << '\n';
-    }
-  }
+  PrintIndex( index );
 
 
   Tcl_DeleteInterp( interp );
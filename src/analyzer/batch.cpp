@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <tcl.h>
+
+#include "flat_script.cpp"
+#include "index.cpp"
+#include "script.cpp"
+#include "source_location.cpp"
+
+// Indexing a whole tree of files in one go (analyzer --dir / --files-from),
+// rather than one document at a time.
+namespace Batch
+{
+  using Clock = std::chrono::steady_clock;
+  using Seconds = std::chrono::duration< double >;
+
+  struct Options
+  {
+    size_t workers = std::max( 1u, std::thread::hardware_concurrency() );
+    Parser::Tokenizer tokenizer = Parser::Tokenizer::TCL;
+  };
+
+  struct Timings
+  {
+    size_t files = 0;
+    size_t failed = 0;  // couldn't be read
+    size_t bytes = 0;
+
+    Seconds discover{};  // finding the files
+    Seconds read{};      // summed over the workers
+    Seconds parse{};     // summed over the workers
+    Seconds index{};     // building the index (one thread)
+    Seconds keys{};      // building the index's keys, at the end
+    Seconds total{};
+  };
+
+  std::ostream& operator<<( std::ostream& o, const Timings& t )
+  {
+    auto ms = []( Seconds s ) { return s.count() * 1000; };
+    o << "Files: " << t.files << " (" << t.failed << " unreadable), "
+      << t.bytes / ( 1024.0 * 1024.0 ) << " MiB\n"
+      << "  Discover: " << ms( t.discover ) << " ms\n"
+      << "  Read:     " << ms( t.read ) << " ms (all workers)\n"
+      << "  Parse:    " << ms( t.parse ) << " ms (all workers)\n"
+      << "  Index:    " << ms( t.index ) << " ms\n"
+      << "  Keys:     " << ms( t.keys ) << " ms\n"
+      << "  Total:    " << ms( t.total ) << " ms, "
+      << t.bytes / ( 1024.0 * 1024.0 ) / t.total.count() << " MiB/s\n";
+    return o;
+  }
+
+  /**
+   * All of the .tcl files under `root`, in a stable order. Directories which
+   * can't be read are skipped.
+   */
+  std::vector< std::string > FindTclFiles( const std::string& root )
+  {
+    namespace fs = std::filesystem;
+
+    std::vector< std::string > paths;
+    std::error_code ec;
+    fs::recursive_directory_iterator it(
+      root,
+      fs::directory_options::skip_permission_denied,
+      ec );
+    for ( ; !ec && it != fs::end( it ); it.increment( ec ) )
+    {
+      std::error_code ignored;
+      if ( it->path().extension() == ".tcl" && it->is_regular_file( ignored ) )
+      {
+        paths.push_back( it->path().string() );
+      }
+    }
+
+    std::sort( paths.begin(), paths.end() );
+    return paths;
+  }
+
+  /**
+   * One path per (non-empty) line of `in`.
+   */
+  std::vector< std::string > ReadFileList( std::istream& in )
+  {
+    std::vector< std::string > paths;
+    for ( std::string line; std::getline( in, line ); )
+    {
+      if ( !line.empty() )
+      {
+        paths.push_back( std::move( line ) );
+      }
+    }
+    return paths;
+  }
+
+  /**
+   * Read, parse and index all of `paths` into `index`.
+   *
+   * The files are read, parsed (bodies and all) and flattened on
+   * `options.workers` threads, each with its own Tcl_Interp, which take the
+   * next file in the order of `paths`. Meanwhile this thread adds each parse
+   * to the index in that same order (so the result doesn't depend on the
+   * scheduling) as soon as it's done, and then frees it; only the text stays,
+   * with the index.
+   * The workers only get so far ahead of it, so only a few parses are held
+   * at once. The index is bulk loaded: its keys are built at the end (in
+   * parallel, with more than one worker).
+   */
+  Timings IndexFiles( Index::Index& index,
+                      const std::vector< std::string >& paths,
+                      Options options = {} )
+  {
+    const auto start = Clock::now();
+
+    Timings timings;
+    timings.files = paths.size();
+
+    struct Parsed
+    {
+      std::optional< Parser::FlatScript > script;  // unset if unreadable
+      bool done{ false };
+    };
+
+    const size_t workers =
+      std::max< size_t >( 1, std::min( options.workers, paths.size() ) );
+
+    // The parses which have been started but not yet indexed
+    const size_t window = 4 * workers;
+
+    std::vector< Parsed > parsed( paths.size() );
+    std::mutex lock;
+    std::condition_variable ready;  // a parse is done
+    std::condition_variable space;  // one has been indexed
+    size_t next = 0;                // the next file to parse
+    size_t indexed = 0;             // the files taken for indexing
+
+    auto work = [ & ]() {
+      // Interps can't be shared between threads
+      Tcl_Interp* interp = Tcl_CreateInterp();
+      Seconds read{};
+      Seconds parse{};
+      size_t bytes = 0;
+
+      while ( true )
+      {
+        size_t file;
+        {
+          std::unique_lock l( lock );
+          space.wait( l, [ & ]() {
+            return next == paths.size() || next < indexed + window;
+          } );
+          if ( next == paths.size() )
+          {
+            break;
+          }
+          file = next++;
+        }
+        Parsed result;
+
+        auto t0 = Clock::now();
+        auto source = Parser::read_source_file( paths[ file ] );
+        auto t1 = Clock::now();
+        read += t1 - t0;
+
+        if ( source )
+        {
+          bytes += source->contents.size();
+          Parser::ParseContext context{
+            .file = std::move( source ),
+            .cur_ns = "",
+            .tokenizer = options.tokenizer,
+          };
+          auto* script =
+            Parser::ParseScript( interp, context, context.file->contents );
+          result.script = Parser::Flatten( context.file, *script );
+          parse += Clock::now() - t1;
+        }
+
+        {
+          std::lock_guard l( lock );
+          parsed[ file ] = std::move( result );
+          parsed[ file ].done = true;
+        }
+        ready.notify_all();
+      }
+
+      Tcl_DeleteInterp( interp );
+
+      std::lock_guard l( lock );
+      timings.read += read;
+      timings.parse += parse;
+      timings.bytes += bytes;
+    };
+
+    std::vector< std::thread > threads;
+    threads.reserve( workers );
+    for ( size_t worker = 0; worker < workers; ++worker )
+    {
+      threads.emplace_back( work );
+    }
+
+    Index::BeginBulkLoad( index );
+    for ( size_t file = 0; file < paths.size(); ++file )
+    {
+      Parsed result;
+      {
+        std::unique_lock l( lock );
+        ready.wait( l, [ & ]() { return parsed[ file ].done; } );
+        result = std::move( parsed[ file ] );
+        ++indexed;
+      }
+      space.notify_all();
+
+      if ( !result.script )
+      {
+        std::cerr << "Unable to read file: " << paths[ file ] << '\n';
+        ++timings.failed;
+        continue;
+      }
+
+      auto t0 = Clock::now();
+      Index::ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+      Index::Build( index, scanContext, *result.script );
+      timings.index += Clock::now() - t0;
+    }
+
+    for ( auto& thread : threads )
+    {
+      thread.join();
+    }
+
+    auto t0 = Clock::now();
+    Index::EndBulkLoad( index, workers > 1 );
+    timings.keys = Clock::now() - t0;
+
+    timings.total = Clock::now() - start;
+    return timings;
+  }
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// The commands built in to Tcl (8.6 and 9.0), which is what most calls in real
+// code are to. Knowing them without looking anything up lets the index rule
+// out a call to one of them as a call to a proc (unless there's a proc of the
+// same name, which would shadow it).
+namespace Parser
+{
+  struct CoreCommand
+  {
+    static constexpr uint8_t ANY = UINT8_MAX;
+
+    std::string_view name;  // without a leading ::
+    uint8_t min_args;
+    uint8_t max_args;       // or ANY
+    bool ensemble = false;  // the first argument is a subcommand
+
+    // The name, without its namespace (e.g. define for oo::define)
+    constexpr std::string_view Tail() const
+    {
+      auto pos = name.rfind( "::" );
+      return pos == std::string_view::npos ? name : name.substr( pos + 2 );
+    }
+  };
+
+  // clang-format off
+  constexpr CoreCommand CORE_COMMANDS[] = {
+    { "after",                   1, CoreCommand::ANY },
+    { "append",                  1, CoreCommand::ANY },
+    { "apply",                   1, CoreCommand::ANY },
+    { "array",                   2, CoreCommand::ANY, true },
+    { "auto_execok",             1, 1 },
+    { "auto_import",             1, 1 },
+    { "auto_load",               1, 2 },
+    { "auto_mkindex",            1, CoreCommand::ANY },
+    { "auto_qualify",            2, 2 },
+    { "auto_reset",              0, 0 },
+    { "bgerror",                 2, 2 },
+    { "binary",                  1, CoreCommand::ANY, true },
+    { "break",                   0, 0 },
+    { "catch",                   1, 3 },
+    { "cd",                      0, 1 },
+    { "chan",                    1, CoreCommand::ANY, true },
+    { "clock",                   1, CoreCommand::ANY, true },
+    { "close",                   1, 2 },
+    { "concat",                  0, CoreCommand::ANY },
+    { "const",                   2, 2 },
+    { "continue",                0, 0 },
+    { "coroinject",              3, CoreCommand::ANY },
+    { "coroprobe",               2, CoreCommand::ANY },
+    { "coroutine",               2, CoreCommand::ANY },
+    { "dict",                    1, CoreCommand::ANY, true },
+    { "encoding",                1, CoreCommand::ANY, true },
+    { "eof",                     1, 1 },
+    { "error",                   1, 3 },
+    { "eval",                    1, CoreCommand::ANY },
+    { "exec",                    1, CoreCommand::ANY },
+    { "exit",                    0, 1 },
+    { "expr",                    1, CoreCommand::ANY },
+    { "fblocked",                1, 1 },
+    { "fconfigure",              1, CoreCommand::ANY },
+    { "fcopy",                   2, 6 },
+    { "file",                    1, CoreCommand::ANY, true },
+    { "fileevent",               2, 3 },
+    { "flush",                   1, 1 },
+    { "for",                     4, 4 },
+    { "foreach",                 3, CoreCommand::ANY },
+    { "foreachLine",             3, 3 },
+    { "format",                  1, CoreCommand::ANY },
+    { "fpclassify",              1, 1 },
+    { "gets",                    1, 2 },
+    { "glob",                    1, CoreCommand::ANY },
+    { "global",                  0, CoreCommand::ANY },
+    { "history",                 0, CoreCommand::ANY, true },
+    { "if",                      2, CoreCommand::ANY },
+    { "incr",                    1, 2 },
+    { "info",                    1, CoreCommand::ANY, true },
+    { "interp",                  1, CoreCommand::ANY, true },
+    { "join",                    1, 2 },
+    { "lappend",                 1, CoreCommand::ANY },
+    { "lassign",                 1, CoreCommand::ANY },
+    { "ledit",                   3, CoreCommand::ANY },
+    { "lindex",                  1, CoreCommand::ANY },
+    { "linsert",                 2, CoreCommand::ANY },
+    { "list",                    0, CoreCommand::ANY },
+    { "llength",                 1, 1 },
+    { "lmap",                    3, CoreCommand::ANY },
+    { "load",                    1, CoreCommand::ANY },
+    { "lpop",                    1, CoreCommand::ANY },
+    { "lrange",                  3, 3 },
+    { "lremove",                 1, CoreCommand::ANY },
+    { "lrepeat",                 1, CoreCommand::ANY },
+    { "lreplace",                3, CoreCommand::ANY },
+    { "lreverse",                1, 1 },
+    { "lsearch",                 2, CoreCommand::ANY },
+    { "lseq",                    1, CoreCommand::ANY },
+    { "lset",                    2, CoreCommand::ANY },
+    { "lsort",                   1, CoreCommand::ANY },
+    { "my",                      1, CoreCommand::ANY },
+    { "namespace",               1, CoreCommand::ANY, true },
+    { "next",                    0, CoreCommand::ANY },
+    { "nextto",                  1, CoreCommand::ANY },
+    { "oo::class",               1, CoreCommand::ANY },
+    { "oo::copy",                1, 3 },
+    { "oo::define",              2, CoreCommand::ANY },
+    { "oo::objdefine",           2, CoreCommand::ANY },
+    { "oo::object",              1, CoreCommand::ANY },
+    { "open",                    1, 3 },
+    { "package",                 1, CoreCommand::ANY, true },
+    { "parray",                  1, 2 },
+    { "pid",                     0, 1 },
+    { "pkg_mkIndex",             1, CoreCommand::ANY },
+    { "proc",                    3, 3 },
+    { "puts",                    1, 3 },
+    { "pwd",                     0, 0 },
+    { "read",                    1, 2 },
+    { "readFile",                1, 2 },
+    { "regexp",                  2, CoreCommand::ANY },
+    { "regsub",                  3, CoreCommand::ANY },
+    { "rename",                  2, 2 },
+    { "return",                  0, CoreCommand::ANY },
+    { "scan",                    2, CoreCommand::ANY },
+    { "seek",                    2, 3 },
+    { "self",                    0, 1 },
+    { "set",                     1, 2 },
+    { "socket",                  2, CoreCommand::ANY },
+    { "source",                  1, CoreCommand::ANY },
+    { "split",                   1, 2 },
+    { "string",                  1, CoreCommand::ANY, true },
+    { "subst",                   1, CoreCommand::ANY },
+    { "switch",                  2, CoreCommand::ANY },
+    { "tailcall",                1, CoreCommand::ANY },
+    { "tcl_endOfWord",           2, 2 },
+    { "tcl_findLibrary",         6, 6 },
+    { "tcl_startOfNextWord",     2, 2 },
+    { "tcl_startOfPreviousWord", 2, 2 },
+    { "tcl_wordBreakAfter",      2, 2 },
+    { "tcl_wordBreakBefore",     2, 2 },
+    { "tell",                    1, 1 },
+    { "throw",                   2, 2 },
+    { "time",                    1, 2 },
+    { "timerate",                1, CoreCommand::ANY },
+    { "trace",                   1, CoreCommand::ANY, true },
+    { "try",                     1, CoreCommand::ANY },
+    { "unknown",                 0, CoreCommand::ANY },
+    { "unload",                  1, CoreCommand::ANY },
+    { "unset",                   0, CoreCommand::ANY },
+    { "update",                  0, 1 },
+    { "uplevel",                 1, CoreCommand::ANY },
+    { "upvar",                   2, CoreCommand::ANY },
+    { "variable",                1, CoreCommand::ANY },
+    { "vwait",                   1, CoreCommand::ANY },
+    { "while",                   2, 2 },
+    { "writeFile",               2, 3 },
+    { "yield",                   0, 1 },
+    { "yieldto",                 1, CoreCommand::ANY },
+    { "zlib",                    1, CoreCommand::ANY, true },
+  };
+  // clang-format on
+
+  constexpr size_t NUM_CORE_COMMANDS = std::size( CORE_COMMANDS );
+  static_assert( NUM_CORE_COMMANDS < UINT8_MAX );
+
+  namespace Core
+  {
+    // FNV-1a, which is simple enough to run at compile time, with a final mix
+    // (as its top bits alone are poorly distributed)
+    constexpr uint64_t HashName( std::string_view name, uint64_t seed )
+    {
+      uint64_t h = 0xcbf29ce484222325ull ^ seed;
+      for ( char c : name )
+      {
+        h ^= static_cast< uint8_t >( c );
+        h *= 0x100000001b3ull;
+      }
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      return h ^ ( h >> 33 );
+    }
+
+    constexpr int SLOT_BITS = 12;
+    constexpr size_t SLOTS = size_t{ 1 } << SLOT_BITS;
+
+    constexpr size_t Slot( std::string_view name, uint64_t seed )
+    {
+      return HashName( name, seed ) >> ( 64 - SLOT_BITS );
+    }
+
+    // Each slot is the position of a command in CORE_COMMANDS, plus 1, or 0
+    // if it's empty. The seed is the first one with which no two commands
+    // share a slot, so a name is found (or not) with one hash and one
+    // comparison.
+    struct Table
+    {
+      uint64_t seed = 0;
+      std::array< uint8_t, SLOTS > slots{};
+    };
+
+    constexpr Table MakeTable()
+    {
+      for ( uint64_t seed = 0; seed < 1000; ++seed )
+      {
+        Table table{ .seed = seed };
+        bool collided = false;
+        for ( size_t i = 0; i < NUM_CORE_COMMANDS && !collided; ++i )
+        {
+          auto& slot = table.slots[ Slot( CORE_COMMANDS[ i ].name, seed ) ];
+          collided = slot != 0;
+          slot = static_cast< uint8_t >( i + 1 );
+        }
+        if ( !collided )
+        {
+          return table;
+        }
+      }
+      throw "No seed gives a perfect hash of the core commands";
+    }
+
+    constexpr Table TABLE = MakeTable();
+  }  // namespace Core
+
+  /**
+   * The core command which `name` (as called, perhaps with a leading ::)
+   * names, if any.
+   */
+  constexpr const CoreCommand* FindCoreCommand( std::string_view name )
+  {
+    if ( name.starts_with( "::" ) )
+    {
+      name.remove_prefix( 2 );
+    }
+
+    auto slot = Core::TABLE.slots[ Core::Slot( name, Core::TABLE.seed ) ];
+    if ( slot == 0 || CORE_COMMANDS[ slot - 1 ].name != name )
+    {
+      return nullptr;
+    }
+    return &CORE_COMMANDS[ slot - 1 ];
+  }
+
+  static_assert( FindCoreCommand( "set" )->name == "set" );
+  static_assert( FindCoreCommand( "::oo::define" ) );
+  static_assert( !FindCoreCommand( "define" ) && !FindCoreCommand( "sett" ) );
+
+  // The position of `command` in CORE_COMMANDS
+  constexpr size_t CoreCommandIndex( const CoreCommand& command )
+  {
+    return static_cast< size_t >( &command - CORE_COMMANDS );
+  }
+
+  namespace Core
+  {
+    constexpr size_t NUM_QUALIFIED = [] {
+      size_t n = 0;
+      for ( const auto& command : CORE_COMMANDS )
+      {
+        n += command.name != command.Tail();
+      }
+      return n;
+    }();
+  }
+
+  // The core commands in a namespace (e.g. oo::define), which a proc of the
+  // same name (define) in that namespace would shadow
+  constexpr auto QUALIFIED_CORE_COMMANDS = [] {
+    std::array< const CoreCommand*, Core::NUM_QUALIFIED > qualified{};
+    size_t n = 0;
+    for ( const auto& command : CORE_COMMANDS )
+    {
+      if ( command.name != command.Tail() )
+      {
+        qualified[ n++ ] = &command;
+      }
+    }
+    return qualified;
+  }();
+}  // namespace Parser
+
+namespace Parser::Test
+{
+  void TestCoreCommands()
+  {
+    auto fail = 0;
+
+    // Every command is found by its own name, with or without ::
+    for ( const auto& command : CORE_COMMANDS )
+    {
+      std::string qualified = "::" + std::string( command.name );
+      if ( FindCoreCommand( command.name ) != &command ||
+           FindCoreCommand( qualified ) != &command ||
+           command.min_args > command.max_args )
+      {
+        std::cerr << "Expected to find core command " << command.name << '\n';
+        ++fail;
+      }
+    }
+
+    for ( std::string_view name :
+          { "", "::", "proc2", "Set", "oo::", "::oo", "ns::set", "sset" } )
+    {
+      if ( FindCoreCommand( name ) )
+      {
+        std::cerr << "Didn't expect " << name << " to be a core command\n";
+        ++fail;
+      }
+    }
+
+    auto* string = FindCoreCommand( "string" );
+    auto* set = FindCoreCommand( "set" );
+    if ( !string || !string->ensemble || !set || set->ensemble ||
+         set->min_args != 1 || set->max_args != 2 ||
+         FindCoreCommand( "oo::define" )->Tail() != "define" )
+    {
+      std::cerr << "Expected string to be an ensemble, and set not\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+}  // namespace Parser::Test
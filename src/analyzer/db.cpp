@@ -1,24 +1,184 @@
 #pragma once
 
 #include "source_location.cpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <tuple>
 #include <unordered_map>
 #include <map>
 #include <deque>
 #include <utility>
+#include <vector>
 
 namespace DB
 {
-  // FIXME: Using heap allocation here is just laziness. It allows me to extract
-  // pointers from the Db and use them while manipulating the tables. it isn't
-  // actually needed, and it's basically a massive performance drain to avoid
-  // typing. Solution might be so just make a macro that gets one of these
-  // things and always use that. But for now we hammer malloc until it goes blue
-  // in the face.
-  //
-  // FIXME: lazy non-serialisable vector of pointers
+  // A vector whose elements never move. They're constructed in place in fixed
+  // size chunks, and a chunk is never reallocated, so references to rows stay
+  // valid as the table grows, without allocating every row separately (and
+  // finding one is still just an index into a chunk).
+  template< typename T,
+            size_t ChunkSize = std::bit_floor(
+              std::max< size_t >( 64, 16 * 1024 / sizeof( T ) ) ) >
+  class ChunkedVector
+  {
+    static_assert( std::has_single_bit( ChunkSize ) );
+    static constexpr size_t SHIFT = std::countr_zero( ChunkSize );
+    static constexpr size_t MASK = ChunkSize - 1;
+
+    struct FreeChunk
+    {
+      void operator()( T* chunk ) const
+      {
+        ::operator delete( chunk, std::align_val_t( alignof( T ) ) );
+      }
+    };
+
+    std::vector< std::unique_ptr< T, FreeChunk > > chunks;
+    size_t count = 0;
+
+    template< typename Vector, typename Value >
+    struct Iterator
+    {
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = T;
+      using difference_type = std::ptrdiff_t;
+      using pointer = Value*;
+      using reference = Value&;
+
+      Vector* vector;
+      size_t pos;
+
+      Value& operator*() const { return ( *vector )[ pos ]; }
+      Value* operator->() const { return &( *vector )[ pos ]; }
+      Iterator& operator++() { ++pos; return *this; }
+      Iterator operator++( int ) { auto it = *this; ++pos; return it; }
+      bool operator==( const Iterator& other ) const
+      {
+        return pos == other.pos;
+      }
+    };
+
+  public:
+    using value_type = T;
+    using iterator = Iterator< ChunkedVector, T >;
+    using const_iterator = Iterator< const ChunkedVector, const T >;
+
+    static constexpr size_t CHUNK_SIZE = ChunkSize;
+
+    ChunkedVector() = default;
+    ChunkedVector( const ChunkedVector& ) = delete;
+    ChunkedVector& operator=( const ChunkedVector& ) = delete;
+
+    ChunkedVector( ChunkedVector&& other ) noexcept
+      : chunks( std::move( other.chunks ) )
+      , count( std::exchange( other.count, 0 ) )
+    {
+    }
+
+    ChunkedVector& operator=( ChunkedVector&& other ) noexcept
+    {
+      if ( this != &other )
+      {
+        clear();
+        chunks = std::move( other.chunks );
+        count = std::exchange( other.count, 0 );
+      }
+      return *this;
+    }
+
+    ~ChunkedVector()
+    {
+      clear();
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Only the list of chunks can be reserved: a chunk is allocated when it's
+    // first needed
+    void reserve( size_t n )
+    {
+      chunks.reserve( ( n + MASK ) >> SHIFT );
+    }
+
+    template< typename... Args >
+    T& emplace_back( Args&&... args )
+    {
+      if ( ( count >> SHIFT ) == chunks.size() )
+      {
+        chunks.emplace_back( static_cast< T* >(
+          ::operator new( ChunkSize * sizeof( T ),
+                          std::align_val_t( alignof( T ) ) ) ) );
+      }
+
+      T* slot = chunks[ count >> SHIFT ].get() + ( count & MASK );
+      new ( slot ) T( std::forward< Args >( args )... );
+      ++count;
+      return *slot;
+    }
+
+    T& push_back( T&& value )
+    {
+      return emplace_back( std::move( value ) );
+    }
+
+    T& operator[]( size_t pos )
+    {
+      return chunks[ pos >> SHIFT ].get()[ pos & MASK ];
+    }
+
+    const T& operator[]( size_t pos ) const
+    {
+      return chunks[ pos >> SHIFT ].get()[ pos & MASK ];
+    }
+
+    T& at( size_t pos )
+    {
+      assert( pos < count );
+      return ( *this )[ pos ];
+    }
+
+    const T& at( size_t pos ) const
+    {
+      assert( pos < count );
+      return ( *this )[ pos ];
+    }
+
+    // Destroy the elements from `size` on, and free the chunks they leave
+    // empty
+    void truncate( size_t size )
+    {
+      for ( size_t pos = size; pos < count; ++pos )
+      {
+        ( *this )[ pos ].~T();
+      }
+      count = std::min( count, size );
+      chunks.resize( ( count + MASK ) >> SHIFT );
+    }
+
+    void clear()
+    {
+      truncate( 0 );
+    }
+
+    iterator begin() { return { this, 0 }; }
+    iterator end() { return { this, count }; }
+    const_iterator begin() const { return { this, 0 }; }
+    const_iterator end() const { return { this, count }; }
+  };
+
   template< typename T >
-  using Storage = std::vector< std::unique_ptr< T > >;
+  using Storage = ChunkedVector< T >;
 
   // TODO: we want:
   //  - to be able to specify arbitrary keys for a type (specialise?)
@@ -31,10 +191,6 @@ namespace DB
   // FIXME: Lazy non-serialisable standard library containers
   template< typename TKey, typename... TValues >
   using SortUniqueKey = std::map< TKey, std::tuple< TValues... > >;
-
-  // FIXME: Lazy non-serialisable standard library containers
-  template< typename TKey, typename... TValues >
-  using HashIndex = std::unordered_multimap< TKey, std::tuple< TValues... > >;
 #endif
 
   // FIXME: Lazy non-serialisable standard library containers
@@ -52,6 +208,453 @@ namespace DB
                                   TValue,
                                   std::tuple< TValue, TRest... > > >;
 
+  // Alternatives to SortIndex for a record's keys. Like it, they're
+  // multimaps: equal_range gives every value added with a key, in the order
+  // they were added, as elements with `first` (the key) and `second`.
+
+  // A sorted vector. Lookups are a binary search of contiguous memory, and
+  // there's no allocation per element. Elements are appended as they're
+  // added, and only sorted (stably) when it's next read, so filling it costs
+  // one sort. It can be read from several threads at once, but (as with any
+  // of these) not while it's being added to.
+  template< typename TKey, typename TValue >
+  class FlatSortIndex
+  {
+  public:
+    using value_type = std::pair< TKey, TValue >;
+    using const_iterator = typename std::vector< value_type >::const_iterator;
+    using iterator = const_iterator;
+
+    FlatSortIndex() = default;
+
+    FlatSortIndex( FlatSortIndex&& other ) noexcept
+      : entries( std::move( other.entries ) )
+      , sorted( other.sorted.load() )
+    {
+    }
+
+    FlatSortIndex& operator=( FlatSortIndex&& other ) noexcept
+    {
+      entries = std::move( other.entries );
+      sorted = other.sorted.load();
+      return *this;
+    }
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    void reserve( size_t n ) { entries.reserve( n ); }
+
+    void emplace( TKey key, TValue value )
+    {
+      if ( !entries.empty() && key < entries.back().first )
+      {
+        sorted.store( false, std::memory_order_relaxed );
+      }
+      entries.emplace_back( std::move( key ), std::move( value ) );
+    }
+
+    std::pair< const_iterator, const_iterator > equal_range(
+      const TKey& key ) const
+    {
+      Sort();
+      return std::equal_range( entries.cbegin(),
+                               entries.cend(),
+                               key,
+                               KeyLess{} );
+    }
+
+    size_t count( const TKey& key ) const
+    {
+      auto range = equal_range( key );
+      return std::distance( range.first, range.second );
+    }
+
+    const_iterator begin() const { Sort(); return entries.cbegin(); }
+    const_iterator end() const { Sort(); return entries.cend(); }
+
+    // Remove the element `key` -> `value`, if there is one
+    void erase( const TKey& key, const TValue& value )
+    {
+      auto range = equal_range( key );
+      auto pos = std::find_if( range.first,
+                               range.second,
+                               [ & ]( const value_type& e ) {
+                                 return e.second == value;
+                               } );
+      if ( pos != range.second )
+      {
+        entries.erase( pos );
+      }
+    }
+
+    void clear()
+    {
+      entries.clear();
+      sorted = true;
+    }
+
+  private:
+    struct KeyLess
+    {
+      bool operator()( const value_type& a, const TKey& b ) const
+      {
+        return a.first < b;
+      }
+      bool operator()( const TKey& a, const value_type& b ) const
+      {
+        return a < b.first;
+      }
+      bool operator()( const value_type& a, const value_type& b ) const
+      {
+        return a.first < b.first;
+      }
+    };
+
+    void Sort() const
+    {
+      if ( sorted.load( std::memory_order_acquire ) )
+      {
+        return;
+      }
+
+      std::lock_guard l( lock );
+      if ( !sorted.load( std::memory_order_relaxed ) )
+      {
+        std::stable_sort( entries.begin(), entries.end(), KeyLess{} );
+        sorted.store( true, std::memory_order_release );
+      }
+    }
+
+    mutable std::vector< value_type > entries;
+    mutable std::atomic< bool > sorted{ true };
+    mutable std::mutex lock;
+  };
+
+  // An open addressing (linear probing) hash table of the distinct keys, each
+  // of which has the first and last of its elements, which are chained
+  // together in one vector. A lookup is one probe sequence and a walk along
+  // the chain, and there's no allocation per element.
+  template< typename TKey,
+            typename TValue,
+            typename THash = std::hash< TKey > >
+  class HashIndex
+  {
+    static constexpr uint32_t NIL = UINT32_MAX;
+    static constexpr uint32_t ERASED = UINT32_MAX - 1;
+
+  public:
+    struct Entry
+    {
+      TKey first;
+      TValue second;
+      uint32_t next;  // the next element with the same key, NIL or ERASED
+    };
+
+    struct const_iterator
+    {
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = Entry;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const Entry*;
+      using reference = const Entry&;
+
+      const std::vector< Entry >* entries;
+      uint32_t pos;
+
+      const Entry& operator*() const { return ( *entries )[ pos ]; }
+      const Entry* operator->() const { return &( *entries )[ pos ]; }
+      const_iterator& operator++()
+      {
+        pos = ( *entries )[ pos ].next;
+        return *this;
+      }
+      const_iterator operator++( int )
+      {
+        auto it = *this;
+        ++*this;
+        return it;
+      }
+      bool operator==( const const_iterator& other ) const
+      {
+        return pos == other.pos;
+      }
+    };
+    using iterator = const_iterator;
+
+    size_t size() const { return entries.size() - erased; }
+    bool empty() const { return size() == 0; }
+    void reserve( size_t n ) { entries.reserve( n ); }
+
+    void emplace( TKey key, TValue value )
+    {
+      if ( ( keys + 1 ) * 2 > slots.size() )
+      {
+        Grow();
+      }
+
+      const auto pos = static_cast< uint32_t >( entries.size() );
+      entries.push_back( Entry{ .first = key,
+                                .second = std::move( value ),
+                                .next = NIL } );
+
+      auto& slot = slots[ Find( key ) ];
+      if ( slot.head == NIL )
+      {
+        slot = Slot{ .key = std::move( key ), .head = pos, .tail = pos };
+        ++keys;
+      }
+      else
+      {
+        entries[ slot.tail ].next = pos;
+        slot.tail = pos;
+      }
+    }
+
+    std::pair< const_iterator, const_iterator > equal_range(
+      const TKey& key ) const
+    {
+      const_iterator end{ &entries, NIL };
+      if ( slots.empty() )
+      {
+        return { end, end };
+      }
+      return { const_iterator{ &entries, slots[ Find( key ) ].head }, end };
+    }
+
+    size_t count( const TKey& key ) const
+    {
+      auto range = equal_range( key );
+      return std::distance( range.first, range.second );
+    }
+
+    // Remove the element `key` -> `value`, if there is one. It's unlinked
+    // from its chain, and the space is reclaimed once half of the elements
+    // have been erased.
+    void erase( const TKey& key, const TValue& value )
+    {
+      if ( slots.empty() )
+      {
+        return;
+      }
+
+      const size_t i = Find( key );
+      auto& slot = slots[ i ];
+      uint32_t prev = NIL;
+      uint32_t pos = slot.head;
+      while ( pos != NIL && !( entries[ pos ].second == value ) )
+      {
+        prev = pos;
+        pos = entries[ pos ].next;
+      }
+      if ( pos == NIL )
+      {
+        return;
+      }
+
+      const uint32_t next = entries[ pos ].next;
+      ( prev == NIL ? slot.head : entries[ prev ].next ) = next;
+      if ( slot.tail == pos )
+      {
+        slot.tail = prev;
+      }
+      entries[ pos ].next = ERASED;
+      ++erased;
+
+      if ( slot.head == NIL )
+      {
+        RemoveSlot( i );
+      }
+
+      if ( erased * 2 > entries.size() )
+      {
+        Repack();
+      }
+    }
+
+    void clear()
+    {
+      slots.clear();
+      entries.clear();
+      keys = 0;
+      erased = 0;
+      shift = 64;
+    }
+
+  private:
+    struct Slot
+    {
+      TKey key{};
+      uint32_t head = NIL;  // NIL if the slot is empty
+      uint32_t tail = NIL;
+    };
+
+    // The slot which has key, or the empty one where it would go
+    size_t Find( const TKey& key ) const
+    {
+      const size_t mask = slots.size() - 1;
+      // Fibonacci hashing, as std::hash is the identity for integers
+      size_t i = ( static_cast< uint64_t >( THash{}( key ) ) *
+                   0x9e3779b97f4a7c15ull ) >>
+                 shift;
+      while ( slots[ i ].head != NIL && !( slots[ i ].key == key ) )
+      {
+        i = ( i + 1 ) & mask;
+      }
+      return i;
+    }
+
+    void Grow()
+    {
+      auto old = std::move( slots );
+      slots.assign( std::max< size_t >( 16, old.size() * 2 ), Slot{} );
+      shift = 64 - std::countr_zero( slots.size() );
+      for ( auto& slot : old )
+      {
+        if ( slot.head != NIL )
+        {
+          slots[ Find( slot.key ) ] = std::move( slot );
+        }
+      }
+    }
+
+    // Empty slot i, moving back any later slot in its probe sequence which
+    // could then no longer be found (backward shift deletion)
+    void RemoveSlot( size_t i )
+    {
+      const size_t mask = slots.size() - 1;
+      size_t j = i;
+      while ( true )
+      {
+        j = ( j + 1 ) & mask;
+        if ( slots[ j ].head == NIL )
+        {
+          break;
+        }
+
+        // Where slots[ j ] would ideally be. It can move to i unless that
+        // lies cyclically in ( i, j ]
+        size_t k = ( static_cast< uint64_t >( THash{}( slots[ j ].key ) ) *
+                     0x9e3779b97f4a7c15ull ) >>
+                   shift;
+        if ( i <= j ? ( i < k && k <= j ) : ( i < k || k <= j ) )
+        {
+          continue;
+        }
+        slots[ i ] = std::move( slots[ j ] );
+        i = j;
+      }
+      slots[ i ] = Slot{};
+      --keys;
+    }
+
+    // Drop the erased elements, keeping the rest in the order they were added
+    void Repack()
+    {
+      auto old = std::move( entries );
+      clear();
+      for ( auto& entry : old )
+      {
+        if ( entry.next != ERASED )
+        {
+          emplace( std::move( entry.first ), std::move( entry.second ) );
+        }
+      }
+    }
+
+    std::vector< Slot > slots;
+    std::vector< Entry > entries;
+    size_t keys = 0;
+    size_t erased = 0;
+    int shift = 64;
+  };
+
+  // Remove `key` -> `value` from any of the key types
+  template< typename TIndex, typename TKey, typename TValue >
+  void EraseKey( TIndex& index, const TKey& key, const TValue& value )
+  {
+    if constexpr ( requires { index.erase( key, value ); } )
+    {
+      index.erase( key, value );
+    }
+    else
+    {
+      // std::map and std::multimap
+      auto range = index.equal_range( key );
+      for ( auto it = range.first; it != range.second; ++it )
+      {
+        if ( it->second == value )
+        {
+          index.erase( it );
+          break;
+        }
+      }
+    }
+  }
+
+  // A set of (64 bit) hashes which can say for certain that one isn't in it,
+  // and otherwise that it probably is. Each is three bits of one word, which
+  // at 16 bits per element is wrong about 1% of the time. It keeps the
+  // hashes, so that it can grow as it fills.
+  class BloomFilter
+  {
+    static constexpr size_t BITS_PER_ELEMENT = 16;
+
+    std::vector< uint64_t > words;
+    std::vector< uint64_t > hashes;
+    int shift = 64;
+
+    size_t Word( uint64_t hash ) const
+    {
+      return ( hash * 0x9e3779b97f4a7c15ull ) >> shift;
+    }
+
+    static uint64_t Bits( uint64_t hash )
+    {
+      return ( uint64_t{ 1 } << ( hash & 63 ) ) |
+             ( uint64_t{ 1 } << ( ( hash >> 6 ) & 63 ) ) |
+             ( uint64_t{ 1 } << ( ( hash >> 12 ) & 63 ) );
+    }
+
+  public:
+    size_t size() const { return hashes.size(); }
+
+    void Add( uint64_t hash )
+    {
+      hashes.push_back( hash );
+      if ( hashes.size() * BITS_PER_ELEMENT > words.size() * 64 )
+      {
+        words.assign( std::bit_ceil( std::max< size_t >(
+                        4,
+                        hashes.size() * BITS_PER_ELEMENT * 2 / 64 ) ),
+                      0 );
+        shift = 64 - std::countr_zero( words.size() );
+        for ( auto h : hashes )
+        {
+          words[ Word( h ) ] |= Bits( h );
+        }
+        return;
+      }
+      words[ Word( hash ) ] |= Bits( hash );
+    }
+
+    bool MayContain( uint64_t hash ) const
+    {
+      if ( words.empty() )
+      {
+        return false;
+      }
+      const auto bits = Bits( hash );
+      return ( words[ Word( hash ) ] & bits ) == bits;
+    }
+
+    void clear()
+    {
+      words.clear();
+      hashes.clear();
+      shift = 64;
+    }
+  };
+
   // FIXME: Lazy non-serialisable standard library containers
   template< typename T >
   using FreeList = std::deque< T >;
@@ -61,20 +664,85 @@ namespace DB
   {
     using Table = Storage< TRow >;
     using Row = TRow;
+    using ID = typename TRow::ID;
 
     Table table;
 
+    // While bulk loading, rows are just appended to the table: their keys
+    // are only updated by BuildKeys, so nothing should be looked up by key
+    // in the meantime (Get is fine).
+    bool bulk_load = false;
+    size_t keyed = 0;  // the rows before this are in the keys
+
+    // The ids of removed rows, which Insert reuses. A removed row stays in
+    // the table as a tombstone, with id 0 (ids start at 1), until Compact.
+    FreeList< ID > free;
+
     template< typename... Args >
     Row& Insert( Args&&... args )
     {
+      // Reusing a row means adding it to the keys straight away, so not
+      // while bulk loading
+      if ( !free.empty() && !bulk_load )
+      {
+        const auto id = free.front();
+        free.pop_front();
+        auto& row = table[ id - 1 ] = Row( std::forward< Args >( args )... );
+        row.id = id;
+        static_cast< TRecord* >( this )->UpdateKeys( row );
+        return row;
+      }
+
       const auto id = table.size() + 1;
       auto& row = table.emplace_back( std::forward< Args >( args )... );
-      row->id = id;
-      static_cast< TRecord* >( this )->UpdateKeys( *row );
-      return *row;
+      row.id = id;
+      if ( !bulk_load )
+      {
+        BuildKeys();
+      }
+      return row;
     }
 
-    Row& Get( typename TRow::ID id ) const
+    // Add the rows which aren't yet in the keys, all in one go
+    void BuildKeys()
+    {
+      auto* self = static_cast< TRecord* >( this );
+      if ( keyed == table.size() )
+      {
+        return;
+      }
+
+      // (but not one at a time, which would reallocate every time)
+      if ( table.size() - keyed > 1 )
+      {
+        self->ReserveKeys( table.size() - keyed );
+      }
+      for ( ; keyed < table.size(); ++keyed )
+      {
+        if ( IsLive( table[ keyed ] ) )
+        {
+          self->UpdateKeys( table[ keyed ] );
+        }
+      }
+    }
+
+    static bool IsLive( const Row& row ) { return row.id != 0; }
+
+    bool IsLive( ID id ) const
+    {
+      return id >= 1 && id <= table.size() && IsLive( table[ id - 1 ] );
+    }
+
+    // The number of rows which haven't been removed
+    size_t Size() const { return table.size() - free.size(); }
+
+    // The proportion of the table which is tombstones
+    double Fragmentation() const
+    {
+      return table.empty() ? 0.0 : double( free.size() ) / table.size();
+    }
+
+    Row& Get( ID id ) const
     {
       if ( id < 1 )
       {
@@ -88,29 +756,105 @@ namespace DB
         abort();
       }
 
-      // FIXME: If anything is ever removed from the table, boom
-      return *table.at( id - 1 ).get();
+      auto& row = const_cast< Table& >( table )[ id - 1 ];
+      if ( !IsLive( row ) )
+      {
+        assert( false && "Row has been removed" );
+        abort();
+      }
+      return row;
+    }
+
+    // Remove the row `id` and its keys. Its id may be given to the next row
+    // inserted; anything which refers to it must be removed too.
+    void Remove( ID id )
+    {
+      assert( !bulk_load );
+      auto& row = Get( id );
+      if ( id - 1 < keyed )
+      {
+        static_cast< TRecord* >( this )->RemoveKeys( row );
+      }
+      row = Row{};
+      free.push_back( id );
+    }
+
+    // Move the rows up over the tombstones, keeping them in order, and
+    // rebuild the keys. The rows' ids change (and so any pointers to them
+    // are invalidated): the result maps each old id to its new one, or to 0
+    // for one which had been removed, and whatever refers to the rows must
+    // be updated with it.
+    std::vector< ID > Compact()
+    {
+      assert( !bulk_load );
+      std::vector< ID > remap( table.size() + 1, 0 );
+      if ( free.empty() )
+      {
+        std::iota( remap.begin() + 1, remap.end(), ID{ 1 } );
+        return remap;
+      }
+
+      size_t next = 0;
+      for ( size_t pos = 0; pos < table.size(); ++pos )
+      {
+        if ( !IsLive( table[ pos ] ) )
+        {
+          continue;
+        }
+        if ( pos != next )
+        {
+          table[ next ] = std::move( table[ pos ] );
+        }
+        ++next;
+        remap[ pos + 1 ] = table[ next - 1 ].id = next;
+      }
+      table.truncate( next );
+      free.clear();
+
+      static_cast< TRecord* >( this )->ClearKeys();
+      keyed = 0;
+      BuildKeys();
+      return remap;
     }
-    // FreeList<size_t> free_;
   };
 
   // OK, we're going all in. CRTP because why the hell not.
   template< typename TRow,
             typename TKey = SortIndex<decltype( TRow::name ),
                                       typename TRow::ID> >
-  struct NamedRecordImpl : Record< NamedRecordImpl< TRow >, TRow >
+  struct NamedRecordImpl : Record< NamedRecordImpl< TRow, TKey >, TRow >
   {
     TKey byName;
 
+    void ReserveKeys( size_t more )
+    {
+      if constexpr ( requires { byName.reserve( more ); } )
+      {
+        byName.reserve( byName.size() + more );
+      }
+    }
+
     void UpdateKeys( const TRow& row )
     {
       byName.emplace( row.name, row.id );
     }
+
+    void RemoveKeys( const TRow& row )
+    {
+      EraseKey( byName, row.name, row.id );
+    }
+
+    void ClearKeys()
+    {
+      byName.clear();
+    }
   };
 
   template< typename TRow,
-            typename TKey = SortIndex< typename TRow::ID, size_t > >
-  struct RefRecordImpl : NamedRecordImpl< TRow >
+            typename TKey = SortIndex< typename TRow::ID, size_t >,
+            typename TNameKey = SortIndex< decltype( TRow::name ),
+                                           typename TRow::ID > >
+  struct RefRecordImpl : NamedRecordImpl< TRow, TNameKey >
   {
     using Reference = typename TRow::Reference;
     using ID = typename TRow::ID;
@@ -119,14 +863,111 @@ namespace DB
 
     Reference& AddReference( Reference&& r )
     {
-      auto pos = references.size();
-      auto& ref = references.emplace_back(
-        new Reference( std::forward< Reference >( r ) ) );
-      refsByID.emplace( r.id, pos );
-      return *ref;
+      auto& ref = references.emplace_back( std::move( r ) );
+      if ( !this->bulk_load )
+      {
+        BuildReferenceKeys();
+      }
+      return ref;
+    }
+
+    // As BuildKeys, for the references
+    void BuildReferenceKeys()
+    {
+      if ( refsKeyed == references.size() )
+      {
+        return;
+      }
+
+      if constexpr ( requires { refsByID.reserve( 0 ); } )
+      {
+        if ( references.size() - refsKeyed > 1 )
+        {
+          refsByID.reserve( refsByID.size() + references.size() - refsKeyed );
+        }
+      }
+      for ( ; refsKeyed < references.size(); ++refsKeyed )
+      {
+        refsByID.emplace( references[ refsKeyed ].id, refsKeyed );
+      }
+    }
+
+    // A removed reference stays in `references` with id 0, until Compact
+    void RemoveReference( size_t pos )
+    {
+      assert( !this->bulk_load );
+      auto& ref = references[ pos ];
+      if ( ref.id == 0 )
+      {
+        return;
+      }
+      EraseKey( refsByID, ref.id, pos );
+      ref.id = 0;
+      ++refsRemoved;
+    }
+
+    // The proportion of the table, or of the references, which is tombstones
+    double Fragmentation() const
+    {
+      return std::max( NamedRecordImpl< TRow, TNameKey >::Fragmentation(),
+                       references.empty()
+                         ? 0.0
+                         : double( refsRemoved ) / references.size() );
+    }
+
+    // Remove the row, and every reference to it
+    void Remove( ID id )
+    {
+      std::vector< size_t > refs;
+      auto range = refsByID.equal_range( id );
+      for ( auto it = range.first; it != range.second; ++it )
+      {
+        refs.push_back( it->second );
+      }
+      for ( auto pos : refs )
+      {
+        RemoveReference( pos );
+      }
+      NamedRecordImpl< TRow, TNameKey >::Remove( id );
+    }
+
+    // As Record::Compact, and the references too: they're repacked and
+    // refer to the rows by their new ids
+    std::vector< ID > Compact()
+    {
+      const bool moved = !this->free.empty();
+      auto remap = NamedRecordImpl< TRow, TNameKey >::Compact();
+      if ( !moved && refsRemoved == 0 )
+      {
+        return remap;
+      }
+
+      size_t next = 0;
+      for ( size_t pos = 0; pos < references.size(); ++pos )
+      {
+        if ( references[ pos ].id == 0 )
+        {
+          continue;
+        }
+        if ( pos != next )
+        {
+          references[ next ] = std::move( references[ pos ] );
+        }
+        references[ next ].id = remap[ references[ next ].id ];
+        ++next;
+      }
+      references.truncate( next );
+      refsRemoved = 0;
+
+      refsByID.clear();
+      refsKeyed = 0;
+      BuildReferenceKeys();
+      return remap;
     }
 
     TKey refsByID;
+    size_t refsKeyed = 0;  // the references before this are in refsByID
+    size_t refsRemoved = 0;
   };
 
   template< typename TRow >
@@ -138,8 +979,13 @@ namespace DB
                      UniqueSortIndex< decltype( TRow::name ),
                                       typename TRow::ID > >;
 
+  // Hashed keys are the fastest to fill and to look up in (see analyzer
+  // --bench-db), and nothing needs to walk them in order
   template< typename TRow >
-  using RefRecord = RefRecordImpl< TRow >;
+  using RefRecord =
+    RefRecordImpl< TRow,
+                   HashIndex< typename TRow::ID, size_t >,
+                   HashIndex< decltype( TRow::name ), typename TRow::ID > >;
 
 
 }  // namespace DB
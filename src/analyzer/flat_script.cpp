@@ -0,0 +1,465 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "script.cpp"
+
+namespace Parser
+{
+  /**
+   * A flattened copy of a Script tree, stored as a structure of arrays. Node 0
+   * is the root script, and the children of any node are stored contiguously,
+   * so walking the tree is index arithmetic over a few flat vectors: no
+   * pointers and no allocation. Only the file's text is referred to, so the
+   * Script (and its arena) can be freed once it's flattened.
+   *
+   * The children of each kind of node are:
+   *   SCRIPT                          -> CALLs
+   *   CALL                            -> WORDs (i.e. Call::words)
+   *   WORD of type SCRIPT             -> CALLs of the nested script
+   *   WORD of type TOKEN_LIST, EXPAND
+   *     or LIST                       -> WORDs
+   *   WORD of type ARRAY_ACCESS       -> a TEXT WORD for the array name,
+   *                                      followed by the index WORDs
+   *
+   * The text of every node is its span of the file, apart from an ERROR
+   * WORD's, which is empty (the message isn't kept).
+   */
+  struct FlatScript
+  {
+    using NodeID = uint32_t;
+    static constexpr NodeID NONE = std::numeric_limits< NodeID >::max();
+
+    enum class Kind : uint8_t
+    {
+      SCRIPT,
+      CALL,
+      WORD,
+    };
+
+    SourceFilePtr file;
+
+    std::vector< Kind > kind;
+    std::vector< uint8_t > type;         // Call::Type or Word::Type
+    std::vector< uint32_t > offset;      // into file->contents
+    std::vector< uint32_t > length;
+    std::vector< NodeID > first_child;
+    std::vector< uint32_t > child_count;
+    std::vector< uint32_t > ns;          // CALL only, index into namespaces
+
+    std::vector< std::string > namespaces;
+
+    size_t size() const
+    {
+      return kind.size();
+    }
+  };
+
+  struct FlatNode;
+
+  struct FlatNodeRange
+  {
+    const FlatScript* tree;
+    FlatScript::NodeID first;
+    uint32_t count;
+
+    struct iterator
+    {
+      const FlatScript* tree;
+      FlatScript::NodeID id;
+
+      FlatNode operator*() const;
+      iterator& operator++()
+      {
+        ++id;
+        return *this;
+      }
+      bool operator==( const iterator& ) const = default;
+    };
+
+    iterator begin() const
+    {
+      return { tree, first };
+    }
+
+    iterator end() const
+    {
+      return { tree, first + count };
+    }
+
+    size_t size() const
+    {
+      return count;
+    }
+
+    FlatNode operator[]( size_t i ) const;
+  };
+
+  /**
+   * A lightweight (pointer + index) view of a node in a FlatScript.
+   */
+  struct FlatNode
+  {
+    const FlatScript* tree;
+    FlatScript::NodeID id;
+
+    FlatScript::Kind Kind() const
+    {
+      return tree->kind[ id ];
+    }
+
+    Word::Type WordType() const
+    {
+      assert( Kind() == FlatScript::Kind::WORD );
+      return static_cast< Word::Type >( tree->type[ id ] );
+    }
+
+    Call::Type CallType() const
+    {
+      assert( Kind() == FlatScript::Kind::CALL );
+      return static_cast< Call::Type >( tree->type[ id ] );
+    }
+
+    SourceLocation Location() const
+    {
+      return { tree->file->id, tree->offset[ id ] };
+    }
+
+    std::string_view Text() const
+    {
+      return std::string_view( tree->file->contents )
+        .substr( tree->offset[ id ], tree->length[ id ] );
+    }
+
+    std::string_view Namespace() const
+    {
+      assert( Kind() == FlatScript::Kind::CALL );
+      return tree->namespaces[ tree->ns[ id ] ];
+    }
+
+    FlatNodeRange Children() const
+    {
+      return { tree, tree->first_child[ id ], tree->child_count[ id ] };
+    }
+
+    FlatNode Child( size_t i ) const
+    {
+      return Children()[ i ];
+    }
+
+    bool operator==( const FlatNode& ) const = default;
+  };
+
+  FlatNode FlatNodeRange::iterator::operator*() const
+  {
+    return { tree, id };
+  }
+
+  FlatNode FlatNodeRange::operator[]( size_t i ) const
+  {
+    assert( i < count );
+    return { tree, static_cast< FlatScript::NodeID >( first + i ) };
+  }
+
+  struct FlatScriptBuilder
+  {
+    FlatScript& tree;
+    std::unordered_map< std::string_view, uint32_t > ns_ids{};
+
+    // Append n uninitialised nodes, returning the id of the first one
+    FlatScript::NodeID Reserve( size_t n )
+    {
+      auto first = static_cast< FlatScript::NodeID >( tree.size() );
+      auto size = tree.size() + n;
+      tree.kind.resize( size );
+      tree.type.resize( size );
+      tree.offset.resize( size );
+      tree.length.resize( size );
+      tree.first_child.resize( size );
+      tree.child_count.resize( size );
+      tree.ns.resize( size );
+      return first;
+    }
+
+    void SetNode( FlatScript::NodeID id,
+                  FlatScript::Kind kind,
+                  uint8_t type,
+                  uint32_t offset,
+                  size_t length )
+    {
+      tree.kind[ id ] = kind;
+      tree.type[ id ] = type;
+      tree.offset[ id ] = offset;
+      tree.length[ id ] = static_cast< uint32_t >( length );
+      tree.first_child[ id ] = FlatScript::NONE;
+      tree.child_count[ id ] = 0;
+      tree.ns[ id ] = 0;
+    }
+
+    void AddCalls( FlatScript::NodeID parent,
+                   const std::pmr::vector< Call >& calls )
+    {
+      auto first = Reserve( calls.size() );
+      tree.first_child[ parent ] = first;
+      tree.child_count[ parent ] = static_cast< uint32_t >( calls.size() );
+      for ( size_t i = 0; i < calls.size(); ++i )
+      {
+        AddCall( first + i, calls[ i ] );
+      }
+    }
+
+    void AddWords( FlatScript::NodeID parent, const Word::WordVec& words )
+    {
+      auto first = Reserve( words.size() );
+      tree.first_child[ parent ] = first;
+      tree.child_count[ parent ] = static_cast< uint32_t >( words.size() );
+      for ( size_t i = 0; i < words.size(); ++i )
+      {
+        AddWord( first + i, words[ i ] );
+      }
+    }
+
+    void AddCall( FlatScript::NodeID id, const Call& call )
+    {
+      SetNode( id,
+               FlatScript::Kind::CALL,
+               static_cast< uint8_t >( call.type ),
+               call.location.offset,
+               call.text.length() );
+
+      auto [ pos, inserted ] =
+        ns_ids.emplace( call.ns, static_cast< uint32_t >( ns_ids.size() ) );
+      if ( inserted )
+      {
+        tree.namespaces.emplace_back( call.ns );
+      }
+      tree.ns[ id ] = pos->second;
+
+      AddWords( id, call.words );
+    }
+
+    void AddWord( FlatScript::NodeID id, const Word& word )
+    {
+      SetNode( id,
+               FlatScript::Kind::WORD,
+               static_cast< uint8_t >( word.type ),
+               word.location.offset,
+               word.type == Word::Type::ERROR ? 0 : word.text.length() );
+
+      switch ( word.type )
+      {
+        case Word::Type::SCRIPT:
+        {
+          if ( auto* script = std::get< Word::ScriptPtr >( word.data ) )
+          {
+            AddCalls( id, script->commands );
+          }
+          break;
+        }
+
+        case Word::Type::TOKEN_LIST:
+        case Word::Type::EXPAND:
+        {
+          AddWords( id, std::get< Word::WordVec >( word.data ) );
+          break;
+        }
+
+        case Word::Type::LIST:
+        {
+          const auto& list = std::get< ListView >( word.data );
+          auto first = Reserve( list.size );
+          tree.first_child[ id ] = first;
+          tree.child_count[ id ] = list.size;
+          for ( auto element : list )
+          {
+            AddWord( first++, element );
+          }
+          break;
+        }
+
+        case Word::Type::ARRAY_ACCESS:
+        {
+          const auto& arrayAccess = std::get< Word::ArrayAccess >( word.data );
+          const auto& index = arrayAccess.index;
+
+          auto first = Reserve( 1 + index.size() );
+          tree.first_child[ id ] = first;
+          tree.child_count[ id ] = static_cast< uint32_t >( 1 + index.size() );
+
+          // The name is a view into the word's text
+          SetNode( first,
+                   FlatScript::Kind::WORD,
+                   static_cast< uint8_t >( Word::Type::TEXT ),
+                   static_cast< uint32_t >( word.location.offset +
+                                            ( arrayAccess.name.data() -
+                                              word.text.data() ) ),
+                   arrayAccess.name.length() );
+
+          for ( size_t i = 0; i < index.size(); ++i )
+          {
+            AddWord( first + 1 + i, index[ i ] );
+          }
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+  };
+
+  /**
+   * Flatten `script`, a parse of `file`.
+   */
+  FlatScript Flatten( SourceFilePtr file, const Script& script )
+  {
+    FlatScript tree{ .file = std::move( file ) };
+    FlatScriptBuilder builder{ .tree = tree };
+
+    auto root = builder.Reserve( 1 );
+    builder.SetNode( root,
+                     FlatScript::Kind::SCRIPT,
+                     0,
+                     script.location.offset,
+                     script.text.length() );
+    builder.AddCalls( root, script.commands );
+
+    // It's kept for as long as the document is open
+    tree.kind.shrink_to_fit();
+    tree.type.shrink_to_fit();
+    tree.offset.shrink_to_fit();
+    tree.length.shrink_to_fit();
+    tree.first_child.shrink_to_fit();
+    tree.child_count.shrink_to_fit();
+    tree.ns.shrink_to_fit();
+
+    return tree;
+  }
+
+  FlatNode Root( const FlatScript& tree )
+  {
+    return { &tree, 0 };
+  }
+}  // namespace Parser
+
+namespace Parser::Test
+{
+  void CompareFlatWord( FlatNode node, const Word& word, size_t offset );
+
+  /**
+   * Abort unless `nodes` are a flattened copy of `calls`, bodies and all.
+   * `nodes` may be of a piece of the text, which starts at `offset`.
+   */
+  void CompareFlatCalls( FlatNodeRange nodes,
+                         const std::pmr::vector< Call >& calls,
+                         size_t offset = 0 )
+  {
+    if ( nodes.size() != calls.size() )
+    {
+      std::cerr << "Expected " << calls.size() << " calls but found "
+                << nodes.size() << '\n';
+      abort();
+    }
+
+    for ( size_t i = 0; i < calls.size(); ++i )
+    {
+      auto node = nodes[ i ];
+      const auto& call = calls[ i ];
+      if ( node.Kind() != FlatScript::Kind::CALL ||
+           node.CallType() != call.type || node.Text() != call.text ||
+           node.Location().offset + offset != call.location.offset ||
+           node.Namespace() != call.ns ||
+           node.Children().size() != call.words.size() )
+      {
+        std::cerr << "Flat call doesn't match call: " << call.text << '\n';
+        abort();
+      }
+
+      for ( size_t w = 0; w < call.words.size(); ++w )
+      {
+        CompareFlatWord( node.Child( w ), call.words[ w ], offset );
+      }
+    }
+  }
+
+  void CompareFlatWord( FlatNode node, const Word& word, size_t offset )
+  {
+    if ( node.Kind() != FlatScript::Kind::WORD ||
+         node.WordType() != word.type ||
+         ( node.Text() != word.text && word.type != Word::Type::ERROR ) ||
+         node.Location().offset + offset != word.location.offset )
+    {
+      std::cerr << "Flat word doesn't match word: " << word.text << '\n';
+      abort();
+    }
+
+    switch ( word.type )
+    {
+      case Word::Type::SCRIPT:
+        CompareFlatCalls( node.Children(),
+                          std::get< Word::ScriptPtr >( word.data )->commands,
+                          offset );
+        break;
+
+      case Word::Type::TOKEN_LIST:
+      case Word::Type::EXPAND:
+      {
+        const auto& words = std::get< Word::WordVec >( word.data );
+        for ( size_t i = 0; i < words.size(); ++i )
+        {
+          CompareFlatWord( node.Child( i ), words[ i ], offset );
+        }
+        break;
+      }
+
+      case Word::Type::LIST:
+      {
+        const auto& list = std::get< ListView >( word.data );
+        if ( node.Children().size() != list.size )
+        {
+          std::cerr << "Flat list size doesn't match: " << word.text << '\n';
+          abort();
+        }
+        uint32_t i = 0;
+        for ( auto element : list )
+        {
+          CompareFlatWord( node.Child( i++ ), element, offset );
+        }
+        break;
+      }
+
+      case Word::Type::ARRAY_ACCESS:
+      {
+        const auto& arrayAccess = std::get< Word::ArrayAccess >( word.data );
+        if ( node.Child( 0 ).Text() != arrayAccess.name )
+        {
+          std::cerr << "Flat array name doesn't match: " << arrayAccess.name
+                    << '\n';
+          abort();
+        }
+        for ( size_t i = 0; i < arrayAccess.index.size(); ++i )
+        {
+          CompareFlatWord( node.Child( i + 1 ),
+                           arrayAccess.index[ i ],
+                           offset );
+        }
+        break;
+      }
+
+      default:
+        if ( node.Children().size() != 0 )
+        {
+          std::cerr << "Unexpected children of flat word: " << word.text
+                    << '\n';
+          abort();
+        }
+        break;
+    }
+  }
+}  // namespace Parser::Test
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+#if defined( _MSC_VER )
+#  include <intrin.h>
+#endif
+
+// A fast, non-cryptographic 64 bit hash of byte strings, in the style of
+// wyhash: 48 bytes per round of three independent 64x64->128 bit multiplies.
+// It is for spotting identical file contents, not for anything adversarial.
+namespace Hash
+{
+  constexpr uint64_t SECRET[ 4 ] = { 0x2d358dccaa6c78a5ull,
+                                     0x8bb84b93962eacc9ull,
+                                     0x4b33a62ed433d4a3ull,
+                                     0x4d5a2da51de1aa47ull };
+
+  // a * b as 128 bits, split into its low (a) and high (b) halves
+  inline void Multiply( uint64_t& a, uint64_t& b )
+  {
+#if defined( _MSC_VER )
+    a = _umul128( a, b, &b );
+#else
+    __uint128_t r = static_cast< __uint128_t >( a ) * b;
+    a = static_cast< uint64_t >( r );
+    b = static_cast< uint64_t >( r >> 64 );
+#endif
+  }
+
+  inline uint64_t Mix( uint64_t a, uint64_t b )
+  {
+    Multiply( a, b );
+    return a ^ b;
+  }
+
+  inline uint64_t Read64( const char* p )
+  {
+    uint64_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+  }
+
+  inline uint64_t Read32( const char* p )
+  {
+    uint32_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return v;
+  }
+
+  // 1 to 3 bytes
+  inline uint64_t ReadSmall( const char* p, size_t length )
+  {
+    auto byte = [ p ]( size_t i ) -> uint64_t {
+      return static_cast< uint8_t >( p[ i ] );
+    };
+    return ( byte( 0 ) << 16 ) | ( byte( length >> 1 ) << 8 ) |
+           byte( length - 1 );
+  }
+
+  uint64_t Bytes( std::string_view data, uint64_t seed = 0 )
+  {
+    const char* p = data.data();
+    const size_t length = data.size();
+
+    seed ^= Mix( seed ^ SECRET[ 0 ], SECRET[ 1 ] );
+
+    uint64_t a = 0;
+    uint64_t b = 0;
+    if ( length <= 16 )
+    {
+      if ( length >= 4 )
+      {
+        // Two (possibly overlapping) pairs of 4 byte reads cover it
+        const size_t step = ( length >> 3 ) << 2;
+        a = ( Read32( p ) << 32 ) | Read32( p + step );
+        b = ( Read32( p + length - 4 ) << 32 ) |
+            Read32( p + length - 4 - step );
+      }
+      else if ( length > 0 )
+      {
+        a = ReadSmall( p, length );
+      }
+    }
+    else
+    {
+      size_t remaining = length;
+      if ( remaining > 48 )
+      {
+        uint64_t seed1 = seed;
+        uint64_t seed2 = seed;
+        do
+        {
+          seed = Mix( Read64( p ) ^ SECRET[ 1 ], Read64( p + 8 ) ^ seed );
+          seed1 =
+            Mix( Read64( p + 16 ) ^ SECRET[ 2 ], Read64( p + 24 ) ^ seed1 );
+          seed2 =
+            Mix( Read64( p + 32 ) ^ SECRET[ 3 ], Read64( p + 40 ) ^ seed2 );
+          p += 48;
+          remaining -= 48;
+        } while ( remaining > 48 );
+        seed ^= seed1 ^ seed2;
+      }
+
+      while ( remaining > 16 )
+      {
+        seed = Mix( Read64( p ) ^ SECRET[ 1 ], Read64( p + 8 ) ^ seed );
+        p += 16;
+        remaining -= 16;
+      }
+
+      // The last 16 bytes, which may overlap the previous round
+      a = Read64( p + remaining - 16 );
+      b = Read64( p + remaining - 8 );
+    }
+
+    a ^= SECRET[ 1 ];
+    b ^= seed;
+    Multiply( a, b );
+    return Mix( a ^ SECRET[ 0 ] ^ length, b ^ SECRET[ 1 ] );
+  }
+}
+
+namespace Parser::Test
+{
+  void TestHash()
+  {
+    auto fail = 0;
+
+    std::string text;
+    for ( int i = 0; i < 300; ++i )
+    {
+      text.push_back( static_cast< char >( 'a' + i % 26 ) );
+    }
+
+    // Every prefix (so every code path), and every single byte change within
+    // each of those, hashes differently
+    std::unordered_set< uint64_t > seen;
+    for ( size_t length = 0; length <= text.size(); ++length )
+    {
+      std::string_view prefix( text.data(), length );
+      auto hash = Hash::Bytes( prefix );
+      if ( hash != Hash::Bytes( std::string( prefix ) ) )
+      {
+        std::cerr << "Hash of " << length << " bytes isn't repeatable\n";
+        ++fail;
+      }
+      if ( !seen.insert( hash ).second )
+      {
+        std::cerr << "Hash of " << length << " bytes collides\n";
+        ++fail;
+      }
+      if ( hash == Hash::Bytes( prefix, 1 ) )
+      {
+        std::cerr << "Hash of " << length << " bytes ignores the seed\n";
+        ++fail;
+      }
+
+      std::string changed( prefix );
+      for ( size_t i = 0; i < length; ++i )
+      {
+        changed[ i ] ^= 1;
+        if ( Hash::Bytes( changed ) == hash )
+        {
+          std::cerr << "Hash of " << length << " bytes ignores byte " << i
+                    << '\n';
+          ++fail;
+        }
+        changed[ i ] ^= 1;
+      }
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+}  // namespace Parser::Test
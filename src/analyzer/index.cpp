@@ -1,14 +1,26 @@
+#pragma once
+
 #include "script.cpp"
+#include "core_commands.cpp"
+#include "flat_script.cpp"
+#include "hash.cpp"
 #include "source_location.cpp"
 #include "db.cpp"
 #include "tclDecls.h"
 #include "tclInt.h"
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <cstddef>
 #include <cstring>
+#include <functional>
+#include <iostream>
 #include <iterator>
 #include <memory>
+#include <numeric>
 #include <optional>
+#include <random>
 #include <sstream>
 #include <string_view>
 #include <type_traits>
@@ -17,7 +29,9 @@
 #include <variant>
 #include <vector>
 #include <string>
+#include <thread>
 #include <unordered_set>
+#include <utility>
 
 namespace Index
 {
@@ -57,7 +71,10 @@ namespace Index
     using ID = VariableID;
 
     VariableID id;
-    std::string name;
+    Parser::Symbol name;
+
+    // The namespace it's in, unless it's local to a proc (or an argument)
+    std::optional< NamespaceID > parent_namespace;
 
     struct Reference
     {
@@ -69,16 +86,51 @@ namespace Index
 
   struct Scope
   {
-    std::vector< VariableID > variables;
+    std::vector< VariableID > variables;  // its own
     std::vector< ProcID > procs;
-    std::vector< VariableID > imported;
+    std::vector< VariableID > imported;  // others' (global, variable, upvar)
+
+    // Every variable that a name in the scope refers to, its own and those
+    // linked in, so that a reference is looked up in one go. Allocated when
+    // the first one is added, as most procs have few variables, if any.
+    std::unordered_map< Parser::Symbol, VariableID > byName;
+  };
+
+  // A name which is worked out the first time it's asked for, and then kept.
+  // That may be from many threads at once (a const Index is shared by the
+  // language server's readers), but they all work out the same name, so
+  // it doesn't matter which of them stores it.
+  struct CachedName
+  {
+    CachedName() = default;
+    CachedName( const CachedName& other ) : id( other.id.load( relaxed ) ) {}
+    CachedName& operator=( const CachedName& other )
+    {
+      id.store( other.id.load( relaxed ), relaxed );
+      return *this;
+    }
+
+    std::optional< Parser::Symbol > Get() const
+    {
+      if ( auto i = id.load( relaxed ) )
+      {
+        return Parser::Symbol{ i };
+      }
+      return std::nullopt;
+    }
+
+    void Set( Parser::Symbol name ) const { id.store( name.id, relaxed ); }
+
+  private:
+    static constexpr auto relaxed = std::memory_order_relaxed;
+    mutable std::atomic< uint32_t > id{ 0 };  // a Symbol, 0 until worked out
   };
 
   struct Proc
   {
     using ID = ProcID;
     ProcID id;
-    std::string name;
+    Parser::Symbol name;
     std::vector< VariableID > arguments;
 
     bool is_variadic; // has args at the end
@@ -88,11 +140,19 @@ namespace Index
     Scope scope;
     NamespaceID parent_namespace;
 
+    CachedName qualified_name;  // see GetPrintName
+
     struct Reference
     {
       Parser::SourceLocation location;
       ProcID id;
       ReferenceType type;
+
+      // For a USAGE, the call it is (as an Index::Call), so that it can go
+      // back to being unresolved if the proc is removed (see RemoveFile)
+      NamespaceID ns = 0;  // in which the call happens
+      Parser::Symbol cmd{};  // as written
+      uint32_t num_args = 0;
     };
   };
 
@@ -100,12 +160,14 @@ namespace Index
   {
     using ID = NamespaceID;
     NamespaceID id;
-    std::string name;
+    Parser::Symbol name;
     Scope scope;
 
     std::vector< NamespaceID > child_namespaces;
     std::optional< NamespaceID > parent_namespace;
 
+    CachedName qualified_name;  // see GetPrintName
+
     struct Reference
     {
       Parser::SourceLocation location;
@@ -114,6 +176,78 @@ namespace Index
     };
   };
 
+  // A namespace by its parent and (unqualified) name, which is unique
+  struct ChildNamespace
+  {
+    NamespaceID parent;
+    Parser::Symbol name;
+
+    bool operator==( const ChildNamespace& ) const = default;
+
+    struct Hash
+    {
+      size_t operator()( const ChildNamespace& key ) const
+      {
+        return std::hash< Parser::Symbol >{}( key.name ) ^
+               ( key.parent * 0x9e3779b97f4a7c15ull );
+      }
+    };
+  };
+
+  // The procs of one name in one namespace. There may be more than one: e.g.
+  // one defined in each branch of an if, which a call is told apart by the
+  // number of arguments it's given (see BestFit).
+  struct Overloads
+  {
+    std::vector< ProcID > procs;  // in id order
+
+    // The best fit for a call with each number of arguments, up to one more
+    // than any of the procs take (not counting args). Every call with more
+    // arguments than that fits them just as that many do.
+    std::vector< ProcID > byArgs;
+
+    ProcID BestFit( size_t num_args ) const
+    {
+      return byArgs[ std::min( num_args, byArgs.size() - 1 ) ];
+    }
+  };
+
+  // The procs of a name in a namespace (see Overloads)
+  struct ProcKey
+  {
+    NamespaceID ns;
+    Parser::Symbol name;  // unqualified
+
+    bool operator==( const ProcKey& ) const = default;
+
+    struct Hash
+    {
+      size_t operator()( const ProcKey& key ) const
+      {
+        return std::hash< Parser::Symbol >{}( key.name ) ^
+               ( key.ns * 0x9e3779b97f4a7c15ull );
+      }
+    };
+  };
+
+  // A command called in a namespace
+  struct CallKey
+  {
+    NamespaceID ns;
+    Parser::Symbol cmd;  // as written, qualified or not
+
+    bool operator==( const CallKey& ) const = default;
+
+    struct Hash
+    {
+      size_t operator()( const CallKey& key ) const
+      {
+        return std::hash< Parser::Symbol >{}( key.cmd ) ^
+               ( key.ns * 0x9e3779b97f4a7c15ull );
+      }
+    };
+  };
+
   struct Index
   {
     DB::RefRecord< Namespace > namespaces;
@@ -121,6 +255,73 @@ namespace Index
     DB::RefRecord< Variable > variables;
 
     NamespaceID global_namespace_id;
+
+    // Every namespace but the global one, so that a path is resolved one
+    // lookup per part, however many siblings each has. It's kept up to date
+    // as namespaces are added, even while bulk loading, as they're found by
+    // their path as the index is built.
+    DB::HashIndex< ChildNamespace, NamespaceID, ChildNamespace::Hash >
+      namespacesByParent;
+
+    // Every proc, by its namespace and name, kept up to date as they're added
+    // and removed, even while bulk loading, as calls are resolved with it
+    std::unordered_map< ProcKey, Overloads, ProcKey::Hash > overloads;
+
+    // A call of a command which isn't a proc in this index. It may be one
+    // defined in another file (see Workspace), or a Tcl command.
+    struct Call
+    {
+      Parser::SourceLocation location;
+      NamespaceID ns;  // in which the call happens
+      Parser::QualifiedName name;
+      size_t num_args;
+    };
+    std::vector< Call > unresolved;
+
+    // The names of the unresolved calls which were to procs that have since
+    // been removed (see RemoveFile), which are resolved again when procs are
+    // next added
+    std::unordered_set< Parser::Symbol > orphaned;
+
+    // How many procs, references to them and unresolved calls there were
+    // when the bulk load began (see BeginBulkLoad)
+    struct BulkStart
+    {
+      size_t procs = 0;
+      size_t references = 0;
+      size_t unresolved = 0;
+    };
+    BulkStart bulkStart;
+
+    // The names of all of the procs, so that most calls (which are to core
+    // commands, or commands from elsewhere) can be ruled out as calls to a
+    // proc without looking them up (see MayBeProc). Removing a proc doesn't
+    // remove its name until the index is compacted.
+    struct ProcNames
+    {
+      DB::BloomFilter hashes;  // of each name (Hash::Bytes)
+
+      // The core commands which a proc has the same name as
+      std::bitset< Parser::NUM_CORE_COMMANDS > core;
+    };
+    ProcNames procNames;
+
+    // Changed whenever procs are added or removed, or ids change, which is
+    // when calls may resolve differently
+    size_t generation = 0;
+
+    // The procs each call resolved to (see ResolveCall), as of `generation`:
+    // entries of `overloads`, which only go away when procs are removed
+    struct Resolved
+    {
+      size_t generation = 0;
+      std::unordered_map< CallKey, const Overloads*, CallKey::Hash > calls;
+    };
+    Resolved resolved;
+
+    // References only record the file's id, so the index keeps the files it
+    // refers to (and so their text) alive for as long as it is in use
+    std::unordered_map< Parser::FileID, Parser::SourceFilePtr > files;
   };
 
   Index make_index()
@@ -129,10 +330,9 @@ namespace Index
 
     index.namespaces.table.reserve( 20 );
     index.procs.table.reserve( 1024 );
-    index.variables.table.reserve( 1024 * 1024 );
 
-    auto& global_namespace = index.namespaces.Insert( new Namespace{
-      .name = "",
+    auto& global_namespace = index.namespaces.Insert( Namespace{
+      .name = Parser::Symbol{},
     } );
 
     index.global_namespace_id = global_namespace.id;
@@ -143,21 +343,28 @@ namespace Index
   struct ScanContext
   {
     std::vector< NamespaceID > nsPath;
+
+    // The proc whose body is being indexed (if any), which variables are
+    // local to
+    std::optional< ProcID > proc;
+
+    // The proc each proc command in the script defined, found by the scan
+    std::unordered_map< Parser::FlatScript::NodeID, ProcID > procs;
   };
 
   void ScanScript( Index& index,
                    ScanContext& context,
-                   const Parser::Script& script );
+                   Parser::FlatNode script );
 
-  void ScanWord( Index& index, ScanContext& context, const Parser::Word& word )
+  void ScanWord( Index& index, ScanContext& context, Parser::FlatNode word )
   {
     using Word = Parser::Word;
-    switch ( word.type )
+    switch ( word.WordType() )
     {
       case Word::Type::EXPAND:
       case Word::Type::TOKEN_LIST:
       {
-        for ( auto& subWord : std::get< Word::WordVec >( word.data ) )
+        for ( auto subWord : word.Children() )
         {
           ScanWord( index, context, subWord );
         }
@@ -165,7 +372,7 @@ namespace Index
       }
       case Word::Type::SCRIPT:
       {
-        ScanScript( index, context, *std::get< Word::ScriptPtr >( word.data ) );
+        ScanScript( index, context, word );
         break;
       }
 
@@ -175,42 +382,52 @@ namespace Index
   }
 
 
+  /**
+   * The fully qualified name of a namespace or proc, e.g. "::a::b::p" (and ""
+   * for the global namespace).
+   *
+   * It's worked out the first time it's asked for and then kept, interned,
+   * with the namespace or proc, so that writing out a large index doesn't
+   * allocate for every name. It never goes out of date: a namespace is never
+   * renamed or moved to another parent, and it is only removed once
+   * everything in it has been (see RemoveFile), which clears its own.
+   */
   template< typename Entity >
-  std::string GetPrintName( Index& index, const Entity& e )
+  std::string_view GetPrintName( const Index& index, const Entity& e )
   {
-    constexpr bool is_opt =
-      std::is_same< decltype( e.parent_namespace ),
-                    std::optional< typename Entity::ID > >();
-
-    if constexpr ( is_opt )
+    std::optional< NamespaceID > parent = e.parent_namespace;
+    if ( !parent )
     {
-      if ( !e.parent_namespace )
-      {
-        return e.name;
-      }
+      return e.name.Text();
     }
 
-    std::vector< std::string_view > parts;
-    parts.push_back( e.name );
-    std::optional< NamespaceID > curr_id = e.parent_namespace;
-    while ( curr_id )
+    if ( auto name = e.qualified_name.Get() )
     {
-      const Namespace& curr = index.namespaces.Get( *curr_id );
-      parts.push_back( curr.name );
-      curr_id = curr.parent_namespace;
+      return name->Text();
     }
 
-    std::ostringstream o;
-    for ( auto i = parts.rbegin(); i != parts.rend(); ++i )
+    auto prefix = GetPrintName( index, index.namespaces.Get( *parent ) );
+    std::string name;
+    name.reserve( prefix.size() + 2 + e.name.Text().size() );
+    name.append( prefix ).append( "::" ).append( e.name.Text() );
+
+    auto symbol = Parser::Intern( name );
+    e.qualified_name.Set( symbol );
+    return symbol.Text();
+  }
+
+  // The child of `parent` called `name`, if there is one
+  std::optional< NamespaceID > FindChildNamespace( const Index& index,
+                                                   NamespaceID parent,
+                                                   Parser::Symbol name )
+  {
+    auto range = index.namespacesByParent.equal_range(
+      ChildNamespace{ .parent = parent, .name = name } );
+    if ( range.first == range.second )
     {
-      if ( i != parts.rbegin() )
-      {
-        o << "::";
-      }
-      o << *i;
+      return std::nullopt;
     }
-
-    return o.str();
+    return range.first->second;
   }
 
   Namespace& ResolveNamespace( Index& index,
@@ -218,70 +435,86 @@ namespace Index
                                Namespace& ns )
   {
     auto cur_id = ns.id;
-    std::vector< std::string_view > parts = qn.NamespaceParts();
     if ( qn.absolute )
     {
       cur_id = index.global_namespace_id;
     }
 
-    for ( auto part : parts )
+    for ( auto part : qn.NamespacePath() )
     {
-      auto& current = index.namespaces.Get( cur_id );
-      auto& children = current.child_namespaces;
-      auto child_pos =
-        std::find_if( children.begin(),
-                      children.end(),
-                      [ & ]( auto child_id ) {
-                        return index.namespaces.Get( child_id ).name == part;
-                      } );
-
-      if ( child_pos == children.end() )
-      {
-        auto& child = index.namespaces.Insert( new Namespace{
-          .name = std::string{ part },
-          .parent_namespace = current.id,
-        } );
-        children.push_back( child.id );
-        cur_id = child.id;
-      }
-      else
+      auto name = Parser::Intern( part );
+      if ( auto child_id = FindChildNamespace( index, cur_id, name ) )
       {
-        cur_id = *child_pos;
+        cur_id = *child_id;
+        continue;
       }
+
+      auto& child = index.namespaces.Insert( Namespace{
+        .name = name,
+        .parent_namespace = cur_id,
+      } );
+      index.namespaces.Get( cur_id ).child_namespaces.push_back( child.id );
+      index.namespacesByParent.emplace(
+        ChildNamespace{ .parent = cur_id, .name = name },
+        child.id );
+      cur_id = child.id;
     }
 
     return index.namespaces.Get( cur_id );
   }
 
-  Namespace* FindNamespace( const Index& index, std::string_view ns_name )
+  std::optional< NamespaceID > FindChildNamespace( const Index& index,
+                                                   NamespaceID parent,
+                                                   std::string_view name )
   {
-    auto qn = Parser::SplitName( ns_name );
-    assert( qn.absolute );
-    auto cur_id = index.global_namespace_id;
-
-    std::vector< std::string_view > parts = qn.Parts();
-    for ( auto part : parts )
+    // A name that has never been seen can't be the name of a namespace
+    auto symbol = Parser::FindSymbol( name );
+    if ( !symbol )
     {
-      auto& current = index.namespaces.Get( cur_id );
-      auto& children = current.child_namespaces;
-      auto child_pos =
-        std::find_if( children.begin(),
-                      children.end(),
-                      [ & ]( auto child_id ) {
-                        return index.namespaces.Get( child_id ).name == part;
-                      } );
+      return std::nullopt;
+    }
+    return FindChildNamespace( index, parent, *symbol );
+  }
 
-      if ( child_pos == children.end() )
+  // As ResolveNamespace, but only finding the namespace of `qn` (relative to
+  // `ns`) if there is one, rather than adding it
+  std::optional< NamespaceID > FindNamespace( const Index& index,
+                                              NamespaceID ns,
+                                              const Parser::QualifiedName& qn )
+  {
+    std::optional< NamespaceID > cur_id =
+      qn.absolute ? index.global_namespace_id : ns;
+    for ( auto part : qn.NamespacePath() )
+    {
+      cur_id = FindChildNamespace( index, *cur_id, part );
+      if ( !cur_id )
       {
-        return nullptr;
+        break;
       }
-      else
+    }
+    return cur_id;
+  }
+
+  // The namespace with the absolute path `ns_name` ("" or "::" being the
+  // global one). Only looks names up, so nothing is interned.
+  Namespace* FindNamespace( const Index& index, std::string_view ns_name )
+  {
+    assert( ns_name.empty() || ns_name.substr( 0, 2 ) == "::" );
+
+    std::optional< NamespaceID > cur_id = index.global_namespace_id;
+    if ( ns_name.size() > 2 )
+    {
+      for ( auto part : Parser::PathParts( ns_name.substr( 2 ) ) )
       {
-        cur_id = *child_pos;
+        cur_id = FindChildNamespace( index, *cur_id, part );
+        if ( !cur_id )
+        {
+          return nullptr;
+        }
       }
     }
 
-    return &index.namespaces.Get( cur_id );
+    return &index.namespaces.Get( *cur_id );
   }
 
   void AddCommandReference( Index& index,
@@ -297,159 +530,315 @@ namespace Index
       } );
   }
 
-  template< typename WordVec >
-  void AddProcToIndex( Index& index, Namespace& ns, const WordVec& words )
+  void AddVariableReference( Index& index,
+                             VariableID id,
+                             const Parser::SourceLocation& location,
+                             ReferenceType type )
+  {
+    index.variables.AddReference( Variable::Reference{
+      .location = location,
+      .id = id,
+      .type = type,
+    } );
+  }
+
+  // How well a proc fits a call with some number of arguments, best first
+  enum class Fit
+  {
+    EXACT,     // one for each of its arguments (and it doesn't have args)
+    DEFAULTS,  // fewer: the rest take their defaults (or args is empty)
+    VARIADIC,  // more, which go in args
+    NONE,      // too few, or too many
+  };
+
+  Fit FitOf( const Proc& proc, size_t num_args )
+  {
+    const size_t positional = proc.required_args + proc.optional_args;
+    if ( num_args < proc.required_args )
+    {
+      return Fit::NONE;
+    }
+    if ( num_args == positional && !proc.is_variadic )
+    {
+      return Fit::EXACT;
+    }
+    if ( num_args <= positional )
+    {
+      return Fit::DEFAULTS;
+    }
+    return proc.is_variadic ? Fit::VARIADIC : Fit::NONE;
+  }
+
+  /**
+   * The index of whichever of `procs` best fits a call with `num_args`
+   * arguments (see Fit), or procs.size() if there aren't any. Of those which
+   * fit as well as each other, the first wins; if none of them fit at all,
+   * it's the first, as the call is still most likely meant for it.
+   *
+   * This is only guessing from the number of arguments, but is the same
+   * guess every time, whatever order the procs were found in.
+   */
+  template< typename Procs, typename GetProc >
+  size_t BestFit( const Procs& procs, size_t num_args, GetProc get_proc )
+  {
+    size_t best_fit = 0;
+    auto best = Fit::NONE;
+    for ( size_t i = 0; i < procs.size() && best != Fit::EXACT; ++i )
+    {
+      auto fit = FitOf( *get_proc( procs[ i ] ), num_args );
+      if ( fit < best )
+      {
+        best = fit;
+        best_fit = i;
+      }
+    }
+    return procs.empty() ? procs.size() : best_fit;
+  }
+
+  // Make `proc` the best fit of `overloads` for the calls which it fits
+  // better than those before it (by id) do
+  void FitOverload( Overloads& overloads, const Index& index, const Proc& proc )
+  {
+    auto& byArgs = overloads.byArgs;
+    const size_t size = proc.required_args + proc.optional_args + 2;
+    if ( byArgs.size() < size )
+    {
+      byArgs.resize( size, byArgs.empty() ? proc.id : byArgs.back() );
+    }
+    for ( size_t n = 0; n < byArgs.size(); ++n )
+    {
+      if ( FitOf( proc, n ) < FitOf( index.procs.Get( byArgs[ n ] ), n ) )
+      {
+        byArgs[ n ] = proc.id;
+      }
+    }
+  }
+
+  void RefitOverloads( Overloads& overloads, const Index& index )
+  {
+    overloads.byArgs.clear();
+    for ( auto id : overloads.procs )
+    {
+      FitOverload( overloads, index, index.procs.Get( id ) );
+    }
+  }
+
+  void AddOverload( Index& index, const Proc& proc )
+  {
+    auto& overloads = index.overloads[ ProcKey{ .ns = proc.parent_namespace,
+                                                .name = proc.name } ];
+    auto& procs = overloads.procs;
+    auto pos = std::upper_bound( procs.begin(), procs.end(), proc.id );
+    const bool last = pos == procs.end();
+    procs.insert( pos, proc.id );
+
+    // (An id is only lower than the others' if it was reused)
+    if ( last )
+    {
+      FitOverload( overloads, index, proc );
+    }
+    else
+    {
+      RefitOverloads( overloads, index );
+    }
+  }
+
+  void RemoveOverload( Index& index, const Proc& proc )
+  {
+    auto it = index.overloads.find(
+      ProcKey{ .ns = proc.parent_namespace, .name = proc.name } );
+    std::erase( it->second.procs, proc.id );
+    if ( it->second.procs.empty() )
+    {
+      index.overloads.erase( it );
+    }
+    else
+    {
+      RefitOverloads( it->second, index );
+    }
+  }
+
+  void AddProcName( Index& index, Parser::Symbol name )
+  {
+    const auto text = name.Text();
+    index.procNames.hashes.Add( Hash::Bytes( text ) );
+
+    if ( auto* command = Parser::FindCoreCommand( text ) )
+    {
+      index.procNames.core.set( Parser::CoreCommandIndex( *command ) );
+    }
+    // (a proc called define shadows oo::define, in ::oo)
+    for ( auto* command : Parser::QUALIFIED_CORE_COMMANDS )
+    {
+      if ( command->Tail() == text )
+      {
+        index.procNames.core.set( Parser::CoreCommandIndex( *command ) );
+      }
+    }
+  }
+
+  /**
+   * Whether calling `cmdName` might call a proc in the index. If not, it
+   * certainly doesn't, and there's no need to look it up. Calls to core
+   * commands are known for sure; others are probably right.
+   */
+  bool MayBeProc( const Index& index, std::string_view cmdName )
+  {
+    if ( auto* command = Parser::FindCoreCommand( cmdName ) )
+    {
+      return index.procNames.core.test( Parser::CoreCommandIndex( *command ) );
+    }
+
+    auto pos = cmdName.rfind( "::" );
+    auto name =
+      pos == std::string_view::npos ? cmdName : cmdName.substr( pos + 2 );
+    return index.procNames.hashes.MayContain( Hash::Bytes( name ) );
+  }
+
+  // Add `proc` to the index, and to its namespace, where calls can find it
+  Proc& AddProc( Index& index, Proc proc )
+  {
+    // The proc only has an id once it's inserted
+    auto& p = index.procs.Insert( std::move( proc ) );
+    AddProcName( index, p.name );
+    AddOverload( index, p );
+    ++index.generation;
+    index.namespaces.Get( p.parent_namespace ).scope.procs.push_back( p.id );
+    return p;
+  }
+
+  Proc& AddProcToIndex( Index& index,
+                        Namespace& ns,
+                        Parser::FlatNodeRange words )
   {
     using Word = Parser::Word;
     // proc name { arg|{ arg default } ... } { body }
-    auto qn = Parser::SplitName( words[ 1 ].text );
-
-    auto proc = std::make_unique<Proc>();
-    proc->name = qn.name;
+    auto qn = Parser::SplitName( words[ 1 ].Text() );
+
+    Proc proc{};
+    proc.name = qn.name;
+
+    // The arguments are read from the list's text, as the parser reads it.
+    // (A list of exactly one argument is left as TEXT by WordToList.)
+    const auto args = words[ 2 ];
+    const bool isList = args.WordType() == Word::Type::LIST;
+    std::optional< Parser::ListView > argList;
+    if ( isList || ( args.WordType() == Word::Type::TEXT &&
+                     Parser::CountListElements( args.Text() ) == 1u ) )
+    {
+      argList = Parser::ListView{
+        .text = args.Text(),
+        .location = args.Location(),
+        .size = isList ? static_cast< uint32_t >( args.Children().size() ) : 1,
+        .nested = true };
+    }
 
-    if ( words[ 2 ].type == Word::Type::LIST )
+    if ( argList )
     {
-      auto& vec = std::get< Word::WordVec >( words[ 2 ].data );
-      proc->arguments.reserve( vec.size() );
-      for ( auto it = vec.begin(); it != vec.end(); ++it )
+      static const auto args = Parser::Intern( "args" );
+      const auto& list = *argList;
+      proc.arguments.reserve( list.size );
+      for ( auto it = list.begin(); it != list.end(); )
       {
-        auto& arg = *it;
-        std::string argName;
+        auto arg = *it;
+        ++it;
+        Parser::Symbol argName;
+        auto location = arg.location;
         if ( arg.type == Word::Type::TEXT )
         {
-          if ( argName == "args" && ( it + 1 ) == vec.end() )
+          argName = Parser::Intern( arg.text );
+          if ( argName == args && it == list.end() )
           {
-            proc->is_variadic = true;
+            proc.is_variadic = true;
           }
           else
           {
-            ++proc->required_args;
+            ++proc.required_args;
           }
-
-          argName = arg.text;
         }
         else
         {
-          ++proc->optional_args;
-          argName = std::get< Word::WordVec >( arg.data )[ 0 ].text;
+          // { name default }, or {} (which Tcl would reject)
+          ++proc.optional_args;
+          auto& nested = std::get< Parser::ListView >( arg.data );
+          if ( nested.size > 0 )
+          {
+            auto first = *nested.begin();
+            argName = Parser::Intern( first.text );
+            location = first.location;
+          }
+          else
+          {
+            argName = Parser::Intern( arg.text );
+          }
         }
-        auto& v = index.variables.Insert( new Variable{
-          .name = std::move( argName ),
+        auto& v = index.variables.Insert( Variable{
+          .name = argName,
         } );
-        proc->arguments.push_back( v.id );
-        // TODO: Add reference with type ReferenceType::DEFINITION
+        proc.arguments.push_back( v.id );
+        proc.scope.byName.insert_or_assign( argName, v.id );
+        AddVariableReference( index,
+                              v.id,
+                              location,
+                              ReferenceType::DEFINITION );
       }
     }
 
+    auto* parent = &ns;
     if ( qn.absolute || qn.ns )
     {
-      auto& resolved = ResolveNamespace( index, qn, ns );
-      resolved.scope.procs.push_back( proc->id );
-      proc->parent_namespace = resolved.id;
-    }
-    else
-    {
-      ns.scope.procs.push_back( proc->id );
-      proc->parent_namespace = ns.id;
+      parent = &ResolveNamespace( index, qn, ns );
     }
+    proc.parent_namespace = parent->id;
 
-    auto& p = index.procs.Insert( std::move( proc ) );
+    auto& p = AddProc( index, std::move( proc ) );
     AddCommandReference( index,
-                         words[ 1 ].location,
+                         words[ 1 ].Location(),
                          p,
                          ReferenceType::DEFINITION );
+    return p;
   }
 
   void ScanScript( Index& index,
                    ScanContext& context,
-                   const Parser::Script& script )
+                   Parser::FlatNode script )
   {
     using Call = Parser::Call;
 
     // Find namespace, proc and variable declarations
-    for ( auto& call : script.commands )
+    for ( auto call : script.Children() )
     {
       auto& ns = index.namespaces.Get( context.nsPath.back() );
+      const auto words = call.Children();
 
       auto scanned = false;
 
-      switch ( call.type )
+      switch ( call.CallType() )
       {
         case Call::Type::NAMESPACE_EVAL:
         {
           Parser::QualifiedName qn = {
-            .ns = std::string( call.words[ 2 ].text ),
-            .name = "",
+            .ns = Parser::Intern( words[ 2 ].Text() ),
+            .name = Parser::Symbol{},
           };
-          context.nsPath.push_back( ResolveNamespace( index, qn, ns ).id );
-          ScanWord( index, context, call.words[ 3 ] );
+          auto& target = ResolveNamespace( index, qn, ns );
+          index.namespaces.AddReference( Namespace::Reference{
+            .location = words[ 2 ].Location(),
+            .id = target.id,
+            .type = ReferenceType::DEFINITION,
+          } );
+          context.nsPath.push_back( target.id );
+          ScanWord( index, context, words[ 3 ] );
           context.nsPath.pop_back();
           scanned = true;
           break;
         }
         case Call::Type::PROC:
         {
-          AddProcToIndex( index, ns, call.words );
+          context.procs.emplace( call.id,
+                                 AddProcToIndex( index, ns, words ).id );
           break;
         }
-#if 0
-        else if ( cmdName == "set" )
-        {
-          if ( call.words.size() == 3 )
-          {
-            // set name value
-            //
-            // if name already in scope, it's an update, otherwise, it's a
-            // declaration
-          }
-        }
-        else if ( cmdName == "array" )
-        {
-        }
-        else if ( cmdName == "global" )
-        {
-          // global name [name ...]
-          //
-          // could be that we're asking for the value, but most likely this is
-          // either declaring or importing name from the namespae scope (like
-          // global above)
-        }
-        else if ( cmdName == "variable" )
-        {
-          if ( call.words.size() > 3 )
-          {
-            if ( ( call.words.size() - 1 ) % 2 == 0 )
-            {
-              // variable [name value]... name value
-            }
-            else
-            {
-              // variable [name value]... name
-            }
-          }
-          else if ( call.words.size() == 3 )
-          {
-            // variable name value
-            //
-            // if name already in scope, it's an update, otherwise, it's a
-            // declaration
-          }
-          else if ( call.words.size() == 2 )
-          {
-            // variable name
-            //
-            // could be that we're asking for the value, but most likely this is
-            // either declaring or importing name from the namespae scope (like
-            // global above)
-          }
-        }
-        else if ( cmdName == "upvar" )
-        {
-        }
-        else if ( cmdName == "uplevel" )
-        {
-        }
-#endif
         default:
           // ignore
           break;
@@ -457,7 +846,7 @@ namespace Index
 
       if ( !scanned )
       {
-        for ( auto& word : call.words )
+        for ( auto word : words )
         {
           ScanWord( index, context, word );
         }
@@ -465,213 +854,588 @@ namespace Index
     }
   }
 
-  void IndexScript( Index& index,
-                    ScanContext& context,
-                    const Parser::Script& script );
+  // Where a variable is: in a proc (which `ns` is unset for), or a namespace
+  struct VariableScope
+  {
+    Scope* scope;
+    std::optional< NamespaceID > ns;
+    std::string_view name;  // in the scope (unqualified)
+  };
 
-  void IndexWord( Index& index, ScanContext& context, const Parser::Word& word )
+  /**
+   * Where the variable `name` (as written, e.g. x, ::x or a::x) is, from
+   * where `context` is: a qualified name is in the namespace it names
+   * (relative to the current one, or failing that to the global one), and
+   * any other in the proc being indexed, or else the current namespace.
+   * Namespaces aren't added: a variable in one that doesn't exist isn't
+   * tracked.
+   */
+  std::optional< VariableScope > FindVariableScope(
+    Index& index,
+    NamespaceID current,
+    std::optional< ProcID > proc,
+    std::string_view name )
   {
-    using Word = Parser::Word;
-    switch ( word.type )
+    auto pos = name.rfind( "::" );
+    if ( pos == std::string_view::npos )
     {
-      case Word::Type::ARRAY_ACCESS:
+      if ( proc )
       {
-        const auto& arrayAccess =
-          std::get< Parser::Word::ArrayAccess >( word.data );
-
-        // if ( auto v = Find( index.variables, context, arrayAccess.name ) )
-        // {
-        //   AddVariableReference( index, *v, word.location );
-        // }
-
-        for ( const auto& subWord : arrayAccess.index )
-        {
-          IndexWord( index, context, subWord );
-        }
-        break;
+        return VariableScope{ .scope = &index.procs.Get( *proc ).scope,
+                              .ns = std::nullopt,
+                              .name = name };
       }
+      auto& ns = index.namespaces.Get( current );
+      return VariableScope{ .scope = &ns.scope, .ns = ns.id, .name = name };
+    }
 
-      case Word::Type::EXPAND:  // fall through
-      case Word::Type::TOKEN_LIST:
-      {
-        const auto& subWords = std::get< Word::WordVec >( word.data );
-        for ( const auto& subWord : subWords )
-        {
-          IndexWord( index, context, subWord );
-        }
-        break;
-      }
+    auto qn = Parser::SplitName( name );
+    auto target = FindNamespace( index, current, qn );
+    if ( !target && !qn.absolute )
+    {
+      target = FindNamespace( index, index.global_namespace_id, qn );
+    }
+    if ( !target )
+    {
+      return std::nullopt;
+    }
+    auto& ns = index.namespaces.Get( *target );
+    return VariableScope{ .scope = &ns.scope,
+                          .ns = ns.id,
+                          .name = name.substr( pos + 2 ) };
+  }
 
-      case Word::Type::VARIABLE:
-      {
-        // if ( auto v = Find( index.variables, context, word.text ) )
-        // {
-        //   AddVariableReference( index, *v, word.location );
-        // }
-        break;
-      }
+  std::optional< VariableScope > FindVariableScope( Index& index,
+                                                    const ScanContext& context,
+                                                    std::string_view name )
+  {
+    return FindVariableScope( index,
+                              context.nsPath.back(),
+                              context.proc,
+                              name );
+  }
 
-      case Word::Type::SCRIPT:
-      {
-        const auto& script = *std::get< Word::ScriptPtr >( word.data );
-        IndexScript( index, context, script );
-        break;
-      }
-
-      default:
-        break;
+  std::optional< VariableID > FindVariable( const VariableScope& where )
+  {
+    // A name which has never been seen can't be a variable's
+    auto symbol = Parser::FindSymbol( where.name );
+    if ( !symbol )
+    {
+      return std::nullopt;
+    }
+    auto it = where.scope->byName.find( *symbol );
+    if ( it == where.scope->byName.end() )
+    {
+      return std::nullopt;
     }
+    return it->second;
   }
 
-  std::vector<Proc*> FindProc( Index& index,
-                               Namespace& ns,
-                               std::string_view cmdName )
+  // The variable at `where`, which is added if there isn't one yet (and if
+  // so, `added` is set)
+  VariableID DeclareVariable( Index& index,
+                              const VariableScope& where,
+                              bool& added )
   {
-    auto qn = Parser::SplitName( cmdName );
-    Namespace::ID target_namespace = ns.id;
+    auto name = Parser::Intern( where.name );
+    auto [ it, inserted ] = where.scope->byName.try_emplace( name, 0 );
+    if ( inserted )
+    {
+      it->second = index.variables
+                     .Insert( Variable{ .name = name,
+                                        .parent_namespace = where.ns } )
+                     .id;
+      where.scope->variables.push_back( it->second );
+    }
+    added = inserted;
+    return it->second;
+  }
 
-    auto range = index.procs.byName.equal_range( qn.name );
+  // Make `name` in `scope` refer to the variable `target` (e.g. after
+  // `global name`)
+  void LinkVariable( Scope& scope, std::string_view name, VariableID target )
+  {
+    scope.byName.insert_or_assign( Parser::Intern( name ), target );
+    if ( std::find( scope.imported.begin(), scope.imported.end(), target ) ==
+         scope.imported.end() )
+    {
+      scope.imported.push_back( target );
+    }
+  }
 
-    if ( qn.absolute || qn.ns )
+  // The name of the variable which the text `name` names, e.g. x for x or
+  // x($i), unless it can only be known when the script is run
+  std::optional< std::string_view > VariableNameOf( std::string_view name )
+  {
+    if ( !name.empty() && name.back() == ')' )
+    {
+      name = name.substr( 0, name.find( '(' ) );
+    }
+    if ( name.empty() || name.find_first_of( "$[\\" ) != name.npos )
     {
-      target_namespace = ResolveNamespace( index, qn, ns ).id;
+      return std::nullopt;
     }
+    return name;
+  }
 
-    std::vector<Proc*> result;
-    result.reserve( std::distance( range.first, range.second ) );
+  // The name of the variable which the word `word` names (as above)
+  std::optional< std::string_view > VariableNameOf( Parser::FlatNode word )
+  {
+    using Word = Parser::Word;
+    if ( word.WordType() != Word::Type::TEXT &&
+         word.WordType() != Word::Type::TOKEN_LIST )
+    {
+      return std::nullopt;
+    }
+    return VariableNameOf( word.Text() );
+  }
 
-    for ( auto it = range.first; it != range.second; ++it )
+  // A reference to the variable `name`, if there is one
+  void ReadVariable( Index& index,
+                     const ScanContext& context,
+                     std::string_view name,
+                     const Parser::SourceLocation& location )
+  {
+    if ( auto where = FindVariableScope( index, context, name ) )
     {
-      auto& p = index.procs.Get( it->second );
-      if ( p.parent_namespace == target_namespace )
+      if ( auto id = FindVariable( *where ) )
       {
-        // NOTE: It's possible to have multiple definitions for the same proc.
-        // for example:
-        //
-        // if { $x } {
-        //   proc Proc {} {}
-        // } else {
-        //   proc Proc { x y z } {}
-        // }
-        //
-        // By indexing everything on the proc's name and namespace, we always
-        // pick whichever one is found first; so we actually use more semantic
-        // information around the proc usage (e.g. number of args specified) to
-        // determine the proc, by calling BestFitProcToCall
-        result.push_back( &p );
+        AddVariableReference( index, *id, location, ReferenceType::USAGE );
       }
     }
+  }
 
-    if ( result.empty() && !qn.absolute && ns.parent_namespace )
+  void ReadVariable( Index& index,
+                     const ScanContext& context,
+                     Parser::FlatNode word )
+  {
+    if ( auto name = VariableNameOf( word ) )
     {
-      // Find in the parent namespace
-      // FIXME: This recursion is extremely SUB-optimal. A loop would be much
-      // faster
-      return FindProc( index,
-                       index.namespaces.Get( *ns.parent_namespace ),
-                       cmdName );
+      ReadVariable( index, context, *name, word.Location() );
     }
+  }
 
-    return result;
+  // Setting the variable `name`, which defines it the first time
+  void WriteVariable( Index& index,
+                      const ScanContext& context,
+                      std::string_view name,
+                      const Parser::SourceLocation& location )
+  {
+    if ( auto where = FindVariableScope( index, context, name ) )
+    {
+      bool added;
+      auto id = DeclareVariable( index, *where, added );
+      AddVariableReference( index,
+                            id,
+                            location,
+                            added ? ReferenceType::DEFINITION
+                                  : ReferenceType::USAGE );
+    }
   }
 
-  Proc* BestFitProcToCall( std::vector<Proc*> procs,
-                           const Parser::Call& call )
+  void WriteVariable( Index& index,
+                      const ScanContext& context,
+                      Parser::FlatNode word )
   {
-    auto num_args = call.words.size() - 1;
+    if ( auto name = VariableNameOf( word ) )
+    {
+      WriteVariable( index, context, *name, word.Location() );
+    }
+  }
 
-    Proc* best_fit = nullptr;
+  // `word` (in a proc) names the variable `target` from another scope (e.g.
+  // by `global word`), which is added if there isn't one yet
+  void ImportVariable( Index& index,
+                       const ScanContext& context,
+                       Parser::FlatNode word,
+                       std::optional< VariableScope > target )
+  {
+    auto local = VariableNameOf( word );
+    if ( !local || !target )
+    {
+      return;
+    }
+    bool added;
+    auto id = DeclareVariable( index, *target, added );
+    LinkVariable( index.procs.Get( *context.proc ).scope,
+                  local->substr( local->rfind( ':' ) + 1 ),
+                  id );
+    AddVariableReference( index,
+                          id,
+                          word.Location(),
+                          ReferenceType::DECLARAION );
+  }
 
-    // TODO: Worlds shittiest overload resolution? This is really just
-    // guessing (badly) based on the number of arguments.
-    //
-    // FIXME: best_fit is actualy last_fit
-    for( auto* proc : procs )
+  /**
+   * The variables which the core command `call` names, rather than refers to
+   * with $: set, incr, append, lappend, lassign, unset, array and foreach
+   * refer to (and define) variables in the current scope; global, variable
+   * and upvar link those of a proc to variables elsewhere.
+   *
+   * upvar can only be followed to the global namespace (with a level of #0,
+   * or a qualified name); otherwise the caller's variable isn't known, so the
+   * name is just a local variable.
+   */
+  void IndexVariableCommand( Index& index,
+                             const ScanContext& context,
+                             Parser::FlatNode call )
+  {
+    const auto words = call.Children();
+    const auto* command = Parser::FindCoreCommand( words[ 0 ].Text() );
+    if ( !command || words.size() < 2 )
     {
-      if ( !best_fit )
+      return;
+    }
+
+    // Where the variable `word` names is, from the namespace `ns`
+    auto from = [ & ]( NamespaceID ns, Parser::FlatNode word )
+      -> std::optional< VariableScope > {
+      auto text = VariableNameOf( word );
+      if ( !text )
       {
-        best_fit = proc;
-        continue;
+        return std::nullopt;
       }
+      return FindVariableScope( index, ns, std::nullopt, *text );
+    };
+    const auto global = index.global_namespace_id;
 
-      if ( num_args < proc->required_args )
+    const std::string_view name = command->name;
+    if ( name == "set" )
+    {
+      if ( words.size() == 3 )
       {
-        continue;
+        WriteVariable( index, context, words[ 1 ] );
+      }
+      else
+      {
+        ReadVariable( index, context, words[ 1 ] );
+      }
+    }
+    else if ( name == "incr" || name == "append" || name == "lappend" )
+    {
+      WriteVariable( index, context, words[ 1 ] );
+    }
+    else if ( name == "lassign" )
+    {
+      for ( size_t i = 2; i < words.size(); ++i )
+      {
+        WriteVariable( index, context, words[ i ] );
+      }
+    }
+    else if ( name == "unset" )
+    {
+      for ( size_t i = 1; i < words.size(); ++i )
+      {
+        if ( !words[ i ].Text().starts_with( '-' ) )
+        {
+          ReadVariable( index, context, words[ i ] );
+        }
+      }
+    }
+    else if ( name == "array" && words.size() > 2 )
+    {
+      if ( words[ 1 ].Text() == "set" )
+      {
+        WriteVariable( index, context, words[ 2 ] );
+      }
+      else
+      {
+        ReadVariable( index, context, words[ 2 ] );
+      }
+    }
+    else if ( name == "foreach" )
+    {
+      // foreach varList list ?varList list ...? body
+      for ( size_t i = 1; i + 2 < words.size(); i += 2 )
+      {
+        const auto list = words[ i ];
+        auto size = Parser::CountListElements( list.Text() );
+        if ( list.WordType() != Parser::Word::Type::TEXT || !size )
+        {
+          continue;
+        }
+        Parser::ListView names{ .text = list.Text(),
+                                .location = list.Location(),
+                                .size = *size,
+                                .nested = false };
+        for ( auto element : names )
+        {
+          if ( auto var = VariableNameOf( element.text ) )
+          {
+            WriteVariable( index, context, *var, element.location );
+          }
+        }
+      }
+    }
+    else if ( name == "global" && context.proc )
+    {
+      for ( size_t i = 1; i < words.size(); ++i )
+      {
+        ImportVariable( index,
+                        context,
+                        words[ i ],
+                        from( global, words[ i ] ) );
+      }
+    }
+    else if ( name == "variable" )
+    {
+      // variable ?name value ...? name ?value?
+      for ( size_t i = 1; i < words.size(); i += 2 )
+      {
+        if ( context.proc )
+        {
+          ImportVariable( index,
+                          context,
+                          words[ i ],
+                          from( context.nsPath.back(), words[ i ] ) );
+        }
+        else
+        {
+          WriteVariable( index, context, words[ i ] );
+        }
+      }
+    }
+    else if ( name == "upvar" && context.proc )
+    {
+      // upvar ?level? otherVar myVar ?otherVar myVar ...?
+      size_t first = 1;
+      bool toGlobal = false;
+      if ( words.size() % 2 == 0 )
+      {
+        toGlobal = words[ 1 ].Text() == "#0";
+        first = 2;
+      }
+      for ( size_t i = first; i + 1 < words.size(); i += 2 )
+      {
+        const auto other = words[ i ];
+        if ( toGlobal || other.Text().find( "::" ) != std::string_view::npos )
+        {
+          ImportVariable( index,
+                          context,
+                          words[ i + 1 ],
+                          from( global, other ) );
+        }
+        else
+        {
+          WriteVariable( index, context, words[ i + 1 ] );
+        }
       }
+    }
+  }
 
-      if ( num_args == proc->required_args )
+  void IndexScript( Index& index,
+                    ScanContext& context,
+                    Parser::FlatNode script );
+
+  void IndexWord( Index& index, ScanContext& context, Parser::FlatNode word )
+  {
+    using Word = Parser::Word;
+    switch ( word.WordType() )
+    {
+      case Word::Type::ARRAY_ACCESS:
       {
-        best_fit = proc;
+        // The array's name (after the $), and then the words of the index
+        const auto children = word.Children();
+        const auto name = children[ 0 ];
+        ReadVariable( index, context, name.Text(), name.Location() );
+
+        for ( size_t i = 1; i < children.size(); ++i )
+        {
+          IndexWord( index, context, children[ i ] );
+        }
         break;
       }
 
-      if ( num_args <= proc->required_args + proc->optional_args )
+      case Word::Type::EXPAND:  // fall through
+      case Word::Type::TOKEN_LIST:
       {
-        // This is a _good_ fit, but hard to know if it is _better_ than
-        // what we have in best_fit right now.
-        best_fit = proc;
-        continue;
+        for ( auto subWord : word.Children() )
+        {
+          IndexWord( index, context, subWord );
+        }
+        break;
       }
 
-      if ( proc->is_variadic )
+      case Word::Type::VARIABLE:
       {
-        best_fit = proc;
-        continue;
+        ReadVariable( index, context, word.Text(), word.Location() );
+        break;
+      }
+
+      case Word::Type::SCRIPT:
+      {
+        IndexScript( index, context, word );
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  /**
+   * The procs which the command `qn` called in namespace `ns` could be: those
+   * in the namespace it names (relative to `ns`), or if there aren't any, in
+   * the one it names relative to each of ns's parents in turn. Unlike
+   * ResolveNamespace, this never adds namespaces.
+   */
+  const Overloads* FindProc( const Index& index,
+                             NamespaceID ns,
+                             const Parser::QualifiedName& qn )
+  {
+    std::optional< NamespaceID > cur_id = ns;
+    if ( qn.absolute )
+    {
+      cur_id = index.global_namespace_id;
+    }
+
+    for ( ; cur_id; cur_id = index.namespaces.Get( *cur_id ).parent_namespace )
+    {
+      if ( auto target = FindNamespace( index, *cur_id, qn ) )
+      {
+        auto it = index.overloads.find(
+          ProcKey{ .ns = *target, .name = qn.name } );
+        if ( it != index.overloads.end() )
+        {
+          return &it->second;
+        }
+      }
+
+      if ( qn.absolute )
+      {
+        break;
       }
     }
 
-    return best_fit;
+    return nullptr;
+  }
+
+  /**
+   * As FindProc, for the command `cmdName`, but remembered: a name called
+   * from the same namespace again is only looked up again once procs have
+   * been added to or removed from the index since.
+   */
+  const Overloads* ResolveCall( Index& index,
+                                NamespaceID ns,
+                                std::string_view cmdName )
+  {
+    auto& cache = index.resolved;
+    if ( cache.generation != index.generation )
+    {
+      cache.calls.clear();
+      cache.generation = index.generation;
+    }
+
+    auto [ it, added ] = cache.calls.try_emplace(
+      CallKey{ .ns = ns, .cmd = Parser::Intern( cmdName ) } );
+    if ( added )
+    {
+      it->second = FindProc( index, ns, Parser::SplitName( cmdName ) );
+    }
+    return it->second;
+  }
+
+  Proc* BestFitProcToCall( const std::vector<Proc*>& procs, size_t num_args )
+  {
+    auto i = BestFit( procs, num_args, []( Proc* p ) { return p; } );
+    return i < procs.size() ? procs[ i ] : nullptr;
+  }
+
+  Proc* BestFitProcToCall( const std::vector<Proc*>& procs,
+                           Parser::FlatNode call )
+  {
+    return BestFitProcToCall( procs, call.Children().size() - 1 );
   }
 
 
   void IndexScript( Index& index,
                     ScanContext& context,
-                    const Parser::Script& script )
+                    Parser::FlatNode script )
   {
     using Call = Parser::Call;
 
-    for ( auto& call : script.commands )
+    for ( auto call : script.Children() )
     {
       auto& ns = index.namespaces.Get( context.nsPath.back() );
+      const auto words = call.Children();
 
       auto scanned = false;
-      switch ( call.type )
+      auto builtin = false;  // may name variables (see IndexVariableCommand)
+      switch ( call.CallType() )
       {
         case Call::Type::NAMESPACE_EVAL:
         {
           Parser::QualifiedName qn = {
-            .ns = std::string( call.words[ 2 ].text ),
-            .name = "",
+            .ns = Parser::Intern( words[ 2 ].Text() ),
+            .name = Parser::Symbol{},
           };
+          // (which leaves the proc, if there is one)
+          auto proc = std::exchange( context.proc, std::nullopt );
           context.nsPath.push_back( ResolveNamespace( index, qn, ns ).id );
-          IndexWord( index, context, call.words[ 3 ] );
+          IndexWord( index, context, words[ 3 ] );
           context.nsPath.pop_back();
+          context.proc = proc;
           scanned = true;
           break;
         }
         case Call::Type::PROC:
         {
           Parser::QualifiedName procName = Parser::SplitName(
-            call.words[ 1 ].text );
+            words[ 1 ].Text() );
+          auto defined = context.procs.find( call.id );
+          auto proc = std::exchange(
+            context.proc,
+            defined != context.procs.end()
+              ? std::optional< ProcID >( defined->second )
+              : std::nullopt );
           context.nsPath.push_back(
             ResolveNamespace( index, procName, ns ).id );
-          IndexWord( index, context, call.words[ 3 ] );
+          IndexWord( index, context, words[ 3 ] );
           context.nsPath.pop_back();
+          context.proc = proc;
           scanned = true;
           break;
         }
+        case Call::Type::FOREACH:
+        {
+          // The loop's variables are set before its body runs
+          IndexVariableCommand( index, context, call );
+          break;
+        }
         case Call::Type::USER:
         {
-          auto procs = FindProc( index, ns, call.words[ 0 ].text );
-          auto* best_fit = BestFitProcToCall( procs, call );
-          if ( best_fit )
+          // Most calls are to core commands, which can be ruled out first.
+          // While bulk loading, none are resolved until the end (see
+          // ResolveCalls).
+          const auto cmdName = words[ 0 ].Text();
+          const auto* procs =
+            !index.procs.bulk_load && MayBeProc( index, cmdName )
+              ? ResolveCall( index, ns.id, cmdName )
+              : nullptr;
+          if ( procs )
           {
             // Add a reference to the proc being called if we can
-            AddCommandReference( index,
-                                 call.words[ 0 ].location,
-                                 *best_fit,
-                                 ReferenceType::USAGE );
+            auto best_fit = procs->BestFit( words.size() - 1 );
+            index.procs.AddReference( Proc::Reference{
+              .location = words[ 0 ].Location(),
+              .id = best_fit,
+              .type = ReferenceType::USAGE,
+              .ns = ns.id,
+              .cmd = Parser::Intern( cmdName ),
+              .num_args = uint32_t( words.size() - 1 ),
+            } );
+          }
+          else
+          {
+            index.unresolved.push_back( Index::Call{
+              .location = words[ 0 ].Location(),
+              .ns = ns.id,
+              .name = Parser::SplitName( cmdName ),
+              .num_args = words.size() - 1,
+            } );
+            builtin = true;
           }
+          break;
         }
 
         default:
@@ -682,91 +1446,564 @@ namespace Index
       // Add references to any variables that are in the command
       if ( !scanned )
       {
-        for ( const auto& word : call.words )
+        for ( auto word : words )
         {
           IndexWord( index, context, word );
         }
       }
+
+      // and then to those it names, which it sets after reading those (as in
+      // set x [expr { $x + 1 }])
+      if ( builtin )
+      {
+        IndexVariableCommand( index, context, call );
+      }
     }
   }
 
-  void Build( Index& index, ScanContext& context, const Parser::Script& script )
+  // Resolve the unresolved calls which RemoveFile orphaned, now that there
+  // may be procs for them again
+  void ResolveOrphans( Index& index )
   {
-    ScanScript( index, context, script );
-    IndexScript( index, context, script );
+    std::unordered_set< Parser::Symbol > remaining;
+    std::erase_if( index.unresolved, [ & ]( const Index::Call& call ) {
+      if ( !index.orphaned.contains( call.name.name ) )
+      {
+        return false;
+      }
+      auto* procs = FindProc( index, call.ns, call.name );
+      if ( !procs )
+      {
+        remaining.insert( call.name.name );
+        return false;
+      }
+      index.procs.AddReference( Proc::Reference{
+        .location = call.location,
+        .id = procs->BestFit( call.num_args ),
+        .type = ReferenceType::USAGE,
+        .ns = call.ns,
+        .cmd = Parser::Intern( call.name.Path() ),
+        .num_args = uint32_t( call.num_args ),
+      } );
+      return true;
+    } );
+    index.orphaned = std::move( remaining );
   }
 
-  // TODO: This isn't really a good cursor, as Calls/Scripts don't point to
-  // their parents. If they did we'd have more of a tree cursor
-  struct ScriptCursor
+  void Build( Index& index,
+              ScanContext& context,
+              const Parser::FlatScript& tree )
   {
-    const Parser::Call* call{nullptr};
-    size_t argument{0};
-    const Parser::Word* word{nullptr};
-  };
+    index.files.emplace( tree.file->id, tree.file );
 
-  ScriptCursor FindPositionInScript( const Parser::Script& script,
-                                     Parser::LinePos pos );
+    // (The procs found are by node, so only of this tree)
+    context.procs.clear();
 
-  std::optional< ScriptCursor > FindPositionInWord( ScriptCursor result,
-                                                    const Parser::Word& word,
-                                                    Parser::LinePos pos )
-  {
-    if ( word.location.line > pos.line )
+    const auto script = Parser::Root( tree );
+    ScanScript( index, context, script );
+    if ( !index.orphaned.empty() && !index.procs.bulk_load )
     {
-      return std::nullopt;
+      ResolveOrphans( index );
     }
-    else if ( word.location.line == pos.line &&
-              word.location.column > pos.column )
+    IndexScript( index, context, script );
+  }
+
+  // As above, flattening `script` first
+  void Build( Index& index, ScanContext& context, const Parser::Script& script )
+  {
+    Build( index,
+           context,
+           Parser::Flatten( Parser::FindSourceFile( script.location.file ),
+                            script ) );
+  }
+
+  /**
+   * Resolve the calls indexed during a bulk load, now that all of its procs
+   * are in the index, so that what a call resolves to doesn't depend on the
+   * order the files were built in. The calls from before the load which may
+   * now resolve differently, because a proc of the same name was added or
+   * removed since, are resolved again too. The index is then as it would
+   * have been had every file been indexed in the one load.
+   */
+  void ResolveCalls( Index& index )
+  {
+    const auto start = index.bulkStart;
+    std::unordered_set< Parser::Symbol > added;
+    for ( size_t pos = start.procs; pos < index.procs.table.size(); ++pos )
     {
-      return std::nullopt;
+      const auto& proc = index.procs.table[ pos ];
+      if ( index.procs.IsLive( proc ) )
+      {
+        added.insert( proc.name );
+      }
     }
 
-    if ( word.type == Parser::Word::Type::SCRIPT )
+    // A call resolved before the load may fit one of the new procs better
+    for ( size_t pos = 0; pos < start.references && !added.empty(); ++pos )
     {
-      result = FindPositionInScript(
-        *std::get<Parser::Word::ScriptPtr>( word.data ),
-        pos );
+      const auto& r = index.procs.references[ pos ];
+      if ( r.id == 0 || r.type != ReferenceType::USAGE ||
+           r.cmd == Parser::Symbol{} ||
+           !added.contains( Parser::SplitName( r.cmd.Text() ).name ) )
+      {
+        continue;
+      }
+      const auto* procs =
+        FindProc( index, r.ns, Parser::SplitName( r.cmd.Text() ) );
+      auto best_fit = procs ? procs->BestFit( r.num_args ) : r.id;
+      if ( best_fit != r.id )
+      {
+        auto moved = r;
+        moved.id = best_fit;
+        index.procs.RemoveReference( pos );
+        index.procs.AddReference( std::move( moved ) );
+      }
     }
-    else if ( word.type == Parser::Word::Type::TOKEN_LIST ||
-              word.type == Parser::Word::Type::EXPAND )
+
+    auto resolve = [ & ]( const Index::Call& call ) {
+      if ( !index.procNames.hashes.MayContain(
+             Hash::Bytes( call.name.name.Text() ) ) )
+      {
+        return false;
+      }
+      const auto* procs = FindProc( index, call.ns, call.name );
+      if ( !procs )
+      {
+        return false;
+      }
+      index.procs.AddReference( Proc::Reference{
+        .location = call.location,
+        .id = procs->BestFit( call.num_args ),
+        .type = ReferenceType::USAGE,
+        .ns = call.ns,
+        .cmd = Parser::Intern( call.name.Path() ),
+        .num_args = uint32_t( call.num_args ),
+      } );
+      return true;
+    };
+
+    // Every call indexed during the load, and then those from before it
+    // which were to procs of a name that was added or removed since
+    auto& calls = index.unresolved;
+    const auto deferred = calls.begin() + start.unresolved;
+    calls.erase( std::remove_if( deferred, calls.end(), resolve ),
+                 calls.end() );
+    const auto before = calls.begin() + start.unresolved;
+    calls.erase( std::remove_if( calls.begin(),
+                                 before,
+                                 [ & ]( const Index::Call& call ) {
+                                   return ( added.contains( call.name.name ) ||
+                                            index.orphaned.contains(
+                                              call.name.name ) ) &&
+                                          resolve( call );
+                                 } ),
+                 before );
+    index.orphaned.clear();
+  }
+
+  // For indexing many files at once (e.g. a whole tree): until EndBulkLoad,
+  // rows and references are only appended, and their keys are then built
+  // all in one go, rather than one element at a time. Calls aren't resolved
+  // until then either (see ResolveCalls).
+  void BeginBulkLoad( Index& index )
+  {
+    index.bulkStart = Index::BulkStart{
+      .procs = index.procs.table.size(),
+      .references = index.procs.references.size(),
+      .unresolved = index.unresolved.size(),
+    };
+    index.namespaces.bulk_load = true;
+    index.procs.bulk_load = true;
+    index.variables.bulk_load = true;
+  }
+
+  void EndBulkLoad( Index& index, bool parallel = false )
+  {
+    // Each of these only touches its own key
+    std::vector< std::function< void() > > passes = {
+      [ & ]() { index.namespaces.BuildKeys(); },
+      [ & ]() { index.namespaces.BuildReferenceKeys(); },
+      [ & ]() { index.procs.BuildKeys(); },
+      [ & ]() { index.procs.BuildReferenceKeys(); },
+      [ & ]() { index.variables.BuildKeys(); },
+      [ & ]() { index.variables.BuildReferenceKeys(); },
+    };
+
+    if ( parallel )
     {
-        const auto& subWords = std::get< Parser::Word::WordVec >( word.data );
-        for ( const auto& subWord : subWords )
-        {
-          auto subresult = FindPositionInWord( result, subWord, pos );
-          if ( !subresult )
-          {
-            return std::nullopt;
-          }
-          result = *subresult;
-        }
+      std::vector< std::thread > threads;
+      for ( size_t i = 1; i < passes.size(); ++i )
+      {
+        threads.emplace_back( passes[ i ] );
+      }
+      passes[ 0 ]();
+      for ( auto& thread : threads )
+      {
+        thread.join();
+      }
     }
     else
     {
-      result.word = &word;
+      for ( auto& pass : passes )
+      {
+        pass();
+      }
     }
 
-    return result;
+    index.namespaces.bulk_load = false;
+    index.procs.bulk_load = false;
+    index.variables.bulk_load = false;
+    ResolveCalls( index );
   }
 
-  ScriptCursor FindPositionInScript( const Parser::Script& script,
-    Parser::LinePos pos )
+  // Map each of `ids` through `remap` (from Record::Compact), dropping any
+  // which were removed
+  void RemapIDs( std::vector< ID >& ids, const std::vector< ID >& remap )
   {
-    // TODO: binary chop the commands, which are neccesarily sorted by line
-    // number
-    std::optional< ScriptCursor > result = ScriptCursor{};
+    for ( auto& id : ids )
+    {
+      id = remap[ id ];
+    }
+    std::erase( ids, ID{ 0 } );
+  }
 
-    for ( const auto& call : script.commands )
+  void RemapScope( Scope& scope,
+                   const std::vector< ID >& procs,
+                   const std::vector< ID >& variables )
+  {
+    RemapIDs( scope.procs, procs );
+    RemapIDs( scope.variables, variables );
+    RemapIDs( scope.imported, variables );
+    for ( auto it = scope.byName.begin(); it != scope.byName.end(); )
     {
-      for ( size_t arg = 0; arg < call.words.size(); ++ arg )
-      {
-        const auto& word = call.words[ arg ];
-        std::optional< ScriptCursor > subresult = ScriptCursor{
-          .call = &call,
+      it->second = variables[ it->second ];
+      it = it->second ? std::next( it ) : scope.byName.erase( it );
+    }
+  }
+
+  // Repack the tables over their removed rows and references, and update
+  // every id which refers to them. Any pointers into the index, and ids held
+  // outside of it, are invalidated.
+  void Compact( Index& index )
+  {
+    const auto nsRemap = index.namespaces.Compact();
+    const auto procRemap = index.procs.Compact();
+    const auto varRemap = index.variables.Compact();
+
+    index.namespacesByParent.clear();
+    for ( auto& ns : index.namespaces.table )
+    {
+      if ( ns.parent_namespace )
+      {
+        ns.parent_namespace = nsRemap[ *ns.parent_namespace ];
+        index.namespacesByParent.emplace(
+          ChildNamespace{ .parent = *ns.parent_namespace, .name = ns.name },
+          ns.id );
+      }
+      RemapIDs( ns.child_namespaces, nsRemap );
+      RemapScope( ns.scope, procRemap, varRemap );
+    }
+
+    index.procNames = {};
+    index.overloads.clear();
+    for ( auto& proc : index.procs.table )
+    {
+      AddProcName( index, proc.name );
+      proc.parent_namespace = nsRemap[ proc.parent_namespace ];
+      RemapIDs( proc.arguments, varRemap );
+      RemapScope( proc.scope, procRemap, varRemap );
+    }
+    for ( const auto& proc : index.procs.table )
+    {
+      AddOverload( index, proc );
+    }
+
+    for ( auto& variable : index.variables.table )
+    {
+      if ( variable.parent_namespace )
+      {
+        variable.parent_namespace = nsRemap[ *variable.parent_namespace ];
+      }
+    }
+
+    index.global_namespace_id = nsRemap[ index.global_namespace_id ];
+    ++index.generation;
+    for ( auto& call : index.unresolved )
+    {
+      call.ns = nsRemap[ call.ns ];
+    }
+    for ( auto& r : index.procs.references )
+    {
+      if ( r.type == ReferenceType::USAGE )
+      {
+        r.ns = nsRemap[ r.ns ];
+      }
+    }
+  }
+
+  // Compact the index once more than `threshold` of any table (or its
+  // references) is tombstones
+  bool MaybeCompact( Index& index, double threshold = 0.25 )
+  {
+    if ( index.namespaces.Fragmentation() <= threshold &&
+         index.procs.Fragmentation() <= threshold &&
+         index.variables.Fragmentation() <= threshold )
+    {
+      return false;
+    }
+    Compact( index );
+    return true;
+  }
+
+  /**
+   * Remove everything which `files` added to the index: the references in
+   * them, the procs defined in them (with their arguments), the calls in them
+   * which weren't resolved, and then any of the namespaces that left empty.
+   * The references are scanned once however many files there are, and the
+   * index is then compacted if it has become too fragmented.
+   *
+   * Calls from other files to the procs they defined go back to being
+   * unresolved, and are resolved again by the next Build which adds procs
+   * (e.g. that of a file's new text).
+   *
+   * A namespace stays while another file still names it (e.g. by `namespace
+   * eval x {}`), even if it's empty.
+   */
+  void RemoveFiles( Index& index,
+                    const std::unordered_set< Parser::FileID >& files )
+  {
+    if ( files.empty() )
+    {
+      return;
+    }
+    auto removed = [ & ]( Parser::FileID file ) {
+      return files.contains( file );
+    };
+
+    std::vector< ProcID > procs;
+    for ( size_t pos = 0; pos < index.procs.references.size(); ++pos )
+    {
+      const auto& r = index.procs.references[ pos ];
+      if ( r.id == 0 || !removed( r.location.file ) )
+      {
+        continue;
+      }
+      if ( r.type == ReferenceType::DEFINITION )
+      {
+        procs.push_back( r.id );
+      }
+      index.procs.RemoveReference( pos );
+    }
+
+    // (returning what they referred to)
+    auto removeRefs = [ & ]( auto& record ) {
+      std::vector< ID > ids;
+      for ( size_t pos = 0; pos < record.references.size(); ++pos )
+      {
+        const auto& r = record.references[ pos ];
+        if ( r.id != 0 && removed( r.location.file ) )
+        {
+          ids.push_back( r.id );
+          record.RemoveReference( pos );
+        }
+      }
+      return ids;
+    };
+    // The namespaces which might now be empty
+    auto namespaces = removeRefs( index.namespaces );
+    auto variables = removeRefs( index.variables );
+
+    // (A proc defined twice in the file has two definitions)
+    std::sort( procs.begin(), procs.end() );
+    procs.erase( std::unique( procs.begin(), procs.end() ), procs.end() );
+    for ( auto id : procs )
+    {
+      auto& proc = index.procs.Get( id );
+      for ( auto v : proc.arguments )
+      {
+        index.variables.Remove( v );
+      }
+      for ( auto v : proc.scope.variables )
+      {
+        if ( index.variables.IsLive( v ) )
+        {
+          index.variables.Remove( v );
+        }
+      }
+
+      // (Its definitions and the files' own calls of it are already gone)
+      auto refs = index.procs.refsByID.equal_range( id );
+      for ( auto it = refs.first; it != refs.second; ++it )
+      {
+        const auto& r = index.procs.references[ it->second ];
+        if ( r.type != ReferenceType::USAGE )
+        {
+          continue;
+        }
+        auto name = Parser::SplitName( r.cmd.Text() );
+        index.orphaned.insert( name.name );
+        index.unresolved.push_back( Index::Call{
+          .location = r.location,
+          .ns = r.ns,
+          .name = name,
+          .num_args = r.num_args,
+        } );
+      }
+
+      auto& parent = index.namespaces.Get( proc.parent_namespace );
+      std::erase( parent.scope.procs, id );
+      namespaces.push_back( parent.id );
+      RemoveOverload( index, proc );
+      index.procs.Remove( id );
+    }
+
+    // A namespace's variable goes once nothing refers to it, as any file
+    // which set, declared or linked it would
+    std::sort( variables.begin(), variables.end() );
+    variables.erase( std::unique( variables.begin(), variables.end() ),
+                     variables.end() );
+    for ( auto id : variables )
+    {
+      if ( !index.variables.IsLive( id ) )
+      {
+        continue;
+      }
+      auto& variable = index.variables.Get( id );
+      auto refs = index.variables.refsByID.equal_range( id );
+      if ( !variable.parent_namespace || refs.first != refs.second )
+      {
+        continue;
+      }
+
+      auto& ns = index.namespaces.Get( *variable.parent_namespace );
+      std::erase( ns.scope.variables, id );
+      if ( auto it = ns.scope.byName.find( variable.name );
+           it != ns.scope.byName.end() && it->second == id )
+      {
+        ns.scope.byName.erase( it );
+      }
+      namespaces.push_back( ns.id );
+      index.variables.Remove( id );
+    }
+
+    // (and those which still have calls in them)
+    std::unordered_set< NamespaceID > calling;
+    std::erase_if( index.unresolved, [ & ]( const Index::Call& call ) {
+      if ( !removed( call.location.file ) )
+      {
+        calling.insert( call.ns );
+        return false;
+      }
+      namespaces.push_back( call.ns );
+      return true;
+    } );
+
+    auto isEmpty = [ & ]( const Namespace& ns ) {
+      return ns.id != index.global_namespace_id && ns.scope.procs.empty() &&
+             ns.scope.variables.empty() && ns.scope.imported.empty() &&
+             ns.child_namespaces.empty() &&
+             index.namespaces.refsByID.count( ns.id ) == 0 &&
+             !calling.contains( ns.id );
+    };
+    for ( auto id : namespaces )
+    {
+      // Removing one may leave its parent empty
+      while ( index.namespaces.IsLive( id ) &&
+              isEmpty( index.namespaces.Get( id ) ) )
+      {
+        auto& ns = index.namespaces.Get( id );
+        auto parent_id = *ns.parent_namespace;
+        std::erase( index.namespaces.Get( parent_id ).child_namespaces, id );
+        index.namespacesByParent.erase(
+          ChildNamespace{ .parent = parent_id, .name = ns.name },
+          id );
+        index.namespaces.Remove( id );
+        id = parent_id;
+      }
+    }
+
+    for ( auto file : files )
+    {
+      index.files.erase( file );
+    }
+    ++index.generation;
+    MaybeCompact( index );
+  }
+
+  void RemoveFile( Index& index, Parser::FileID file )
+  {
+    RemoveFiles( index, { file } );
+  }
+
+  // TODO: This isn't really a good cursor, as Calls/Scripts don't point to
+  // their parents. If they did we'd have more of a tree cursor
+  struct ScriptCursor
+  {
+    std::optional< Parser::FlatNode > call;
+    size_t argument{0};
+    std::optional< Parser::FlatNode > word;
+  };
+
+  ScriptCursor FindPositionInScript( Parser::FlatNode script, size_t offset );
+
+  std::optional< ScriptCursor > FindPositionInWord( ScriptCursor result,
+                                                    Parser::FlatNode word,
+                                                    size_t offset )
+  {
+    if ( word.Location().offset > offset )
+    {
+      return std::nullopt;
+    }
+
+    if ( word.WordType() == Parser::Word::Type::SCRIPT )
+    {
+      // Only look inside a script which contains offset
+      if ( offset < word.Location().offset + word.Text().length() )
+      {
+        result = FindPositionInScript( word, offset );
+      }
+      else
+      {
+        result.word = word;
+      }
+    }
+    else if ( word.WordType() == Parser::Word::Type::TOKEN_LIST ||
+              word.WordType() == Parser::Word::Type::EXPAND )
+    {
+        for ( auto subWord : word.Children() )
+        {
+          auto subresult = FindPositionInWord( result, subWord, offset );
+          if ( !subresult )
+          {
+            return std::nullopt;
+          }
+          result = *subresult;
+        }
+    }
+    else
+    {
+      result.word = word;
+    }
+
+    return result;
+  }
+
+  ScriptCursor FindPositionInScript( Parser::FlatNode script, size_t offset )
+  {
+    // TODO: binary chop the commands, which are neccesarily sorted by line
+    // number
+    std::optional< ScriptCursor > result = ScriptCursor{};
+
+    for ( auto call : script.Children() )
+    {
+      const auto words = call.Children();
+      for ( size_t arg = 0; arg < words.size(); ++ arg )
+      {
+        std::optional< ScriptCursor > subresult = ScriptCursor{
+          .call = call,
           .argument = arg,
         };
-        subresult = FindPositionInWord( *subresult, word, pos );
+        subresult = FindPositionInWord( *subresult, words[ arg ], offset );
 
         if ( !subresult )
         {
@@ -783,12 +2020,1319 @@ namespace Index
     return *result;
   }
 
-
+  ScriptCursor FindPositionInScript( const Parser::FlatScript& tree,
+                                     Parser::LinePos pos )
+  {
+    return FindPositionInScript( Parser::Root( tree ),
+                                 Parser::LineByteToOffset( *tree.file, pos ) );
+  }
 }  // namespace Index
 
 namespace Index::Test
 {
-  void Run()
+  void TestFlatScript()
   {
+    Parser::ParseContext context{
+      .file = Parser::make_source_file( "test",
+                                        "namespace eval ns {\n"
+                                        "  proc p { a { b 1 } } {\n"
+                                        "    puts \"$a [ set x($b,$a) ]\"\n"
+                                        "    {*}$a\n"
+                                        "  }\n"
+                                        "}\n"
+                                        "p 1 [p 2]; set y ${z}x\n" ),
+      .cur_ns = "",
+    };
+    auto* script = Parser::ParseScript( nullptr,
+                                        context,
+                                        context.file->contents );
+    auto tree = Parser::Flatten( context.file, *script );
+
+    Parser::Test::CompareFlatCalls( Parser::Root( tree ).Children(),
+                                    script->commands );
+
+    // The call, argument and word at each position, down into bodies and
+    // command substitutions
+    struct Expect
+    {
+      Parser::LinePos pos;
+      std::string_view call;  // how it starts
+      std::string_view ns;
+      size_t argument;
+      std::string_view word;
+    };
+    for ( const auto& expect : {
+            Expect{ { 0, 0 }, "namespace eval", "", 0, "namespace" },
+            Expect{ { 2, 4 }, "puts", "::ns", 0, "puts" },
+            Expect{ { 2, 16 }, "set x", "::ns", 0, "set" },
+            Expect{ { 6, 0 }, "p 1", "", 0, "p" },
+            Expect{ { 6, 5 }, "p 2", "", 0, "p" },
+            Expect{ { 6, 7 }, "p 2", "", 1, "2" },
+          } )
+    {
+      auto cursor = FindPositionInScript( tree, expect.pos );
+      if ( !cursor.call || !cursor.word ||
+           !cursor.call->Text().starts_with( expect.call ) ||
+           cursor.call->Namespace() != expect.ns ||
+           cursor.argument != expect.argument ||
+           cursor.word->Text() != expect.word )
+      {
+        std::cerr << "Wrong cursor at " << expect.pos << '\n';
+        abort();
+      }
+    }
   }
-}  // namespace Index::Test
+
+  void TestParallelParse()
+  {
+    std::string text;
+    for ( int i = 0; i < 200; ++i )
+    {
+      auto n = std::to_string( i );
+      text += "namespace eval ns" + n + " {\n"
+              "  proc p" + n + " { a { b 1 } } {\n"
+              "    foreach x $a { puts \"$x [ set y($b) ]\" }\n"
+              "  }\n"
+              "}\n"
+              "# comment " + n + "\n"
+              "p" + n + " 1 [ns" + n + "::p" + n + " 2]; set z ${y}x\n";
+    }
+
+    Parser::ParseContext sequential{
+      .file = Parser::make_source_file( "test", text ),
+      .cur_ns = "",
+    };
+    auto* expected = Parser::ParseScript( nullptr,
+                                          sequential,
+                                          sequential.file->contents );
+
+    Parser::ParseContext parallel{
+      .file = sequential.file,
+      .cur_ns = "",
+    };
+    auto* script = Parser::ParseScriptParallel( nullptr,
+                                                parallel,
+                                                parallel.file->contents,
+                                                { .workers = 4,
+                                                  .chunk_size = 512 } );
+    if ( parallel.worker_arenas.empty() )
+    {
+      std::cerr << "Expected the script to be parsed in parallel\n";
+      abort();
+    }
+
+    Parser::Test::CompareCalls( script->commands, expected->commands );
+  }
+
+  void TestChunkedStorage()
+  {
+    // Rows keep their addresses, across chunks and moves of the table
+    auto index = make_index();
+    const size_t rows = 3 * DB::Storage< Variable >::CHUNK_SIZE + 5;
+    std::vector< const Variable* > addresses;
+    for ( size_t i = 0; i < rows; ++i )
+    {
+      auto& v = index.variables.Insert( Variable{
+        .name = Parser::Intern( "v" + std::to_string( i % 7 ) ),
+      } );
+      addresses.push_back( &v );
+    }
+
+    auto moved = std::move( index );
+    size_t i = 0;
+    for ( const auto& v : moved.variables.table )
+    {
+      if ( &v != addresses[ i ] || v.id != i + 1 ||
+           &moved.variables.Get( v.id ) != &v ||
+           v.name.Text() != "v" + std::to_string( i % 7 ) )
+      {
+        std::cerr << "Variable " << i + 1 << " moved or changed\n";
+        abort();
+      }
+      ++i;
+    }
+
+    if ( i != rows || moved.variables.byName.size() != rows ||
+         !index.variables.table.empty() )
+    {
+      std::cerr << "Expected " << rows << " variables\n";
+      abort();
+    }
+  }
+
+  void TestKeys()
+  {
+    // Each kind of key gives the same values as a std::multimap, in the same
+    // order, however the keys were added or erased (and across rehashes)
+    std::mt19937 random( 1234 );
+    DB::SortIndex< ID, size_t > expected;
+    DB::FlatSortIndex< ID, size_t > flat;
+    DB::HashIndex< ID, size_t > hash;
+
+    auto check = [ & ]( const char* when, size_t i ) {
+      for ( ID k = 0; k <= 1001; ++k )
+      {
+        auto values = []( auto range ) {
+          std::vector< size_t > v;
+          for ( auto it = range.first; it != range.second; ++it )
+          {
+            v.push_back( it->second );
+          }
+          return v;
+        };
+        auto e = values( expected.equal_range( k ) );
+        if ( values( flat.equal_range( k ) ) != e ||
+             values( hash.equal_range( k ) ) != e ||
+             flat.count( k ) != e.size() || hash.count( k ) != e.size() )
+        {
+          std::cerr << "Keys differ for " << k << " " << when << " " << i
+                    << " elements\n";
+          abort();
+        }
+      }
+      if ( flat.size() != expected.size() || hash.size() != expected.size() )
+      {
+        std::cerr << "Expected " << expected.size() << " keys\n";
+        abort();
+      }
+    };
+
+    std::vector< std::pair< ID, size_t > > added;
+    for ( size_t i = 0; i < 5000; ++i )
+    {
+      ID key = random() % 1000;
+      expected.emplace( key, i );
+      flat.emplace( key, i );
+      hash.emplace( key, i );
+      added.emplace_back( key, i );
+
+      // and they can be read part way through being filled
+      if ( i % 1000 == 999 || i < 3 )
+      {
+        check( "after adding", i + 1 );
+      }
+    }
+
+    // Erasing most of them empties some keys altogether, and makes the hash
+    // reclaim its space
+    std::shuffle( added.begin(), added.end(), random );
+    for ( size_t i = 0; i < 4000; ++i )
+    {
+      auto [ key, value ] = added[ i ];
+      DB::EraseKey( expected, key, value );
+      DB::EraseKey( flat, key, value );
+      DB::EraseKey( hash, key, value );
+      if ( i % 1000 == 999 )
+      {
+        check( "after erasing", i + 1 );
+      }
+    }
+
+    // Erasing what isn't there does nothing
+    DB::EraseKey( flat, ID{ 1001 }, size_t{ 0 } );
+    DB::EraseKey( hash, ID{ 1001 }, size_t{ 0 } );
+    DB::EraseKey( hash, added[ 0 ].first, added[ 0 ].second );
+
+    for ( size_t i = 5000; i < 6000; ++i )
+    {
+      ID key = random() % 1000;
+      expected.emplace( key, i );
+      flat.emplace( key, i );
+      hash.emplace( key, i );
+    }
+    check( "after adding back", 6000 );
+  }
+
+  void TestRemove()
+  {
+    // Removed rows are tombstones until compacted, their ids are reused, and
+    // compacting maps ids and references to the packed table
+    DB::RefRecord< Proc > procs;
+    auto a = Parser::Intern( "a" );
+    auto b = Parser::Intern( "b" );
+    for ( int i = 0; i < 10; ++i )
+    {
+      auto& p = procs.Insert( Proc{ .name = i % 2 ? b : a } );
+      procs.AddReference( Proc::Reference{ .location = { .offset = 0 },
+                                           .id = p.id,
+                                           .type = ReferenceType::USAGE } );
+      procs.AddReference( Proc::Reference{ .location = { .offset = 1 },
+                                           .id = p.id,
+                                           .type = ReferenceType::USAGE } );
+    }
+
+    auto fail = 0;
+    auto expect = [ & ]( bool ok, const char* what ) {
+      if ( !ok )
+      {
+        std::cerr << what << '\n';
+        ++fail;
+      }
+    };
+
+    procs.Remove( 3 );
+    procs.Remove( 4 );
+    procs.RemoveReference( 0 );  // proc 1's first
+    expect( !procs.IsLive( ID{ 3 } ) && procs.IsLive( ID{ 5 } ) &&
+              procs.Size() == 8 && procs.table.size() == 10,
+            "Expected 3 and 4 to be tombstones" );
+    expect( procs.byName.count( a ) == 4 && procs.byName.count( b ) == 4,
+            "Expected removed rows' names to be removed" );
+    expect( procs.refsByID.count( 3 ) == 0 && procs.refsByID.count( 1 ) == 1,
+            "Expected removed references to be removed" );
+
+    auto& reused = procs.Insert( Proc{ .name = b } );
+    expect( reused.id == 3 && procs.table.size() == 10 &&
+              procs.byName.count( b ) == 5,
+            "Expected a removed row's id to be reused" );
+    procs.Remove( 3 );
+
+    auto remap = procs.Compact();
+    expect( procs.table.size() == 8 && procs.Fragmentation() == 0 &&
+              procs.references.size() == 15,
+            "Expected compacting to drop the tombstones" );
+    expect( remap[ 2 ] == 2 && remap[ 3 ] == 0 && remap[ 4 ] == 0 &&
+              remap[ 5 ] == 3 && remap[ 10 ] == 8,
+            "Expected later ids to move up" );
+    for ( const auto& p : procs.table )
+    {
+      auto range = procs.refsByID.equal_range( p.id );
+      expect( std::distance( range.first, range.second ) == ( p.id == 1 ? 1
+                                                                        : 2 ),
+              "Expected references to follow their proc" );
+      auto names = procs.byName.equal_range( p.name );
+      expect( std::any_of( names.first,
+                           names.second,
+                           [ & ]( const auto& e ) {
+                             return e.second == p.id;
+                           } ),
+              "Expected names to follow their proc" );
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void TestRemoveFile()
+  {
+    // Removing a file from an index leaves it the same as if the file had
+    // never been in it (for everything the other files don't get from it)
+    std::vector< std::unique_ptr< Parser::ParseContext > > contexts;
+    auto parse = [ & ]( const std::string& name, const std::string& text ) {
+      contexts.push_back( std::make_unique< Parser::ParseContext >(
+        Parser::ParseContext{
+          .file = Parser::make_source_file( name, text ),
+          .cur_ns = "",
+        } ) );
+      auto& context = *contexts.back();
+      return std::make_pair(
+        &context,
+        Parser::ParseScript( nullptr, context, context.file->contents ) );
+    };
+    auto a = parse( "a",
+                    "namespace eval ns {\n"
+                    "  proc p { x } { q; r }\n"
+                    "}\n"
+                    "proc q {} { ns::p 1 }\n" );
+    auto b = parse( "b",
+                    "namespace eval nsb::inner {\n"
+                    "  proc p { x { y 1 } args } { ::ns::p $x; q; s }\n"
+                    "}\n"
+                    "proc ns::t {} { ::nsb::inner::p 1 }\n"
+                    "q\n" );
+    auto c = parse( "c", "proc r {} { q; ns::p 2; s }\n" );
+
+    auto build = [ & ]( const auto& files ) {
+      auto index = make_index();
+      for ( auto [ context, script ] : files )
+      {
+        ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+        Build( index, scanContext, *script );
+      }
+      return index;
+    };
+
+    // Everything by name (not id)
+    auto dump = []( const Index& index ) {
+      std::vector< std::string > lines;
+      for ( const auto& ns : index.namespaces.table )
+      {
+        if ( index.namespaces.IsLive( ns ) )
+        {
+          lines.push_back( "namespace " +
+                           std::string( GetPrintName( index, ns ) ) );
+        }
+      }
+      for ( const auto& proc : index.procs.table )
+      {
+        if ( !index.procs.IsLive( proc ) )
+        {
+          continue;
+        }
+        std::ostringstream o;
+        o << "proc " << GetPrintName( index, proc ) << " "
+          << proc.arguments.size() << " args in "
+          << GetPrintName( index,
+                           index.namespaces.Get( proc.parent_namespace ) );
+        auto range = index.procs.refsByID.equal_range( proc.id );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          const auto& r = index.procs.references[ it->second ];
+          o << ", " << r.type << " at "
+            << Parser::FindSourceFile( r.location.file )->fileName << ":"
+            << r.location.offset;
+        }
+        lines.push_back( o.str() );
+      }
+      for ( const auto& call : index.unresolved )
+      {
+        std::ostringstream o;
+        o << "call " << call.name.name.Text() << " in "
+          << GetPrintName( index, index.namespaces.Get( call.ns ) ) << " at "
+          << Parser::FindSourceFile( call.location.file )->fileName << ":"
+          << call.location.offset;
+        lines.push_back( o.str() );
+      }
+      std::sort( lines.begin(), lines.end() );
+      return lines;
+    };
+
+    // The names are worked out before the rows are removed and moved about,
+    // and must still be right afterwards
+    auto index = build( std::vector{ a, b, c } );
+    const auto variables = index.variables.Size();
+    dump( index );
+    RemoveFile( index, b.first->file->id );
+
+    auto expected = build( std::vector{ a, c } );
+    if ( dump( index ) != dump( expected ) ||
+         index.variables.Size() != variables - 3 ||
+         index.files.size() != 2 ||
+         index.procs.Fragmentation() != 0 )
+    {
+      std::cerr << "Index without b differs from one which never had it:\n";
+      for ( const auto& line : dump( index ) )
+      {
+        std::cerr << "  " << line << '\n';
+      }
+      abort();
+    }
+
+    if ( FindNamespace( index, "::nsb" ) || !FindNamespace( index, "::ns" ) )
+    {
+      std::cerr << "Expected b's namespaces to be gone, and a's to be left\n";
+      abort();
+    }
+
+    // Calls from the other files to a's procs become unresolved again, as if
+    // a had never been indexed, and are resolved again once it is
+    auto without = build( std::vector{ a, b, c } );
+    RemoveFile( without, a.first->file->id );
+    if ( dump( without ) != dump( build( std::vector{ b, c } ) ) )
+    {
+      std::cerr << "Expected the calls to a's procs to be unresolved\n";
+      abort();
+    }
+
+    ScanContext rebuild{ .nsPath = { without.global_namespace_id } };
+    Build( without, rebuild, *a.second );
+    auto usages = [ & ]( std::string_view name, const std::string& file ) {
+      auto* procs = FindProc( without,
+                              without.global_namespace_id,
+                              Parser::SplitName( name ) );
+      size_t n = 0;
+      for ( auto id : procs ? procs->procs : std::vector< ProcID >{} )
+      {
+        auto range = without.procs.refsByID.equal_range( id );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          const auto& r = without.procs.references[ it->second ];
+          n += r.type == ReferenceType::USAGE &&
+               Parser::FindSourceFile( r.location.file )->fileName == file;
+        }
+      }
+      return n;
+    };
+    if ( usages( "ns::p", "a" ) != 1 || usages( "ns::p", "b" ) != 1 ||
+         usages( "ns::p", "c" ) != 1 || usages( "q", "a" ) != 1 ||
+         usages( "q", "b" ) != 2 || usages( "q", "c" ) != 1 ||
+         !without.orphaned.empty() )
+    {
+      std::cerr << "Expected the calls to a's procs to be resolved again\n";
+      abort();
+    }
+
+    // Removing several files at once is the same as removing each in turn
+    auto several = build( std::vector{ a, b, c } );
+    RemoveFiles( several, { a.first->file->id, c.first->file->id } );
+    if ( dump( several ) != dump( build( std::vector{ b } ) ) )
+    {
+      std::cerr << "Expected only b to be left\n";
+      abort();
+    }
+
+    // and the rest can then be removed too
+    RemoveFile( index, a.first->file->id );
+    RemoveFile( index, c.first->file->id );
+    Compact( index );
+    if ( index.namespaces.Size() != 1 || !index.procs.table.empty() ||
+         !index.variables.table.empty() || !index.unresolved.empty() ||
+         index.namespaces.Get( index.global_namespace_id ).name !=
+           Parser::Symbol{} )
+    {
+      std::cerr << "Expected only the global namespace to be left\n";
+      abort();
+    }
+
+    // A namespace which another file still names stays, even once it's
+    // empty
+    auto d = parse( "d", "namespace eval foo {}\n" );
+    auto e = parse( "e", "namespace eval foo { proc x {} {} }\n" );
+    auto named = build( std::vector{ d, e } );
+    RemoveFile( named, e.first->file->id );
+    auto f = parse( "e", "namespace eval bar { proc x {} {} }\n" );
+    ScanContext changed{ .nsPath = { named.global_namespace_id } };
+    Build( named, changed, *f.second );
+    if ( !FindNamespace( named, "::foo" ) || !FindNamespace( named, "::bar" ) ||
+         FindProc( named, named.global_namespace_id,
+                   Parser::SplitName( "foo::x" ) ) )
+    {
+      std::cerr << "Expected ::foo to stay while d names it\n";
+      abort();
+    }
+    RemoveFile( named, d.first->file->id );
+    if ( FindNamespace( named, "::foo" ) )
+    {
+      std::cerr << "Expected ::foo to go with the last file naming it\n";
+      abort();
+    }
+  }
+
+  void TestNamespaces()
+  {
+    // Paths resolve through many siblings to the same namespace every time,
+    // and only exactly the namespaces which exist are found
+    auto index = make_index();
+    auto& global = index.namespaces.Get( index.global_namespace_id );
+    std::vector< NamespaceID > inner;
+    for ( int i = 0; i < 500; ++i )
+    {
+      auto path = "gen::ns" + std::to_string( i ) + "::inner";
+      inner.push_back( ResolveNamespace(
+                         index,
+                         Parser::QualifiedName{ .ns = Parser::Intern( path ),
+                                                .name = {} },
+                         global ).id );
+    }
+
+    auto fail = 0;
+    for ( int i = 0; i < 500; ++i )
+    {
+      auto path = "::gen::ns" + std::to_string( i ) + "::inner";
+      auto* ns = FindNamespace( index, path );
+      auto again = ResolveNamespace( index,
+                                     Parser::SplitName( path + "::p" ),
+                                     global ).id;
+      if ( !ns || ns->id != inner[ i ] || again != inner[ i ] ||
+           GetPrintName( index, *ns ) != path )
+      {
+        std::cerr << "Expected to find " << path << '\n';
+        ++fail;
+      }
+    }
+
+    auto* gen = FindNamespace( index, "::gen" );
+    if ( !gen || gen->child_namespaces.size() != 500 ||
+         index.namespaces.Size() != 1 + 1 + 500 * 2 ||
+         index.namespacesByParent.size() != 1 + 500 * 2 ||
+         FindNamespace( index, "::gen::ns500" ) ||
+         FindNamespace( index, "::gen::inner" ) ||
+         FindNamespace( index, "::gen::ns1::inner::inner" ) ||
+         FindNamespace( index, "::never::seen" ) )
+    {
+      std::cerr << "Expected only the namespaces which were made\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void TestPrintName()
+  {
+    // Names are worked out once, and then the same (interned) text is given
+    // back every time, from copies of the rows too
+    auto index = make_index();
+    auto& global = index.namespaces.Get( index.global_namespace_id );
+    auto& ns =
+      ResolveNamespace( index, Parser::SplitName( "a::b::p" ), global );
+    auto& proc = index.procs.Insert(
+      Proc{ .name = Parser::Intern( "p" ), .parent_namespace = ns.id } );
+
+    auto name = GetPrintName( index, proc );
+    const Proc copy = proc;
+    if ( name != "::a::b::p" || GetPrintName( index, ns ) != "::a::b" ||
+         GetPrintName( index, global ) != "" ||
+         GetPrintName( index, proc ).data() != name.data() ||
+         GetPrintName( index, copy ).data() != name.data() )
+    {
+      std::cerr << "Expected ::a::b::p, worked out once, not " << name << '\n';
+      abort();
+    }
+  }
+
+  void TestResolveCall()
+  {
+    // Calls resolve through the parent namespaces without adding any, each
+    // distinct call is looked up once, and adding a proc makes them be
+    // looked up again
+    std::string text = "namespace eval a {\n"
+                       "  proc p {} {}\n"
+                       "  namespace eval b { proc q {} {} }\n"
+                       "}\n"
+                       "proc r {} {}\n";
+    for ( int i = 0; i < 100; ++i )
+    {
+      text += "namespace eval a::b { p; q; r; b::q; ::a::p; x::p; set y 1 }\n";
+    }
+    Parser::ParseContext context{
+      .file = Parser::make_source_file( "resolve", text ),
+      .cur_ns = "",
+    };
+    auto* script =
+      Parser::ParseScript( nullptr, context, context.file->contents );
+
+    auto index = make_index();
+    ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+    Build( index, scanContext, *script );
+
+    auto fail = 0;
+    auto expect = [ & ]( bool ok, const char* what ) {
+      if ( !ok )
+      {
+        std::cerr << what << '\n';
+        ++fail;
+      }
+    };
+
+    auto b = FindNamespace( index, "::a::b" );
+    expect( b != nullptr, "Expected ::a::b" );
+    expect( index.namespaces.Size() == 3 &&
+              !FindNamespace( index, "::a::b::x" ),
+            "Expected calls not to add namespaces" );
+
+    // All but x::p and set resolve (b::q from a's namespace)
+    expect( index.procs.references.size() == 3 + 100 * 5 &&
+              index.unresolved.size() == 100 * 2,
+            "Expected five calls in each line to resolve" );
+    // (set is a core command, which isn't looked up at all)
+    expect( index.resolved.calls.size() == 6,
+            "Expected each distinct call to be resolved once" );
+
+    auto resolve = [ & ]( std::string_view cmd ) {
+      return ResolveCall( index, b->id, cmd );
+    };
+    expect( resolve( "b::q" ) ==
+                FindProc( index, b->id, Parser::SplitName( "b::q" ) ) &&
+              resolve( "b::q" )->procs.size() == 1 && !resolve( "x::p" ),
+            "Expected the cache to give what FindProc does" );
+
+    // A closer proc hides the one which was found
+    auto& p = AddProc( index,
+                       Proc{ .name = Parser::Intern( "p" ),
+                             .parent_namespace = b->id } );
+    expect( resolve( "p" )->procs == std::vector< ProcID >{ p.id },
+            "Expected a new proc to be found" );
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void TestOverloads()
+  {
+    // Generated code may define a proc many times over (e.g. in each branch
+    // of an if): calls go to the one which fits them best, and of those which
+    // fit as well, the first
+    std::string text = "proc p { x } {}\n"
+                       "proc p { x { y 1 } } {}\n"
+                       "proc p { x y args } {}\n"
+                       "namespace eval gen {\n"
+                       "  proc ::p { x } {}\n"
+                       "}\n"
+                       "proc p {} {}\n"
+                       "proc q { x y } {}\n";
+    Parser::ParseContext context{
+      .file = Parser::make_source_file( "overloads", text ),
+      .cur_ns = "",
+    };
+    auto* script =
+      Parser::ParseScript( nullptr, context, context.file->contents );
+
+    auto index = make_index();
+    ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+    Build( index, scanContext, *script );
+
+    auto fail = 0;
+    const auto global = index.global_namespace_id;
+    const auto* p = FindProc( index, global, Parser::SplitName( "p" ) );
+    const auto* q = FindProc( index, global, Parser::SplitName( "::q" ) );
+    if ( !p || p->procs.size() != 5 || !q || q->procs.size() != 1 )
+    {
+      std::cerr << "Expected all five p and one q\n";
+      abort();
+    }
+
+    // { x }, { x { y 1 } }, { x y args }, { x } again, {}
+    const auto& ids = p->procs;
+    const std::vector< ProcID > expected = {
+      ids[ 4 ],  // exactly
+      ids[ 0 ],  // exactly, and before the other { x }
+      ids[ 1 ],  // exactly, rather than with no args
+      ids[ 2 ],  // with args
+      ids[ 2 ],
+      ids[ 2 ],
+    };
+    for ( size_t n = 0; n < expected.size(); ++n )
+    {
+      auto best_fit = BestFit( ids, n, [ & ]( ProcID id ) {
+        return &index.procs.Get( id );
+      } );
+      if ( p->BestFit( n ) != expected[ n ] ||
+           ids[ best_fit ] != expected[ n ] )
+      {
+        std::cerr << "Expected a call of p with " << n
+                  << " args to fit the same proc every time\n";
+        ++fail;
+      }
+    }
+
+    // A call which fits nothing still goes to the first
+    if ( q->BestFit( 0 ) != q->procs[ 0 ] || q->BestFit( 5 ) != q->procs[ 0 ] )
+    {
+      std::cerr << "Expected calls of q to fit it, however many args\n";
+      ++fail;
+    }
+
+    RemoveFile( index, context.file->id );
+    if ( !index.overloads.empty() )
+    {
+      std::cerr << "Expected no procs to be left\n";
+      ++fail;
+    }
+
+    // Removing one leaves the best of the rest, and one added again (with its
+    // old id) is fitted in before the others
+    auto add = [ & ]( unsigned required, unsigned optional ) {
+      return AddProc( index,
+                      Proc{ .name = Parser::Intern( "r" ),
+                            .required_args = required,
+                            .optional_args = optional,
+                            .parent_namespace = global } )
+        .id;
+    };
+    auto remove = [ & ]( ProcID id ) {
+      RemoveOverload( index, index.procs.Get( id ) );
+      index.procs.Remove( id );
+    };
+    const auto key = ProcKey{ .ns = global, .name = Parser::Intern( "r" ) };
+    auto r0 = add( 0, 0 );
+    auto r1 = add( 1, 0 );
+    auto r01 = add( 0, 1 );
+    remove( r1 );
+    if ( index.overloads.at( key ).BestFit( 0 ) != r0 ||
+         index.overloads.at( key ).BestFit( 1 ) != r01 )
+    {
+      std::cerr << "Expected the rest of r's overloads to fit\n";
+      ++fail;
+    }
+    if ( add( 1, 0 ) != r1 || index.overloads.at( key ).BestFit( 1 ) != r1 )
+    {
+      std::cerr << "Expected r's overloads to be fitted again\n";
+      ++fail;
+    }
+
+    Compact( index );
+    const auto& r = index.overloads.at( key );
+    if ( r.procs.size() != 3 || r.BestFit( 0 ) != r.procs[ 0 ] ||
+         r.BestFit( 1 ) != r.procs[ 1 ] || r.BestFit( 9 ) != r.procs[ 0 ] )
+    {
+      std::cerr << "Expected r's overloads to survive compaction\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void TestVariables()
+  {
+    // Each proc has a scope of its own, which global, variable and upvar #0
+    // link to those of namespaces
+    std::vector< std::unique_ptr< Parser::ParseContext > > contexts;
+    auto parse = [ & ]( const std::string& name, const std::string& text ) {
+      contexts.push_back( std::make_unique< Parser::ParseContext >(
+        Parser::ParseContext{
+          .file = Parser::make_source_file( name, text ),
+          .cur_ns = "",
+        } ) );
+      auto& context = *contexts.back();
+      return std::make_pair(
+        &context,
+        Parser::ParseScript( nullptr, context, context.file->contents ) );
+    };
+    auto a = parse( "vars_a",
+                    "set g 1\n"
+                    "namespace eval n {\n"
+                    "  variable v 0\n"
+                    "}\n"
+                    "proc p { x { y 2 } } {\n"
+                    "  global g\n"
+                    "  variable ::n::v\n"
+                    "  set z \"$x $y $v\"\n"
+                    "  foreach { i j } $z { incr z $i }\n"
+                    "  upvar #0 h h\n"
+                    "  set arr(k) $g\n"
+                    "  return $arr(k)\n"
+                    "}\n" );
+    auto b = parse( "vars_b",
+                    "proc q {} {\n"
+                    "  global g\n"
+                    "  return $g\n"
+                    "}\n" );
+
+    auto index = make_index();
+    for ( auto [ context, script ] : { a, b } )
+    {
+      ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+      Build( index, scanContext, *script );
+    }
+
+    auto find = [ & ]( std::string_view scope, std::string_view name ) {
+      auto where = FindVariableScope( index,
+                                      index.global_namespace_id,
+                                      std::nullopt,
+                                      std::string( scope ) + "::" +
+                                        std::string( name ) );
+      return where ? FindVariable( *where ) : std::nullopt;
+    };
+    auto local = [ & ]( std::string_view proc, std::string_view name ) {
+      const auto* procs = FindProc( index,
+                                    index.global_namespace_id,
+                                    Parser::SplitName( proc ) );
+      return FindVariable(
+        VariableScope{ .scope = &index.procs.Get( procs->procs[ 0 ] ).scope,
+                       .name = name } );
+    };
+    auto refs = [ & ]( std::optional< VariableID > id ) {
+      std::vector< ReferenceType > types;
+      if ( id )
+      {
+        auto range = index.variables.refsByID.equal_range( *id );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          types.push_back( index.variables.references[ it->second ].type );
+        }
+        std::sort( types.begin(), types.end() );
+      }
+      return types;
+    };
+    using enum ReferenceType;
+
+    auto fail = 0;
+    auto expect = [ & ]( std::optional< VariableID > id,
+                         std::vector< ReferenceType > types,
+                         const char* what ) {
+      std::sort( types.begin(), types.end() );
+      if ( !id || refs( id ) != types )
+      {
+        std::cerr << "Expected " << what << " to be referred to "
+                  << types.size() << " times\n";
+        ++fail;
+      }
+    };
+    expect( find( "", "g" ),
+            { DEFINITION, DECLARAION, USAGE, DECLARAION, USAGE },
+            "::g" );
+    expect( find( "::n", "v" ), { DEFINITION, DECLARAION, USAGE }, "::n::v" );
+    expect( find( "", "h" ), { DECLARAION }, "::h" );
+    expect( local( "p", "x" ), { DEFINITION, USAGE }, "p's x" );
+    expect( local( "p", "y" ), { DEFINITION, USAGE }, "p's y" );
+    expect( local( "p", "z" ), { DEFINITION, USAGE, USAGE }, "p's z" );
+    expect( local( "p", "i" ), { DEFINITION, USAGE }, "p's i" );
+    expect( local( "p", "j" ), { DEFINITION }, "p's j" );
+    expect( local( "p", "arr" ), { DEFINITION, USAGE }, "p's arr" );
+    if ( local( "p", "g" ) != find( "", "g" ) ||
+         local( "q", "g" ) != find( "", "g" ) ||
+         local( "p", "v" ) != find( "::n", "v" ) || find( "", "z" ) ||
+         find( "", "x" ) )
+    {
+      std::cerr << "Expected procs' variables to be local, but for those "
+                   "linked to a namespace's\n";
+      ++fail;
+    }
+
+    // What's left of a namespace's variable, after the file which set it
+    // goes, is what the other files refer to
+    RemoveFile( index, a.first->file->id );
+    Compact( index );
+    expect( find( "", "g" ), { DECLARAION, USAGE }, "::g without vars_a" );
+    if ( local( "q", "g" ) != find( "", "g" ) || find( "", "h" ) ||
+         FindNamespace( index, "::n" ) )
+    {
+      std::cerr << "Expected only q's ::g to be left\n";
+      ++fail;
+    }
+
+    RemoveFile( index, b.first->file->id );
+    Compact( index );
+    const auto& global = index.namespaces.Get( index.global_namespace_id );
+    if ( !index.variables.table.empty() || !global.scope.byName.empty() )
+    {
+      std::cerr << "Expected no variables to be left\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void TestMayBeProc()
+  {
+    // Core commands are ruled out unless a proc shadows them, and other names
+    // unless there's a proc of that name (almost always)
+    std::string text = "namespace eval ns {\n"
+                       "  proc puts { x } {}\n"
+                       "  proc define {} {}\n"
+                       "  puts 1\n"
+                       "}\n"
+                       "proc helper {} { puts 2; set x 1; ns::puts 3 }\n";
+    Parser::ParseContext context{
+      .file = Parser::make_source_file( "core", text ),
+      .cur_ns = "",
+    };
+    auto* script =
+      Parser::ParseScript( nullptr, context, context.file->contents );
+
+    auto index = make_index();
+    ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+    Build( index, scanContext, *script );
+
+    auto fail = 0;
+    for ( std::string_view name :
+          { "puts", "::puts", "oo::define", "helper", "::ns::helper" } )
+    {
+      if ( !MayBeProc( index, name ) )
+      {
+        std::cerr << "Expected " << name << " to maybe be a proc\n";
+        ++fail;
+      }
+    }
+    for ( std::string_view name : { "set", "string", "oo::class", "gets" } )
+    {
+      if ( MayBeProc( index, name ) )
+      {
+        std::cerr << "Expected " << name << " not to be a proc\n";
+        ++fail;
+      }
+    }
+
+    // puts resolves to ns::puts only where it would be found
+    if ( index.procs.references.size() != 3 + 2 ||
+         index.unresolved.size() != 2 )
+    {
+      std::cerr << "Expected the calls of ns::puts to resolve\n";
+      ++fail;
+    }
+
+    // A filter never misses what's in it, and is rarely wrong about the rest
+    DB::BloomFilter filter;
+    std::mt19937_64 random( 1234 );
+    std::vector< uint64_t > added( 10000 );
+    for ( auto& hash : added )
+    {
+      hash = random();
+      filter.Add( hash );
+    }
+    size_t wrong = 0;
+    for ( int i = 0; i < 100000; ++i )
+    {
+      wrong += filter.MayContain( random() );
+    }
+    if ( !std::all_of( added.begin(),
+                       added.end(),
+                       [ & ]( uint64_t hash ) {
+                         return filter.MayContain( hash );
+                       } ) ||
+         wrong > 3000 )
+    {
+      std::cerr << "Bloom filter is wrong " << wrong << " times in 100000\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void TestBulkLoad()
+  {
+    // Bulk loading gives the same keys as adding one row at a time, and
+    // calls resolve the same way (to procs from earlier files too)
+    std::vector< std::unique_ptr< Parser::ParseContext > > contexts;
+    std::vector< const Parser::Script* > scripts;
+    for ( int i = 0; i < 3; ++i )
+    {
+      auto n = std::to_string( i );
+      std::string text = "namespace eval ns" + n + " {\n"
+                         "  proc p { a { b 1 } } { p $a; q }\n"
+                         "}\n"
+                         "proc q {} { set x 1; ns" + n + "::p 1 2 }\n"
+                         "ns0::p 1\n";
+      contexts.push_back( std::make_unique< Parser::ParseContext >(
+        Parser::ParseContext{
+          .file = Parser::make_source_file( "bulk" + n, text ),
+          .cur_ns = "",
+        } ) );
+      auto& context = *contexts.back();
+      scripts.push_back(
+        Parser::ParseScript( nullptr, context, context.file->contents ) );
+    }
+
+    auto build = [ & ]( bool bulk, bool parallel ) {
+      auto index = make_index();
+      if ( bulk )
+      {
+        BeginBulkLoad( index );
+      }
+      for ( size_t i = 0; i < scripts.size(); ++i )
+      {
+        ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+        Build( index, scanContext, *scripts[ i ] );
+      }
+      if ( bulk )
+      {
+        EndBulkLoad( index, parallel );
+      }
+      return index;
+    };
+
+    auto keys = []( const auto& record ) {
+      std::vector< std::pair< size_t, size_t > > result;
+      for ( const auto& row : record.table )
+      {
+        auto range = record.byName.equal_range( row.name );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          result.emplace_back( row.id, it->second );
+        }
+        auto refs = record.refsByID.equal_range( row.id );
+        for ( auto it = refs.first; it != refs.second; ++it )
+        {
+          const auto& r = record.references[ it->second ];
+          result.emplace_back( r.id, r.location.offset );
+        }
+      }
+      return result;
+    };
+
+    auto expected = build( false, false );
+    for ( bool parallel : { false, true } )
+    {
+      auto bulk = build( true, parallel );
+      if ( keys( bulk.namespaces ) != keys( expected.namespaces ) ||
+           keys( bulk.procs ) != keys( expected.procs ) ||
+           keys( bulk.variables ) != keys( expected.variables ) ||
+           bulk.procs.references.size() != expected.procs.references.size() )
+      {
+        std::cerr << "Bulk loaded index differs (parallel: " << parallel
+                  << ")\n";
+        abort();
+      }
+    }
+  }
+
+  void Run()
+  {
+    TestFlatScript();
+    TestParallelParse();
+    TestChunkedStorage();
+    TestKeys();
+    TestBulkLoad();
+    TestRemove();
+    TestRemoveFile();
+    TestNamespaces();
+    TestPrintName();
+    TestResolveCall();
+    TestOverloads();
+    TestVariables();
+    TestMayBeProc();
+  }
+}  // namespace Index::Test
+
+// Timings of the index tables themselves (analyzer --bench-db)
+namespace Index::Bench
+{
+  using Clock = std::chrono::steady_clock;
+
+  template< typename F >
+  double NanosecondsPer( size_t rows, F&& f )
+  {
+    auto start = Clock::now();
+    f();
+    std::chrono::duration< double, std::nano > elapsed = Clock::now() - start;
+    return elapsed.count() / static_cast< double >( rows );
+  }
+
+  void Report( const char* table,
+               size_t rows,
+               double insert,
+               double bulk,
+               double get )
+  {
+    std::cout << table << ": " << rows << " rows, insert " << insert
+              << " ns/row (bulk loaded " << bulk << "), get " << get
+              << " ns/row\n";
+  }
+
+  void Run( size_t rows )
+  {
+    // Names come from a fixed set, so that interning doesn't dominate
+    std::vector< Parser::Symbol > names;
+    for ( int i = 0; i < 1024; ++i )
+    {
+      names.push_back( Parser::Intern( "name" + std::to_string( i ) ) );
+    }
+    auto name = [ & ]( size_t i ) { return names[ i % names.size() ]; };
+
+    // Rows are looked up in a random order, as they are when resolving
+    std::vector< ID > ids( rows );
+    std::iota( ids.begin(), ids.end(), 1 );
+    std::shuffle( ids.begin(), ids.end(), std::mt19937( 1234 ) );
+
+    auto index = make_index();
+    size_t checksum = 0;
+
+    auto bench = [ & ]( const char* table, auto& record, auto make ) {
+      auto insert = NanosecondsPer( rows, [ & ]() {
+        for ( size_t i = 0; i < rows; ++i )
+        {
+          record.Insert( make( i ) );
+        }
+      } );
+      auto get = NanosecondsPer( rows, [ & ]() {
+        // offset by the rows that were already there (e.g. ::)
+        const auto base = record.table.size() - rows;
+        for ( auto id : ids )
+        {
+          checksum += record.Get( base + id ).name.Text().size();
+        }
+      } );
+
+      std::remove_reference_t< decltype( record ) > loaded;
+      auto bulk = NanosecondsPer( rows, [ & ]() {
+        loaded.bulk_load = true;
+        for ( size_t i = 0; i < rows; ++i )
+        {
+          loaded.Insert( make( i ) );
+        }
+        loaded.BuildKeys();
+      } );
+      Report( table, rows, insert, bulk, get );
+    };
+
+    bench( "namespaces", index.namespaces, [ & ]( size_t i ) {
+      return Namespace{ .name = name( i ),
+                        .parent_namespace = index.global_namespace_id };
+    } );
+    bench( "procs", index.procs, [ & ]( size_t i ) {
+      return Proc{ .name = name( i ),
+                   .parent_namespace = index.global_namespace_id };
+    } );
+    bench( "variables", index.variables, [ & ]( size_t i ) {
+      return Variable{ .name = name( i ) };
+    } );
+
+    auto insert = NanosecondsPer( rows, [ & ]() {
+      for ( size_t i = 0; i < rows; ++i )
+      {
+        index.procs.AddReference( Proc::Reference{
+          .location = { .offset = static_cast< uint32_t >( i ) },
+          .id = ids[ i ],
+          .type = ReferenceType::USAGE,
+        } );
+      }
+    } );
+    auto get = NanosecondsPer( rows, [ & ]() {
+      for ( auto id : ids )
+      {
+        checksum += index.procs.references[ id - 1 ].location.offset;
+      }
+    } );
+
+    decltype( index.procs ) loaded;
+    auto bulk = NanosecondsPer( rows, [ & ]() {
+      loaded.bulk_load = true;
+      for ( size_t i = 0; i < rows; ++i )
+      {
+        loaded.AddReference( Proc::Reference{
+          .location = { .offset = static_cast< uint32_t >( i ) },
+          .id = ids[ i ],
+          .type = ReferenceType::USAGE,
+        } );
+      }
+      loaded.BuildReferenceKeys();
+    } );
+    Report( "references", rows, insert, bulk, get );
+
+    // Namespaces with many siblings (as generated code has), found by path
+    std::vector< std::string > paths;
+    for ( size_t i = 0; i < rows; ++i )
+    {
+      paths.push_back( "::gen::ns" + std::to_string( i % 1000 ) +
+                       "::inner" + std::to_string( i / 1000 ) );
+    }
+    std::vector< Parser::QualifiedName > qualified;
+    for ( const auto& path : paths )
+    {
+      qualified.push_back( Parser::SplitName( path + "::p" ) );
+    }
+    auto& global = index.namespaces.Get( index.global_namespace_id );
+    auto resolve = NanosecondsPer( rows, [ & ]() {
+      for ( const auto& qn : qualified )
+      {
+        checksum += ResolveNamespace( index, qn, global ).id;
+      }
+    } );
+    auto find = NanosecondsPer( rows, [ & ]() {
+      for ( auto id : ids )
+      {
+        checksum += FindNamespace( index, paths[ id - 1 ] )->id;
+      }
+    } );
+    std::cout << "namespace paths: " << rows << ", resolve " << resolve
+              << " ns/path, find " << find << " ns/path\n";
+
+    // Their names: worked out the first time, and then kept
+    const auto namespaces = index.namespaces.table.size();
+    auto name_first = NanosecondsPer( namespaces, [ & ]() {
+      for ( auto& ns : index.namespaces.table )
+      {
+        checksum += GetPrintName( index, ns ).size();
+      }
+    } );
+    auto name_again = NanosecondsPer( namespaces, [ & ]() {
+      for ( auto& ns : index.namespaces.table )
+      {
+        checksum += GetPrintName( index, ns ).size();
+      }
+    } );
+    std::cout << "namespace names: " << namespaces << ", first " << name_first
+              << " ns/row, then " << name_again << " ns/row\n";
+
+    // Keep the lookups from being optimised away
+    if ( checksum == 0 )
+    {
+      std::cout << "(no rows)\n";
+    }
+  }
+
+  // Filling one of the DB key types with `keys` (the value being the
+  // position), then looking up each of `lookups` and walking the values
+  template< typename TIndex, typename TKey >
+  void TimeKeys( const char* type,
+                 const std::vector< TKey >& keys,
+                 const std::vector< TKey >& lookups )
+  {
+    TIndex index;
+    size_t checksum = 0;
+    auto build = NanosecondsPer( keys.size(), [ & ]() {
+      for ( size_t i = 0; i < keys.size(); ++i )
+      {
+        index.emplace( keys[ i ], i );
+      }
+      // A FlatSortIndex sorts when it is first read
+      checksum += index.count( keys[ 0 ] );
+    } );
+    auto lookup = NanosecondsPer( lookups.size(), [ & ]() {
+      for ( const auto& key : lookups )
+      {
+        auto range = index.equal_range( key );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          checksum += it->second;
+        }
+      }
+    } );
+    std::cout << "    " << type << ": build " << build << " ns/row, lookup "
+              << lookup << " ns" << ( checksum ? "\n" : " (empty)\n" );
+  }
+
+  // The key types, at the sizes of real workspaces: a tree of 563 files has
+  // about 4,000 procs, with 1,700 distinct names, and 6,000 references
+  void RunKeys()
+  {
+    std::mt19937 random( 1234 );
+    for ( size_t procs : { 4000, 40000, 400000 } )
+    {
+      std::vector< Parser::Symbol > names;
+      for ( size_t i = 0; i < procs * 42 / 100; ++i )
+      {
+        names.push_back( Parser::Intern( "proc" + std::to_string( i ) ) );
+      }
+
+      std::vector< Parser::Symbol > byName( procs );
+      for ( auto& name : byName )
+      {
+        name = names[ random() % names.size() ];
+      }
+      std::vector< ID > refsByID( procs * 3 / 2 );
+      for ( auto& id : refsByID )
+      {
+        id = 1 + random() % procs;
+      }
+
+      auto lookups = [ & ]( const auto& keys ) {
+        std::remove_cvref_t< decltype( keys ) > result( 100000 );
+        for ( auto& key : result )
+        {
+          key = keys[ random() % keys.size() ];
+        }
+        return result;
+      };
+      auto nameLookups = lookups( byName );
+      auto idLookups = lookups( refsByID );
+
+      std::cout << procs << " procs\n  byName (" << names.size()
+                << " names):\n";
+      TimeKeys< DB::SortIndex< Parser::Symbol, size_t > >( "multimap",
+                                                           byName,
+                                                           nameLookups );
+      TimeKeys< DB::FlatSortIndex< Parser::Symbol, size_t > >( "flat",
+                                                               byName,
+                                                               nameLookups );
+      TimeKeys< DB::HashIndex< Parser::Symbol, size_t > >( "hash",
+                                                           byName,
+                                                           nameLookups );
+
+      std::cout << "  refsByID (" << refsByID.size() << " references):\n";
+      TimeKeys< DB::SortIndex< ID, size_t > >( "multimap",
+                                               refsByID,
+                                               idLookups );
+      TimeKeys< DB::FlatSortIndex< ID, size_t > >( "flat",
+                                                   refsByID,
+                                                   idLookups );
+      TimeKeys< DB::HashIndex< ID, size_t > >( "hash", refsByID, idLookups );
+    }
+  }
+}  // namespace Index::Bench
@@ -0,0 +1,1678 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.cpp"
+#include "index.cpp"
+#include "source_location.cpp"
+
+// A file format for an Index::Index which is used by mapping it and querying
+// it where it lies, so that the index saved by one run can be used by the
+// next without reading or parsing any source, as long as none of the files it
+// was built from have changed. It has all of the index, so it can also be
+// loaded back into one (see Load), so that only the files which have changed
+// need to be indexed again, or into an index of each file (see LoadFiles).
+//
+// The file is a Header followed by sections, each an array of one of the
+// fixed size records below. Nothing in it is a pointer: records refer to each
+// other by id (row n of a table has id n + 1, as in DB::Record) or by a Range
+// of another section, and to text by a String in the STRINGS section. It is
+// in native byte order (the header records which), and every section is 8
+// byte aligned.
+namespace IndexFile
+{
+  constexpr char MAGIC[ 8 ] = { 'T', 'C', 'L', 'I', 'N', 'D', 'E', 'X' };
+  constexpr uint32_t VERSION = 2;
+  constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+  constexpr uint32_t NONE = std::numeric_limits< uint32_t >::max();
+
+  struct String
+  {
+    uint32_t offset;  // into STRINGS
+    uint32_t length;
+  };
+
+  struct Range
+  {
+    uint32_t first;
+    uint32_t count;
+  };
+
+  struct File
+  {
+    String name;
+    uint64_t size;
+    int64_t mtime;  // std::filesystem::file_time_type ticks, when read
+    uint64_t hash;  // Hash::Bytes of the contents that were indexed
+    Range newlines;  // NEWLINES, as SourceFile::newlines
+  };
+
+  // An Index::Scope, but for its procs
+  struct Scope
+  {
+    Range variables;  // SCOPE_IDS
+    Range imported;   // SCOPE_IDS
+    Range names;      // SCOPE_NAMES, i.e. byName, in name order
+  };
+
+  struct ScopeName
+  {
+    String name;
+    uint32_t variable;
+  };
+
+  struct Namespace
+  {
+    String name;
+    uint32_t parent;  // NONE for the global namespace
+    Range children;   // NAMESPACE_CHILDREN
+    Range procs;      // NAMESPACE_PROCS, i.e. scope.procs
+    Range references; // NAMESPACE_REFS
+    Scope scope;
+  };
+
+  struct Proc
+  {
+    String name;
+    uint32_t parent_namespace;
+    Range arguments;  // PROC_ARGUMENTS
+    uint32_t required_args;
+    uint32_t optional_args;
+    uint32_t is_variadic;
+    Range references;  // PROC_REFS
+    Scope scope;
+  };
+
+  struct Variable
+  {
+    String name;
+    Range references;  // VARIABLE_REFS
+    uint32_t parent_namespace;  // NONE if it's local to a proc
+  };
+
+  // The line and column are stored as well as the offset, as the file's text
+  // isn't saved
+  struct Reference
+  {
+    uint32_t id;
+    uint32_t file;    // FILES, or NONE if it wasn't known
+    uint32_t offset;
+    uint32_t line;    // 0-based, as Parser::LinePos
+    uint32_t column;  // 0-based
+    uint32_t type;    // Index::ReferenceType
+  };
+
+  // What a call was written as, and where (see Index::Proc::Reference), so
+  // that a call to a proc can go back to being unresolved
+  struct CallSite
+  {
+    uint32_t ns;  // in which the call happens, or NONE if it isn't a call
+    String cmd;   // as written (Parser::QualifiedName::Path)
+    uint32_t num_args;
+  };
+
+  // An Index::Index::Call
+  struct Call
+  {
+    uint32_t file;  // FILES, or NONE if it wasn't known
+    uint32_t offset;
+    CallSite site;
+  };
+
+  enum Section : uint32_t
+  {
+    STRINGS,             // char
+    FILES,               // File
+    NAMESPACES,          // Namespace
+    NAMESPACE_CHILDREN,  // uint32_t namespace id
+    NAMESPACE_PROCS,     // uint32_t proc id
+    PROCS,               // Proc
+    PROC_ARGUMENTS,      // uint32_t variable id
+    VARIABLES,           // Variable
+    NAMESPACE_REFS,      // Reference, in id order
+    PROC_REFS,           // Reference, in id order
+    VARIABLE_REFS,       // Reference, in id order
+    NAMESPACES_BY_NAME,  // uint32_t namespace id, sorted by name then id
+    PROCS_BY_NAME,       // uint32_t proc id, sorted by name then id
+    VARIABLES_BY_NAME,   // uint32_t variable id, sorted by name then id
+    NEWLINES,            // uint32_t offset
+    SCOPE_IDS,           // uint32_t variable id
+    SCOPE_NAMES,         // ScopeName
+    PROC_CALLS,          // CallSite, one for each of PROC_REFS
+    UNRESOLVED,          // Call
+    ORPHANED,            // String, in name order (see Index::orphaned)
+    SECTION_COUNT
+  };
+
+  constexpr size_t SECTION_ELEMENT_SIZE[ SECTION_COUNT ] = {
+    sizeof( char ),      sizeof( File ),      sizeof( Namespace ),
+    sizeof( uint32_t ),  sizeof( uint32_t ),  sizeof( Proc ),
+    sizeof( uint32_t ),  sizeof( Variable ),  sizeof( Reference ),
+    sizeof( Reference ), sizeof( Reference ), sizeof( uint32_t ),
+    sizeof( uint32_t ),  sizeof( uint32_t ),  sizeof( uint32_t ),
+    sizeof( uint32_t ),  sizeof( ScopeName ), sizeof( CallSite ),
+    sizeof( Call ),      sizeof( String ),
+  };
+
+  struct Header
+  {
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t size;  // of the whole file
+    uint32_t global_namespace;
+    uint32_t section_count;
+
+    struct
+    {
+      uint64_t offset;
+      uint64_t count;  // of elements, not bytes
+    } sections[ SECTION_COUNT ];
+  };
+
+  // Saving {{{
+
+  struct Writer
+  {
+    std::string strings;
+    std::unordered_map< std::string, String > seen;
+    std::vector< std::string > sections{ SECTION_COUNT };
+    Header header{};
+
+    String Add( std::string_view text )
+    {
+      auto [ pos, inserted ] = seen.try_emplace( std::string( text ) );
+      if ( inserted )
+      {
+        pos->second = { static_cast< uint32_t >( strings.size() ),
+                        static_cast< uint32_t >( text.size() ) };
+        strings.append( text );
+      }
+      return pos->second;
+    }
+
+    template< typename T >
+    void Set( Section section, const std::vector< T >& rows )
+    {
+      static_assert( std::is_trivially_copyable_v< T > );
+      sections[ section ].assign(
+        reinterpret_cast< const char* >( rows.data() ),
+        rows.size() * sizeof( T ) );
+      header.sections[ section ].count = rows.size();
+    }
+
+    std::string Finish()
+    {
+      sections[ STRINGS ] = std::move( strings );
+      header.sections[ STRINGS ].count = sections[ STRINGS ].size();
+
+      memcpy( header.magic, MAGIC, sizeof( MAGIC ) );
+      header.version = VERSION;
+      header.byte_order = BYTE_ORDER_MARK;
+      header.section_count = SECTION_COUNT;
+
+      auto align = []( size_t n ) { return ( n + 7 ) & ~size_t( 7 ); };
+      size_t size = align( sizeof( Header ) );
+      for ( uint32_t s = 0; s < SECTION_COUNT; ++s )
+      {
+        header.sections[ s ].offset = size;
+        size = align( size + sections[ s ].size() );
+      }
+      header.size = size;
+
+      std::string out( size, '\0' );
+      memcpy( out.data(), &header, sizeof( Header ) );
+      for ( uint32_t s = 0; s < SECTION_COUNT; ++s )
+      {
+        memcpy( out.data() + header.sections[ s ].offset,
+                sections[ s ].data(),
+                sections[ s ].size() );
+      }
+      return out;
+    }
+  };
+
+  // The references of each row of `record`, in id order (and within an id, in
+  // the order they were added, as refsByID has them), each of which is also
+  // given to `each`
+  template< typename TRecord, typename Each >
+  std::vector< Range > AddReferences(
+    const TRecord& record,
+    const std::unordered_map< Parser::FileID, uint32_t >& files,
+    std::vector< Reference >& references,
+    Each&& each )
+  {
+    std::vector< Range > ranges( record.table.size(), Range{ 0, 0 } );
+    for ( auto& row : record.table )
+    {
+      auto refs = record.refsByID.equal_range( row.id );
+      if ( refs.first == refs.second )
+      {
+        continue;
+      }
+
+      auto& range = ranges[ row.id - 1 ];
+      range.first = static_cast< uint32_t >( references.size() );
+      for ( auto it = refs.first; it != refs.second; ++it )
+      {
+        ++range.count;
+
+        const auto& r = record.references[ it->second ];
+        Reference ref{ .id = static_cast< uint32_t >( r.id ),
+                       .file = NONE,
+                       .offset = r.location.offset,
+                       .line = 0,
+                       .column = 0,
+                       .type = static_cast< uint32_t >( r.type ) };
+        if ( auto file = files.find( r.location.file ); file != files.end() )
+        {
+          ref.file = file->second;
+          auto sourceFile = Parser::FindSourceFile( r.location.file );
+          auto pos =
+            Parser::OffsetToLineByte( *sourceFile, r.location.offset );
+          ref.line = static_cast< uint32_t >( pos.line );
+          ref.column = static_cast< uint32_t >( pos.column );
+        }
+        references.push_back( ref );
+        each( r );
+      }
+    }
+    return ranges;
+  }
+
+  template< typename TRecord >
+  std::vector< uint32_t > SortedByName( const TRecord& record )
+  {
+    std::vector< uint32_t > ids( record.table.size() );
+    for ( size_t i = 0; i < ids.size(); ++i )
+    {
+      ids[ i ] = static_cast< uint32_t >( i + 1 );
+    }
+    std::stable_sort( ids.begin(), ids.end(), [ & ]( auto a, auto b ) {
+      return record.Get( a ).name.Text() < record.Get( b ).name.Text();
+    } );
+    return ids;
+  }
+
+  struct Mapped;
+
+  // The File which `m` has for `name`, if any (see Loading)
+  const File* FindFile( const Mapped& m, std::string_view name );
+
+  /**
+   * The file format version of `index`, which must only be made of files
+   * which are still registered (Index::Index keeps them alive). Rows are
+   * written by position, so it mustn't have any removed (see Index::Compact).
+   *
+   * Each file's time is the one it had when it was read, so a file written
+   * since then is indexed again next time. A file whose text wasn't read (one
+   * loaded by Load) keeps the size, time and hash that `previous`, the index
+   * it was loaded from, has for it.
+   */
+  std::string Serialize( const Index::Index& index,
+                         const Mapped* previous = nullptr )
+  {
+    assert( index.namespaces.Fragmentation() == 0 &&
+            index.procs.Fragmentation() == 0 &&
+            index.variables.Fragmentation() == 0 );
+
+    Writer writer;
+    writer.header.global_namespace =
+      static_cast< uint32_t >( index.global_namespace_id );
+
+    auto range = []( const auto& section, const auto& rows ) {
+      return Range{ static_cast< uint32_t >( section.size() ),
+                    static_cast< uint32_t >( rows.size() ) };
+    };
+
+    // Files in name order, so that the output doesn't depend on their ids
+    std::vector< Parser::SourceFilePtr > sourceFiles;
+    for ( auto& [ id, file ] : index.files )
+    {
+      sourceFiles.push_back( file );
+    }
+    std::sort( sourceFiles.begin(),
+               sourceFiles.end(),
+               []( const auto& a, const auto& b ) {
+                 return a->fileName < b->fileName;
+               } );
+
+    std::vector< File > files;
+    std::vector< uint32_t > newlines;
+    std::unordered_map< Parser::FileID, uint32_t > fileIndex;
+    for ( auto& file : sourceFiles )
+    {
+      fileIndex.emplace( file->id, static_cast< uint32_t >( files.size() ) );
+      File f{ .name = writer.Add( file->fileName ),
+              .size = file->contents.size(),
+              .mtime = file->mtime,
+              .hash = Hash::Bytes( file->contents ),
+              .newlines = range( newlines, file->newlines ) };
+      if ( Parser::IsUnread( *file ) )
+      {
+        const File* saved =
+          previous ? FindFile( *previous, file->fileName ) : nullptr;
+        assert( saved && "An unread file's text must have been saved" );
+        if ( saved )
+        {
+          f.size = saved->size;
+          f.mtime = saved->mtime;
+          f.hash = saved->hash;
+        }
+      }
+      newlines.insert( newlines.end(),
+                       file->newlines.begin(),
+                       file->newlines.end() );
+      files.push_back( f );
+    }
+    writer.Set( FILES, files );
+    writer.Set( NEWLINES, newlines );
+
+    auto ignore = []( const auto& ) {};
+    std::vector< Reference > references;
+    auto nsRefs =
+      AddReferences( index.namespaces, fileIndex, references, ignore );
+    writer.Set( NAMESPACE_REFS, references );
+    references.clear();
+    std::vector< CallSite > calls;
+    auto procRefs = AddReferences(
+      index.procs,
+      fileIndex,
+      references,
+      [ & ]( const Index::Proc::Reference& r ) {
+        CallSite site{ .ns = NONE, .cmd = {}, .num_args = 0 };
+        if ( r.type == Index::ReferenceType::USAGE )
+        {
+          site = { .ns = static_cast< uint32_t >( r.ns ),
+                   .cmd = writer.Add( r.cmd.Text() ),
+                   .num_args = r.num_args };
+        }
+        calls.push_back( site );
+      } );
+    writer.Set( PROC_REFS, references );
+    writer.Set( PROC_CALLS, calls );
+    references.clear();
+    auto varRefs =
+      AddReferences( index.variables, fileIndex, references, ignore );
+    writer.Set( VARIABLE_REFS, references );
+
+    std::vector< uint32_t > scopeIds;
+    std::vector< ScopeName > scopeNames;
+    auto addScope = [ & ]( const Index::Scope& scope ) {
+      Scope result{};
+      result.variables = range( scopeIds, scope.variables );
+      scopeIds.insert( scopeIds.end(),
+                       scope.variables.begin(),
+                       scope.variables.end() );
+      result.imported = range( scopeIds, scope.imported );
+      scopeIds.insert( scopeIds.end(),
+                       scope.imported.begin(),
+                       scope.imported.end() );
+
+      std::vector< std::pair< Parser::Symbol, Index::VariableID > > names(
+        scope.byName.begin(),
+        scope.byName.end() );
+      std::sort( names.begin(), names.end(), []( auto& a, auto& b ) {
+        return a.first.Text() < b.first.Text();
+      } );
+      result.names = range( scopeNames, names );
+      for ( auto& [ name, id ] : names )
+      {
+        scopeNames.push_back(
+          ScopeName{ .name = writer.Add( name.Text() ),
+                     .variable = static_cast< uint32_t >( id ) } );
+      }
+      return result;
+    };
+
+    std::vector< Namespace > namespaces;
+    std::vector< uint32_t > children;
+    std::vector< uint32_t > nsProcs;
+    for ( auto& row : index.namespaces.table )
+    {
+      Namespace ns{ .name = writer.Add( row.name.Text() ),
+                    .parent = NONE,
+                    .children = range( children, row.child_namespaces ),
+                    .procs = range( nsProcs, row.scope.procs ),
+                    .references = nsRefs[ row.id - 1 ],
+                    .scope = addScope( row.scope ) };
+      if ( row.parent_namespace )
+      {
+        ns.parent = static_cast< uint32_t >( *row.parent_namespace );
+      }
+      children.insert( children.end(),
+                       row.child_namespaces.begin(),
+                       row.child_namespaces.end() );
+      nsProcs.insert( nsProcs.end(),
+                      row.scope.procs.begin(),
+                      row.scope.procs.end() );
+      namespaces.push_back( ns );
+    }
+    writer.Set( NAMESPACES, namespaces );
+    writer.Set( NAMESPACE_CHILDREN, children );
+    writer.Set( NAMESPACE_PROCS, nsProcs );
+
+    std::vector< Proc > procs;
+    std::vector< uint32_t > arguments;
+    for ( auto& row : index.procs.table )
+    {
+      procs.push_back(
+        Proc{ .name = writer.Add( row.name.Text() ),
+              .parent_namespace =
+                static_cast< uint32_t >( row.parent_namespace ),
+              .arguments = range( arguments, row.arguments ),
+              .required_args = row.required_args,
+              .optional_args = row.optional_args,
+              .is_variadic = row.is_variadic,
+              .references = procRefs[ row.id - 1 ],
+              .scope = addScope( row.scope ) } );
+      arguments.insert( arguments.end(),
+                        row.arguments.begin(),
+                        row.arguments.end() );
+    }
+    writer.Set( PROCS, procs );
+    writer.Set( PROC_ARGUMENTS, arguments );
+
+    std::vector< Variable > variables;
+    for ( auto& row : index.variables.table )
+    {
+      variables.push_back(
+        Variable{ .name = writer.Add( row.name.Text() ),
+                  .references = varRefs[ row.id - 1 ],
+                  .parent_namespace =
+                    row.parent_namespace
+                      ? static_cast< uint32_t >( *row.parent_namespace )
+                      : NONE } );
+    }
+    writer.Set( VARIABLES, variables );
+    writer.Set( SCOPE_IDS, scopeIds );
+    writer.Set( SCOPE_NAMES, scopeNames );
+
+    std::vector< Call > unresolved;
+    for ( auto& call : index.unresolved )
+    {
+      auto file = fileIndex.find( call.location.file );
+      unresolved.push_back(
+        Call{ .file = file != fileIndex.end() ? file->second : NONE,
+              .offset = call.location.offset,
+              .site = { .ns = static_cast< uint32_t >( call.ns ),
+                        .cmd = writer.Add( call.name.Path() ),
+                        .num_args = static_cast< uint32_t >(
+                          call.num_args ) } } );
+    }
+    writer.Set( UNRESOLVED, unresolved );
+
+    std::vector< std::string_view > orphanedNames;
+    for ( auto name : index.orphaned )
+    {
+      orphanedNames.push_back( name.Text() );
+    }
+    std::sort( orphanedNames.begin(), orphanedNames.end() );
+    std::vector< String > orphaned;
+    for ( auto name : orphanedNames )
+    {
+      orphaned.push_back( writer.Add( name ) );
+    }
+    writer.Set( ORPHANED, orphaned );
+
+    writer.Set( NAMESPACES_BY_NAME, SortedByName( index.namespaces ) );
+    writer.Set( PROCS_BY_NAME, SortedByName( index.procs ) );
+    writer.Set( VARIABLES_BY_NAME, SortedByName( index.variables ) );
+
+    return writer.Finish();
+  }
+
+  /**
+   * Write `index` to `path`. It's written alongside and then renamed into
+   * place, so anything which has the old file mapped (e.g. `previous`, see
+   * Serialize) is unaffected.
+   */
+  bool Save( const Index::Index& index,
+             const std::string& path,
+             const Mapped* previous = nullptr )
+  {
+    const auto data = Serialize( index, previous );
+    const auto temp = path + ".tmp";
+    {
+      std::ofstream f( temp, std::ios::binary | std::ios::trunc );
+      if ( !f.write( data.data(), data.size() ) )
+      {
+        return false;
+      }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename( temp, path, ec );
+    return !ec;
+  }
+
+  // }}}
+
+  // Loading {{{
+
+  struct Mapped
+  {
+    const char* data{ nullptr };
+    size_t size{ 0 };
+
+    Mapped() = default;
+    Mapped( const Mapped& ) = delete;
+    Mapped& operator=( const Mapped& ) = delete;
+
+    ~Mapped()
+    {
+      if ( data )
+      {
+        munmap( const_cast< char* >( data ), size );
+      }
+    }
+
+    const Header& GetHeader() const
+    {
+      return *reinterpret_cast< const Header* >( data );
+    }
+
+    template< typename T >
+    std::span< const T > Rows( Section section ) const
+    {
+      const auto& s = GetHeader().sections[ section ];
+      return { reinterpret_cast< const T* >( data + s.offset ), s.count };
+    }
+
+    template< typename T >
+    std::span< const T > Rows( Section section, Range range ) const
+    {
+      return Rows< T >( section ).subspan( range.first, range.count );
+    }
+
+    std::string_view Text( String s ) const
+    {
+      return { data + GetHeader().sections[ STRINGS ].offset + s.offset,
+               s.length };
+    }
+
+    std::span< const File > Files() const { return Rows< File >( FILES ); }
+
+    std::span< const uint32_t > Newlines( const File& file ) const
+    {
+      return Rows< uint32_t >( NEWLINES, file.newlines );
+    }
+
+    const Namespace& GetNamespace( uint32_t id ) const
+    {
+      return Rows< Namespace >( NAMESPACES )[ id - 1 ];
+    }
+
+    const Proc& GetProc( uint32_t id ) const
+    {
+      return Rows< Proc >( PROCS )[ id - 1 ];
+    }
+
+    const Variable& GetVariable( uint32_t id ) const
+    {
+      return Rows< Variable >( VARIABLES )[ id - 1 ];
+    }
+
+    std::span< const Reference > References( const Proc& proc ) const
+    {
+      return Rows< Reference >( PROC_REFS, proc.references );
+    }
+
+    std::span< const Reference > References( const Namespace& ns ) const
+    {
+      return Rows< Reference >( NAMESPACE_REFS, ns.references );
+    }
+
+    /**
+     * The ids of the procs (in any namespace) called `name`, by binary search
+     * of PROCS_BY_NAME.
+     */
+    std::span< const uint32_t > FindProcs( std::string_view name ) const
+    {
+      auto ids = Rows< uint32_t >( PROCS_BY_NAME );
+      auto [ first, last ] = std::equal_range(
+        ids.begin(),
+        ids.end(),
+        name,
+        [ & ]( auto a, auto b ) { return NameOf( a ) < NameOf( b ); } );
+      return { first, last };
+    }
+
+    /**
+     * The fully qualified name of a namespace or proc, as
+     * Index::GetPrintName.
+     */
+    std::string PrintName( String name, uint32_t parent ) const
+    {
+      std::vector< std::string_view > parts{ Text( name ) };
+      for ( ; parent != NONE; parent = GetNamespace( parent ).parent )
+      {
+        parts.push_back( Text( GetNamespace( parent ).name ) );
+      }
+
+      std::string result;
+      for ( auto i = parts.rbegin(); i != parts.rend(); ++i )
+      {
+        if ( i != parts.rbegin() )
+        {
+          result += "::";
+        }
+        result += *i;
+      }
+      return result;
+    }
+
+  private:
+    std::string_view NameOf( std::string_view name ) const { return name; }
+    std::string_view NameOf( uint32_t id ) const
+    {
+      return Text( GetProc( id ).name );
+    }
+  };
+
+  // Checks that everything in the file refers to something within it, so
+  // that it can be queried without any further checks
+  bool Validate( const Mapped& m )
+  {
+    if ( m.size < sizeof( Header ) )
+    {
+      return false;
+    }
+
+    const auto& h = m.GetHeader();
+    if ( memcmp( h.magic, MAGIC, sizeof( MAGIC ) ) != 0 ||
+         h.version != VERSION || h.byte_order != BYTE_ORDER_MARK ||
+         h.size != m.size || h.section_count != SECTION_COUNT )
+    {
+      return false;
+    }
+
+    for ( uint32_t s = 0; s < SECTION_COUNT; ++s )
+    {
+      const auto& section = h.sections[ s ];
+      if ( section.offset % 8 != 0 || section.offset > m.size ||
+           section.count > ( m.size - section.offset ) /
+                             SECTION_ELEMENT_SIZE[ s ] )
+      {
+        return false;
+      }
+    }
+
+    const auto count = [ & ]( Section s ) { return h.sections[ s ].count; };
+    const auto string = [ & ]( String s ) {
+      return uint64_t( s.offset ) + s.length <= count( STRINGS );
+    };
+    const auto range = [ & ]( Range r, Section s ) {
+      return uint64_t( r.first ) + r.count <= count( s );
+    };
+    const auto id = [ & ]( uint32_t id, Section s ) {
+      return id >= 1 && id <= count( s );
+    };
+    const auto ids = [ & ]( Section s, Section of ) {
+      auto rows = m.Rows< uint32_t >( s );
+      return std::all_of( rows.begin(), rows.end(), [ & ]( auto i ) {
+        return id( i, of );
+      } );
+    };
+    const auto location = [ & ]( uint32_t file, uint32_t offset ) {
+      return file == NONE ||
+             ( file < count( FILES ) && offset <= m.Files()[ file ].size );
+    };
+    const auto refs = [ & ]( Section s, Section of ) {
+      auto rows = m.Rows< Reference >( s );
+      return std::all_of( rows.begin(), rows.end(), [ & ]( auto& r ) {
+        return id( r.id, of ) && location( r.file, r.offset );
+      } );
+    };
+    const auto scope = [ & ]( const Scope& s ) {
+      return range( s.variables, SCOPE_IDS ) &&
+             range( s.imported, SCOPE_IDS ) && range( s.names, SCOPE_NAMES );
+    };
+
+    if ( !id( h.global_namespace, NAMESPACES ) ||
+         !ids( NAMESPACE_CHILDREN, NAMESPACES ) ||
+         !ids( NAMESPACE_PROCS, PROCS ) || !ids( PROC_ARGUMENTS, VARIABLES ) ||
+         !ids( NAMESPACES_BY_NAME, NAMESPACES ) ||
+         !ids( PROCS_BY_NAME, PROCS ) ||
+         !ids( VARIABLES_BY_NAME, VARIABLES ) ||
+         !refs( NAMESPACE_REFS, NAMESPACES ) || !refs( PROC_REFS, PROCS ) ||
+         !refs( VARIABLE_REFS, VARIABLES ) || !ids( SCOPE_IDS, VARIABLES ) ||
+         count( PROC_CALLS ) != count( PROC_REFS ) )
+    {
+      return false;
+    }
+
+    // Each file's lines end in order, the last at its end
+    for ( auto& file : m.Files() )
+    {
+      if ( !string( file.name ) || !range( file.newlines, NEWLINES ) ||
+           file.newlines.count == 0 )
+      {
+        return false;
+      }
+      auto newlines = m.Newlines( file );
+      if ( !std::is_sorted( newlines.begin(), newlines.end() ) ||
+           newlines.back() != file.size )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& name : m.Rows< ScopeName >( SCOPE_NAMES ) )
+    {
+      if ( !string( name.name ) || !id( name.variable, VARIABLES ) )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& site : m.Rows< CallSite >( PROC_CALLS ) )
+    {
+      if ( site.ns != NONE &&
+           ( !id( site.ns, NAMESPACES ) || !string( site.cmd ) ) )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& call : m.Rows< Call >( UNRESOLVED ) )
+    {
+      if ( !location( call.file, call.offset ) ||
+           !id( call.site.ns, NAMESPACES ) || !string( call.site.cmd ) )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& name : m.Rows< String >( ORPHANED ) )
+    {
+      if ( !string( name ) )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& ns : m.Rows< Namespace >( NAMESPACES ) )
+    {
+      if ( !string( ns.name ) ||
+           ( ns.parent != NONE && !id( ns.parent, NAMESPACES ) ) ||
+           !range( ns.children, NAMESPACE_CHILDREN ) ||
+           !range( ns.procs, NAMESPACE_PROCS ) ||
+           !range( ns.references, NAMESPACE_REFS ) || !scope( ns.scope ) )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& proc : m.Rows< Proc >( PROCS ) )
+    {
+      if ( !string( proc.name ) || !id( proc.parent_namespace, NAMESPACES ) ||
+           !range( proc.arguments, PROC_ARGUMENTS ) ||
+           !range( proc.references, PROC_REFS ) || !scope( proc.scope ) )
+      {
+        return false;
+      }
+    }
+
+    for ( auto& variable : m.Rows< Variable >( VARIABLES ) )
+    {
+      if ( !string( variable.name ) ||
+           !range( variable.references, VARIABLE_REFS ) ||
+           ( variable.parent_namespace != NONE &&
+             !id( variable.parent_namespace, NAMESPACES ) ) )
+      {
+        return false;
+      }
+    }
+
+    // A cycle of parents would make PrintName loop forever
+    const auto& namespaces = m.Rows< Namespace >( NAMESPACES );
+    for ( auto& ns : namespaces )
+    {
+      auto parent = ns.parent;
+      for ( size_t depth = 0; parent != NONE; ++depth )
+      {
+        if ( depth > namespaces.size() )
+        {
+          return false;
+        }
+        parent = m.GetNamespace( parent ).parent;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Map the index saved at `path` (read only), or return nullptr if there
+   * isn't one, or it isn't one this version can use.
+   */
+  std::unique_ptr< Mapped > Map( const std::string& path )
+  {
+    int fd = open( path.c_str(), O_RDONLY );
+    if ( fd < 0 )
+    {
+      return nullptr;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || st.st_size <= 0 )
+    {
+      close( fd );
+      return nullptr;
+    }
+
+    void* data =
+      mmap( nullptr, static_cast< size_t >( st.st_size ), PROT_READ,
+            MAP_PRIVATE, fd, 0 );
+    close( fd );  // the mapping stays
+    if ( data == MAP_FAILED )
+    {
+      return nullptr;
+    }
+
+    auto m = std::make_unique< Mapped >();
+    m->data = static_cast< const char* >( data );
+    m->size = static_cast< size_t >( st.st_size );
+    if ( !Validate( *m ) )
+    {
+      return nullptr;
+    }
+    return m;
+  }
+
+  /**
+   * Whether `file` still has the contents that were indexed. The size and
+   * modification time are checked first; the file is only read and hashed if
+   * its time has changed but its size hasn't (e.g. it was checked out again).
+   */
+  bool IsFresh( const Mapped& m, const File& file )
+  {
+    const std::string name( m.Text( file.name ) );
+    std::error_code ec;
+    auto size = std::filesystem::file_size( name, ec );
+    if ( ec || size != file.size )
+    {
+      return false;
+    }
+
+    if ( Parser::ModificationTime( name ) == file.mtime )
+    {
+      return true;
+    }
+
+    auto contents = Parser::read_source_file( name );
+    return contents && Hash::Bytes( contents->contents ) == file.hash;
+  }
+
+  /**
+   * Whether `m` is an index of exactly `paths`, all of which are unchanged
+   * since it was saved.
+   */
+  bool IsIndexOf( const Mapped& m, std::vector< std::string > paths )
+  {
+    std::sort( paths.begin(), paths.end() );
+    paths.erase( std::unique( paths.begin(), paths.end() ), paths.end() );
+
+    auto files = m.Files();
+    if ( files.size() != paths.size() )
+    {
+      return false;
+    }
+
+    // Files are saved in name order
+    for ( size_t i = 0; i < files.size(); ++i )
+    {
+      if ( m.Text( files[ i ].name ) != paths[ i ] )
+      {
+        return false;
+      }
+    }
+
+    return std::all_of( files.begin(), files.end(), [ & ]( auto& file ) {
+      return IsFresh( m, file );
+    } );
+  }
+
+  const File* FindFile( const Mapped& m, std::string_view name )
+  {
+    // Files are saved in name order
+    auto files = m.Files();
+    auto pos = std::lower_bound(
+      files.begin(),
+      files.end(),
+      name,
+      [ & ]( const File& file, std::string_view n ) {
+        return m.Text( file.name ) < n;
+      } );
+    if ( pos == files.end() || m.Text( pos->name ) != name )
+    {
+      return nullptr;
+    }
+    return &*pos;
+  }
+
+  /**
+   * The index that `m` was saved from, to go on building: e.g. to index the
+   * files which have changed again (see RemoveStale). Its files' text isn't
+   * read, only where their lines end (see Parser::make_unread_source_file),
+   * so it's saved again with `m` as the previous index (see Serialize).
+   */
+  Index::Index Load( const Mapped& m )
+  {
+    Index::Index index{};
+    Index::BeginBulkLoad( index );
+
+    auto symbol = [ & ]( String s ) { return Parser::Intern( m.Text( s ) ); };
+    auto ids = [ & ]( Section section, Range range ) {
+      auto rows = m.Rows< uint32_t >( section, range );
+      return std::vector< Index::ID >( rows.begin(), rows.end() );
+    };
+    auto scope = [ & ]( const Scope& s ) {
+      Index::Scope result{ .variables = ids( SCOPE_IDS, s.variables ),
+                           .procs = {},
+                           .imported = ids( SCOPE_IDS, s.imported ),
+                           .byName = {} };
+      for ( auto& name : m.Rows< ScopeName >( SCOPE_NAMES, s.names ) )
+      {
+        result.byName.emplace( symbol( name.name ), name.variable );
+      }
+      return result;
+    };
+
+    std::vector< Parser::FileID > files;
+    for ( auto& file : m.Files() )
+    {
+      auto newlines = m.Newlines( file );
+      auto sourceFile = Parser::make_unread_source_file(
+        std::string( m.Text( file.name ) ),
+        std::vector< size_t >( newlines.begin(), newlines.end() ) );
+      files.push_back( sourceFile->id );
+      index.files.emplace( sourceFile->id, std::move( sourceFile ) );
+    }
+    auto location = [ & ]( uint32_t file, uint32_t offset ) {
+      return Parser::SourceLocation{ .file = file == NONE ? 0 : files[ file ],
+                                     .offset = offset };
+    };
+
+    // Rows are inserted in order, so each has the id it was saved with
+    for ( auto& row : m.Rows< Namespace >( NAMESPACES ) )
+    {
+      auto& ns = index.namespaces.Insert( Index::Namespace{
+        .name = symbol( row.name ),
+        .scope = scope( row.scope ),
+        .child_namespaces = ids( NAMESPACE_CHILDREN, row.children ),
+      } );
+      ns.scope.procs = ids( NAMESPACE_PROCS, row.procs );
+      if ( row.parent != NONE )
+      {
+        ns.parent_namespace = row.parent;
+        index.namespacesByParent.emplace(
+          Index::ChildNamespace{ .parent = row.parent, .name = ns.name },
+          ns.id );
+      }
+    }
+    index.global_namespace_id = m.GetHeader().global_namespace;
+
+    for ( auto& row : m.Rows< Variable >( VARIABLES ) )
+    {
+      auto& variable =
+        index.variables.Insert( Index::Variable{ .name = symbol( row.name ) } );
+      if ( row.parent_namespace != NONE )
+      {
+        variable.parent_namespace = row.parent_namespace;
+      }
+    }
+
+    for ( auto& row : m.Rows< Proc >( PROCS ) )
+    {
+      auto& proc = index.procs.Insert( Index::Proc{
+        .name = symbol( row.name ),
+        .arguments = ids( PROC_ARGUMENTS, row.arguments ),
+        .is_variadic = row.is_variadic != 0,
+        .required_args = row.required_args,
+        .optional_args = row.optional_args,
+        .scope = scope( row.scope ),
+        .parent_namespace = row.parent_namespace,
+      } );
+      Index::AddProcName( index, proc.name );
+    }
+    for ( const auto& proc : index.procs.table )
+    {
+      Index::AddOverload( index, proc );
+    }
+
+    for ( auto& r : m.Rows< Reference >( NAMESPACE_REFS ) )
+    {
+      index.namespaces.AddReference( Index::Namespace::Reference{
+        .location = location( r.file, r.offset ),
+        .id = r.id,
+        .type = static_cast< Index::ReferenceType >( r.type ),
+      } );
+    }
+    const auto procRefs = m.Rows< Reference >( PROC_REFS );
+    const auto procCalls = m.Rows< CallSite >( PROC_CALLS );
+    for ( size_t i = 0; i < procRefs.size(); ++i )
+    {
+      const auto& r = procRefs[ i ];
+      const auto& site = procCalls[ i ];
+      Index::Proc::Reference ref{
+        .location = location( r.file, r.offset ),
+        .id = r.id,
+        .type = static_cast< Index::ReferenceType >( r.type ),
+      };
+      if ( site.ns != NONE )
+      {
+        ref.ns = site.ns;
+        ref.cmd = symbol( site.cmd );
+        ref.num_args = site.num_args;
+      }
+      index.procs.AddReference( std::move( ref ) );
+    }
+    for ( auto& r : m.Rows< Reference >( VARIABLE_REFS ) )
+    {
+      index.variables.AddReference( Index::Variable::Reference{
+        .location = location( r.file, r.offset ),
+        .id = r.id,
+        .type = static_cast< Index::ReferenceType >( r.type ),
+      } );
+    }
+
+    // (The calls were resolved as far as they can be when it was saved, so
+    // they're added once the load is over, rather than resolved again)
+    Index::EndBulkLoad( index );
+    for ( auto& call : m.Rows< Call >( UNRESOLVED ) )
+    {
+      index.unresolved.push_back( Index::Index::Call{
+        .location = location( call.file, call.offset ),
+        .ns = call.site.ns,
+        .name = Parser::SplitName( m.Text( call.site.cmd ) ),
+        .num_args = call.site.num_args,
+      } );
+    }
+    for ( auto name : m.Rows< String >( ORPHANED ) )
+    {
+      index.orphaned.insert( symbol( name ) );
+    }
+    return index;
+  }
+
+  /**
+   * Remove from `index`, loaded from `m`, each file which has changed since
+   * it was saved or isn't one of `paths` (see Index::RemoveFiles), and
+   * return those of `paths` which it then doesn't have: the ones which
+   * changed, and any which are new, for indexing again.
+   */
+  std::vector< std::string > RemoveStale( Index::Index& index,
+                                          const Mapped& m,
+                                          std::vector< std::string > paths )
+  {
+    std::sort( paths.begin(), paths.end() );
+    paths.erase( std::unique( paths.begin(), paths.end() ), paths.end() );
+
+    std::unordered_map< std::string, Parser::FileID > loaded;
+    for ( auto& [ id, file ] : index.files )
+    {
+      loaded.emplace( file->fileName, id );
+    }
+
+    std::unordered_set< Parser::FileID > stale;
+    std::unordered_set< std::string > fresh;
+    for ( auto& file : m.Files() )
+    {
+      std::string name( m.Text( file.name ) );
+      auto pos = loaded.find( name );
+      if ( pos == loaded.end() )
+      {
+        continue;
+      }
+      if ( std::binary_search( paths.begin(), paths.end(), name ) &&
+           IsFresh( m, file ) )
+      {
+        fresh.insert( std::move( name ) );
+      }
+      else
+      {
+        stale.insert( pos->second );
+      }
+    }
+    Index::RemoveFiles( index, stale );
+
+    std::erase_if( paths, [ & ]( const std::string& path ) {
+      return fresh.contains( path );
+    } );
+    return paths;
+  }
+
+  /**
+   * The index of each of the files in `m` on its own, as a shard of a
+   * Workspace, with its file named `names[ i ]` (e.g. its uri). Each has the
+   * procs which the file defines, and the calls in it: those of its own
+   * procs resolved, and the rest unresolved, for the workspace to resolve
+   * when it's queried, as a shard built from the file's text would have
+   * them. (Like those shards' indexes, nothing else uses its variables, so
+   * they're left out.)
+   */
+  std::vector< Index::Index > LoadFiles(
+    const Mapped& m,
+    const std::vector< std::string >& names )
+  {
+    const auto files = m.Files();
+    assert( names.size() == files.size() );
+
+    std::vector< Index::Index > indexes;
+    std::vector< Parser::FileID > ids;
+    indexes.reserve( files.size() );
+    for ( size_t i = 0; i < files.size(); ++i )
+    {
+      auto& index = indexes.emplace_back( Index::make_index() );
+      auto newlines = m.Newlines( files[ i ] );
+      auto file = Parser::make_unread_source_file(
+        names[ i ],
+        std::vector< size_t >( newlines.begin(), newlines.end() ) );
+      ids.push_back( file->id );
+      index.files.emplace( file->id, std::move( file ) );
+    }
+
+    // Each file's index's namespaces, by their saved ids, which are added
+    // (with their parents) as they're needed
+    std::vector< std::unordered_map< uint32_t, Index::NamespaceID > >
+      namespaces( files.size() );
+    std::function< Index::NamespaceID( uint32_t, uint32_t ) > namespaceOf =
+      [ & ]( uint32_t file, uint32_t id ) {
+        auto& index = indexes[ file ];
+        const auto& saved = m.GetNamespace( id );
+        if ( saved.parent == NONE )
+        {
+          return index.global_namespace_id;
+        }
+        if ( auto it = namespaces[ file ].find( id );
+             it != namespaces[ file ].end() )
+        {
+          return it->second;
+        }
+
+        auto parent = namespaceOf( file, saved.parent );
+        Parser::QualifiedName qn{ .ns = Parser::Intern( m.Text( saved.name ) ),
+                                  .name = Parser::Symbol{} };
+        auto ns =
+          Index::ResolveNamespace( index, qn, index.namespaces.Get( parent ) )
+            .id;
+        namespaces[ file ].emplace( id, ns );
+        return ns;
+      };
+
+    auto addUnresolved = [ & ]( uint32_t file,
+                                uint32_t offset,
+                                const CallSite& site ) {
+      auto ns = namespaceOf( file, site.ns );
+      indexes[ file ].unresolved.push_back( Index::Index::Call{
+        .location = { .file = ids[ file ], .offset = offset },
+        .ns = ns,
+        .name = Parser::SplitName( m.Text( site.cmd ) ),
+        .num_args = site.num_args,
+      } );
+    };
+
+    // The procs each file defines, by their saved ids
+    std::vector< std::unordered_map< uint32_t, Index::ProcID > > procs(
+      files.size() );
+    const auto refs = m.Rows< Reference >( PROC_REFS );
+    const auto calls = m.Rows< CallSite >( PROC_CALLS );
+    for ( auto& r : refs )
+    {
+      if ( r.file == NONE ||
+           r.type != uint32_t( Index::ReferenceType::DEFINITION ) ||
+           procs[ r.file ].contains( r.id ) )
+      {
+        continue;
+      }
+
+      const auto& saved = m.GetProc( r.id );
+      auto ns = namespaceOf( r.file, saved.parent_namespace );
+      auto& proc = Index::AddProc( indexes[ r.file ],
+                                   Index::Proc{
+                                     .name = Parser::Intern(
+                                       m.Text( saved.name ) ),
+                                     .is_variadic = saved.is_variadic != 0,
+                                     .required_args = saved.required_args,
+                                     .optional_args = saved.optional_args,
+                                     .parent_namespace = ns,
+                                   } );
+      procs[ r.file ].emplace( r.id, proc.id );
+    }
+
+    for ( size_t i = 0; i < refs.size(); ++i )
+    {
+      const auto& r = refs[ i ];
+      const auto& site = calls[ i ];
+      if ( r.file == NONE )
+      {
+        continue;
+      }
+
+      auto own = procs[ r.file ].find( r.id );
+      if ( own == procs[ r.file ].end() )
+      {
+        // A call of a proc in another file
+        if ( site.ns != NONE )
+        {
+          addUnresolved( r.file, r.offset, site );
+        }
+        continue;
+      }
+
+      Index::Proc::Reference ref{
+        .location = { .file = ids[ r.file ], .offset = r.offset },
+        .id = own->second,
+        .type = static_cast< Index::ReferenceType >( r.type ),
+      };
+      if ( site.ns != NONE )
+      {
+        ref.ns = namespaceOf( r.file, site.ns );
+        ref.cmd = Parser::Intern( m.Text( site.cmd ) );
+        ref.num_args = site.num_args;
+      }
+      indexes[ r.file ].procs.AddReference( std::move( ref ) );
+    }
+
+    for ( auto& call : m.Rows< Call >( UNRESOLVED ) )
+    {
+      if ( call.file != NONE )
+      {
+        addUnresolved( call.file, call.offset, call.site );
+      }
+    }
+
+    return indexes;
+  }
+
+  // }}}
+}
+
+namespace IndexFile::Test
+{
+  void TestSaveAndMap()
+  {
+    const std::string dir = std::filesystem::temp_directory_path() /
+                            ( "index_file_test." + std::to_string( getpid() ) );
+    std::filesystem::create_directories( dir );
+    const std::string source = dir + "/test.tcl";
+    const std::string saved = dir + "/index";
+    {
+      std::ofstream f( source );
+      f << "namespace eval a {\n"
+           "  proc p { x { y 1 } args } { b::q }\n"
+           "  namespace eval b { proc q {} {} }\n"
+           "}\n"
+           "proc p {} {}\n"
+           "a::p 1; p\n";
+    }
+
+    Parser::ParseContext context{
+      .file = Parser::read_source_file( source ),
+      .cur_ns = "",
+    };
+    auto* script =
+      Parser::ParseScript( nullptr, context, context.file->contents );
+    auto index = Index::make_index();
+    Index::ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+    Index::Build( index, scanContext, *script );
+
+    auto fail = 0;
+    auto expect = [ & ]( bool ok, std::string_view what ) {
+      if ( !ok )
+      {
+        std::cerr << "IndexFile: " << what << '\n';
+        ++fail;
+      }
+    };
+
+    expect( Save( index, saved ), "Unable to save" );
+    auto m = Map( saved );
+    expect( m != nullptr, "Unable to map" );
+    if ( !m )
+    {
+      abort();
+    }
+
+    expect( IsIndexOf( *m, { source } ), "Saved index isn't fresh" );
+    expect( !IsIndexOf( *m, { source, source + "x" } ),
+            "Saved index covers a file it doesn't have" );
+
+    // Every proc is there with its name, arity and references
+    for ( auto& row : index.procs.table )
+    {
+      auto ids = m->FindProcs( row.name.Text() );
+      auto found = std::find( ids.begin(), ids.end(), row.id );
+      expect( found != ids.end(), "Proc not found by name" );
+
+      auto& proc = m->GetProc( static_cast< uint32_t >( row.id ) );
+      expect( m->PrintName( proc.name, proc.parent_namespace ) ==
+                Index::GetPrintName( index, row ),
+              "Proc name doesn't match" );
+      expect( proc.required_args == row.required_args &&
+                proc.optional_args == row.optional_args &&
+                bool( proc.is_variadic ) == row.is_variadic,
+              "Proc arity doesn't match" );
+
+      auto refs = m->References( proc );
+      auto range = index.procs.refsByID.equal_range( row.id );
+      expect( refs.size() == size_t( std::distance( range.first,
+                                                    range.second ) ),
+              "Wrong number of references" );
+      size_t i = 0;
+      for ( auto it = range.first; it != range.second && i < refs.size();
+            ++it, ++i )
+      {
+        auto& r = index.procs.references[ it->second ];
+        auto pos =
+          Parser::OffsetToLineByte( *context.file, r.location.offset );
+        expect( refs[ i ].offset == r.location.offset &&
+                  refs[ i ].line == pos.line &&
+                  refs[ i ].column == pos.column &&
+                  refs[ i ].type == uint32_t( r.type ) &&
+                  m->Text( m->Files()[ refs[ i ].file ].name ) == source,
+                "Reference doesn't match" );
+      }
+    }
+    expect( m->FindProcs( "p" ).size() == 2, "Expected two procs called p" );
+    expect( m->FindProcs( "nope" ).empty(), "Found a proc that isn't there" );
+
+    // The same size but a different time: the contents decide
+    std::filesystem::last_write_time(
+      source,
+      std::filesystem::last_write_time( source ) - std::chrono::hours( 1 ) );
+    expect( IsIndexOf( *m, { source } ),
+            "Touched but unchanged file isn't fresh" );
+    {
+      std::fstream f( source, std::ios::in | std::ios::out );
+      f.seekp( 0 );
+      f << 'N';
+    }
+    expect( !IsIndexOf( *m, { source } ), "Changed file is fresh" );
+
+    // A file written after it was read, but before the index is saved, is
+    // saved as it was when read, so isn't fresh either
+    {
+      const auto again = saved + ".again";
+      expect( Save( index, again ), "Unable to save again" );
+      auto m2 = Map( again );
+      expect( m2 && !IsIndexOf( *m2, { source } ),
+              "File written since it was read is fresh" );
+      std::filesystem::remove( again );
+    }
+
+    // Anything truncated or corrupted isn't used
+    {
+      std::string data;
+      {
+        std::ifstream f( saved, std::ios::binary );
+        data.assign( std::istreambuf_iterator< char >( f ), {} );
+      }
+      auto write = [ & ]( std::string_view contents ) {
+        std::ofstream f( saved, std::ios::binary | std::ios::trunc );
+        f.write( contents.data(), contents.size() );
+      };
+
+      write( std::string_view( data ).substr( 0, data.size() / 2 ) );
+      expect( Map( saved ) == nullptr, "Mapped a truncated index" );
+
+      auto corrupt = data;
+      reinterpret_cast< Header* >( corrupt.data() )->version = VERSION + 1;
+      write( corrupt );
+      expect( Map( saved ) == nullptr, "Mapped another version" );
+
+      corrupt = data;
+      auto& h = *reinterpret_cast< Header* >( corrupt.data() );
+      auto* procs = reinterpret_cast< Proc* >( corrupt.data() +
+                                               h.sections[ PROCS ].offset );
+      procs[ 0 ].references.count = 1000;
+      write( corrupt );
+      expect( Map( saved ) == nullptr, "Mapped an index with a bad range" );
+    }
+
+    m.reset();
+    std::filesystem::remove_all( dir );
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  // Add the files at `paths` to `index`, in that order and in one bulk load
+  // (as Batch::IndexFiles does)
+  void IndexInto( Index::Index& index, const std::vector< std::string >& paths )
+  {
+    Index::BeginBulkLoad( index );
+    for ( auto& path : paths )
+    {
+      Parser::ParseContext context{
+        .file = Parser::read_source_file( path ),
+        .cur_ns = "",
+      };
+      auto* script =
+        Parser::ParseScript( nullptr, context, context.file->contents );
+      Index::ScanContext scanContext{ .nsPath = { index.global_namespace_id } };
+      Index::Build( index, scanContext, *script );
+    }
+    Index::EndBulkLoad( index );
+  }
+
+  Index::Index IndexOf( const std::vector< std::string >& paths )
+  {
+    auto index = Index::make_index();
+    IndexInto( index, paths );
+    return index;
+  }
+
+  // Everything in `index`, in an order which doesn't depend on its ids
+  std::vector< std::string > Describe( const Index::Index& index )
+  {
+    std::vector< std::string > lines;
+    auto add = [ & ]( auto&&... parts ) {
+      std::ostringstream o;
+      ( ( o << parts << ' ' ), ... );
+      lines.push_back( o.str() );
+    };
+
+    for ( auto& ns : index.namespaces.table )
+    {
+      if ( index.namespaces.IsLive( ns ) )
+      {
+        add( "namespace", Index::GetPrintName( index, ns ) );
+      }
+    }
+    for ( auto& proc : index.procs.table )
+    {
+      if ( index.procs.IsLive( proc ) )
+      {
+        add( "proc",
+             Index::GetPrintName( index, proc ),
+             proc.required_args,
+             proc.optional_args,
+             proc.is_variadic,
+             proc.arguments.size() );
+      }
+    }
+    for ( auto& r : index.procs.references )
+    {
+      if ( r.id != 0 )
+      {
+        add( r.type,
+             Index::GetPrintName( index, index.procs.Get( r.id ) ),
+             r.location,
+             r.cmd.Text(),
+             r.num_args );
+      }
+    }
+    for ( auto& r : index.variables.references )
+    {
+      if ( r.id != 0 )
+      {
+        auto& variable = index.variables.Get( r.id );
+        add( r.type,
+             variable.name.Text(),
+             variable.parent_namespace.has_value(),
+             r.location );
+      }
+    }
+    for ( auto& call : index.unresolved )
+    {
+      add( "call",
+           Index::GetPrintName( index, index.namespaces.Get( call.ns ) ),
+           call.name.Path(),
+           call.num_args,
+           call.location );
+    }
+
+    std::sort( lines.begin(), lines.end() );
+    return lines;
+  }
+
+  // A saved index is loaded back as it was, and indexing a file which
+  // changed again then gives what indexing them all would
+  void TestLoad()
+  {
+    const std::string dir = std::filesystem::temp_directory_path() /
+                            ( "index_file_load." + std::to_string( getpid() ) );
+    std::filesystem::create_directories( dir );
+    const std::string a = dir + "/a.tcl";
+    const std::string b = dir + "/b.tcl";
+    const std::string saved = dir + "/index";
+    auto write = []( const std::string& path, std::string_view text ) {
+      std::ofstream f( path, std::ios::trunc );
+      f << text;
+    };
+    write( b,
+           "namespace eval ns {\n"
+           "  variable v 1\n"
+           "  proc q { x { y 1 } } { variable v; set z $x }\n"
+           "}\n" );
+    write( a,
+           "proc p { args } { ns::q 1; upvar 1 w w; r }\n"
+           "proc t {} {}\n"
+           "namespace eval ns { q 1 2; t }\n"
+           "p\n" );
+
+    auto fail = 0;
+    auto expect = [ & ]( bool ok, std::string_view what ) {
+      if ( !ok )
+      {
+        std::cerr << "IndexFile: " << what << '\n';
+        ++fail;
+      }
+    };
+
+    // (a's calls of b's procs, which come later, are resolved)
+    auto index = IndexOf( { a, b } );
+    expect( Save( index, saved ), "Unable to save" );
+    auto m = Map( saved );
+    if ( !m )
+    {
+      std::cerr << "IndexFile: Unable to map\n";
+      abort();
+    }
+
+    auto loaded = Load( *m );
+    expect( Describe( loaded ) == Describe( index ),
+            "Loaded index isn't the one saved" );
+    expect( Serialize( loaded, m.get() ) == Serialize( index ),
+            "Loaded index doesn't save the same" );
+
+    // Each file on its own, with the other's procs to be resolved
+    auto files = LoadFiles( *m, { "A", "B" } );
+    const auto& own = files[ 0 ];
+    expect( files.size() == 2 &&
+              own.files.begin()->second->fileName == "A" &&
+              own.procs.Size() == 2 && files[ 1 ].procs.Size() == 1,
+            "Each file should have its own procs" );
+    auto* ns = Index::FindNamespace( own, "::ns" );
+    auto isUnresolved = [ & ]( Index::NamespaceID in,
+                               std::string_view name,
+                               size_t num_args ) {
+      return std::any_of( own.unresolved.begin(),
+                          own.unresolved.end(),
+                          [ & ]( const Index::Index::Call& call ) {
+                            return call.ns == in &&
+                                   call.name.Path() == name &&
+                                   call.num_args == num_args;
+                          } );
+    };
+    expect( ns && own.procs.references.size() == 4 &&
+              isUnresolved( own.global_namespace_id, "ns::q", 1 ) &&
+              isUnresolved( ns->id, "q", 2 ) &&
+              isUnresolved( own.global_namespace_id, "r", 0 ),
+            "A file's calls of others' procs should be unresolved" );
+
+    // Change b, and index it again on top of what was saved: the result is
+    // the same as indexing both from scratch, even though b is now indexed
+    // after a, and its new procs are a better fit for calls in a which had
+    // been resolved to others (t) or not at all (r)
+    write( b,
+           "namespace eval ns {\n"
+           "  proc q { x y } {}\n"
+           "  proc s {} { q 1 2 }\n"
+           "  proc t {} {}\n"
+           "}\n"
+           "proc r {} {}\n" );
+    auto changed = RemoveStale( loaded, *m, { a, b } );
+    expect( changed == std::vector< std::string >{ b },
+            "Only the changed file should be indexed again" );
+    IndexInto( loaded, changed );
+    Index::MaybeCompact( loaded, 0.0 );
+
+    const auto full = IndexOf( { a, b } );
+    expect( Describe( loaded ) == Describe( full ),
+            "Indexing a changed file again differs from indexing them all" );
+    auto* t = Index::FindProc( full,
+                               full.global_namespace_id,
+                               Parser::SplitName( "ns::t" ) );
+    expect( t && full.procs.refsByID.count( t->procs.front() ) == 2,
+            "Expected the call of t in ns to be to ns::t" );
+
+    // which can be saved again, for the next time
+    expect( Save( loaded, saved, m.get() ), "Unable to save again" );
+    m = Map( saved );
+    expect( m && IsIndexOf( *m, { a, b } ), "Saved again isn't fresh" );
+
+    m.reset();
+    std::filesystem::remove_all( dir );
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void Run()
+  {
+    TestSaveAndMap();
+    TestLoad();
+  }
+}  // namespace IndexFile::Test
+
+// vim: foldmethod=marker
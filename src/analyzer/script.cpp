@@ -1,11 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <iterator>
 #include <memory>
+#include <memory_resource>
 #include <optional>
 #include <variant>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <tcl.h>
 #include <tclInt.h>
@@ -13,7 +20,11 @@
 #include <tclDecls.h>
 #include "tclIntDecls.h"
 
+#include "core_commands.cpp"
+#include "hash.cpp"
 #include "source_location.cpp"
+#include "symbol_table.cpp"
+#include "tokenizer.cpp"
 
 namespace Parser
 {
@@ -37,10 +48,68 @@ namespace Parser
     return vec;
   }
 
+  // The parts of a namespace path, as SplitPath would give them, but found as
+  // they're iterated over rather than allocated
+  class PathParts
+  {
+    std::string_view path;
+    bool none = true;  // no parts at all (SplitPath always has one)
+
+  public:
+    struct iterator
+    {
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = std::string_view;
+      using difference_type = std::ptrdiff_t;
+      using pointer = const std::string_view*;
+      using reference = std::string_view;
+
+      std::string_view path;
+      size_t start;  // of the current part, or npos at the end
+
+      std::string_view operator*() const
+      {
+        auto end = path.find( "::", start );
+        return path.substr( start,
+                            end == std::string_view::npos ? end
+                                                          : end - start );
+      }
+      iterator& operator++()
+      {
+        auto end = path.find( "::", start );
+        start = end == std::string_view::npos ? end : end + 2;
+        return *this;
+      }
+      iterator operator++( int )
+      {
+        auto it = *this;
+        ++*this;
+        return it;
+      }
+      bool operator==( const iterator& other ) const
+      {
+        return start == other.start;
+      }
+    };
+
+    PathParts() = default;
+    explicit PathParts( std::string_view path ) : path( path ), none( false )
+    {
+    }
+
+    iterator begin() const
+    {
+      return { path, none ? std::string_view::npos : 0 };
+    }
+    iterator end() const { return { path, std::string_view::npos }; }
+  };
+
+  // The parts of a (possibly) namespace-qualified name. Both are interned, so
+  // comparing the names of things is comparing Symbols.
   struct QualifiedName
   {
-    std::optional< std::string > ns;
-    std::string name;
+    std::optional< Symbol > ns;
+    Symbol name;
     bool absolute;
 
     QualifiedName AbsPath( std::string_view current_path ) const
@@ -54,62 +123,72 @@ namespace Parser
       {
         // Empty path is the same as the "::" namespace, so return an "aboslute"
         // version of *this;
-        return QualifiedName{ .ns = ( ns.has_value() ? "::" + ns.value() : "" ),
-                              .name = name };
+        return QualifiedName{
+          .ns = ( ns.has_value() ? Intern( "::" + std::string( ns->Text() ) )
+                                 : Symbol{} ),
+          .name = name };
       }
 
-      return QualifiedName{ .ns = std::string( current_path ) +
-                                  ( ns.has_value() ? ns.value() : "" ),
-                            .name = name };
+      return QualifiedName{
+        .ns = Intern( std::string( current_path ) +
+                      std::string( ns.has_value() ? ns->Text() : "" ) ),
+        .name = name };
     }
 
-    std::string Path()
+    std::string Path() const
     {
       if ( ns.has_value() )
       {
-        return ns.value() + "::" + name;
+        return std::string( ns->Text() ) + "::" + std::string( name.Text() );
       }
-      return name;
+      return std::string( name.Text() );
     }
 
-    std::string Namespace()
+    std::string_view Namespace() const
     {
       if ( ns.has_value() )
       {
-        return ns.value();
+        return ns->Text();
       }
 
       return "";
     }
 
-    std::vector< std::string_view > NamespaceParts() const
+    // The namespaces of the path, outermost first (not including :: itself)
+    PathParts NamespacePath() const
     {
       if ( !ns )
       {
         return {};
       }
 
-      if ( absolute && !ns->empty() )
+      if ( absolute && ns->id != 0 )
       {
-        return SplitPath( std::string_view( *ns ).substr( 2 ) );
+        return PathParts( ns->Text().substr( 2 ) );
       }
       else if ( absolute )
       {
         return {};
       }
 
-      return SplitPath( std::string_view( *ns ) );
+      return PathParts( ns->Text() );
+    }
+
+    std::vector< std::string_view > NamespaceParts() const
+    {
+      auto parts = NamespacePath();
+      return { parts.begin(), parts.end() };
     }
 
     std::vector< std::string_view > Parts() const
     {
       auto parts = NamespaceParts();
-      if ( name.empty() )
+      if ( name.id == 0 )
       {
         return parts;
       }
 
-      parts.push_back( name );
+      parts.push_back( name.Text() );
       return parts;
     }
   };
@@ -138,55 +217,112 @@ namespace Parser
     {
       // The magic :: namespace is treated as an absolute path
       qn.absolute = true;
-      qn.ns = "";
-      qn.name = "";
+      qn.ns = Symbol{};
+      qn.name = Symbol{};
     }
     else if ( pos == std::string_view::npos )
     {
-      qn.name = name;
+      qn.name = Intern( name );
     }
     else if (name.length() >= 2 && name.substr( 0, 2 ) == "::" )
     {
       qn.absolute = true;
       if ( name.length() > 2 )
       {
-        qn.name = name.substr( pos + 2 );
-        qn.ns = name.substr( 0, pos );
+        qn.name = Intern( name.substr( pos + 2 ) );
+        qn.ns = Intern( name.substr( 0, pos ) );
       }
       else
       {
-        qn.name = "";
-        qn.ns = "";
+        qn.name = Symbol{};
+        qn.ns = Symbol{};
       }
     }
     else
     {
-      qn.name = name.substr( pos + 2 );
-      qn.ns = name.substr( 0, pos );
+      qn.name = Intern( name.substr( pos + 2 ) );
+      qn.ns = Intern( name.substr( 0, pos ) );
     }
 
     return qn;
   }
 
+  // All of the Scripts, Calls and Words for a parse are allocated from a
+  // single arena owned by the ParseContext. Nothing in the tree is ever
+  // destroyed individually; the whole tree goes away in one shot with the
+  // arena (i.e. when the ParseContext is destroyed or replaced).
+  using Arena = std::pmr::monotonic_buffer_resource;
+
+  // What splits the script into commands and words. They produce the same
+  // tokens (and so the same Words), but NATIVE doesn't need Tcl and is faster.
+  enum class Tokenizer
+  {
+    TCL,     // Tcl_ParseCommand
+    NATIVE,  // Native::ParseCommand
+  };
+
   struct ParseContext
   {
-    SourceFile file;
+    SourceFilePtr file;
     std::string cur_ns;
+
+    Tokenizer tokenizer = Tokenizer::TCL;
+
+    std::unique_ptr< Arena > arena = std::make_unique< Arena >();
+
+    // Arenas of the ParseScriptParallel workers, which own parts of the tree
+    std::vector< std::unique_ptr< Arena > > worker_arenas;
   };
 
   struct Script;
+  struct Word;
+
+  /**
+   * The elements of a word which is a literal list (e.g. the arguments of a
+   * proc). Nothing is stored per element: they're found in the text (with
+   * Native::FindElement) as the list is iterated, and each is yielded as a
+   * TEXT Word, or if `nested`, as a list itself (see WordToList).
+   */
+  struct ListView
+  {
+    std::string_view text;  // the whole list
+    SourceLocation location;  // of text
+    uint32_t size;  // number of elements
+    bool nested;  // a list of lists
+
+    struct iterator
+    {
+      const ListView* list;
+      const char* next;  // where the element after this one starts
+      std::string_view element;
+
+      Word operator*() const;
+      iterator& operator++();
+      bool operator==( const iterator& other ) const
+      {
+        return element.data() == other.element.data();
+      }
+    };
+
+    iterator begin() const;
+    iterator end() const
+    {
+      const char* last = text.data() + text.size();
+      return { this, last, { last, 0 } };
+    }
+  };
 
   struct Word
   {
     // TODO: Should use better names here ?
-    using ScriptPtr = std::unique_ptr< Script >;
-    using WordVec = std::vector< Word >;
-    using WordPtr = std::unique_ptr< Word >;
+    using ScriptPtr = Script*;  // owned by the arena
+    using WordVec = std::pmr::vector< Word >;
+    using WordPtr = Word*;      // owned by the arena
     using Nothing = std::monostate;
 
     struct ArrayAccess
     {
-      std::string name;
+      std::string_view name;
       WordVec index;
     };
 
@@ -200,16 +336,102 @@ namespace Parser
       SCRIPT,        // use data.ScriptPtr
       TOKEN_LIST,    // use data.WordVec
       EXPAND,        // use data.WordPtr
-      LIST,          // use data.WordVec
+      LIST,          // use data.ListView
       ERROR,         // Some sort of parse error (use text)
     } type;
 
     SourceLocation location;
     std::string_view text;
 
-    std::variant< Nothing, ArrayAccess, ScriptPtr, WordVec, WordPtr > data;
+    std::variant< Nothing, ArrayAccess, ScriptPtr, WordVec, WordPtr, ListView >
+      data;
   };
 
+  /**
+   * The number of elements in the list `text`, or nothing if it isn't a valid
+   * list. This walks the whole list, but doesn't allocate.
+   */
+  std::optional< uint32_t > CountListElements( std::string_view text )
+  {
+    const char* next = text.data();
+    const char* const last = text.data() + text.size();
+    uint32_t size = 0;
+    while ( next < last )
+    {
+      const char* element;
+      size_t length;
+      bool literal;
+      if ( !Native::FindElement( next,
+                                 last - next,
+                                 element,
+                                 next,
+                                 length,
+                                 literal ) )
+      {
+        return std::nullopt;
+      }
+      if ( element < last )
+      {
+        ++size;
+      }
+    }
+    return size;
+  }
+
+  /**
+   * Makes `word` a LIST if its text is a list of anything other than exactly
+   * one element; otherwise it's left as it is. If `nested`, the elements are
+   * then lists too.
+   */
+  Word WordToList( Word&& word, bool nested = false )
+  {
+    auto size = CountListElements( word.text );
+    if ( !size || *size == 1 )
+    {
+      return std::move( word );
+    }
+
+    word.type = Word::Type::LIST;
+    word.data = ListView{ .text = word.text,
+                          .location = word.location,
+                          .size = *size,
+                          .nested = nested };
+    return std::move( word );
+  }
+
+  ListView::iterator ListView::begin() const
+  {
+    iterator it{ this, text.data(), {} };
+    return ++it;
+  }
+
+  ListView::iterator& ListView::iterator::operator++()
+  {
+    // The list was checked when the view was made
+    const char* last = list->text.data() + list->text.size();
+    const char* start = last;
+    size_t length = 0;
+    bool literal;
+    if ( next < last )
+    {
+      Native::FindElement( next, last - next, start, next, length, literal );
+    }
+    element = { start, start < last ? length : 0 };
+    return *this;
+  }
+
+  Word ListView::iterator::operator*() const
+  {
+    Word word{ .type = Word::Type::TEXT,
+               .location = { list->location.file,
+                             static_cast< uint32_t >(
+                               list->location.offset +
+                               ( element.data() - list->text.data() ) ) },
+               .text = element,
+               .data{} };
+    return list->nested ? WordToList( std::move( word ) ) : word;
+  }
+
 
   struct Call
   {
@@ -224,27 +446,33 @@ namespace Parser
       IF,
       USER,
     } type;
-    std::vector< Word > words;
-    std::string ns; // lexical namespace in which the call happens
+    std::pmr::vector< Word > words;
+    std::pmr::string ns; // lexical namespace in which the call happens
+
+    SourceLocation location;
+    std::string_view text; // the whole command, including its terminator
   };
 
   struct Script
   {
     SourceLocation location;
-    std::vector< Call > commands;
+    std::pmr::vector< Call > commands;
+    std::string_view text;
   };
 
-  Script ParseScript( Tcl_Interp* interp,
-                      ParseContext& context,
-                      std::string_view script );
+  Script* ParseScript( Tcl_Interp* interp,
+                       ParseContext& context,
+                       std::string_view script );
 
+  // Tokens is either a Tcl_Parse or a Native::Parse
+  template< typename Tokens >
   Word ParseWord( Tcl_Interp* interp,
                   ParseContext& context,
-                  Tcl_Parse& parseResult,
+                  Tokens& parseResult,
                   size_t& nextToken )
   {
     Word word;
-    Tcl_Token& token = parseResult.tokenPtr[ nextToken++ ];
+    auto& token = parseResult.tokenPtr[ nextToken++ ];
 
     switch ( token.type )
     {
@@ -278,9 +506,9 @@ namespace Parser
         {
           word.type = Word::Type::TOKEN_LIST;
         }
-        word.location = make_source_location( context.file, token.start );
+        word.location = make_source_location( *context.file, token.start );
         word.text = std::string_view{ token.start, (size_t)token.size };
-        auto& vec = word.data.emplace< Word::WordVec >();
+        auto& vec = word.data.emplace< Word::WordVec >( context.arena.get() );
         vec.reserve( token.numComponents );
 
         size_t maxToken = nextToken + token.numComponents;
@@ -297,7 +525,7 @@ namespace Parser
       {
         word.type = Word::Type::TEXT;
         word.text = std::string_view{ token.start, (size_t)token.size };
-        word.location = make_source_location( context.file, token.start );
+        word.location = make_source_location( *context.file, token.start );
         break;
       }
 
@@ -305,17 +533,16 @@ namespace Parser
       {
         word.type = Word::Type::SCRIPT;
         word.text = std::string_view{ token.start, (size_t)token.size };
-        word.location = make_source_location( context.file, token.start );
+        word.location = make_source_location( *context.file, token.start );
 
         // A command like `[ a b c ]`
         //
         // NOTE: The text of TCL_TOKEN_COMMAND includes the [ and the ]. We need
         // to parse only the contents of the command, so we use start + 1 and
         // legth - 2 to ignore the [ and the ] to get the `a b c`
-        word.data = std::make_unique< Script >(
-          ParseScript( interp,
-                       context,
-                       { token.start + 1, (size_t)token.size - 2 } ) );
+        word.data = ParseScript( interp,
+                                 context,
+                                 { token.start + 1, (size_t)token.size - 2 } );
 
         break;
       }
@@ -336,10 +563,11 @@ namespace Parser
           // make up the array index
           word.type = Word::Type::ARRAY_ACCESS;
           word.text = std::string_view{ token.start, (size_t)token.size };
-          word.location = make_source_location( context.file, token.start );
+          word.location = make_source_location( *context.file, token.start );
 
           size_t maxToken = nextToken + token.numComponents;
-          auto& arrayAccess = word.data.emplace< Word::ArrayAccess >();
+          auto& arrayAccess = word.data.emplace< Word::ArrayAccess >(
+            Word::ArrayAccess{ .index = Word::WordVec( context.arena.get() ) } );
 
           Word name = ParseWord( interp, context, parseResult, nextToken );
           assert( name.type == Word::Type::TEXT );
@@ -364,62 +592,10 @@ namespace Parser
     return word;
   }
 
-  Word WordToList( Tcl_Interp* interp,
-                   const ParseContext& context,
-                   Word&& word )
-  {
-    const char* list = word.text.data();
-    size_t length = word.text.length();
-    const char* prevList = nullptr;
-    const char* last = list + length;
-    size_t size;
-    const char* element;
-
-    Word::WordVec vec;
-
-    while ( true )
-    {
-      prevList = list;
-      if ( TclFindElement( interp,
-                           list,
-                           length,
-                           &element,
-                           &list,
-                           &size,
-                           NULL ) != TCL_OK )
-      {
-        // unable to convert to list, leave as a word
-        return std::move( word );
-      }
-      length -= ( list - prevList );
-      if ( element >= last )
-      {
-        break;
-      }
-      // TODO: What if the element is itself a list? do we need to really
-      // defer this processing until we need it ? or say, this is specifically
-      // for parsing function arguments. for now, leave it for the indexer to
-      // =work out
-      vec.emplace_back(
-        Word{ .type = Word::Type::TEXT,
-              .location = make_source_location( context.file, element ),
-              .text = { element, (size_t)( size ) },
-              .data{} } );
-    }
-
-    if ( vec.size() == 1 )
-    {
-      return std::move( word );
-    }
-
-    word.type = Word::Type::LIST;
-    word.data = std::move( vec );
-    return std::move( word );
-  };
-
+  template< typename Tokens >
   void ParseCommand( Tcl_Interp* interp,
                      ParseContext& context,
-                     Tcl_Parse& parseResult,
+                     Tokens& parseResult,
                      Script& s )
   {
     if ( parseResult.numWords < 1 )
@@ -430,7 +606,11 @@ namespace Parser
 
     auto& call = s.commands.emplace_back( Call{
       .type = Call::Type::USER,
-      .ns = context.cur_ns,
+      .words = Word::WordVec( context.arena.get() ),
+      .ns = std::pmr::string( context.cur_ns, context.arena.get() ),
+      .location = make_source_location( *context.file,
+                                        parseResult.commandStart ),
+      .text = { parseResult.commandStart, (size_t)parseResult.commandSize },
     } );
     call.words.reserve( parseResult.numWords );
 
@@ -456,7 +636,7 @@ namespace Parser
       {
         return call.words.emplace_back(
           Word{ .type = Word::Type::ERROR,
-                .location = make_source_location( context.file,
+                .location = make_source_location( *context.file,
                                                   parseResult.commandStart +
                                                     parseResult.commentSize ),
                 .text = "Expected word!",
@@ -473,34 +653,18 @@ namespace Parser
       {
         return call.words.emplace_back(
           Word{ .type = Word::Type::ERROR,
-                .location = make_source_location( context.file,
+                .location = make_source_location( *context.file,
                                                   parseResult.commandStart +
                                                     parseResult.commentSize ),
                 .text = "Expected list!",
                 .data{} } );
       }
 
-      auto word =
-        WordToList( interp,
-                    context,
-                    ParseWord( interp, context, parseResult, tokenIndex ) );
-
-      // If we recognised some sort of list, parse the second level (as args is
-      // a list-of-lists)
-      if ( word.type == Word::Type::LIST )
-      {
-        auto& vec = std::get< Word::WordVec >( word.data );
-        Word::WordVec parsedArgs;
-        parsedArgs.reserve( vec.size() );
-        for ( auto& arg : vec )
-        {
-          parsedArgs.emplace_back(
-            WordToList( interp, context, std::move( arg ) ) );
-        }
-        word.data = std::move( parsedArgs );
-      }
-
-      return call.words.emplace_back( std::move( word ) );
+      // args is a list-of-lists, e.g. { a { b 1 } }. Its elements are only
+      // looked at when something iterates it.
+      return call.words.emplace_back(
+        WordToList( ParseWord( interp, context, parseResult, tokenIndex ),
+                    true ) );
     };
 
     auto parseBody = [ & ]() -> auto&
@@ -509,21 +673,21 @@ namespace Parser
       {
         return call.words.emplace_back(
           Word{ .type = Word::Type::ERROR,
-                .location = make_source_location( context.file,
+                .location = make_source_location( *context.file,
                                                   parseResult.commandStart +
                                                     parseResult.commentSize ),
                 .text = "Expected body!",
                 .data{} } );
       }
 
-      auto word = ParseWord( interp, context, parseResult, tokenIndex );
+      Word word = ParseWord( interp, context, parseResult, tokenIndex );
 
       if ( word.type == Word::Type::TEXT )
       {
         // Body is a simple word, so we can parse it
         word.type = Word::Type::SCRIPT;
-        word.data.emplace< Word::ScriptPtr >( std::make_unique< Script >(
-          ParseScript( interp, context, word.text ) ) );
+        word.data.emplace< Word::ScriptPtr >(
+          ParseScript( interp, context, word.text ) );
       }
 
       return call.words.emplace_back( std::move( word ) );
@@ -609,52 +773,415 @@ namespace Parser
     parseRest();
   }
 
-  Script ParseScript( Tcl_Interp* interp,
-                      ParseContext& context,
-                      std::string_view script )
+  Script& NewScript( ParseContext& context, std::string_view script )
   {
-    Tcl_Parse parseResult;
+    std::pmr::polymorphic_allocator<> alloc( context.arena.get() );
+    return *alloc.new_object< Script >( Script{
+      .location = make_source_location( *context.file, script.data() ),
+      .commands = std::pmr::vector< Call >( context.arena.get() ),
+      .text = script,
+    } );
+  }
 
-    Script s{
-      .location = make_source_location( context.file, script.data() ),
-      .commands{},
-    };
+  // Tokenizes a script one command at a time, with the context's tokenizer
+  struct CommandTokenizer
+  {
+    Tcl_Interp* interp;
+    ParseContext& context;
+
+    Tcl_Parse tcl;
+    bool tclParsed = false;  // tcl needs freeing
+    Native::Parse native{};
+
+    CommandTokenizer( Tcl_Interp* interp, ParseContext& context )
+      : interp( interp )
+      , context( context )
+    {
+    }
 
-    while ( script.size() > 0 )
+    CommandTokenizer( const CommandTokenizer& ) = delete;
+    CommandTokenizer& operator=( const CommandTokenizer& ) = delete;
+
+    ~CommandTokenizer()
     {
-      if ( Tcl_ParseCommand( interp,
-                             script.data(),
-                             script.size(),
-                             0,
-                             &parseResult ) != TCL_OK )
+      Free();
+    }
+
+    void Free()
+    {
+      if ( tclParsed )
       {
-        // TDDO: ERROR RECOVERY
-        return s;
+        Tcl_FreeParse( &tcl );
+        tclParsed = false;
       }
+    }
 
-      // Parse the command
-      ParseCommand( interp, context, parseResult, s );
+    // Tokenize the first command in [ start, end ). Returns false if it can't
+    // be parsed.
+    bool Next( const char* start, const char* end )
+    {
+      Free();
+      if ( context.tokenizer == Tokenizer::NATIVE )
+      {
+        return Native::ParseCommand(
+          { start, static_cast< size_t >( end - start ) },
+          native );
+      }
 
-      // calculate the remaining chunk of text to parse
-      const char* end = script.data() + script.size();
-      const char* start = parseResult.commandStart + parseResult.commandSize;
-      assert( end >= start );
-      script = { start, static_cast< size_t >( end - start ) };
-      Tcl_FreeParse( &parseResult );
+      tclParsed = Tcl_ParseCommand( interp, start, end - start, 0, &tcl ) ==
+                  TCL_OK;
+      return tclParsed;
     }
 
-    return s;
+    // The end of the command (including its terminator)
+    const char* CommandEnd() const
+    {
+      return context.tokenizer == Tokenizer::NATIVE
+               ? native.commandStart + native.commandSize
+               : tcl.commandStart + tcl.commandSize;
+    }
+
+    // Add the command to s
+    void Parse( Script& s )
+    {
+      if ( context.tokenizer == Tokenizer::NATIVE )
+      {
+        ParseCommand( interp, context, native, s );
+      }
+      else
+      {
+        ParseCommand( interp, context, tcl, s );
+      }
+    }
   };
+
+  void ParseCommands( Tcl_Interp* interp, ParseContext& context, Script& s )
+  {
+    CommandTokenizer tokenizer( interp, context );
+    const char* next = s.text.data();
+    const char* const end = next + s.text.size();
+
+    while ( next < end )
+    {
+      if ( !tokenizer.Next( next, end ) )
+      {
+        // TDDO: ERROR RECOVERY
+        return;
+      }
+
+      tokenizer.Parse( s );
+      next = tokenizer.CommandEnd();
+    }
+  }
+
+  Script* ParseScript( Tcl_Interp* interp,
+                       ParseContext& context,
+                       std::string_view script )
+  {
+    Script& s = NewScript( context, script );
+    ParseCommands( interp, context, s );
+    return &s;
+  };
+
+  struct ParallelParseOptions
+  {
+    size_t workers = std::max( 1u, std::thread::hardware_concurrency() );
+    size_t chunk_size = 256 * 1024;  // bytes of script per unit of work
+  };
+
+  /**
+   * Same result as ParseScript, but the top-level commands are parsed on
+   * `options.workers` threads.
+   *
+   * Top-level commands are independent once we know where they start and
+   * end, so we first find the boundaries with a top-level only pass
+   * (Tcl_ParseCommand doesn't look inside braced words, which is where most of
+   * the text is), group the commands into chunks of about `chunk_size` bytes,
+   * and then fully parse the chunks in parallel, each worker with its own
+   * Tcl_Interp and arena. The namespace at top level is always
+   * context.cur_ns; a `namespace eval` only changes it for its own body, which
+   * is always within a single chunk.
+   */
+  Script* ParseScriptParallel( Tcl_Interp* interp,
+                               ParseContext& context,
+                               std::string_view script,
+                               ParallelParseOptions options = {} )
+  {
+    if ( options.workers < 2 || script.size() < 2 * options.chunk_size )
+    {
+      return ParseScript( interp, context, script );
+    }
+
+    const char* const end = script.data() + script.size();
+    std::vector< std::string_view > chunks;
+    {
+      CommandTokenizer tokenizer( interp, context );
+      const char* chunk_start = script.data();
+      const char* next = chunk_start;
+      while ( next < end )
+      {
+        if ( !tokenizer.Next( next, end ) )
+        {
+          // The last chunk runs to the end of the script, so parsing it stops
+          // at the same error as ParseScript would
+          break;
+        }
+
+        next = tokenizer.CommandEnd();
+
+        if ( static_cast< size_t >( next - chunk_start ) >=
+             options.chunk_size )
+        {
+          chunks.emplace_back( chunk_start, next - chunk_start );
+          chunk_start = next;
+        }
+      }
+
+      if ( chunk_start < end )
+      {
+        chunks.emplace_back( chunk_start, end - chunk_start );
+      }
+    }
+
+    if ( chunks.size() < 2 )
+    {
+      return ParseScript( interp, context, script );
+    }
+
+    const size_t workers = std::min( options.workers, chunks.size() );
+    std::vector< Script* > results( chunks.size() );
+    std::vector< std::unique_ptr< Arena > > arenas( workers );
+    std::atomic< size_t > next_chunk{ 0 };
+
+    auto work = [ & ]( size_t worker ) {
+      // Interps can't be shared between threads
+      Tcl_Interp* workerInterp = Tcl_CreateInterp();
+      ParseContext workerContext{
+        .file = context.file,
+        .cur_ns = context.cur_ns,
+        .tokenizer = context.tokenizer,
+      };
+
+      for ( size_t chunk = next_chunk++; chunk < chunks.size();
+            chunk = next_chunk++ )
+      {
+        results[ chunk ] = ParseScript( workerInterp,
+                                        workerContext,
+                                        chunks[ chunk ] );
+      }
+
+      arenas[ worker ] = std::move( workerContext.arena );
+      Tcl_DeleteInterp( workerInterp );
+    };
+
+    std::vector< std::thread > threads;
+    threads.reserve( workers - 1 );
+    for ( size_t worker = 1; worker < workers; ++worker )
+    {
+      threads.emplace_back( work, worker );
+    }
+    work( 0 );
+    for ( auto& thread : threads )
+    {
+      thread.join();
+    }
+
+    // Stitch the chunks' commands together, in order. The Calls' contents stay
+    // where they are, in the workers' arenas.
+    Script& s = NewScript( context, script );
+
+    size_t numCommands = 0;
+    for ( auto* result : results )
+    {
+      numCommands += result->commands.size();
+    }
+    s.commands.reserve( numCommands );
+    for ( auto* result : results )
+    {
+      std::move( result->commands.begin(),
+                 result->commands.end(),
+                 std::back_inserter( s.commands ) );
+    }
+
+    for ( auto& arena : arenas )
+    {
+      context.worker_arenas.push_back( std::move( arena ) );
+    }
+
+    return &s;
+  }
+
+  /**
+   * Where to split `text`, which starts where a top-level command could (e.g.
+   * at the start of a file), into pieces of about `size` bytes which each
+   * parse on their own (with ParseScript) just as they do as part of the
+   * whole: each is a run of whole top-level commands ending with a newline.
+   * A command which can't be parsed stops the parse of everything after it,
+   * so the piece it's in runs to the end of `text`.
+   *
+   * Returns the length of each piece. `complete` is set if the last one ends
+   * as the others do, rather than just where `text` does.
+   */
+  std::vector< size_t > SplitPieces( Tokenizer tokenizer,
+                                     std::string_view text,
+                                     size_t size,
+                                     bool* complete = nullptr )
+  {
+    std::vector< size_t > pieces;
+    ParseContext context{ .tokenizer = tokenizer };
+    CommandTokenizer commands( nullptr, context );
+
+    const char* const end = text.data() + text.size();
+    const char* start = text.data();
+    const char* next = start;
+    bool ended = true;  // at a newline, after a whole command
+    while ( next < end )
+    {
+      if ( !commands.Next( next, end ) )
+      {
+        ended = false;
+        break;
+      }
+
+      next = commands.CommandEnd();
+      ended = next[ -1 ] == '\n';
+      if ( ended && static_cast< size_t >( next - start ) >= size )
+      {
+        pieces.push_back( next - start );
+        start = next;
+      }
+    }
+
+    if ( start < end )
+    {
+      pieces.push_back( end - start );
+    }
+    if ( complete )
+    {
+      *complete = ended && next == end;
+    }
+    return pieces;
+  }
 }  // namespace Parser
 
 namespace Parser::Test
 {
+  void CompareWord( const Word& word, const Word& expected, size_t offset );
+
+  /**
+   * Abort unless `calls` are the same as `expected`, bodies and all: the same
+   * types, text and offsets all the way down. `calls` may be of a piece of the
+   * text, which starts at `offset`.
+   */
+  void CompareCalls( const std::pmr::vector< Call >& calls,
+                     const std::pmr::vector< Call >& expected,
+                     size_t offset = 0 )
+  {
+    if ( calls.size() != expected.size() )
+    {
+      std::cerr << "Expected " << expected.size() << " calls but found "
+                << calls.size() << '\n';
+      abort();
+    }
+
+    for ( size_t i = 0; i < calls.size(); ++i )
+    {
+      const auto& call = calls[ i ];
+      const auto& other = expected[ i ];
+      if ( call.type != other.type || call.text != other.text ||
+           call.location.offset + offset != other.location.offset ||
+           call.ns != other.ns || call.words.size() != other.words.size() )
+      {
+        std::cerr << "Call doesn't match call: " << other.text << '\n';
+        abort();
+      }
+
+      for ( size_t w = 0; w < call.words.size(); ++w )
+      {
+        CompareWord( call.words[ w ], other.words[ w ], offset );
+      }
+    }
+  }
+
+  void CompareWord( const Word& word, const Word& expected, size_t offset )
+  {
+    if ( word.type != expected.type || word.text != expected.text ||
+         word.location.offset + offset != expected.location.offset )
+    {
+      std::cerr << "Word doesn't match word: " << expected.text << '\n';
+      abort();
+    }
+
+    auto compareWords = [ & ]( const Word::WordVec& words,
+                               const Word::WordVec& others ) {
+      if ( words.size() != others.size() )
+      {
+        std::cerr << "Wrong number of words in: " << expected.text << '\n';
+        abort();
+      }
+      for ( size_t i = 0; i < words.size(); ++i )
+      {
+        CompareWord( words[ i ], others[ i ], offset );
+      }
+    };
+
+    switch ( word.type )
+    {
+      case Word::Type::SCRIPT:
+        CompareCalls( std::get< Word::ScriptPtr >( word.data )->commands,
+                      std::get< Word::ScriptPtr >( expected.data )->commands,
+                      offset );
+        break;
+
+      case Word::Type::TOKEN_LIST:
+      case Word::Type::EXPAND:
+        compareWords( std::get< Word::WordVec >( word.data ),
+                      std::get< Word::WordVec >( expected.data ) );
+        break;
+
+      case Word::Type::LIST:
+      {
+        const auto& list = std::get< ListView >( word.data );
+        const auto& other = std::get< ListView >( expected.data );
+        if ( list.size != other.size || list.nested != other.nested )
+        {
+          std::cerr << "List doesn't match: " << expected.text << '\n';
+          abort();
+        }
+        break;
+      }
+
+      case Word::Type::ARRAY_ACCESS:
+      {
+        const auto& arrayAccess = std::get< Word::ArrayAccess >( word.data );
+        const auto& other = std::get< Word::ArrayAccess >( expected.data );
+        if ( arrayAccess.name != other.name )
+        {
+          std::cerr << "Array name doesn't match: " << other.name << '\n';
+          abort();
+        }
+        compareWords( arrayAccess.index, other.index );
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
   void TestQualifiedName()
   {
+    struct Expect
+    {
+      std::optional< std::string > ns;
+      std::string name;
+      bool absolute;
+    };
+
     struct Test
     {
       std::string lexeme;
-      QualifiedName expect;
+      Expect expect;
       std::string path;
       std::string abspath;
     };
@@ -675,15 +1202,17 @@ namespace Parser::Test
     for ( auto&& test : tests )
     {
       QualifiedName qn = SplitName( test.lexeme );
-      if ( qn.ns != test.expect.ns )
+      if ( qn.ns.has_value() != test.expect.ns.has_value() ||
+           ( qn.ns && qn.ns->Text() != *test.expect.ns ) )
       {
         std::cerr << "Expected " << test.lexeme << " to have ns "
                   << ( test.expect.ns ? *test.expect.ns : "<unset>" )
-                  << " but found " << ( qn.ns ? *qn.ns : "<unset>" )
+                  << " but found "
+                  << ( qn.ns ? qn.ns->Text() : "<unset>" )
                   << '\n';
         ++fail;
       }
-      if ( qn.name != test.expect.name )
+      if ( qn.name != Intern( test.expect.name ) )
       {
         std::cerr << "Expected " << test.lexeme << " to have name "
                   << test.expect.name << " but found " << qn.name
@@ -716,6 +1245,24 @@ namespace Parser::Test
       }
     }
 
+    // Iterating over a path's parts finds the same ones as splitting it
+    for ( std::string_view path :
+          { "", "a", "a::b", "::a", "a::", "::", "a:::b", "a::::b", "a:b" } )
+    {
+      PathParts parts( path );
+      if ( std::vector< std::string_view >( parts.begin(), parts.end() ) !=
+           SplitPath( path ) )
+      {
+        std::cerr << "Expected the parts of " << path << " to match\n";
+        ++fail;
+      }
+    }
+    if ( PathParts().begin() != PathParts().end() )
+    {
+      std::cerr << "Expected no parts\n";
+      ++fail;
+    }
+
     if ( fail )
     {
       abort();
@@ -751,6 +1298,89 @@ namespace Parser::Test
     words.emplace_back( std::move( w ) );
   }
 
+  void TestWordToList()
+  {
+    struct Test
+    {
+      std::string text;
+      std::optional< std::vector< std::string > > expect;  // unset: not a LIST
+    };
+
+    std::vector< Test > tests = {
+      { "a", {} },
+      { "{a b}", {} },
+      { "{a b", {} },
+      { "", { {} } },
+      { "  ", { {} } },
+      { "a b", { { "a", "b" } } },
+      { " a {b c}  \"d e\" ", { { "a", "b c", "d e" } } },
+      { "a {} b\\ c", { { "a", "", "b\\ c" } } },
+    };
+
+    auto fail = 0;
+    for ( auto&& test : tests )
+    {
+      Word word = WordToList( { .type = Word::Type::TEXT,
+                                .location{ 0, 10 },
+                                .text = test.text,
+                                .data{} } );
+      if ( ( word.type == Word::Type::LIST ) != test.expect.has_value() )
+      {
+        std::cerr << "Expected [" << test.text << "] "
+                  << ( test.expect ? "to be" : "not to be" ) << " a list\n";
+        ++fail;
+        continue;
+      }
+      if ( !test.expect )
+      {
+        continue;
+      }
+
+      auto& list = std::get< ListView >( word.data );
+      std::vector< std::string > found;
+      for ( auto element : list )
+      {
+        auto offset = element.text.data() - test.text.data();
+        if ( element.location.offset != 10 + offset )
+        {
+          std::cerr << "Wrong location for element " << element.text
+                    << " of [" << test.text << "]\n";
+          ++fail;
+        }
+        found.emplace_back( element.text );
+      }
+      if ( found != *test.expect || list.size != found.size() )
+      {
+        std::cerr << "Wrong elements for [" << test.text << "]\n";
+        ++fail;
+      }
+    }
+
+    // Proc args are a list of lists
+    Word args = WordToList( { .type = Word::Type::TEXT,
+                              .location{},
+                              .text = "a {b 1} c",
+                              .data{} },
+                            true );
+    std::vector< Word::Type > types;
+    for ( auto arg : std::get< ListView >( args.data ) )
+    {
+      types.push_back( arg.type );
+    }
+    if ( types != std::vector{ Word::Type::TEXT,
+                               Word::Type::LIST,
+                               Word::Type::TEXT } )
+    {
+      std::cerr << "Wrong nested list\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
   void TestLinePosToScriptCursor()
   {
 
@@ -759,8 +1389,15 @@ namespace Parser::Test
   void Run()
   {
     TestWord();
+    TestWordToList();
+    TestSymbolTable();
     TestQualifiedName();
+    TestCoreCommands();
     TestLinePosToScriptCursor();
     TestOffsetToLineByte();
+    TestApplyEdit();
+    TestSourceFileRegistry();
+    TestNativeTokenizer();
+    TestHash();
   }
 }  // namespace Parser::Test
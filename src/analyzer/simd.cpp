@@ -0,0 +1,112 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+#  include <immintrin.h>
+#endif
+
+// Byte scanning helpers. These use AVX2 or SSE2 when the compiler is allowed
+// to (e.g. -mavx2 or -march=native for AVX2; SSE2 is always there on x86_64)
+// and fall back to memchr otherwise, which is usually vectorised by libc
+// anyway.
+namespace SIMD
+{
+  /**
+   * Calls f( pos ) for each pos in [ begin, end ) where *pos == c, in order.
+   */
+  template< typename F >
+  void ForEachByte( const char* begin, const char* end, char c, F&& f )
+  {
+    const char* p = begin;
+
+#if defined( __AVX2__ )
+    const __m256i needle32 = _mm256_set1_epi8( c );
+    for ( ; end - p >= 32; p += 32 )
+    {
+      __m256i chunk = _mm256_loadu_si256( (const __m256i*)p );
+      uint32_t mask = static_cast< uint32_t >(
+        _mm256_movemask_epi8( _mm256_cmpeq_epi8( chunk, needle32 ) ) );
+      while ( mask )
+      {
+        f( p + std::countr_zero( mask ) );
+        mask &= mask - 1;
+      }
+    }
+#endif
+
+#if defined( __SSE2__ )
+    const __m128i needle16 = _mm_set1_epi8( c );
+    for ( ; end - p >= 16; p += 16 )
+    {
+      __m128i chunk = _mm_loadu_si128( (const __m128i*)p );
+      uint32_t mask = static_cast< uint32_t >(
+        _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, needle16 ) ) );
+      while ( mask )
+      {
+        f( p + std::countr_zero( mask ) );
+        mask &= mask - 1;
+      }
+    }
+#endif
+
+    while ( p < end )
+    {
+      auto found = static_cast< const char* >( memchr( p, c, end - p ) );
+      if ( !found )
+      {
+        break;
+      }
+      f( found );
+      p = found + 1;
+    }
+  }
+
+  /**
+   * Returns the first pos in [ begin, end ) where *pos is one of Cs, or end if
+   * there isn't one.
+   */
+  template< char... Cs >
+  const char* FindFirstOf( const char* begin, const char* end )
+  {
+    const char* p = begin;
+
+#if defined( __AVX2__ )
+    for ( ; end - p >= 32; p += 32 )
+    {
+      __m256i chunk = _mm256_loadu_si256( (const __m256i*)p );
+      uint32_t mask = static_cast< uint32_t >( _mm256_movemask_epi8(
+        ( _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( Cs ) ) | ... ) ) );
+      if ( mask )
+      {
+        return p + std::countr_zero( mask );
+      }
+    }
+#endif
+
+#if defined( __SSE2__ )
+    for ( ; end - p >= 16; p += 16 )
+    {
+      __m128i chunk = _mm_loadu_si128( (const __m128i*)p );
+      uint32_t mask = static_cast< uint32_t >( _mm_movemask_epi8(
+        ( _mm_cmpeq_epi8( chunk, _mm_set1_epi8( Cs ) ) | ... ) ) );
+      if ( mask )
+      {
+        return p + std::countr_zero( mask );
+      }
+    }
+#endif
+
+    for ( ; p < end; ++p )
+    {
+      if ( ( ( *p == Cs ) || ... ) )
+      {
+        return p;
+      }
+    }
+
+    return end;
+  }
+}  // namespace SIMD
@@ -1,51 +1,306 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <sstream>
 #include <string>
+#include <system_error>
+#include <unordered_map>
 #include <vector>
 #include <compare>
+#include <string_view>
+
+#include "simd.cpp"
 
 namespace Parser
 {
+  using FileID = uint32_t;
+
+  // The text of one version of a file. It is immutable and shared rather than
+  // copied: the LSP document, the SourceFile (and so every string_view in the
+  // parse tree) and the index all hold the same buffer, which is freed when
+  // the last of them lets go.
+  using SourceText = std::shared_ptr< const std::string >;
+
+  SourceText make_source_text( std::string text )
+  {
+    return std::make_shared< const std::string >( std::move( text ) );
+  }
+
+  // A file's last write time, or UNKNOWN_TIME if it hasn't got one (e.g. it
+  // isn't on disk)
+  constexpr int64_t UNKNOWN_TIME = std::numeric_limits< int64_t >::min();
+
+  int64_t ModificationTime( const std::string& path )
+  {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time( path, ec );
+    if ( ec )
+    {
+      return UNKNOWN_TIME;
+    }
+    return time.time_since_epoch().count();
+  }
+
   struct SourceFile
   {
+    FileID id;
     std::string fileName;
-    std::string contents;
+    SourceText text;
+    std::string_view contents;  // all of *text
 
     std::vector< size_t > newlines;
 
+    // The file's last write time from just before it was read, so that a
+    // write while it's being read makes it look changed rather than not
+    int64_t mtime{ UNKNOWN_TIME };
+
     void ParseNewLines();
+    void ApplyEdit( size_t offset, size_t removed, std::string_view inserted );
   };
 
-  SourceFile make_source_file( std::string fileName,
-                               std::string contents )
+  using SourceFilePtr = std::shared_ptr< const SourceFile >;
+
+  // Every SourceFile is given an id so that a SourceLocation doesn't need to
+  // carry a pointer. The registry doesn't own the files: a file is
+  // unregistered when the last reference to it (the ParseContext that parsed
+  // it) goes away.
+  struct SourceFileRegistry
   {
-    SourceFile f{ .fileName = std::move( fileName ),
-                  .contents = std::move( contents ),
-                  .newlines{} };
-    f.ParseNewLines();
-    return f;
-  }
+    std::mutex lock;
+    FileID next_id{ 1 };  // 0 is never a valid id
+    std::unordered_map< FileID, std::weak_ptr< const SourceFile > > files;
+  };
 
-  void SourceFile::ParseNewLines()
+  SourceFileRegistry& GetSourceFileRegistry()
   {
-    newlines.reserve( std::count_if( contents.begin(),
-                                     contents.end(),
-                                     []( auto x ) { return x == '\n'; } ) +
-                      1 );
+    static SourceFileRegistry registry;
+    return registry;
+  }
 
-    for ( size_t i = 0; i <= contents.length(); ++i )
+  SourceFilePtr FindSourceFile( FileID id )
+  {
+    auto& registry = GetSourceFileRegistry();
+    std::lock_guard l( registry.lock );
+    auto pos = registry.files.find( id );
+    if ( pos == registry.files.end() )
     {
-      if ( contents[ i ] == '\n' )
+      return nullptr;
+    }
+    return pos->second.lock();
+  }
+
+  // Give the file an id, and unregister it when the last reference goes
+  SourceFilePtr register_source_file( SourceFile* file )
+  {
+    // SourceLocation only has 32 bits for the offset
+    assert( file->contents.length() < std::numeric_limits< uint32_t >::max() );
+
+    std::shared_ptr< SourceFile > f( file, []( SourceFile* f ) {
+      auto& registry = GetSourceFileRegistry();
       {
-        newlines.push_back( i );
+        std::lock_guard l( registry.lock );
+        registry.files.erase( f->id );
       }
+      delete f;
+    } );
+
+    auto& registry = GetSourceFileRegistry();
+    std::lock_guard l( registry.lock );
+    f->id = registry.next_id++;
+    registry.files.emplace( f->id, f );
+    return f;
+  }
+
+  SourceFilePtr make_source_file( std::string fileName,
+                                  SourceText text,
+                                  int64_t mtime = UNKNOWN_TIME )
+  {
+    assert( text );
+
+    std::string_view contents = *text;
+    auto* f = new SourceFile{ .id = 0,
+                              .fileName = std::move( fileName ),
+                              .text = std::move( text ),
+                              .contents = contents,
+                              .newlines{},
+                              .mtime = mtime };
+    f->ParseNewLines();
+    return register_source_file( f );
+  }
+
+  SourceFilePtr make_source_file( std::string fileName, std::string contents )
+  {
+    return make_source_file( std::move( fileName ),
+                             make_source_text( std::move( contents ) ) );
+  }
+
+  /**
+   * A file whose text isn't read, only where its lines end (e.g. one loaded
+   * from a saved index), so that locations in it can still be turned into
+   * lines and columns. `newlines` is as SourceFile::newlines would be.
+   */
+  SourceFilePtr make_unread_source_file( std::string fileName,
+                                         std::vector< size_t > newlines )
+  {
+    assert( !newlines.empty() );
+
+    auto* f = new SourceFile{ .id = 0,
+                              .fileName = std::move( fileName ),
+                              .text = make_source_text( {} ),
+                              .contents = {},
+                              .newlines = std::move( newlines ) };
+    return register_source_file( f );
+  }
+
+  // Whether `file` was made by make_unread_source_file (an empty file which
+  // was read is the same as one which wasn't)
+  bool IsUnread( const SourceFile& file )
+  {
+    return file.contents.length() != file.newlines.back();
+  }
+
+  /**
+   * Read all of the file at `path` (which is also its name), sized up front
+   * and read in one go. Returns nullptr if it can't be read.
+   */
+  SourceFilePtr read_source_file( std::string path )
+  {
+    const auto mtime = ModificationTime( path );
+    std::ifstream f( path, std::ios::binary | std::ios::ate );
+    if ( !f )
+    {
+      return nullptr;
+    }
+
+    std::string contents;
+    auto size = f.tellg();
+    if ( size > 0 )
+    {
+      contents.resize( static_cast< size_t >( size ) );
+      f.seekg( 0 );
+      f.read( contents.data(), size );
+      contents.resize( static_cast< size_t >( f.gcount() ) );
     }
+    else
+    {
+      // Not a regular file, so it doesn't know its size
+      f.clear();
+      f.seekg( 0 );
+      contents.assign( std::istreambuf_iterator< char >( f ), {} );
+    }
+
+    if ( f.bad() )
+    {
+      return nullptr;
+    }
+
+    return make_source_file( std::move( path ),
+                             make_source_text( std::move( contents ) ),
+                             mtime );
+  }
+
+  /**
+   * The next version of `file`, with the `removed` bytes at `offset` replaced
+   * by `inserted`. `file` itself is unchanged (it is still in use), but only
+   * the newlines of the edited part of the text are scanned.
+   */
+  SourceFilePtr make_edited_source_file( const SourceFile& file,
+                                         size_t offset,
+                                         size_t removed,
+                                         std::string_view inserted )
+  {
+    auto* f = new SourceFile( file );
+    f->ApplyEdit( offset, removed, inserted );
+    return register_source_file( f );
+  }
+
+  void SourceFile::ParseNewLines()
+  {
+    newlines.clear();
+    SIMD::ForEachByte( contents.data(),
+                       contents.data() + contents.length(),
+                       '\n',
+                       [ & ]( const char* nl ) {
+                         newlines.push_back( nl - contents.data() );
+                       } );
     newlines.push_back( contents.length() );
   }
+
+  /**
+   * Replace the `removed` bytes at `offset` with `inserted`, and patch
+   * newlines to match without rescanning the whole file: newlines within the
+   * replaced range are dropped, those after it are shifted, and only
+   * `inserted` is scanned.
+   *
+   * The text is immutable (other versions of the file may still be using it),
+   * so this makes a new buffer rather than editing it in place.
+   */
+  void SourceFile::ApplyEdit( size_t offset,
+                              size_t removed,
+                              std::string_view inserted )
+  {
+    assert( offset + removed <= contents.length() );
+
+    auto edited = std::make_shared< std::string >();
+    edited->reserve( contents.length() - removed + inserted.length() );
+    edited->append( contents.substr( 0, offset ) )
+      .append( inserted )
+      .append( contents.substr( offset + removed ) );
+    text = std::move( edited );
+    contents = *text;
+
+    // The last entry is always the length of the file, never a real newline
+    auto last_newline = newlines.end() - 1;
+    auto first = std::lower_bound( newlines.begin(), last_newline, offset );
+    auto last = std::lower_bound( first, last_newline, offset + removed );
+
+    // Shift everything after the edit (including the end-of-file entry)
+    const auto delta = static_cast< ptrdiff_t >( inserted.length() ) -
+                       static_cast< ptrdiff_t >( removed );
+    for ( auto it = last; it != newlines.end(); ++it )
+    {
+      *it += delta;
+    }
+
+    // Overwrite the newlines in the removed range with those in the inserted
+    // text, then either drop the leftovers or insert the extras
+    auto out = first;
+    std::vector< size_t > extra;
+    SIMD::ForEachByte( inserted.data(),
+                       inserted.data() + inserted.length(),
+                       '\n',
+                       [ & ]( const char* nl ) {
+                         size_t pos = offset + ( nl - inserted.data() );
+                         if ( out != last )
+                         {
+                           *out++ = pos;
+                         }
+                         else
+                         {
+                           extra.push_back( pos );
+                         }
+                       } );
+
+    if ( extra.empty() )
+    {
+      newlines.erase( out, last );
+    }
+    else
+    {
+      newlines.insert( last, extra.begin(), extra.end() );
+    }
+  }
 }  // namespace Parser
 
 namespace Parser
@@ -69,42 +324,68 @@ namespace Parser
   /**
    * Returns the 0-based line number and 0-based byte offset into that line of
    * the supplied 0-based byte offset into the contnts of the file.
+   *
+   * newlines is sorted (and ends with contents.length()), so this is a binary
+   * search for the first newline at or after offset.
    */
   LinePos OffsetToLineByte( const SourceFile& sourceFile, size_t offset )
   {
-    for ( size_t i = 0; i < sourceFile.newlines.size(); ++i )
+    const auto& newlines = sourceFile.newlines;
+    auto pos = std::lower_bound( newlines.begin(), newlines.end(), offset );
+    if ( pos == newlines.end() )
     {
-      if ( sourceFile.newlines[ i ] >= offset )
-      {
-        auto start_of_line = i == 0 ? 0 : sourceFile.newlines[ i - 1 ] + 1;
-        auto column = offset - start_of_line;
+      assert( false && "Invalid offset" );
+      return { 0, 0 };
+    }
 
-        return { i, column };
-      }
+    size_t line = pos - newlines.begin();
+    auto start_of_line = line == 0 ? 0 : newlines[ line - 1 ] + 1;
+    return { line, offset - start_of_line };
+  }
+
+  /**
+   * The inverse of OffsetToLineByte. Positions past the end of a line are
+   * clamped to the end of that line, and lines past the end of the file are
+   * clamped to the end of the file.
+   */
+  size_t LineByteToOffset( const SourceFile& sourceFile, LinePos pos )
+  {
+    const auto& newlines = sourceFile.newlines;
+    if ( pos.line >= newlines.size() )
+    {
+      return newlines.back();
     }
 
-    assert( false && "Invalid offset" );
-    return { 0, 0 };
+    auto start_of_line = pos.line == 0 ? 0 : newlines[ pos.line - 1 ] + 1;
+    return std::min( start_of_line + pos.column, newlines[ pos.line ] );
   }
 }  // namespace Parser
 
 namespace Parser
 {
+  // One of these is stored for every Word the parser creates, so it is kept
+  // small. The line and column are only calculated when asked for, using the
+  // SourceFile's newlines (see OffsetToLineByte).
   struct SourceLocation
   {
-    const SourceFile* sourceFile;
-    size_t offset;  /// 0-based byte offset into source file
-    size_t line;    /// 0-based line
-    size_t column;  /// 0-based byte offset into line
+    FileID file;      /// SourceFile::id
+    uint32_t offset;  /// 0-based byte offset into source file
   };
 
+  static_assert( sizeof( SourceLocation ) == 8 );
+
   std::ostream& operator<<( std::ostream& o, const SourceLocation& loc )
   {
-    o << loc.sourceFile->fileName
-      << ':'
-      << loc.line + 1
+    auto sourceFile = FindSourceFile( loc.file );
+    if ( !sourceFile )
+    {
+      o << "<unknown>:" << loc.offset;
+      return o;
+    }
+
+    o << sourceFile->fileName
       << ':'
-      << loc.column + 1;
+      << OffsetToLineByte( *sourceFile, loc.offset );
 
     return o;
   }
@@ -112,8 +393,8 @@ namespace Parser
   SourceLocation make_source_location( const SourceFile& sourceFile,
                                        size_t offset )
   {
-    auto [ line, column ] = OffsetToLineByte( sourceFile, offset );
-    return { &sourceFile, offset, line, column };
+    assert( offset <= sourceFile.contents.length() );
+    return { sourceFile.id, static_cast< uint32_t >( offset ) };
   }
 
   SourceLocation make_source_location( const SourceFile& sourceFile,
@@ -129,7 +410,7 @@ namespace Parser::Test
   {
     struct Test
     {
-      SourceFile file;
+      SourceFilePtr file;
       size_t offset;
       LinePos pos;
     };
@@ -148,12 +429,94 @@ namespace Parser::Test
 
     for ( auto&& test : tests )
     {
-      auto result = OffsetToLineByte( test.file, test.offset );
+      auto result = OffsetToLineByte( *test.file, test.offset );
       if ( result != test.pos )
       {
         std::cerr << "Expected " << test.pos << " but got " << result << '\n';
         abort();
       }
+
+      auto offset = LineByteToOffset( *test.file, test.pos );
+      if ( offset != test.offset )
+      {
+        std::cerr << "Expected " << test.offset << " but got " << offset
+                  << '\n';
+        abort();
+      }
+    }
+  }
+
+  void TestApplyEdit()
+  {
+    struct Test
+    {
+      std::string contents;
+      size_t offset;
+      size_t removed;
+      std::string inserted;
+    };
+
+    std::vector< Test > tests = {
+      { "", 0, 0, "" },
+      { "", 0, 0, "a\nb\n" },
+      { "1\n2\n3\n4", 0, 0, "\n" },
+      { "1\n2\n3\n4", 7, 0, "\n5\n" },
+      { "1\n2\n3\n4", 1, 1, "" },
+      { "1\n2\n3\n4", 1, 4, "x" },
+      { "1\n2\n3\n4", 1, 4, "\n\n\n\n\n" },
+      { "1\n2\n3\n4", 0, 7, "" },
+      { "aaaa\nbbbb\ncccc", 6, 2, "b\nb\nb" },
+      { std::string( 100, '\n' ), 10, 50, std::string( 70, 'x' ) + "\n" },
+    };
+
+    for ( auto&& test : tests )
+    {
+      auto original = make_source_text( test.contents );
+      SourceFile file{ .text = original, .contents = *original };
+      file.ParseNewLines();
+      file.ApplyEdit( test.offset, test.removed, test.inserted );
+
+      auto replaced = test.contents;
+      replaced.replace( test.offset, test.removed, test.inserted );
+      SourceFile expected{ .text = make_source_text( replaced ) };
+      expected.contents = *expected.text;
+      expected.ParseNewLines();
+
+      if ( file.contents != expected.contents ||
+           file.newlines != expected.newlines || *original != test.contents )
+      {
+        std::cerr << "Edit at " << test.offset << " of " << test.removed
+                  << " bytes didn't match a full rescan\n";
+        abort();
+      }
+    }
+  }
+
+  void TestSourceFileRegistry()
+  {
+    FileID id;
+    {
+      auto file = make_source_file( "test", "1\n2\n3\n4" );
+      id = file->id;
+      if ( FindSourceFile( id ) != file )
+      {
+        std::cerr << "Expected file " << id << " to be registered\n";
+        abort();
+      }
+
+      std::ostringstream o;
+      o << make_source_location( *file, 4 );
+      if ( o.str() != "test:3:1" )
+      {
+        std::cerr << "Expected test:3:1 but got " << o.str() << '\n';
+        abort();
+      }
+    }
+
+    if ( FindSourceFile( id ) )
+    {
+      std::cerr << "Expected file " << id << " to be unregistered\n";
+      abort();
     }
   }
 };  // namespace Parser::Test
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <compare>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Parser
+{
+  // An interned name (of a namespace, proc, variable...). The text is stored
+  // once, in the SymbolTable, and comparing two Symbols compares their ids.
+  // The same text always gets the same id for the life of the process.
+  //
+  // NOTE: Symbols are ordered by id, i.e. the order in which they were first
+  // interned, not by their text.
+  struct Symbol
+  {
+    uint32_t id{ 0 };  // 0 is always the empty string
+
+    std::string_view Text() const;
+
+    auto operator<=>( const Symbol& ) const = default;
+  };
+
+  std::ostream& operator<<( std::ostream& o, Symbol symbol )
+  {
+    return o << symbol.Text();
+  }
+
+  struct SymbolTable
+  {
+    struct Entry
+    {
+      const char* text;
+      uint32_t length;
+      uint32_t hash;
+    };
+
+    // Entries are stored in blocks which double in size, so that they never
+    // move once written: Symbol::Text() reads them without taking the lock.
+    static constexpr size_t FIRST_BLOCK_SIZE = 1024;
+    static constexpr size_t MAX_BLOCKS = 22;  // enough for every 32 bit id
+    std::array< std::unique_ptr< Entry[] >, MAX_BLOCKS > blocks;
+    uint32_t size{ 0 };
+
+    // Open addressing (linear probing) table of ids, where 0 is an empty slot
+    // (the empty string is never in here). The size is a power of 2.
+    std::vector< uint32_t > slots;
+
+    // The text of all of the symbols. Nothing is ever freed.
+    std::pmr::monotonic_buffer_resource arena;
+
+    // Readers take it shared to look up a symbol, and only take it exclusively
+    // to add one
+    std::shared_mutex lock;
+
+    SymbolTable()
+    {
+      blocks[ 0 ] = std::make_unique< Entry[] >( FIRST_BLOCK_SIZE );
+      blocks[ 0 ][ 0 ] = Entry{ .text = "", .length = 0, .hash = 0 };
+      size = 1;
+    }
+
+    static uint32_t Hash( std::string_view text )
+    {
+      return static_cast< uint32_t >( std::hash< std::string_view >{}( text ) );
+    }
+
+    // The block that id is in, and where it is in that block
+    static std::pair< size_t, size_t > Locate( uint32_t id )
+    {
+      size_t block = std::bit_width( id / FIRST_BLOCK_SIZE + 1 ) - 1;
+      return { block, id - FIRST_BLOCK_SIZE * ( ( size_t{ 1 } << block ) - 1 ) };
+    }
+
+    Entry& At( uint32_t id ) const
+    {
+      auto [ block, offset ] = Locate( id );
+      return blocks[ block ][ offset ];
+    }
+
+    std::optional< Symbol > Find( std::string_view text, uint32_t hash ) const
+    {
+      if ( slots.empty() )
+      {
+        return std::nullopt;
+      }
+
+      const size_t mask = slots.size() - 1;
+      for ( size_t slot = hash & mask; slots[ slot ] != 0;
+            slot = ( slot + 1 ) & mask )
+      {
+        const auto& entry = At( slots[ slot ] );
+        if ( entry.hash == hash &&
+             std::string_view( entry.text, entry.length ) == text )
+        {
+          return Symbol{ slots[ slot ] };
+        }
+      }
+
+      return std::nullopt;
+    }
+
+    void AddSlot( uint32_t id, uint32_t hash )
+    {
+      const size_t mask = slots.size() - 1;
+      size_t slot = hash & mask;
+      while ( slots[ slot ] != 0 )
+      {
+        slot = ( slot + 1 ) & mask;
+      }
+      slots[ slot ] = id;
+    }
+
+    // Must hold the lock exclusively, and text must not already be interned
+    Symbol Insert( std::string_view text, uint32_t hash )
+    {
+      assert( size < std::numeric_limits< uint32_t >::max() );
+
+      // Keep the load factor under 3/4
+      if ( ( size_t{ size } + 1 ) * 4 > slots.size() * 3 )
+      {
+        std::vector< uint32_t > old(
+          std::max( FIRST_BLOCK_SIZE, slots.size() * 2 ) );
+        std::swap( old, slots );
+        for ( auto id : old )
+        {
+          if ( id != 0 )
+          {
+            AddSlot( id, At( id ).hash );
+          }
+        }
+      }
+
+      const uint32_t id = size;
+      const auto block = Locate( id ).first;
+      if ( !blocks[ block ] )
+      {
+        blocks[ block ] =
+          std::make_unique< Entry[] >( FIRST_BLOCK_SIZE << block );
+      }
+
+      auto* copy = static_cast< char* >( arena.allocate( text.length(), 1 ) );
+      std::memcpy( copy, text.data(), text.length() );
+      At( id ) = Entry{
+        .text = copy,
+        .length = static_cast< uint32_t >( text.length() ),
+        .hash = hash,
+      };
+      ++size;
+
+      AddSlot( id, hash );
+      return Symbol{ id };
+    }
+  };
+
+  SymbolTable& GetSymbolTable()
+  {
+    static SymbolTable table;
+    return table;
+  }
+
+  std::string_view Symbol::Text() const
+  {
+    const auto& entry = GetSymbolTable().At( id );
+    return { entry.text, entry.length };
+  }
+
+  /**
+   * Returns the Symbol for text, adding it to the table if it isn't there
+   * already.
+   */
+  Symbol Intern( std::string_view text )
+  {
+    if ( text.empty() )
+    {
+      return {};
+    }
+
+    auto& table = GetSymbolTable();
+    const auto hash = SymbolTable::Hash( text );
+    {
+      std::shared_lock l( table.lock );
+      if ( auto symbol = table.Find( text, hash ) )
+      {
+        return *symbol;
+      }
+    }
+
+    std::unique_lock l( table.lock );
+    // Someone else might have added it in the meantime
+    if ( auto symbol = table.Find( text, hash ) )
+    {
+      return *symbol;
+    }
+    return table.Insert( text, hash );
+  }
+
+  /**
+   * Returns the Symbol for text if it has ever been interned. If it hasn't,
+   * then nothing can have that name.
+   */
+  std::optional< Symbol > FindSymbol( std::string_view text )
+  {
+    if ( text.empty() )
+    {
+      return Symbol{};
+    }
+
+    auto& table = GetSymbolTable();
+    std::shared_lock l( table.lock );
+    return table.Find( text, SymbolTable::Hash( text ) );
+  }
+}  // namespace Parser
+
+template<>
+struct std::hash< Parser::Symbol >
+{
+  size_t operator()( Parser::Symbol symbol ) const
+  {
+    return std::hash< uint32_t >{}( symbol.id );
+  }
+};
+
+namespace Parser::Test
+{
+  void TestSymbolTable()
+  {
+    if ( Intern( "" ) != Symbol{} || Symbol{}.Text() != "" )
+    {
+      std::cerr << "Expected the empty string to be symbol 0\n";
+      abort();
+    }
+
+    if ( FindSymbol( "TestSymbolTable::never interned" ) )
+    {
+      std::cerr << "Expected an unknown name not to have a symbol\n";
+      abort();
+    }
+
+    // Enough to need several blocks and to rehash a few times, interned from
+    // a few threads at once
+    std::vector< std::string > names;
+    for ( int i = 0; i < 10000; ++i )
+    {
+      names.push_back( "TestSymbolTable::name" + std::to_string( i ) );
+    }
+
+    std::vector< std::vector< Symbol > > symbols( 4 );
+    std::vector< std::thread > threads;
+    for ( auto& result : symbols )
+    {
+      threads.emplace_back( [ & ]() {
+        for ( const auto& name : names )
+        {
+          result.push_back( Intern( name ) );
+        }
+      } );
+    }
+    for ( auto& thread : threads )
+    {
+      thread.join();
+    }
+
+    for ( size_t i = 0; i < names.size(); ++i )
+    {
+      for ( const auto& result : symbols )
+      {
+        if ( result[ i ] != symbols[ 0 ][ i ] ||
+             result[ i ].Text() != names[ i ] ||
+             FindSymbol( names[ i ] ) != result[ i ] )
+        {
+          std::cerr << "Symbol for " << names[ i ] << " doesn't match\n";
+          abort();
+        }
+      }
+
+      if ( i > 0 && symbols[ 0 ][ i ] == symbols[ 0 ][ i - 1 ] )
+      {
+        std::cerr << "Expected different names to be different symbols\n";
+        abort();
+      }
+    }
+  }
+}  // namespace Parser::Test
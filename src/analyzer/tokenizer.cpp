@@ -0,0 +1,1101 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <tcl.h>
+
+#include "simd.cpp"
+
+// A Tcl tokenizer which doesn't need Tcl (or an interp). It follows the rules
+// of Tcl_ParseCommand and produces the same tokens, so that the same code can
+// turn either into Words, but it skips over the plain text of a script with
+// SIMD::FindFirstOf rather than looking at it a byte at a time.
+namespace Parser::Native
+{
+  struct Token
+  {
+    int type;  // TCL_TOKEN_*, as for a Tcl_Token
+    const char* start;
+    size_t size;
+    size_t numComponents;
+  };
+
+  // The tokens of one command. The members that Words are built from have the
+  // same names (and meanings) as those of a Tcl_Parse.
+  struct Parse
+  {
+    const char* commentStart;
+    size_t commentSize;
+    const char* commandStart;
+    size_t commandSize;
+    size_t numWords;
+    Token* tokenPtr;
+    size_t numTokens;
+
+    // Storage for the tokens, which is reused from one command to the next
+    std::vector< Token > tokens;
+  };
+
+  namespace Chars
+  {
+    // The character classes of tclParse.c
+    enum : uint8_t
+    {
+      NORMAL = 0,
+      SPACE = 0x1,
+      COMMAND_END = 0x2,
+      SUBS = 0x4,
+      QUOTE = 0x8,
+      CLOSE_PAREN = 0x10,
+      CLOSE_BRACK = 0x20,
+      BRACE = 0x40,
+    };
+
+    constexpr std::array< uint8_t, 256 > TYPES = []() {
+      std::array< uint8_t, 256 > types{};
+      for ( unsigned char c : std::string_view( "\t\v\f\r " ) )
+      {
+        types[ c ] = SPACE;
+      }
+      types[ '\n' ] = types[ ';' ] = COMMAND_END;
+      types[ '$' ] = types[ '[' ] = types[ '\\' ] = types[ 0 ] = SUBS;
+      types[ '"' ] = QUOTE;
+      types[ ')' ] = CLOSE_PAREN;
+      types[ ']' ] = CLOSE_BRACK;
+      types[ '{' ] = types[ '}' ] = BRACE;
+      return types;
+    }();
+
+    uint8_t Type( char c )
+    {
+      return TYPES[ static_cast< unsigned char >( c ) ];
+    }
+
+    // Whitespace between list elements
+    bool IsSpace( char c )
+    {
+      return c == ' ' || ( c >= '\t' && c <= '\r' );
+    }
+
+    // Characters of a variable name which don't need braces
+    bool IsBareword( char c )
+    {
+      return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+             ( c >= '0' && c <= '9' ) || c == '_';
+    }
+
+    bool IsHexDigit( char c )
+    {
+      return ( c >= '0' && c <= '9' ) || ( c >= 'a' && c <= 'f' ) ||
+             ( c >= 'A' && c <= 'F' );
+    }
+  }  // namespace Chars
+
+  /**
+   * The number of hex digits (of at most numBytes) at the start of src which
+   * make up a \x, \u or \U escape. As TclParseHex, this stops before the value
+   * goes past the last unicode character.
+   */
+  size_t HexLength( const char* src, size_t numBytes )
+  {
+    uint32_t value = 0;
+    size_t length = 0;
+    while ( length < numBytes && Chars::IsHexDigit( src[ length ] ) &&
+            value <= 0x10FFF )
+    {
+      char c = src[ length++ ];
+      value = value * 16 + ( c <= '9'   ? c - '0'
+                             : c <= 'F' ? c - 'A' + 10
+                                        : c - 'a' + 10 );
+    }
+    return length;
+  }
+
+  /**
+   * The length of the backslash sequence at the start of src (as
+   * TclParseBackslash).
+   */
+  size_t BackslashLength( const char* src, size_t numBytes )
+  {
+    if ( numBytes < 2 )
+    {
+      return numBytes;
+    }
+
+    const char* p = src + 1;
+    switch ( *p )
+    {
+      case 'x':
+        return 2 + HexLength( p + 1, numBytes > 3 ? 2 : numBytes - 2 );
+      case 'u':
+        return 2 + HexLength( p + 1, numBytes > 5 ? 4 : numBytes - 2 );
+      case 'U':
+        return 2 + HexLength( p + 1, numBytes > 9 ? 8 : numBytes - 2 );
+
+      case '\n':
+      {
+        // Along with any spaces and tabs that follow it
+        size_t length = 2;
+        while ( length < numBytes &&
+                ( src[ length ] == ' ' || src[ length ] == '\t' ) )
+        {
+          ++length;
+        }
+        return length;
+      }
+
+      case '\0':
+        return 1;  // just the backslash
+
+      default:
+        break;
+    }
+
+    if ( *p >= '0' && *p <= '7' )
+    {
+      // Up to 3 octal digits, as long as the value fits in a byte
+      if ( numBytes == 2 || p[ 1 ] < '0' || p[ 1 ] > '7' )
+      {
+        return 2;
+      }
+      if ( numBytes == 3 || p[ 2 ] < '0' || p[ 2 ] > '7' || p[ 0 ] >= '4' )
+      {
+        return 3;
+      }
+      return 4;
+    }
+
+    // A multi-byte UTF-8 character is escaped as a whole. An incomplete or
+    // invalid one is taken a byte at a time.
+    const auto lead = static_cast< unsigned char >( *p );
+    const size_t length = lead >= 0xC0 && lead < 0xE0   ? 2
+                          : lead >= 0xE0 && lead < 0xF0 ? 3
+                          : lead >= 0xF0 && lead < 0xF5 ? 4
+                                                        : 1;
+    if ( length > numBytes - 1 )
+    {
+      return 2;
+    }
+    for ( size_t i = 1; i < length; ++i )
+    {
+      if ( ( static_cast< unsigned char >( p[ i ] ) & 0xC0 ) != 0x80 )
+      {
+        return 2;
+      }
+    }
+    return 1 + length;
+  }
+
+  /**
+   * Finds the first element of the list in [ list, list + length ), as
+   * TclFindElement: element and size are the element without any braces or
+   * quotes around it, next is the start of the following element, and literal
+   * is false if the element contains backslash sequences which would need to
+   * be substituted. Returns false if the list is malformed.
+   *
+   * If there are no more elements, element is the end of the list.
+   */
+  bool FindElement( const char* list,
+                    size_t length,
+                    const char*& element,
+                    const char*& next,
+                    size_t& size,
+                    bool& literal )
+  {
+    const char* p = list;
+    const char* const limit = list + length;
+    literal = true;
+    size = 0;
+
+    while ( p < limit && Chars::IsSpace( *p ) )
+    {
+      ++p;
+    }
+    if ( p == limit )
+    {
+      element = next = limit;
+      return true;
+    }
+
+    size_t openBraces = 0;
+    bool inQuotes = false;
+    if ( *p == '{' )
+    {
+      openBraces = 1;
+      ++p;
+    }
+    else if ( *p == '"' )
+    {
+      inQuotes = true;
+      ++p;
+    }
+    element = p;
+
+    bool done = false;
+    for ( ; p < limit && !done; ++p )
+    {
+      switch ( *p )
+      {
+        case '{':
+          if ( openBraces != 0 )
+          {
+            ++openBraces;
+          }
+          break;
+
+        case '}':
+          if ( openBraces > 1 )
+          {
+            --openBraces;
+          }
+          else if ( openBraces == 1 )
+          {
+            size = p - element;
+            if ( p + 1 < limit && !Chars::IsSpace( p[ 1 ] ) )
+            {
+              return false;  // junk after the close brace
+            }
+            done = true;
+          }
+          break;
+
+        case '\\':
+          if ( openBraces == 0 )
+          {
+            literal = false;
+          }
+          p += BackslashLength( p, limit - p ) - 1;
+          break;
+
+        case '"':
+          if ( inQuotes )
+          {
+            size = p - element;
+            if ( p + 1 < limit && !Chars::IsSpace( p[ 1 ] ) )
+            {
+              return false;  // junk after the close quote
+            }
+            done = true;
+          }
+          break;
+
+        default:
+          if ( Chars::IsSpace( *p ) && openBraces == 0 && !inQuotes )
+          {
+            size = p - element;
+            done = true;
+            --p;  // the space is skipped below
+          }
+          break;
+      }
+    }
+
+    if ( !done )
+    {
+      if ( openBraces != 0 || inQuotes )
+      {
+        return false;  // unmatched open brace or quote
+      }
+      size = p - element;
+    }
+
+    while ( p < limit && Chars::IsSpace( *p ) )
+    {
+      ++p;
+    }
+    next = p;
+    return true;
+  }
+
+  // The state of parsing one (top-level) command. Nested commands (command
+  // substitutions) are parsed with the same Tokenizer, and their tokens are
+  // thrown away once we know where they end, as for Tcl_ParseCommand.
+  struct Tokenizer
+  {
+    std::vector< Token >& tokens;
+    const char* const end;  // of the script
+
+    // Of the command currently being parsed: where parsing stopped, and
+    // whether it ended with a backslash-newline
+    const char* term = nullptr;
+    bool incomplete = false;
+
+    struct Command
+    {
+      const char* commentStart = nullptr;
+      size_t commentSize = 0;
+      const char* commandStart = nullptr;
+      size_t commandSize = 0;
+      size_t numWords = 0;
+    };
+
+    /**
+     * Skips spaces and backslash-newlines (but not newlines), and returns how
+     * many bytes that was. type is set to the type of the character that
+     * stopped it.
+     */
+    size_t WhiteSpace( const char* src, size_t numBytes, uint8_t& type )
+    {
+      const char* p = src;
+      type = Chars::NORMAL;
+      while ( true )
+      {
+        while ( numBytes && ( ( type = Chars::Type( *p ) ) & Chars::SPACE ) )
+        {
+          --numBytes;
+          ++p;
+        }
+        if ( numBytes && ( type & Chars::SUBS ) && *p == '\\' &&
+             numBytes > 1 && p[ 1 ] == '\n' )
+        {
+          p += 2;
+          numBytes -= 2;
+          if ( numBytes == 0 )
+          {
+            incomplete = true;
+            break;
+          }
+          continue;
+        }
+        break;
+      }
+      return p - src;
+    }
+
+    /**
+     * Skips whitespace, newlines and comments before a command, and returns
+     * how many bytes that was
+     */
+    size_t Comment( const char* src, size_t numBytes, Command& command )
+    {
+      const char* p = src;
+      while ( numBytes )
+      {
+        uint8_t type;
+        do
+        {
+          size_t scanned = WhiteSpace( p, numBytes, type );
+          p += scanned;
+          numBytes -= scanned;
+        } while ( numBytes && *p == '\n' && ( ++p, numBytes-- ) );
+
+        if ( numBytes == 0 || *p != '#' )
+        {
+          break;
+        }
+        if ( !command.commentStart )
+        {
+          command.commentStart = p;
+        }
+
+        // The comment runs to the next newline which isn't escaped
+        while ( numBytes )
+        {
+          const char* next =
+            SIMD::FindFirstOf< '\\', '\n' >( p, p + numBytes );
+          numBytes -= next - p;
+          p = next;
+          if ( numBytes == 0 )
+          {
+            break;
+          }
+
+          if ( *p == '\n' )
+          {
+            ++p;
+            --numBytes;
+            break;
+          }
+
+          size_t scanned = WhiteSpace( p, numBytes, type );
+          if ( scanned == 0 )
+          {
+            scanned = BackslashLength( p, numBytes );
+          }
+          p += scanned;
+          numBytes -= scanned;
+        }
+        command.commentSize = p - command.commentStart;
+      }
+      return p - src;
+    }
+
+    /**
+     * The end of the run of plain text starting at p: the first character
+     * that is a substitution or is in mask.
+     */
+    static const char* SkipText( const char* p,
+                                 const char* limit,
+                                 uint8_t mask )
+    {
+      using namespace Chars;
+      switch ( mask )
+      {
+        case SPACE | COMMAND_END:
+          return SIMD::FindFirstOf< '\t', '\v', '\f', '\r', ' ', '\n', ';',
+                                    '$', '[', '\\', '\0' >( p, limit );
+        case SPACE | COMMAND_END | CLOSE_BRACK:
+          return SIMD::FindFirstOf< '\t', '\v', '\f', '\r', ' ', '\n', ';',
+                                    ']', '$', '[', '\\', '\0' >( p, limit );
+        case QUOTE:
+          return SIMD::FindFirstOf< '"', '$', '[', '\\', '\0' >( p, limit );
+        case CLOSE_PAREN:
+          return SIMD::FindFirstOf< ')', '$', '[', '\\', '\0' >( p, limit );
+        default:
+          while ( p < limit && !( Type( *p ) & ( mask | SUBS ) ) )
+          {
+            ++p;
+          }
+          return p;
+      }
+    }
+
+    /**
+     * Adds the tokens for text (with substitutions) up to the first character
+     * in mask, as Tcl's ParseTokens. term is set to where it stopped.
+     */
+    bool Tokens( const char* src, size_t numBytes, uint8_t mask )
+    {
+      const size_t originalTokens = tokens.size();
+      uint8_t type;
+      while ( numBytes && !( ( type = Chars::Type( *src ) ) & mask ) )
+      {
+        const char* start = src;
+        if ( !( type & Chars::SUBS ) )
+        {
+          src = SkipText( src + 1, src + numBytes, mask );
+          numBytes -= src - start;
+          tokens.push_back( Token{ TCL_TOKEN_TEXT,
+                                   start,
+                                   static_cast< size_t >( src - start ),
+                                   0 } );
+        }
+        else if ( *src == '$' )
+        {
+          const size_t varToken = tokens.size();
+          if ( !VarName( src, numBytes ) )
+          {
+            return false;
+          }
+          src += tokens[ varToken ].size;
+          numBytes -= tokens[ varToken ].size;
+        }
+        else if ( *src == '[' )
+        {
+          // Parse the command(s) inside the brackets to find the end, then
+          // throw away their tokens; they're parsed again as a script
+          ++src;
+          --numBytes;
+          const bool outerIncomplete = incomplete;
+          const size_t outerTokens = tokens.size();
+          while ( true )
+          {
+            Command nested;
+            if ( !ParseCommand( src, numBytes, true, nested ) )
+            {
+              return false;
+            }
+            tokens.resize( outerTokens );
+            src = nested.commandStart + nested.commandSize;
+            numBytes = end - src;
+
+            if ( term < end && *term == ']' && !incomplete )
+            {
+              break;
+            }
+            if ( numBytes == 0 )
+            {
+              return false;  // missing close-bracket
+            }
+          }
+          incomplete = outerIncomplete;
+          tokens.push_back( Token{ TCL_TOKEN_COMMAND,
+                                   start,
+                                   static_cast< size_t >( src - start ),
+                                   0 } );
+        }
+        else if ( *src == '\\' )
+        {
+          const size_t size = BackslashLength( src, numBytes );
+          if ( size == 1 )
+          {
+            // Just a backslash, at the end of the script
+            tokens.push_back( Token{ TCL_TOKEN_TEXT, src, 1, 0 } );
+            ++src;
+            --numBytes;
+            continue;
+          }
+
+          if ( src[ 1 ] == '\n' )
+          {
+            if ( numBytes == 2 )
+            {
+              incomplete = true;
+            }
+
+            // A backslash-newline is a word separator
+            if ( mask & Chars::SPACE )
+            {
+              break;
+            }
+          }
+
+          tokens.push_back( Token{ TCL_TOKEN_BS, src, size, 0 } );
+          src += size;
+          numBytes -= size;
+        }
+        else
+        {
+          // A null
+          tokens.push_back( Token{ TCL_TOKEN_TEXT, src, 1, 0 } );
+          ++src;
+          --numBytes;
+        }
+      }
+
+      if ( tokens.size() == originalTokens )
+      {
+        // Always at least one token, even if it's empty
+        tokens.push_back( Token{ TCL_TOKEN_TEXT, src, 0, 0 } );
+      }
+      term = src;
+      return true;
+    }
+
+    /**
+     * Adds the tokens for the variable reference at src (a $), as
+     * Tcl_ParseVarName. A $ that isn't followed by a name is just text.
+     */
+    bool VarName( const char* src, size_t numBytes )
+    {
+      const size_t varIndex = tokens.size();
+      tokens.push_back( Token{ TCL_TOKEN_VARIABLE, src, 0, 0 } );
+      ++src;
+      --numBytes;
+
+      if ( numBytes > 0 && *src == '{' )
+      {
+        // ${name}: everything up to the close brace
+        ++src;
+        --numBytes;
+        auto* close =
+          static_cast< const char* >( memchr( src, '}', numBytes ) );
+        if ( !close )
+        {
+          return false;  // missing close-brace for variable name
+        }
+        tokens.push_back( Token{ TCL_TOKEN_TEXT,
+                                 src,
+                                 static_cast< size_t >( close - src ),
+                                 0 } );
+        src = close + 1;
+      }
+      else
+      {
+        // Letters, digits, underscores and namespace separators, optionally
+        // followed by an array index in parentheses
+        const char* name = src;
+        while ( numBytes )
+        {
+          if ( Chars::IsBareword( *src ) )
+          {
+            ++src;
+            --numBytes;
+          }
+          else if ( *src == ':' && numBytes > 1 && src[ 1 ] == ':' )
+          {
+            src += 2;
+            numBytes -= 2;
+            while ( numBytes && *src == ':' )
+            {
+              ++src;
+              --numBytes;
+            }
+          }
+          else
+          {
+            break;
+          }
+        }
+
+        const bool array = numBytes && *src == '(';
+        if ( src == name && !array )
+        {
+          tokens[ varIndex ] = Token{ TCL_TOKEN_TEXT, name - 1, 1, 0 };
+          return true;
+        }
+
+        tokens.push_back( Token{ TCL_TOKEN_TEXT,
+                                 name,
+                                 static_cast< size_t >( src - name ),
+                                 0 } );
+        if ( array )
+        {
+          if ( !Tokens( src + 1, numBytes - 1, Chars::CLOSE_PAREN ) )
+          {
+            return false;
+          }
+          if ( term == src + numBytes || *term != ')' )
+          {
+            return false;  // missing )
+          }
+          src = term + 1;
+        }
+      }
+
+      tokens[ varIndex ].size = src - tokens[ varIndex ].start;
+      tokens[ varIndex ].numComponents = tokens.size() - ( varIndex + 1 );
+      return true;
+    }
+
+    /**
+     * Adds the tokens for the quoted word at src, as Tcl_ParseQuotedString.
+     * termPtr is set to just after the close quote.
+     */
+    bool QuotedString( const char* src,
+                       size_t numBytes,
+                       const char*& termPtr )
+    {
+      if ( !Tokens( src + 1, numBytes - 1, Chars::QUOTE ) )
+      {
+        return false;
+      }
+      if ( term == end || *term != '"' )
+      {
+        return false;  // missing "
+      }
+      termPtr = term + 1;
+      return true;
+    }
+
+    /**
+     * Adds the tokens for the braced word at src, as Tcl_ParseBraces: the
+     * text between the braces, split at any backslash-newlines. termPtr is
+     * set to just after the close brace.
+     */
+    bool Braces( const char* src, size_t numBytes, const char*& termPtr )
+    {
+      const char* const limit = src + numBytes;
+      const size_t startIndex = tokens.size();
+      Token text{ TCL_TOKEN_TEXT, src + 1, 0, 0 };
+      size_t level = 1;
+      while ( true )
+      {
+        src = SIMD::FindFirstOf< '{', '}', '\\' >( src + 1, limit );
+        if ( src == limit )
+        {
+          return false;  // missing close-brace
+        }
+
+        if ( *src == '{' )
+        {
+          ++level;
+        }
+        else if ( *src == '}' )
+        {
+          if ( --level == 0 )
+          {
+            // Finish the text, unless it's empty because it follows a
+            // backslash-newline
+            if ( src != text.start || tokens.size() == startIndex )
+            {
+              text.size = src - text.start;
+              tokens.push_back( text );
+            }
+            termPtr = src + 1;
+            return true;
+          }
+        }
+        else
+        {
+          const size_t length = BackslashLength( src, limit - src );
+          if ( length > 1 && src[ 1 ] == '\n' )
+          {
+            // Backslash-newline is substituted even inside braces, so it gets
+            // a token of its own
+            if ( limit - src == 2 )
+            {
+              incomplete = true;
+            }
+            text.size = src - text.start;
+            if ( text.size != 0 )
+            {
+              tokens.push_back( text );
+            }
+            tokens.push_back( Token{ TCL_TOKEN_BS, src, length, 0 } );
+            text = Token{ TCL_TOKEN_TEXT, src + length, 0, 0 };
+          }
+          src += length - 1;
+        }
+      }
+    }
+
+    /**
+     * Expands the literal list of {*}word, whose word token is at wordIndex,
+     * into a word per element, as Tcl_ParseCommand does. If it isn't a
+     * literal list, the word is left to be expanded when it's evaluated.
+     */
+    void ExpandLiteral( size_t wordIndex, Command& command )
+    {
+      const size_t numComponents = tokens[ wordIndex ].numComponents;
+      for ( size_t i = 1; i <= numComponents; ++i )
+      {
+        if ( tokens[ wordIndex + i ].type != TCL_TOKEN_TEXT )
+        {
+          tokens[ wordIndex ].type = TCL_TOKEN_EXPAND_WORD;
+          return;
+        }
+      }
+
+      const Token& last = tokens[ wordIndex + numComponents ];
+      const char* const listEnd = last.start + last.size;
+      const char* const listStart = tokens[ wordIndex + 1 ].start;
+
+      size_t elemCount = 0;
+      for ( const char* nextElem = listStart; nextElem < listEnd; )
+      {
+        const char* elemStart;
+        size_t size;
+        bool literal;
+        if ( !FindElement( nextElem,
+                           listEnd - nextElem,
+                           elemStart,
+                           nextElem,
+                           size,
+                           literal ) ||
+             !literal )
+        {
+          tokens[ wordIndex ].type = TCL_TOKEN_EXPAND_WORD;
+          return;
+        }
+        if ( elemStart < listEnd )
+        {
+          ++elemCount;
+        }
+      }
+
+      if ( elemCount == 0 )
+      {
+        // {*}{}: no words at all
+        --command.numWords;
+        tokens.resize( wordIndex );
+        return;
+      }
+
+      // A simple word for each element, pointing at its text in the script
+      command.numWords += elemCount - 1;
+      tokens.resize( wordIndex + 2 * elemCount );
+      Token* tokenPtr = &tokens[ wordIndex ];
+      const char* nextElem = listStart;
+      while ( Chars::IsSpace( *nextElem ) )
+      {
+        ++nextElem;
+      }
+      while ( nextElem < listEnd )
+      {
+        tokenPtr[ 0 ] = Token{ TCL_TOKEN_SIMPLE_WORD, nextElem, 0, 1 };
+        tokenPtr[ 1 ] = Token{ TCL_TOKEN_TEXT, nullptr, 0, 0 };
+        bool literal;
+        FindElement( nextElem,
+                     listEnd - nextElem,
+                     tokenPtr[ 1 ].start,
+                     nextElem,
+                     tokenPtr[ 1 ].size,
+                     literal );
+
+        const char* elemEnd = tokenPtr[ 1 ].start + tokenPtr[ 1 ].size;
+        tokenPtr[ 0 ].size = elemEnd - tokenPtr[ 0 ].start;
+        if ( elemEnd != listEnd && !Chars::IsSpace( *elemEnd ) )
+        {
+          ++tokenPtr[ 0 ].size;  // the close brace or quote
+        }
+        tokenPtr += 2;
+      }
+    }
+
+    /**
+     * Parses the command at the start of [ start, start + numBytes ), as
+     * Tcl_ParseCommand. A nested command (a command substitution) also ends at
+     * a close bracket.
+     */
+    bool ParseCommand( const char* start,
+                       size_t numBytes,
+                       bool nested,
+                       Command& command )
+    {
+      using namespace Chars;
+      const uint8_t terminators =
+        nested ? COMMAND_END | CLOSE_BRACK : COMMAND_END;
+
+      term = start + numBytes;
+      incomplete = false;
+
+      size_t scanned = Comment( start, numBytes, command );
+      const char* src = start + scanned;
+      numBytes -= scanned;
+      if ( numBytes == 0 && nested )
+      {
+        incomplete = true;
+      }
+      command.commandStart = src;
+
+      while ( true )
+      {
+        uint8_t type;
+        scanned = WhiteSpace( src, numBytes, type );
+        src += scanned;
+        numBytes -= scanned;
+        if ( numBytes == 0 )
+        {
+          term = src;
+          break;
+        }
+        if ( type & terminators )
+        {
+          term = src;
+          ++src;
+          break;
+        }
+
+        const size_t wordIndex = tokens.size();
+        tokens.push_back( Token{ TCL_TOKEN_WORD, src, 0, 0 } );
+        ++command.numWords;
+
+        bool expandWord = false;
+        while ( true )
+        {
+          const char* termPtr;
+          if ( *src == '"' )
+          {
+            if ( !QuotedString( src, numBytes, termPtr ) )
+            {
+              return false;
+            }
+            src = termPtr;
+            numBytes = end - src;
+          }
+          else if ( *src == '{' )
+          {
+            if ( !Braces( src, numBytes, termPtr ) )
+            {
+              return false;
+            }
+            src = termPtr;
+            numBytes = end - src;
+
+            // {*} followed by more of the word is the expansion prefix
+            const Token& text = tokens.back();
+            if ( !expandWord && tokens.size() == wordIndex + 2 &&
+                 text.size == 1 && text.start[ 0 ] == '*' && numBytes > 0 &&
+                 WhiteSpace( src, numBytes, type ) == 0 &&
+                 type != COMMAND_END )
+            {
+              expandWord = true;
+              tokens.pop_back();
+              continue;
+            }
+          }
+          else
+          {
+            if ( !Tokens( src, numBytes, SPACE | terminators ) )
+            {
+              return false;
+            }
+            src = term;
+            numBytes = end - src;
+          }
+          break;
+        }
+
+        Token& word = tokens[ wordIndex ];
+        word.size = src - word.start;
+        word.numComponents = tokens.size() - ( wordIndex + 1 );
+        if ( expandWord )
+        {
+          ExpandLiteral( wordIndex, command );
+        }
+        else if ( word.numComponents == 1 &&
+                  tokens[ wordIndex + 1 ].type == TCL_TOKEN_TEXT )
+        {
+          word.type = TCL_TOKEN_SIMPLE_WORD;
+        }
+
+        // The word must be followed by a space or the end of the command
+        scanned = WhiteSpace( src, numBytes, type );
+        if ( scanned )
+        {
+          src += scanned;
+          numBytes -= scanned;
+          continue;
+        }
+        if ( numBytes == 0 )
+        {
+          term = src;
+          break;
+        }
+        if ( type & terminators )
+        {
+          term = src;
+          ++src;
+          break;
+        }
+        return false;  // extra characters after close-quote or close-brace
+      }
+
+      command.commandSize = src - command.commandStart;
+      return true;
+    }
+  };
+
+  /**
+   * Parses the first command in script, like Tcl_ParseCommand( interp,
+   * script.data(), script.size(), 0, &parse ). Returns false if it can't be
+   * parsed; Tcl_ParseCommand would report an error for exactly the same
+   * scripts.
+   */
+  bool ParseCommand( std::string_view script, Parse& parse )
+  {
+    parse.tokens.clear();
+    Tokenizer tokenizer{ .tokens = parse.tokens,
+                         .end = script.data() + script.size() };
+    Tokenizer::Command command;
+    if ( !tokenizer.ParseCommand( script.data(),
+                                  script.size(),
+                                  false,
+                                  command ) )
+    {
+      return false;
+    }
+
+    parse.commentStart = command.commentStart;
+    parse.commentSize = command.commentSize;
+    parse.commandStart = command.commandStart;
+    parse.commandSize = command.commandSize;
+    parse.numWords = command.numWords;
+    parse.tokenPtr = parse.tokens.data();
+    parse.numTokens = parse.tokens.size();
+    return true;
+  }
+}  // namespace Parser::Native
+
+namespace Parser::Test
+{
+  // Compare the native tokenizer with Tcl_ParseCommand, command by command,
+  // over the whole of script. Returns false (having said why) if they differ.
+  bool CompareTokenizers( std::string_view script )
+  {
+    Native::Parse native;
+    Tcl_Parse tcl;
+    const char* next = script.data();
+    const char* const end = script.data() + script.size();
+    while ( next < end )
+    {
+      const std::string_view rest( next, end - next );
+      const bool ok = Tcl_ParseCommand( nullptr,
+                                        next,
+                                        end - next,
+                                        0,
+                                        &tcl ) == TCL_OK;
+      if ( Native::ParseCommand( rest, native ) != ok )
+      {
+        std::cerr << "Tokenizers disagree about whether this parses: "
+                  << rest << '\n';
+        if ( ok )
+        {
+          Tcl_FreeParse( &tcl );
+        }
+        return false;
+      }
+      if ( !ok )
+      {
+        return true;
+      }
+
+      bool same = native.commandStart == tcl.commandStart &&
+                  native.commandSize == (size_t)tcl.commandSize &&
+                  native.commentSize == (size_t)tcl.commentSize &&
+                  native.numWords == (size_t)tcl.numWords &&
+                  native.numTokens == (size_t)tcl.numTokens;
+      for ( size_t i = 0; same && i < native.numTokens; ++i )
+      {
+        const auto& a = native.tokenPtr[ i ];
+        const auto& b = tcl.tokenPtr[ i ];
+        same = a.type == b.type && a.start == b.start &&
+               a.size == (size_t)b.size &&
+               a.numComponents == (size_t)b.numComponents;
+      }
+
+      next = tcl.commandStart + tcl.commandSize;
+      Tcl_FreeParse( &tcl );
+      if ( !same )
+      {
+        std::cerr << "Tokenizers disagree about the tokens of: " << rest
+                  << '\n';
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void TestNativeTokenizer()
+  {
+    const std::vector< std::string > scripts = {
+      "",
+      "puts hello\n",
+      "  # comment \\\n still comment\n set x 1; set y 2 ;\n",
+      "proc p { a { b 1 } } {\n  return [expr { $a + $b }]\n}\n",
+      "puts \"a $b ${c d} $e(f$g) $h::i::j [k l] \\n\\x41\\u00e9\\101\"\n",
+      "set a($b [c]) \"x\"; set ::ns::v $::ns::w(1)\n",
+      "foo {*}$args {*}{a {b c} \"d e\"} {*}{} {*}[list 1 2]\n",
+      "foo bar\\\n   baz {x\\\ny} \"p\\\nq\"\n",
+      "a [b [c \"d]\"] {e]}]; f $\n",
+      "a \\\\ \\\" \\{ \\} \\[ \\$ \\; \\\n",
+      "while { $i < 10 } { incr i }\nforeach x $y { puts $x }\n",
+      "namespace eval ns {\n  proc q {} { ::p 1 2 }\n}\n",
+      // Errors
+      "puts \"unterminated\n",
+      "puts {unterminated\n",
+      "puts [unterminated\n",
+      "puts \"a\"b\n",
+      "puts {a}b\n",
+      "puts ${unterminated\n",
+      "puts $a(unterminated\n",
+    };
+    for ( const auto& script : scripts )
+    {
+      if ( !CompareTokenizers( script ) )
+      {
+        abort();
+      }
+    }
+
+    // Random scripts made of the characters (and sequences) that matter
+    std::mt19937 random( 1234 );
+    const std::vector< std::string_view > fragments = {
+      " ", " ", "\t", "\n", ";", "$", "[", "]", "{", "}", "\"", "\\", "(",
+      ")", "#", "*", ":", "::", "a", "b1", "_", "x", "u", "U", "0", "7",
+      "\\\n", "{*}", "\r\n", "\xc3\xa9", std::string_view( "\0", 1 ),
+    };
+    for ( int i = 0; i < 20000; ++i )
+    {
+      std::string script;
+      const size_t length = random() % 40;
+      for ( size_t j = 0; j < length; ++j )
+      {
+        script += fragments[ random() % fragments.size() ];
+      }
+      if ( !CompareTokenizers( script ) )
+      {
+        abort();
+      }
+    }
+  }
+}  // namespace Parser::Test
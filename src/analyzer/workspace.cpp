@@ -0,0 +1,1091 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "flat_script.cpp"
+#include "index.cpp"
+#include "script.cpp"
+#include "source_location.cpp"
+
+// The index of a set of files (e.g. the documents open in the language
+// server), made of one index per file, or per piece of a file: a shard. Each
+// shard is built on its own, from its text alone, so changing a file only
+// means building the shards of what changed again. Calls which a shard
+// couldn't resolve itself are resolved against the whole workspace when it is
+// queried.
+//
+// A View is never changed once made. Replacing a file's shards makes a new
+// View which shares all of the other shards, so readers can go on using the
+// one they have while it is made, and publishing it is just a pointer swap.
+namespace Workspace
+{
+  struct Shard
+  {
+    std::shared_ptr< const Index::Index > index;
+
+    // The text this is the index of: the whole of its file, or the piece of
+    // it which starts at `line` (see Document). The index's locations are in
+    // `parsed`, which may be another file with the same text (see
+    // lsp::parse_cache).
+    Parser::SourceFilePtr file;
+    Parser::FileID parsed;
+    size_t line = 0;
+  };
+
+  struct View
+  {
+    // By file name: the file's shards, in order
+    std::map< std::string, std::vector< Shard > > files;
+  };
+
+  using ViewPtr = std::shared_ptr< const View >;
+
+  ViewPtr make_view()
+  {
+    return std::make_shared< const View >();
+  }
+
+  /**
+   * `view` with the shards of `name` (if any) replaced by `shards`.
+   */
+  ViewPtr WithShards( const View& view,
+                      const std::string& name,
+                      std::vector< Shard > shards )
+  {
+    auto next = std::make_shared< View >( view );
+    next->files.insert_or_assign( name, std::move( shards ) );
+    return next;
+  }
+
+  /**
+   * `view` with the shards of each of `files` (e.g. those loaded from a saved
+   * index) replacing any it had, made in one go.
+   */
+  ViewPtr WithShards( const View& view,
+                      std::map< std::string, std::vector< Shard > > files )
+  {
+    auto next = std::make_shared< View >( view );
+    for ( auto& [ name, shards ] : files )
+    {
+      next->files.insert_or_assign( name, std::move( shards ) );
+    }
+    return next;
+  }
+
+  ViewPtr WithShard( const View& view, const std::string& name, Shard shard )
+  {
+    return WithShards( view, name, { std::move( shard ) } );
+  }
+
+  /**
+   * `view` without the shards of `name` (e.g. a document which was closed).
+   */
+  ViewPtr WithoutShards( const View& view, const std::string& name )
+  {
+    auto next = std::make_shared< View >( view );
+    next->files.erase( name );
+    return next;
+  }
+
+  // A place in a file as a whole, rather than in one of its pieces
+  struct Position
+  {
+    Parser::SourceFilePtr file;  // (of the piece, which has the file's name)
+    Parser::LinePos pos;
+  };
+
+  /**
+   * Where `location`, from `shard`'s index, is in the shard's own file.
+   */
+  std::optional< Position > Locate( const Shard& shard,
+                                    Parser::SourceLocation location )
+  {
+    auto file = shard.file;
+    auto line = shard.line;
+    if ( location.file != shard.parsed || !file )
+    {
+      file = Parser::FindSourceFile( location.file );
+      line = 0;
+    }
+    if ( !file )
+    {
+      return std::nullopt;
+    }
+
+    auto pos = Parser::OffsetToLineByte( *file, location.offset );
+    pos.line += line;
+    return Position{ .file = std::move( file ), .pos = pos };
+  }
+
+  struct ShardProc
+  {
+    const Shard* shard;
+    const Index::Proc* proc;
+  };
+
+  /**
+   * As FindProc, in the shards which `forEachShard` calls its argument with.
+   */
+  template< typename ForEachShard >
+  std::vector< ShardProc > FindProcIn( ForEachShard&& forEachShard,
+                                       std::string_view ns,
+                                       const Parser::QualifiedName& qn )
+  {
+    std::vector< ShardProc > result;
+
+    // Where each shard is in the namespace path `ns`: the deepest of its
+    // namespaces along it, and how deep that is
+    struct Position
+    {
+      const Shard* shard;
+      Index::NamespaceID id;
+      size_t depth;
+    };
+
+    auto path = !qn.absolute && ns.size() > 2
+                  ? Parser::PathParts( ns.substr( 2 ) )
+                  : Parser::PathParts();
+    size_t depth = std::distance( path.begin(), path.end() );
+
+    std::vector< Position > positions;
+    forEachShard( [ & ]( const Shard& shard ) {
+      const auto& index = *shard.index;
+      Position position{ &shard, index.global_namespace_id, 0 };
+      for ( auto part : path )
+      {
+        auto child = Index::FindChildNamespace( index, position.id, part );
+        if ( !child )
+        {
+          break;
+        }
+        position.id = *child;
+        ++position.depth;
+      }
+      positions.push_back( position );
+    } );
+
+    // From `ns` outwards, stopping at the first namespace which has any
+    while ( true )
+    {
+      for ( auto& position : positions )
+      {
+        const auto& index = *position.shard->index;
+        if ( position.depth > depth )
+        {
+          position.id = *index.namespaces.Get( position.id ).parent_namespace;
+          --position.depth;
+        }
+        if ( position.depth != depth )
+        {
+          continue;
+        }
+
+        auto target = Index::FindNamespace( index, position.id, qn );
+        if ( !target )
+        {
+          continue;
+        }
+
+        auto range = index.procs.byName.equal_range( qn.name );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          auto& p = index.procs.Get( it->second );
+          if ( p.parent_namespace == *target )
+          {
+            result.push_back( ShardProc{ .shard = position.shard,
+                                         .proc = &p } );
+          }
+        }
+      }
+
+      if ( !result.empty() || depth == 0 )
+      {
+        break;
+      }
+
+      // Try the parent namespace
+      --depth;
+    }
+
+    return result;
+  }
+
+  /**
+   * The procs, in any shard, which the command `cmdName` called in namespace
+   * `ns` (a path, as in Parser::Call::ns) could be. Like Index::FindProc, the
+   * nearest namespace which has any wins.
+   */
+  std::vector< ShardProc > FindProc( const View& view,
+                                     std::string_view ns,
+                                     const Parser::QualifiedName& qn )
+  {
+    auto all = [ & ]( auto&& f ) {
+      for ( const auto& [ name, shards ] : view.files )
+      {
+        for ( const auto& shard : shards )
+        {
+          f( shard );
+        }
+      }
+    };
+    return FindProcIn( all, ns, qn );
+  }
+
+  std::vector< ShardProc > FindProc( const View& view,
+                                     std::string_view ns,
+                                     std::string_view cmdName )
+  {
+    return FindProc( view, ns, Parser::SplitName( cmdName ) );
+  }
+
+  /**
+   * As FindProc, for a call in the file with the shards `own`: a file's own
+   * procs hide any of the same name in other files, so if it has any, only
+   * those are found (as they would be if it were indexed as a whole).
+   */
+  std::vector< ShardProc > FindProc( const View& view,
+                                     std::string_view ns,
+                                     const Parser::QualifiedName& qn,
+                                     const std::vector< Shard >& own )
+  {
+    auto procs = FindProcIn(
+      [ & ]( auto&& f ) {
+        for ( const auto& shard : own )
+        {
+          f( shard );
+        }
+      },
+      ns,
+      qn );
+    return procs.empty() ? FindProc( view, ns, qn ) : procs;
+  }
+
+  /**
+   * Whichever of `procs` best fits a call with `num_args` arguments, as
+   * Index::BestFit: of those which fit as well as each other, the first (so
+   * the one in the first shard, by name).
+   */
+  std::optional< ShardProc > BestFitProcToCall(
+    const std::vector< ShardProc >& procs,
+    size_t num_args )
+  {
+    auto i = Index::BestFit( procs, num_args, []( const ShardProc& p ) {
+      return p.proc;
+    } );
+    if ( i == procs.size() )
+    {
+      return std::nullopt;
+    }
+    return procs[ i ];
+  }
+
+  struct Reference
+  {
+    const Shard* shard;
+    Parser::SourceLocation location;  // in shard->parsed
+    Index::ReferenceType type;
+  };
+
+  /**
+   * All of the references to `target`: those in its own shard (and in any
+   * other shard which shares its index, e.g. a copy of its file), and the
+   * calls in every other shard which resolve to it.
+   */
+  std::vector< Reference > FindReferences( const View& view,
+                                           ShardProc target )
+  {
+    std::vector< Reference > result;
+
+    const auto& own = *target.shard->index;
+    auto addOwn = [ & ]( const Shard* shard ) {
+      auto range = own.procs.refsByID.equal_range( target.proc->id );
+      for ( auto it = range.first; it != range.second; ++it )
+      {
+        const auto& r = own.procs.references[ it->second ];
+        result.push_back( Reference{ .shard = shard,
+                                     .location = r.location,
+                                     .type = r.type } );
+      }
+    };
+    addOwn( target.shard );
+
+    for ( const auto& [ name, shards ] : view.files )
+    {
+      for ( const auto& shard : shards )
+      {
+        if ( &shard == target.shard )
+        {
+          continue;
+        }
+
+        // A call to target in a shard with its index would have resolved
+        // there
+        if ( shard.index == target.shard->index )
+        {
+          addOwn( &shard );
+          continue;
+        }
+
+        const auto& index = *shard.index;
+        for ( const auto& call : index.unresolved )
+        {
+          if ( call.name.name != target.proc->name )
+          {
+            continue;
+          }
+
+          auto ns =
+            Index::GetPrintName( index, index.namespaces.Get( call.ns ) );
+          auto best_fit = BestFitProcToCall(
+            FindProc( view, ns, call.name, shards ),
+            call.num_args );
+          if ( best_fit && best_fit->proc == target.proc )
+          {
+            result.push_back(
+              Reference{ .shard = &shard,
+                         .location = call.location,
+                         .type = Index::ReferenceType::USAGE } );
+          }
+        }
+      }
+    }
+
+    return result;
+  }
+
+  // One piece of a Document: a run of whole top-level commands, with its own
+  // text, parse and index. None of it changes once made, so it is shared by
+  // every version of the document which has the same piece, and by any other
+  // document with the same text.
+  struct Piece
+  {
+    // The piece's text as part of its document: script.file, unless the
+    // parse is shared with a document of another name (see RenameDocument)
+    Parser::SourceFilePtr file;
+
+    // The parse, flattened: only that is kept, not the tree it was made from
+    Parser::FlatScript script;
+    std::shared_ptr< const Index::Index > index;
+  };
+
+  using PiecePtr = std::shared_ptr< const Piece >;
+
+  /**
+   * A version of a file, parsed and indexed in pieces (see
+   * Parser::SplitPieces), so that an edit only parses and indexes again the
+   * pieces it touches (see EditDocument), and copies only their text. The
+   * parse of each piece is the same as that part of a parse of the whole, and
+   * each is a shard of the workspace.
+   */
+  struct Document
+  {
+    std::string name;
+    std::vector< PiecePtr > pieces;
+
+    // Where each piece starts in the whole text
+    std::vector< size_t > offsets;
+    std::vector< size_t > lines;
+    size_t length = 0;
+  };
+
+  using DocumentPtr = std::shared_ptr< const Document >;
+
+  struct DocumentOptions
+  {
+    Parser::Tokenizer tokenizer = Parser::Tokenizer::TCL;
+    size_t piece_size = 16 * 1024;  // bytes of text per piece, or so
+    size_t workers = std::max( 1u, std::thread::hardware_concurrency() );
+  };
+
+  DocumentPtr make_document( std::string name, std::vector< PiecePtr > pieces )
+  {
+    auto document = std::make_shared< Document >();
+    document->name = std::move( name );
+    document->offsets.reserve( pieces.size() );
+    document->lines.reserve( pieces.size() );
+    size_t line = 0;
+    for ( const auto& piece : pieces )
+    {
+      document->offsets.push_back( document->length );
+      document->lines.push_back( line );
+      document->length += piece->file->contents.length();
+      line += piece->file->newlines.size() - 1;
+    }
+    document->pieces = std::move( pieces );
+    return document;
+  }
+
+  /**
+   * Parse and index `file`, a piece of a document.
+   */
+  PiecePtr make_piece( Parser::SourceFilePtr file, Parser::Tokenizer tokenizer )
+  {
+    Parser::FlatScript tree;
+    {
+      // The tree's arena is freed once it's flattened
+      Parser::ParseContext context{
+        .file = file,
+        .cur_ns = "",
+        .tokenizer = tokenizer,
+      };
+      auto* script = Parser::ParseScript( nullptr, context, file->contents );
+      tree = Parser::Flatten( file, *script );
+    }
+
+    auto index = std::make_shared< Index::Index >( Index::make_index() );
+    Index::ScanContext scanContext{
+      .nsPath = { index->global_namespace_id },
+    };
+    Index::BeginBulkLoad( *index );
+    Index::Build( *index, scanContext, tree );
+    Index::EndBulkLoad( *index );
+
+    return std::make_shared< const Piece >( Piece{
+      .file = std::move( file ),
+      .script = std::move( tree ),
+      .index = std::move( index ),
+    } );
+  }
+
+  PiecePtr make_piece( const std::string& name,
+                       std::string_view text,
+                       Parser::Tokenizer tokenizer )
+  {
+    return make_piece( Parser::make_source_file( name, std::string( text ) ),
+                       tokenizer );
+  }
+
+  /**
+   * make_piece for each of `texts`, on up to `options.workers` threads.
+   */
+  std::vector< PiecePtr > make_pieces(
+    const std::string& name,
+    const std::vector< std::string_view >& texts,
+    const DocumentOptions& options )
+  {
+    std::vector< PiecePtr > pieces( texts.size() );
+    std::atomic< size_t > next{ 0 };
+    auto work = [ & ]() {
+      for ( size_t i = next++; i < texts.size(); i = next++ )
+      {
+        pieces[ i ] = make_piece( name, texts[ i ], options.tokenizer );
+      }
+    };
+
+    std::vector< std::thread > threads;
+    const size_t workers = std::min( options.workers, texts.size() );
+    for ( size_t worker = 1; worker < workers; ++worker )
+    {
+      threads.emplace_back( work );
+    }
+    work();
+    for ( auto& thread : threads )
+    {
+      thread.join();
+    }
+    return pieces;
+  }
+
+  // `lengths` of `text`, one after the other
+  std::vector< std::string_view > Split( std::string_view text,
+                                         const std::vector< size_t >& lengths )
+  {
+    std::vector< std::string_view > parts;
+    parts.reserve( lengths.size() );
+    for ( auto length : lengths )
+    {
+      parts.push_back( text.substr( 0, length ) );
+      text.remove_prefix( length );
+    }
+    return parts;
+  }
+
+  DocumentPtr ParseDocument( std::string name,
+                             std::string_view text,
+                             const DocumentOptions& options = {} )
+  {
+    auto lengths =
+      Parser::SplitPieces( options.tokenizer, text, options.piece_size );
+    auto pieces = make_pieces( name, Split( text, lengths ), options );
+    return make_document( std::move( name ), std::move( pieces ) );
+  }
+
+  /**
+   * The next version of `document`, with the `removed` bytes at `offset`
+   * replaced by `inserted`: the same as ParseDocument of the edited text, but
+   * sharing the pieces the edit couldn't have changed.
+   *
+   * The pieces the edit is in are parsed again, from the start of the first
+   * (where a command starts, as before). If the last command of those no
+   * longer ends where the pieces did (e.g. a brace was opened), the next piece
+   * is parsed again with them, and so on, as the parse of those after it would
+   * no longer be the same. An edit which stays within one piece is applied
+   * to that piece's file, so that only the inserted text is scanned for
+   * newlines (see Parser::make_edited_source_file).
+   */
+  DocumentPtr EditDocument( const Document& document,
+                            size_t offset,
+                            size_t removed,
+                            std::string_view inserted,
+                            const DocumentOptions& options = {} )
+  {
+    const auto& pieces = document.pieces;
+    if ( pieces.empty() )
+    {
+      return ParseDocument( document.name, inserted, options );
+    }
+    assert( offset + removed <= document.length );
+
+    auto pieceAt = [ & ]( size_t pos ) -> size_t {
+      return std::upper_bound( document.offsets.begin(),
+                               document.offsets.end(),
+                               pos ) -
+             document.offsets.begin() - 1;
+    };
+    auto text = [ & ]( size_t i ) { return pieces[ i ]->file->contents; };
+
+    const size_t first = pieceAt( offset );
+    const size_t last = removed == 0 ? first : pieceAt( offset + removed - 1 );
+    size_t next = last + 1;  // the first piece after those parsed again
+
+    // The edited text of the pieces: that of `file` while it's just the one
+    // piece, and otherwise `region`
+    Parser::SourceFilePtr file;
+    std::string region;
+    if ( first == last )
+    {
+      file =
+        Parser::make_edited_source_file( *pieces[ first ]->file,
+                                         offset - document.offsets[ first ],
+                                         removed,
+                                         inserted );
+    }
+    else
+    {
+      region = text( first ).substr( 0, offset - document.offsets[ first ] );
+      region.append( inserted ).append(
+        text( last ).substr( offset + removed - document.offsets[ last ] ) );
+    }
+    auto edited = [ & ]() -> std::string_view {
+      return file ? file->contents : region;
+    };
+    auto extend = [ & ]() {
+      if ( file )
+      {
+        region = file->contents;
+        file.reset();
+      }
+      region.append( text( next++ ) );
+    };
+
+    // Small pieces are merged with the next, so that edits don't leave the
+    // document in ever smaller ones
+    if ( edited().length() < options.piece_size / 2 && next < pieces.size() )
+    {
+      extend();
+    }
+
+    std::vector< size_t > lengths;
+    size_t start = 0;  // of the part of the edited text not yet split
+    while ( true )
+    {
+      bool complete = false;
+      auto rest = edited().substr( start );
+      auto split = Parser::SplitPieces( options.tokenizer,
+                                        rest,
+                                        options.piece_size,
+                                        &complete );
+      if ( complete || next == pieces.size() )
+      {
+        lengths.insert( lengths.end(), split.begin(), split.end() );
+        break;
+      }
+
+      // The last of them runs on into the next piece, so that's split again
+      // with it
+      lengths.insert( lengths.end(), split.begin(), split.end() - 1 );
+      start = edited().length() - split.back();
+      extend();
+    }
+
+    std::vector< PiecePtr > result( pieces.begin(), pieces.begin() + first );
+    result.reserve( pieces.size() + lengths.size() );
+    if ( file && lengths.size() == 1 )
+    {
+      result.push_back( make_piece( std::move( file ), options.tokenizer ) );
+    }
+    else
+    {
+      for ( auto& piece : make_pieces( document.name,
+                                       Split( edited(), lengths ),
+                                       options ) )
+      {
+        result.push_back( std::move( piece ) );
+      }
+    }
+    result.insert( result.end(), pieces.begin() + next, pieces.end() );
+
+    return make_document( document.name, std::move( result ) );
+  }
+
+  /**
+   * `document` (e.g. from the parse cache) as the document `name`: the same
+   * parses and indexes, with the text of each piece in a file of that name.
+   */
+  DocumentPtr RenameDocument( const Document& document, std::string name )
+  {
+    std::vector< PiecePtr > pieces;
+    pieces.reserve( document.pieces.size() );
+    for ( const auto& piece : document.pieces )
+    {
+      auto renamed = std::make_shared< Piece >( *piece );
+      renamed->file = Parser::make_source_file( name, piece->file->text );
+      pieces.push_back( std::move( renamed ) );
+    }
+    return make_document( std::move( name ), std::move( pieces ) );
+  }
+
+  // The whole text of `document`
+  std::string Text( const Document& document )
+  {
+    std::string text;
+    text.reserve( document.length );
+    for ( const auto& piece : document.pieces )
+    {
+      text.append( piece->file->contents );
+    }
+    return text;
+  }
+
+  /**
+   * Whether the text of `document` is `text`.
+   */
+  bool HasText( const Document& document, std::string_view text )
+  {
+    if ( document.length != text.length() )
+    {
+      return false;
+    }
+    for ( size_t i = 0; i < document.pieces.size(); ++i )
+    {
+      const auto contents = document.pieces[ i ]->file->contents;
+      if ( text.substr( document.offsets[ i ], contents.length() ) !=
+           contents )
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * The piece of `document` (which must have some) that has line `line`, or
+   * the last one if it's past the end.
+   */
+  size_t FindPiece( const Document& document, size_t line )
+  {
+    assert( !document.pieces.empty() );
+    return std::upper_bound( document.lines.begin(),
+                             document.lines.end(),
+                             line ) -
+           document.lines.begin() - 1;
+  }
+
+  /**
+   * As Parser::LineByteToOffset, in the whole of `document`.
+   */
+  size_t DocumentOffset( const Document& document, Parser::LinePos pos )
+  {
+    if ( document.pieces.empty() )
+    {
+      return 0;
+    }
+
+    auto i = FindPiece( document, pos.line );
+    return document.offsets[ i ] +
+           Parser::LineByteToOffset(
+             *document.pieces[ i ]->file,
+             { pos.line - document.lines[ i ], pos.column } );
+  }
+
+  // The shard of each piece of `document`
+  std::vector< Shard > DocumentShards( const Document& document )
+  {
+    std::vector< Shard > shards;
+    shards.reserve( document.pieces.size() );
+    for ( size_t i = 0; i < document.pieces.size(); ++i )
+    {
+      const auto& piece = *document.pieces[ i ];
+      shards.push_back( Shard{ .index = piece.index,
+                               .file = piece.file,
+                               .parsed = piece.script.file->id,
+                               .line = document.lines[ i ] } );
+    }
+    return shards;
+  }
+}
+
+namespace Workspace::Test
+{
+  std::shared_ptr< const Index::Index > IndexOf( const std::string& name,
+                                                 const std::string& text )
+  {
+    Parser::ParseContext context{
+      .file = Parser::make_source_file( name, text ),
+      .cur_ns = "",
+    };
+    auto* script = Parser::ParseScript( nullptr,
+                                        context,
+                                        context.file->contents );
+
+    auto index = std::make_shared< Index::Index >( Index::make_index() );
+    Index::ScanContext scanContext{
+      .nsPath = { index->global_namespace_id },
+    };
+    Index::Build( *index, scanContext, *script );
+    return index;
+  }
+
+  Shard ShardOf( const std::string& name, const std::string& text )
+  {
+    auto index = IndexOf( name, text );
+    auto file = index->files.begin()->second;
+    return Shard{ .index = index, .file = file, .parsed = file->id };
+  }
+
+  void TestShards()
+  {
+    auto fail = 0;
+
+    auto view = make_view();
+    view = WithShard( *view,
+                      "a",
+                      ShardOf( "a",
+                               "namespace eval ns {\n"
+                               "  proc p { x } {}\n"
+                               "  proc p { x y } {}\n"
+                               "}\n"
+                               "proc q {} { ns::p 1 }\n" ) );
+    view = WithShard( *view,
+                      "b",
+                      ShardOf( "b",
+                               "ns::p 1\n"
+                               "namespace eval ns { p 1 2; q }\n"
+                               "::ns::p 3 4\n"
+                               "r\n" ) );
+    const auto* a = &view->files.at( "a" )[ 0 ];
+
+    // Calls in b resolve to procs in a
+    auto procs = FindProc( *view, "::ns", "p" );
+    if ( procs.size() != 2 || procs[ 0 ].shard != a )
+    {
+      std::cerr << "Expected to find both ns::p in a\n";
+      ++fail;
+    }
+    if ( FindProc( *view, "::ns", "q" ).size() != 1 ||
+         !FindProc( *view, "", "r" ).empty() )
+    {
+      std::cerr << "Expected q (only) to be found from ::ns\n";
+      ++fail;
+    }
+
+    auto p1 = BestFitProcToCall( FindProc( *view, "", "ns::p" ), 1 );
+    auto p2 = BestFitProcToCall( FindProc( *view, "", "ns::p" ), 2 );
+    if ( !p1 || !p2 || p1->proc == p2->proc )
+    {
+      std::cerr << "Expected calls to fit each ns::p\n";
+      ++fail;
+    }
+
+    // Shards which only have part of the path are still searched from the
+    // namespaces they do have, and the nearest one wins across all of them
+    auto nested = WithShard( *view,
+                             "d",
+                             ShardOf( "d",
+                                      "namespace eval ns::inner {\n"
+                                      "  proc p {} {}\n"
+                                      "}\n" ) );
+    const auto* d = &nested->files.at( "d" )[ 0 ];
+    auto inner = FindProc( *nested, "::ns::inner::deep", "p" );
+    if ( inner.size() != 1 || inner[ 0 ].shard != d ||
+         FindProc( *nested, "::ns::other::deep", "p" ).size() != 2 ||
+         FindProc( *nested, "::ns::inner::deep", "q" ).size() != 1 ||
+         FindProc( *nested, "::ns::inner", "::ns::p" ).size() != 2 )
+    {
+      std::cerr << "Expected the nearest namespace's procs from any shard\n";
+      ++fail;
+    }
+
+    auto count = [ & ]( const ViewPtr& v,
+                        ShardProc target,
+                        const std::string& file,
+                        Index::ReferenceType type ) {
+      size_t n = 0;
+      for ( const auto& r : FindReferences( *v, target ) )
+      {
+        auto position = Locate( *r.shard, r.location );
+        n += ( r.type == type && position &&
+               position->file->fileName == file );
+      }
+      return n;
+    };
+
+    using Index::ReferenceType;
+    if ( count( view, *p1, "a", ReferenceType::DEFINITION ) != 1 ||
+         count( view, *p1, "a", ReferenceType::USAGE ) != 1 ||
+         count( view, *p1, "b", ReferenceType::USAGE ) != 1 ||
+         count( view, *p2, "b", ReferenceType::USAGE ) != 2 )
+    {
+      std::cerr << "Expected references to ns::p from both files\n";
+      ++fail;
+    }
+
+    // A copy of a's text has its own procs, which hide a's from its calls
+    auto copy = WithShard( *view, "c", Shard{ .index = a->index,
+                                              .file = a->file,
+                                              .parsed = a->parsed } );
+    const auto* c = &copy->files.at( "c" )[ 0 ];
+    auto ns_p = Parser::SplitName( "ns::p" );
+    auto procs_c = FindProc( *copy, "", ns_p, copy->files.at( "c" ) );
+    if ( FindProc( *copy, "", "ns::p" ).size() != 4 || procs_c.size() != 2 ||
+         procs_c[ 0 ].shard != c || procs_c[ 1 ].shard != c ||
+         FindProc( *copy, "", ns_p, copy->files.at( "b" ) ).size() != 4 )
+    {
+      std::cerr << "Expected c's calls to prefer c's own procs\n";
+      ++fail;
+    }
+
+    // Its references are found in both files which share the index
+    auto twin_file =
+      Parser::make_source_file( "c", std::string( a->file->contents ) );
+    auto twin = WithShard( *view, "c", Shard{ .index = a->index,
+                                              .file = twin_file,
+                                              .parsed = a->parsed } );
+    auto procs_twin = FindProc( *twin, "", ns_p, twin->files.at( "c" ) );
+    auto p1_c = BestFitProcToCall( procs_twin, 1 );
+    if ( !p1_c || count( twin, *p1_c, "c", ReferenceType::DEFINITION ) != 1 ||
+         count( twin, *p1_c, "c", ReferenceType::USAGE ) != 1 ||
+         count( twin, *p1_c, "a", ReferenceType::DEFINITION ) != 1 ||
+         count( twin, *p1_c, "a", ReferenceType::USAGE ) != 1 ||
+         count( twin, *p1_c, "b", ReferenceType::USAGE ) != 1 )
+    {
+      std::cerr << "Expected references from every shard of the index\n";
+      ++fail;
+    }
+
+    // and only in a once c is gone
+    auto closed = WithoutShards( *twin, "c" );
+    auto p1_a = BestFitProcToCall( FindProc( *closed, "", "ns::p" ), 1 );
+    if ( closed->files.contains( "c" ) || !p1_a ||
+         FindProc( *closed, "", "ns::p" ).size() != 2 ||
+         count( closed, *p1_a, "c", ReferenceType::USAGE ) != 0 ||
+         count( closed, *p1_a, "a", ReferenceType::USAGE ) != 1 )
+    {
+      std::cerr << "Expected c's shard to be removed\n";
+      ++fail;
+    }
+
+    // Replacing b leaves a as it was, and drops b's references
+    auto next = WithShard( *view, "b", ShardOf( "b", "r\n" ) );
+    if ( next->files.at( "a" )[ 0 ].index != a->index ||
+         view->files.at( "b" )[ 0 ].index == next->files.at( "b" )[ 0 ].index )
+    {
+      std::cerr << "Expected only b's shard to be replaced\n";
+      ++fail;
+    }
+    if ( count( next, *p2, "b", ReferenceType::USAGE ) != 0 ||
+         count( view, *p2, "b", ReferenceType::USAGE ) != 2 )
+    {
+      std::cerr << "Expected b's old references only in the old view\n";
+      ++fail;
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  // Abort unless `document` is made of pieces whose parses are the same as
+  // a parse of `text` as a whole, each in its part of it
+  void CheckDocument( const Document& document, const std::string& text )
+  {
+    if ( !HasText( document, text ) )
+    {
+      std::cerr << "Expected the document to have the edited text\n";
+      abort();
+    }
+
+    Parser::ParseContext full{
+      .file = Parser::make_source_file( "test", text ),
+      .cur_ns = "",
+    };
+    auto* expected =
+      Parser::ParseScript( nullptr, full, full.file->contents );
+
+    auto next = expected->commands.begin();
+    for ( size_t i = 0; i < document.pieces.size(); ++i )
+    {
+      const auto& piece = *document.pieces[ i ];
+      const auto commands = Parser::Root( piece.script ).Children();
+      if ( static_cast< size_t >( expected->commands.end() - next ) <
+           commands.size() )
+      {
+        std::cerr << "Piece " << i << " has too many calls\n";
+        abort();
+      }
+
+      std::pmr::vector< Parser::Call > part( next, next + commands.size() );
+      Parser::Test::CompareFlatCalls( commands, part, document.offsets[ i ] );
+      next += commands.size();
+
+      const auto line =
+        Parser::OffsetToLineByte( *full.file, document.offsets[ i ] ).line;
+      if ( document.lines[ i ] != line ||
+           DocumentOffset( document, { line, 0 } ) != document.offsets[ i ] ||
+           FindPiece( document, line ) != i )
+      {
+        std::cerr << "Piece " << i << " isn't where it should be\n";
+        abort();
+      }
+
+      // (An edited piece's newlines are patched rather than scanned again)
+      auto scanned = Parser::make_source_file(
+        "test",
+        std::string( piece.file->contents ) );
+      if ( piece.file->newlines != scanned->newlines )
+      {
+        std::cerr << "Newlines of piece " << i << " don't match a rescan\n";
+        abort();
+      }
+    }
+
+    if ( next != expected->commands.end() )
+    {
+      std::cerr << "Expected " << expected->commands.end() - next
+                << " more calls\n";
+      abort();
+    }
+  }
+
+  void TestDocuments()
+  {
+    auto fail = 0;
+
+    std::string text;
+    for ( int i = 0; i < 30; ++i )
+    {
+      auto n = std::to_string( i );
+      text += "namespace eval ns" + n + " {\n"
+              "  proc p" + n + " { a { b 1 } } {\n"
+              "    foreach x $a { puts \"$x [ set y($b) ]\" }\n"
+              "  }\n"
+              "}\n"
+              "# comment " + n + "\n"
+              "p" + n + " 1 [ns" + n + "::p" + n + " 2]; set z ${y}x\n";
+    }
+
+    const DocumentOptions options{ .piece_size = 64, .workers = 2 };
+    auto document = ParseDocument( "test", text, options );
+    CheckDocument( *document, text );
+    if ( document->pieces.size() < 30 )
+    {
+      std::cerr << "Expected the document in pieces\n";
+      ++fail;
+    }
+
+    // Only the piece which is edited is parsed again
+    auto edited = EditDocument( *document,
+                                document->offsets[ 5 ],
+                                0,
+                                "set w 1\n",
+                                options );
+    if ( edited->pieces.size() < document->pieces.size() ||
+         !std::equal( document->pieces.begin(),
+                      document->pieces.begin() + 5,
+                      edited->pieces.begin() ) ||
+         edited->pieces[ 5 ] == document->pieces[ 5 ] ||
+         edited->pieces.back() != document->pieces.back() )
+    {
+      std::cerr << "Expected the pieces which weren't edited to be kept\n";
+      ++fail;
+    }
+
+    // and everything after an unclosed brace, which stops the parse
+    auto unclosed = EditDocument( *document, 0, 0, "namespace eval x {\n",
+                                  options );
+    CheckDocument( *unclosed, "namespace eval x {\n" + text );
+    auto closed = EditDocument( *unclosed, 0, 19, "", options );
+    CheckDocument( *closed, text );
+    if ( unclosed->pieces.size() != 1 ||
+         closed->pieces.size() != document->pieces.size() )
+    {
+      std::cerr << "Expected the unclosed brace to run to the end\n";
+      ++fail;
+    }
+
+    // Calls in one piece resolve to procs in another, and are located in
+    // the document as a whole
+    auto view = WithShards( *make_view(), "test", DocumentShards( *document ) );
+    const auto& shards = view->files.at( "test" );
+    auto target = BestFitProcToCall(
+      FindProc( *view, "", Parser::SplitName( "ns29::p29" ), shards ),
+      1 );
+    size_t usages = 0;
+    if ( target )
+    {
+      for ( const auto& r : FindReferences( *view, *target ) )
+      {
+        auto position = Locate( *r.shard, r.location );
+        usages += r.type == Index::ReferenceType::USAGE && position &&
+                  position->pos.line == 29 * 7 + 6;
+      }
+    }
+    if ( !target || target->shard == &shards.front() || usages != 1 )
+    {
+      std::cerr << "Expected references to ns29::p29 across pieces\n";
+      ++fail;
+    }
+
+    // Random edits, including ones which change where commands start and end
+    const std::vector< std::string > fragments = {
+      "",  "x", " ", "\n", ";", "{", "}", "[", "]", "\"", "#", "\\",
+      "proc q { x } {\n  q $x\n}\n", "namespace eval ns {",
+    };
+    std::mt19937 random( 1234 );
+    for ( int i = 0; i < 500; ++i )
+    {
+      const size_t offset = random() % ( text.length() + 1 );
+      const size_t removed =
+        std::min< size_t >( random() % 4, text.length() - offset );
+      const auto& inserted = fragments[ random() % fragments.size() ];
+
+      document =
+        EditDocument( *document, offset, removed, inserted, options );
+      text.replace( offset, removed, inserted );
+      CheckDocument( *document, text );
+    }
+
+    if ( fail )
+    {
+      abort();
+    }
+  }
+
+  void Run()
+  {
+    TestShards();
+    TestDocuments();
+  }
+}  // namespace Workspace::Test
@@ -1,6 +1,7 @@
 #include <asio/awaitable.hpp>
 #include <asio/co_spawn.hpp>
 #include <asio/posix/stream_descriptor.hpp>
+#include <asio/post.hpp>
 #include <asio/use_awaitable.hpp>
 #include <iostream>
 #include <json/json.hpp>
@@ -24,7 +25,7 @@ namespace lsp::handlers
   // General Messages {{{
   asio::awaitable<void> handle_initialize( Server& server,
                                            stream& out,
-                                           const json& message )
+                                           json message )
   {
     auto response = json::object();
     response[ "capabilities" ] = json::object(
@@ -32,7 +33,7 @@ namespace lsp::handlers
         { "referencesProvider", true },
         { "textDocumentSync", {
             { "openClose", true },
-            { "change", types::TextDocumentSyncKind::Full },
+            { "change", types::TextDocumentSyncKind::Incremental },
           }
         },
         { "definitionProvider", true },
@@ -43,6 +44,16 @@ namespace lsp::handlers
     server.options = params.value( "initializationOptions", json::object() );
     server.rootUri = params.value( "rootUri", "" );
 
+    // The files which aren't open are queried from the index the analyzer
+    // saved, if there is one. It's loaded on the index queue, so that the
+    // documents opened from now on are parsed after it.
+    if ( !server.options.index_file.empty() )
+    {
+      asio::post( server.index_queue, [ &server ]() {
+        lsp::parse_manager::LoadSavedIndex( server );
+      } );
+    }
+
     co_await send_reply( out, message[ "id" ], response );
   }
 
@@ -70,23 +81,36 @@ namespace lsp::handlers
 
   asio::awaitable<void> on_textdocument_didopen( Server& server,
                                                  stream&,
-                                                 const json& message )
+                                                 json message )
   {
+    // Move the text out of the message first, so that it isn't copied
+    auto text = types::take_string(
+      message.at( "params" ).at( "textDocument" ).at( "text" ) );
     DidOpenTextDocumentParams params = message.at( "params" );
 
-    auto [ pos, _ ] = server.documents.emplace(
-      params.textDocument.uri,
-      lsp::server::Document{ .item = params.textDocument } );
+    size_t opened;
+    {
+      std::unique_lock l(server.index_lock);
+      opened = ++server.opened;
+      server.documents.insert_or_assign(
+        params.textDocument.uri,
+        lsp::server::Document{ .item = params.textDocument,
+                               .opened = opened } );
+    }
 
     co_await asio::co_spawn( server.index_queue,
-                             lsp::parse_manager::Reparse( server, pos->second ),
+                             lsp::parse_manager::Open(
+                               server,
+                               params.textDocument.uri,
+                               opened,
+                               std::move( text ) ),
                              asio::use_awaitable );
   }
 
   struct TextDocumentContentChangeEvent
   {
     std::optional< types::Range > range;
-    types::string text;
+    types::shared_string text;
 
     friend void from_json( const json& j, TextDocumentContentChangeEvent& o )
     {
@@ -109,19 +133,55 @@ namespace lsp::handlers
 
   asio::awaitable<void> on_textdocument_didchange( Server& server,
                                                    stream&,
-                                                   const json& message )
+                                                   json message )
   {
+    // Move the text out of the message first, so that it isn't copied
+    std::vector< types::shared_string > texts;
+    for ( auto& change : message.at( "params" ).at( "contentChanges" ) )
+    {
+      texts.push_back( types::take_string( change.at( "text" ) ) );
+    }
     DidChnageTextDocumentParams params = message.at( "params" );
+    for ( size_t i = 0; i < texts.size(); ++i )
+    {
+      params.contentChanges[ i ].text = std::move( texts[ i ] );
+    }
+
+    // The document's parse is brought up to date on the index queue, which
+    // applies the changes to it in the order they were made
+    std::optional< size_t > opened;
+    {
+      std::unique_lock l(server.index_lock);
+      auto& document = server.documents.at( params.textDocument.uri );
+      if ( document.item.version < params.textDocument.version )
+      {
+        opened = document.opened;
+        document.item.version = params.textDocument.version;
+      }
+    }
 
-    auto& document = server.documents.at( params.textDocument.uri );
-    if ( document.item.version < params.textDocument.version &&
-         params.contentChanges.size() == 1 )
+    if ( opened )
     {
-      document.item.text = params.contentChanges[ 0 ].text;
-      document.item.version = params.textDocument.version;
+      std::vector< lsp::parse_manager::Change > changes;
+      for ( auto& change : params.contentChanges )
+      {
+        lsp::parse_manager::Change& c = changes.emplace_back();
+        c.text = std::move( change.text );
+        if ( change.range )
+        {
+          c.range = { { change.range->start.line,
+                        change.range->start.character },
+                      { change.range->end.line,
+                        change.range->end.character } };
+        }
+      }
 
       co_await asio::co_spawn( server.index_queue,
-                               lsp::parse_manager::Reparse( server, document ),
+                               lsp::parse_manager::Edit(
+                                 server,
+                                 params.textDocument.uri,
+                                 *opened,
+                                 std::move( changes ) ),
                                asio::use_awaitable );
     }
     // else protocol error!
@@ -141,18 +201,69 @@ namespace lsp::handlers
   {
     DidCloseTextDocumentParams params = message.at( "params" );
 
-    std::unique_lock l(server.index_lock);
-    auto& document = server.documents.at( params.textDocument.uri );
-    // State that we're using the filesystem version of the doc now.
+    // We're using the filesystem version of the doc now. The index keeps the
+    // text (and locations) of the version it was built from for as long as it
+    // needs them.
     // TODO: Should we queue parsing of the filesystem version?
-    // NOTE: we can't free the document, because its text is used by the index
-    document.state = lsp::server::Document::State::CLOSED;
+    {
+      std::unique_lock l(server.index_lock);
+      server.documents.erase( params.textDocument.uri );
+    }
+
+    // Its shards go once any edit of it already queued is done
+    asio::post( server.index_queue,
+                [ &server, uri = params.textDocument.uri ]() {
+                  lsp::parse_manager::Close( server, uri );
+                } );
   }
 
   // }}}
 
   // Language Features {{{
 
+  std::optional< types::Location > to_location(
+    const std::optional< Workspace::Position >& position )
+  {
+    if ( !position )
+    {
+      return std::nullopt;
+    }
+
+    const auto& pos = position->pos;
+    return types::Location{
+      .uri = position->file->fileName,
+      .range = {
+        .start = {
+          .line = pos.line,
+          .character = pos.column
+        },
+        .end = {
+          .line = pos.line,
+          .character = pos.column,
+        }
+      }
+    };
+  }
+
+  // The proc that the call at the cursor, in document `uri`, calls. It's
+  // looked for in every document, but the document's own procs come first.
+  std::optional< Workspace::ShardProc > proc_at_cursor(
+    const Workspace::View& workspace,
+    const std::string& uri,
+    const Index::ScriptCursor& cursor )
+  {
+    auto qn = Parser::SplitName( cursor.word->Text() );
+    auto ns = cursor.call->Namespace();
+    auto pos = workspace.files.find( uri );
+    auto procs =
+      pos != workspace.files.end()
+        ? Workspace::FindProc( workspace, ns, qn, pos->second )
+        : Workspace::FindProc( workspace, ns, qn );
+    return Workspace::BestFitProcToCall(
+      procs,
+      cursor.call->Children().size() - 1 );
+  }
+
   struct ReferenceContext
   {
     types::boolean includeDeclaration;
@@ -172,7 +283,7 @@ namespace lsp::handlers
 
   asio::awaitable<void> on_textdocument_references( Server& server,
                                                     stream& out,
-                                                    const json& message )
+                                                    json message )
   {
     ReferencesParams params = message.at( "params" );
     auto cursor = parse_manager::GetCursor( server, params );
@@ -190,7 +301,7 @@ namespace lsp::handlers
 
     std::shared_lock l(server.index_lock);
 
-    switch ( cursor.word->type )
+    switch ( cursor.word->WordType() )
     {
       case Parser::Word::Type::ARRAY_ACCESS:
         // find the array?
@@ -200,39 +311,21 @@ namespace lsp::handlers
         if ( cursor.argument == 0 )
         {
           // It's a call, find the references!
-          auto* ns = Index::FindNamespace( server.index, cursor.call->ns );
-          if ( !ns )
-          {
-            break;
-          }
-
-          auto procs = Index::FindProc( server.index,
-                                        *ns,
-                                        cursor.word->text );
-          auto* p = Index::BestFitProcToCall( procs, *cursor.call );
-
+          auto p = proc_at_cursor( *server.workspace,
+                                   params.textDocument.uri,
+                                   cursor );
           if (!p)
           {
             break;
           }
 
-          auto range = server.index.procs.refsByID.equal_range( p->id );
-          for ( auto it = range.first; it != range.second; ++it )
+          for ( auto& r : Workspace::FindReferences( *server.workspace, *p ) )
           {
-            auto& r = server.index.procs.references[ it->second ];
-            response.push_back( types::Location{
-              .uri = r->location.sourceFile->fileName,
-              .range = {
-                .start = {
-                  .line = r->location.line,
-                  .character = r->location.column
-                },
-                .end = {
-                  .line = r->location.line,
-                  .character = r->location.column,
-                }
-              }
-            } );
+            if ( auto location = to_location(
+                   Workspace::Locate( *r.shard, r.location ) ) )
+            {
+              response.push_back( *location );
+            }
           }
         }
         break;
@@ -249,7 +342,7 @@ namespace lsp::handlers
 
   asio::awaitable<void> on_textdocument_definition( Server& server,
                                                     stream& out,
-                                                    const json& message )
+                                                    json message )
   {
     DefinitionParams params = message.at( "params" );
     auto cursor = parse_manager::GetCursor( server, params );
@@ -267,7 +360,7 @@ namespace lsp::handlers
     std::shared_lock l(server.index_lock);
 
     // TODO/FIXME: Copy pasta above
-    switch ( cursor.word->type )
+    switch ( cursor.word->WordType() )
     {
       case Parser::Word::Type::ARRAY_ACCESS:
         // find the array?
@@ -276,45 +369,30 @@ namespace lsp::handlers
       case Parser::Word::Type::TEXT:
         if ( cursor.argument == 0 )
         {
-          // It's a call, find the references!
-          auto* ns = Index::FindNamespace( server.index, cursor.call->ns );
-          if ( !ns )
-          {
-            break;
-          }
-
-          auto procs = Index::FindProc( server.index,
-                                        *ns,
-                                        cursor.word->text );
-          auto* p = Index::BestFitProcToCall( procs, *cursor.call );
-
+          // It's a call, find the definition, in whichever document has it
+          auto p = proc_at_cursor( *server.workspace,
+                                   params.textDocument.uri,
+                                   cursor );
           if (!p)
           {
             break;
           }
 
-          auto range = server.index.procs.refsByID.equal_range( p->id );
+          const auto& index = *p->shard->index;
+          auto range = index.procs.refsByID.equal_range( p->proc->id );
           for ( auto it = range.first; it != range.second; ++it )
           {
-            auto& r = server.index.procs.references[ it->second ];
-            if ( r->type != Index::ReferenceType::DEFINITION )
+            auto& r = index.procs.references[ it->second ];
+            if ( r.type != Index::ReferenceType::DEFINITION )
             {
               continue;
             }
 
-            response.push_back( types::Location{
-              .uri = r->location.sourceFile->fileName,
-              .range = {
-                .start = {
-                  .line = r->location.line,
-                  .character = r->location.column
-                },
-                .end = {
-                  .line = r->location.line,
-                  .character = r->location.column,
-                }
-              }
-            } );
+            if ( auto location = to_location(
+                   Workspace::Locate( *p->shard, r.location ) ) )
+            {
+              response.push_back( *location );
+            }
           }
         }
         break;
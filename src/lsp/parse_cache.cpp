@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+
+#include <analyzer/workspace.cpp>
+
+namespace lsp::parse_cache
+{
+  // A finished parse of some text, and the index built from it (see
+  // Workspace::Document), which every document with the same text can share
+  using EntryPtr = Workspace::DocumentPtr;
+
+  // The parses of the most recently opened or closed texts, keyed by a hash of
+  // the text, so that reopening a file, or opening another copy of it, doesn't
+  // parse or index it again. The versions in between, as a document is
+  // edited, aren't kept: they're unlikely to be opened again.
+  //
+  // This isn't thread safe: it's only used from the index queue.
+  struct ParseCache
+  {
+    // The most text it holds the parses of, in bytes. A parse and its index
+    // take some tens of times as much memory as the text.
+    size_t capacity = 4 << 20;
+
+    struct Slot
+    {
+      uint64_t hash;
+      EntryPtr entry;
+    };
+
+    // Most recently used first
+    std::list< Slot > recent;
+    std::unordered_multimap< uint64_t, std::list< Slot >::iterator > byHash;
+    size_t size = 0;  // bytes of text in recent
+
+    EntryPtr Find( uint64_t hash, std::string_view contents )
+    {
+      auto range = byHash.equal_range( hash );
+      for ( auto it = range.first; it != range.second; ++it )
+      {
+        // Hashes can collide, so check that it really is the same text
+        const auto& entry = it->second->entry;
+        if ( Workspace::HasText( *entry, contents ) )
+        {
+          recent.splice( recent.begin(), recent, it->second );
+          return entry;
+        }
+      }
+      return nullptr;
+    }
+
+    // Add `entry` (which Find didn't find), whose text has the hash `hash`,
+    // and forget the least recently used parses until it's within capacity
+    void Insert( uint64_t hash, EntryPtr entry )
+    {
+      size += entry->length;
+      recent.push_front( Slot{ .hash = hash, .entry = std::move( entry ) } );
+      byHash.emplace( hash, recent.begin() );
+
+      while ( size > capacity )
+      {
+        // Documents (and the workspace's shards) hold on to the parses they
+        // use, so this only forgets it
+        auto last = std::prev( recent.end() );
+        auto range = byHash.equal_range( last->hash );
+        for ( auto it = range.first; it != range.second; ++it )
+        {
+          if ( it->second == last )
+          {
+            byHash.erase( it );
+            break;
+          }
+        }
+        size -= last->entry->length;
+        recent.erase( last );
+      }
+    }
+  };
+}
@@ -1,41 +1,274 @@
 #include "lsp/server.hpp"
 #include "lsp/types.cpp"
 #include <asio/awaitable.hpp>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
 #include <shared_mutex>
 
 namespace lsp::parse_manager
 {
   using server::Server;
 
-  asio::awaitable<void> Reparse( Server& server, server::Document& doc )
+  // Replace the shards of `uri` in the workspace. Called only from the index
+  // queue, so nothing else changes server.workspace meanwhile: the next view
+  // is made without the lock, which is only held to swap it in.
+  void UpdateShards( Server& server,
+                     const std::string& uri,
+                     std::vector< Workspace::Shard > shards )
   {
-    // TODO(Ben): this is pretty horrific. Parser::SourceFile duplicates the
-    // contents and much other badness. this is just for exploration.
-    auto context = Parser::ParseContext{
-      .file = Parser::make_source_file( doc.item.uri, doc.item.text ),
-      .cur_ns = "",
-    };
+    Workspace::ViewPtr current;
+    {
+      std::shared_lock l(server.index_lock);
+      current = server.workspace;
+    }
+
+    auto next = Workspace::WithShards( *current, uri, std::move( shards ) );
+
+    {
+      std::unique_lock write_index(server.index_lock);
+      std::swap( server.workspace, next );
+    }
+    // The previous view (and any shard only it used) is released here, outside
+    // the lock
+  }
+
+  // Remove the shards of `uri` (a closed document) from the workspace. Like
+  // UpdateShards, only called from the index queue, so it comes after any
+  // parse of the document which was queued before it was closed.
+  void RemoveShards( Server& server, const std::string& uri )
+  {
+    Workspace::ViewPtr current;
+    {
+      std::shared_lock l(server.index_lock);
+      current = server.workspace;
+    }
+
+    auto next = Workspace::WithoutShards( *current, uri );
+
+    {
+      std::unique_lock write_index(server.index_lock);
+      std::swap( server.workspace, next );
+    }
+  }
+
+  // The uri of the file at (absolute) `path`
+  std::string FileUri( std::string_view path )
+  {
+    static constexpr char HEX[] = "0123456789ABCDEF";
+    std::string uri = "file://";
+    for ( unsigned char c : path )
+    {
+      if ( std::isalnum( c ) || std::strchr( "/-._~", c ) )
+      {
+        uri += char( c );
+      }
+      else
+      {
+        uri += '%';
+        uri += HEX[ c >> 4 ];
+        uri += HEX[ c & 0xf ];
+      }
+    }
+    return uri;
+  }
 
-    auto script = Parser::ParseScript( server.interp,
-                                       context,
-                                       context.file.contents );
+  // Add a shard to the workspace for each file of the index which the
+  // analyzer saved (see WorkspaceOptions::index_file) that hasn't changed
+  // since, so that it's queried without being opened. Called from the index
+  // queue before any document is opened.
+  void LoadSavedIndex( Server& server )
+  {
+    auto mapped = IndexFile::Map( server.options.index_file );
+    if ( !mapped )
+    {
+      std::cerr << "Unable to use the saved index "
+                << server.options.index_file << std::endl;
+      return;
+    }
+
+    const auto files = mapped->Files();
+    std::vector< std::string > uris;
+    for ( auto& file : files )
+    {
+      uris.push_back( FileUri( mapped->Text( file.name ) ) );
+    }
+    auto indexes = IndexFile::LoadFiles( *mapped, uris );
+
+    std::map< std::string, std::vector< Workspace::Shard > > shards;
+    for ( size_t i = 0; i < files.size(); ++i )
+    {
+      if ( !IndexFile::IsFresh( *mapped, files[ i ] ) )
+      {
+        continue;
+      }
 
-    // TODO: Index::make_temp_index( server.index ) (with read lock)
-    //  that can then be merged with the main index via something like
-    //  Index::merge( server.index, temp_index ) under the write lock
-    auto index = Index::make_index();
-    Index::ScanContext scanContext{
-      .nsPath = { index.global_namespace_id }
+      auto index =
+        std::make_shared< const Index::Index >( std::move( indexes[ i ] ) );
+      auto file = index->files.begin()->second;
+      Workspace::Shard shard{ .index = std::move( index ),
+                              .file = file,
+                              .parsed = file->id };
+      server.saved.files.emplace( uris[ i ],
+                                  server::SavedFile{ .file = &files[ i ],
+                                                     .shard = shard } );
+      shards.emplace( uris[ i ], std::vector{ std::move( shard ) } );
+    }
+    server.saved.mapped = std::move( mapped );
+
+    Workspace::ViewPtr current;
+    {
+      std::shared_lock l(server.index_lock);
+      current = server.workspace;
+    }
+
+    auto next = Workspace::WithShards( *current, std::move( shards ) );
+
+    {
+      std::unique_lock write_index(server.index_lock);
+      std::swap( server.workspace, next );
+    }
+  }
+
+  // Forget the document `uri`, which was closed, once the edits queued before
+  // the close have been applied to it, and keep its parse in the cache in case
+  // it's opened again. If the saved index has the file, and it hasn't changed
+  // since (i.e. the edits weren't saved), it's queried from that again.
+  void Close( Server& server, const std::string& uri )
+  {
+    auto pos = server.latest.find( uri );
+    if ( pos == server.latest.end() )
+    {
+      return;
+    }
+    auto parsed = std::move( pos->second );
+    server.latest.erase( pos );
+
+    auto saved = server.saved.files.find( uri );
+    if ( saved != server.saved.files.end() &&
+         IndexFile::IsFresh( *server.saved.mapped, *saved->second.file ) )
+    {
+      UpdateShards( server, uri, { saved->second.shard } );
+    }
+    else
+    {
+      RemoveShards( server, uri );
+    }
+
+    auto text = Workspace::Text( *parsed );
+    auto hash = Hash::Bytes( text );
+    if ( !server.parse_cache.Find( hash, text ) )
+    {
+      server.parse_cache.Insert( hash, std::move( parsed ) );
+    }
+  }
+
+  Workspace::DocumentOptions DocumentOptions( const Server& server )
+  {
+    return Workspace::DocumentOptions{
+      .tokenizer = server.options.tokenizer == "native"
+                     ? Parser::Tokenizer::NATIVE
+                     : Parser::Tokenizer::TCL,
     };
-    Index::Build( index, scanContext, script );
+  }
 
+  // Make `parsed` the latest version of the document `uri`, and its pieces
+  // the document's shards. Queries only see it if the document hasn't been
+  // closed (and maybe opened again) since the opening of it which this is a
+  // parse of: the Close queued by that may already have run.
+  void Publish( Server& server,
+                const std::string& uri,
+                size_t opened,
+                Workspace::DocumentPtr parsed )
+  {
+    server.latest.insert_or_assign( uri, parsed );
     {
       std::unique_lock write_index(server.index_lock);
-      doc.context = std::move( context );
-      doc.script = std::move( script );
-      server.index = std::move( index );
+      auto pos = server.documents.find( uri );
+      if ( pos == server.documents.end() || pos->second.opened != opened )
+      {
+        return;
+      }
+      pos->second.parsed = parsed;
     }
 
+    UpdateShards( server, uri, Workspace::DocumentShards( *parsed ) );
+  }
+
+  // Parse (and index) the document `uri` as it was opened, with `text`.
+  //
+  // If a text which was recently opened or closed is the same (e.g. the
+  // document was closed and reopened, or is a copy of another one), its parse
+  // and index are used instead.
+  asio::awaitable<void> Open( Server& server,
+                              std::string uri,
+                              size_t opened,
+                              types::shared_string text )
+  {
+    auto hash = Hash::Bytes( *text );
+    auto parsed = server.parse_cache.Find( hash, *text );
+    if ( parsed && parsed->name != uri )
+    {
+      parsed = Workspace::RenameDocument( *parsed, uri );
+    }
+    else if ( !parsed )
+    {
+      parsed =
+        Workspace::ParseDocument( uri, *text, DocumentOptions( server ) );
+      server.parse_cache.Insert( hash, parsed );
+    }
+
+    Publish( server, uri, opened, std::move( parsed ) );
+    co_return;
+  }
+
+  struct Change
+  {
+    // Replaced by text, or the whole document if not given
+    std::optional< std::pair< Parser::LinePos, Parser::LinePos > > range;
+    types::shared_string text;
+  };
+
+  // Apply `changes`, in order, to the document `uri`'s latest version: the
+  // one which the last Open or Edit of it made, as they're all handled on the
+  // index queue, in the order they were made. Only the pieces which the
+  // changes touch are parsed and indexed again (see Workspace::EditDocument).
+  asio::awaitable<void> Edit( Server& server,
+                              std::string uri,
+                              size_t opened,
+                              std::vector< Change > changes )
+  {
+    auto pos = server.latest.find( uri );
+    if ( pos == server.latest.end() )
+    {
+      co_return;  // protocol error!
+    }
+    auto parsed = pos->second;
+
+    const auto options = DocumentOptions( server );
+    for ( const auto& change : changes )
+    {
+      if ( !change.range )
+      {
+        parsed = Workspace::ParseDocument( uri, *change.text, options );
+        continue;
+      }
+
+      auto start = Workspace::DocumentOffset( *parsed, change.range->first );
+      auto end = std::max( start,
+                           Workspace::DocumentOffset( *parsed,
+                                                      change.range->second ) );
+      parsed = Workspace::EditDocument( *parsed,
+                                        start,
+                                        end - start,
+                                        *change.text,
+                                        options );
+    }
+
+    Publish( server, uri, opened, std::move( parsed ) );
     co_return;
   }
 
@@ -45,8 +278,17 @@ namespace lsp::parse_manager
     // TODO: Check the URI!
     std::shared_lock l(server.index_lock);
     auto& document = server.documents.at( pos.textDocument.uri );
+    if ( !document.parsed || document.parsed->pieces.empty() )
+    {
+      return Index::ScriptCursor{};
+    }
+
+    // The cursor is in the piece's own parse, whose lines start at the piece
+    const auto& parsed = *document.parsed;
+    auto i = Workspace::FindPiece( parsed, pos.position.line );
+    const auto& piece = *parsed.pieces[ i ];
     return Index::FindPositionInScript(
-      document.script,
-      { pos.position.line, pos.position.character } );
+      piece.script,
+      { pos.position.line - parsed.lines[ i ], pos.position.character } );
   }
 }
@@ -9,7 +9,10 @@
 #include <shared_mutex>
 
 #include <analyzer/index.cpp>
+#include <analyzer/index_file.cpp>
+#include <analyzer/workspace.cpp>
 
+#include "parse_cache.cpp"
 #include "types.cpp"
 
 
@@ -21,10 +24,17 @@ namespace lsp::server
   struct WorkspaceOptions
   {
     std::vector< std::string > auto_path;
+    std::string tokenizer = "tcl";  // or "native"
+
+    // An index saved by the analyzer (see its --index-file), which the files
+    // that aren't open are queried from
+    std::string index_file;
 
     friend void from_json( const json& j, WorkspaceOptions& o )
     {
       LSP_FROM_JSON_OPTIONAL(j, o, auto_path);
+      LSP_FROM_JSON_OPTIONAL(j, o, tokenizer);
+      LSP_FROM_JSON_OPTIONAL(j, o, index_file);
     }
   };
 
@@ -34,10 +44,31 @@ namespace lsp::server
 
   struct Document
   {
-    types::TextDocumentItem item;
-    Parser::ParseContext context;
-    Parser::Script script;
-    enum class State { OPEN, CLOSED } state = State::OPEN;
+    types::TextDocumentItem item;  // but for its text, which is in `parsed`
+
+    // Which opening of the document this is (see Server::opened), so that the
+    // parse of one which was closed isn't taken for that of a reopened one
+    size_t opened{ 0 };
+
+    // The latest version of the document which has been parsed and indexed
+    // (in pieces), which queries use. Only the index queue replaces it. Its
+    // pieces are shared with earlier and later versions, and with any other
+    // document with the same text (see parse_cache).
+    Workspace::DocumentPtr parsed;
+  };
+
+  // A file of the saved index (see WorkspaceOptions::index_file), which is a
+  // shard of the workspace whenever it isn't open
+  struct SavedFile
+  {
+    const IndexFile::File* file;  // in SavedIndex::mapped
+    Workspace::Shard shard;
+  };
+
+  struct SavedIndex
+  {
+    std::unique_ptr< IndexFile::Mapped > mapped;
+    std::unordered_map< std::string, SavedFile > files;  // by uri
   };
 
   struct Server final
@@ -46,12 +77,26 @@ namespace lsp::server
     std::unordered_map< std::string, Document > documents;
 
     std::shared_mutex index_lock;
-    Index::Index index = Index::make_index();
+
+    // The shards of each document (one per piece), and of each file of the
+    // saved index which isn't open. Only the index queue replaces it, so it
+    // can make the next view from this one without holding the lock.
+    Workspace::ViewPtr workspace = Workspace::make_view();
+
+    parse_cache::ParseCache parse_cache;  // only used from index_queue
+
+    // The latest version of each open document, which edits are applied to.
+    // Only used from index_queue, where opens, edits and closes are handled in
+    // the order they were made.
+    std::unordered_map< std::string, Workspace::DocumentPtr > latest;
+
+    SavedIndex saved;  // only used from index_queue
 
     std::string rootUri;
     ClientCapabilities clientCapabilities;
 
     size_t next_id{0};
+    size_t opened{0};  // documents opened so far
 
     Tcl_Interp* interp{nullptr};
 
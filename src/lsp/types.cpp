@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <optional>
 #include <variant>
 #include <string>
@@ -34,7 +35,38 @@ namespace lsp::types
   template< typename T > using nullable = one_of< null, T >;
   template< typename... Ts > using optional = std::optional< Ts... >;
 
+  // Document text is immutable and shared (with the parser and the index)
+  // rather than copied
+  using shared_string = std::shared_ptr< const string >;
+
+  // Move a string out of a decoded message, leaving an empty one behind. This
+  // is how document text gets into a shared_string without being copied.
+  inline shared_string take_string( json& j )
+  {
+    return std::make_shared< const string >(
+      std::move( j.get_ref< string& >() ) );
+  }
+
   // }}}
+}
+
+template<>
+struct nlohmann::adl_serializer< lsp::types::shared_string >
+{
+  static void to_json( json& j, const lsp::types::shared_string& s )
+  {
+    j = s ? *s : std::string();
+  }
+
+  static void from_json( const json& j, lsp::types::shared_string& s )
+  {
+    s = std::make_shared< const std::string >(
+      j.get_ref< const std::string& >() );
+  }
+};
+
+namespace lsp::types
+{
 
   // Basic Structures {{{
 
@@ -96,7 +128,7 @@ namespace lsp::types
     DocumentURI uri;
     string languageId;
     integer version;
-    string text;
+    shared_string text;
 
     NLOHMANN_DEFINE_TYPE_INTRUSIVE( TextDocumentItem,
                                     uri,
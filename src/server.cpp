@@ -79,7 +79,9 @@ namespace lsp::server
           break;
         }
 
-        const auto& message = *message_;
+        // Handlers run after we've moved on to the next message, so they
+        // take ownership of it rather than referring to it
+        auto& message = *message_;
 
         // spawn a new handler for this message
         if ( !message.contains("method") )
@@ -87,16 +89,17 @@ namespace lsp::server
           continue;
         }
 
-        const auto& method = message[ "method" ];
+        const std::string method = message[ "method" ];
 
         std::cerr << "RX: " << message.dump( 2 ) << std::endl;
 
         if ( method == "initialize" )
         {
           asio::co_spawn( co_await asio::this_coro::executor,
-                          lsp::handlers::handle_initialize(server,
-                                                           out,
-                                                           message ),
+                          lsp::handlers::handle_initialize(
+                            server,
+                            out,
+                            std::move( message ) ),
                           handle_unexpected_exception<> );
         }
         else if ( method == "initialized" )
@@ -121,17 +124,19 @@ namespace lsp::server
         else if ( method == "textDocument/didOpen" )
         {
           asio::co_spawn( co_await asio::this_coro::executor,
-                          lsp::handlers::on_textdocument_didopen(server,
-                                                                 out,
-                                                                 message ),
+                          lsp::handlers::on_textdocument_didopen(
+                            server,
+                            out,
+                            std::move( message ) ),
                           handle_unexpected_exception<> );
         }
         else if ( method == "textDocument/didChange" )
         {
           asio::co_spawn( co_await asio::this_coro::executor,
-                          lsp::handlers::on_textdocument_didchange(server,
-                                                                   out,
-                                                                   message ),
+                          lsp::handlers::on_textdocument_didchange(
+                            server,
+                            out,
+                            std::move( message ) ),
                           handle_unexpected_exception<> );
         }
         else if ( method == "textDocument/didClose" )
@@ -143,17 +148,19 @@ namespace lsp::server
         else if ( method == "textDocument/references" )
         {
           asio::co_spawn( co_await asio::this_coro::executor,
-                          lsp::handlers::on_textdocument_references( server,
-                                                                     out,
-                                                                     message ),
+                          lsp::handlers::on_textdocument_references(
+                            server,
+                            out,
+                            std::move( message ) ),
                           handle_unexpected_exception<> );
         }
         else if ( method == "textDocument/definition" )
         {
           asio::co_spawn( co_await asio::this_coro::executor,
-                          lsp::handlers::on_textdocument_definition( server,
-                                                                     out,
-                                                                     message ),
+                          lsp::handlers::on_textdocument_definition(
+                            server,
+                            out,
+                            std::move( message ) ),
                           handle_unexpected_exception<> );
         }
         else